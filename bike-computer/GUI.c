@@ -1397,7 +1397,14 @@ void GUI_MainMenu(void) {
 							break;
 						case 1:
 							if (_logging) {
-								LOG_FileSync();
+								i = LOG_FileSync();
+								if (i != LOG_OK) {
+									UC1701_Fill(0x00);
+									PutStr(0,0,"SYNC:",fnt7x10);
+									PutIntU(39,0,i,fnt7x10);
+									UC1701_Flush();
+									Delay_ms(2000);
+								}
 							} else {
 								BEEPER_Enable(4321,10);
 							}
@@ -1411,7 +1418,16 @@ void GUI_MainMenu(void) {
 								LOG_WriteStr(" ");
 								LOG_WriteTime(RTC_Time.RTC_Hours,RTC_Time.RTC_Minutes,RTC_Time.RTC_Seconds);
 								LOG_WriteStr(")\r\n");
-								LOG_FileSync();
+								i = LOG_FileClose();
+								if (i != LOG_OK) {
+									// The log is on the card, but its length or the FAT may be wrong
+									UC1701_Fill(0x00);
+									PutStr(0,0,"CLOSE:",fnt7x10);
+									PutIntU(46,0,i,fnt7x10);
+									UC1701_Flush();
+									Delay_ms(2000);
+									mnu_sel = 0xff;
+								}
 							} else {
 								BEEPER_Enable(4321,10);
 							}
@@ -20,23 +20,12 @@ uint32_t pstart;                            // Partition start sector
 FILEINFO log_file;                          // Current log file handler
 uint8_t log_data[LOG_DATA_BUF_SIZE];        // Buffer for data to write
 uint32_t log_data_pos;                      // Position in data buffer
+uint32_t log_last_num;                      // Highest log file number on the card
+bool _log_last_num;                         // TRUE if log_last_num is known
+uint32_t log_syncs;                         // LOG_FileSync() calls since the FAT mirror was updated
+uint32_t log_reserved;                      // File length up to which the space is preallocated
 
 
-uint32_t fn_atoi(char *filename) {
-	uint8_t ch;
-	uint32_t result = 0;
-
-	ch = *filename++;
-	while (ch >= '0' && ch <= '9') {
-		result += ch - '0';
-		result *= 10;
-		ch = *filename++;
-	}
-	result /= 10;
-
-	return result;
-}
-
 void fn_itoa(uint32_t num, char *filename) {
 	uint8_t i = 7;
 
@@ -47,6 +36,38 @@ void fn_itoa(uint32_t num, char *filename) {
 	}
 }
 
+// Full path of the log file with the given number
+// input:
+//   num - log number
+//   path - buffer for the path (at least 18 bytes)
+static void LOG_Path(uint32_t num, uint8_t *path) {
+	char filename[13];
+
+	fn_itoa(num,filename);
+	strcpy((char *)path,"LOGS/");
+	strcat((char *)path,filename);
+}
+
+// Release the space preallocated for the newest log file beyond its length
+// A log which was not closed (power lost or switched off while logging) keeps its
+// whole reservation, on the card it is the chain past the length in the directory entry
+// return: LOG_Result
+static LOG_Result LOG_TrimLast(void) {
+	uint8_t path[64];
+
+	if (DFS_GetMaxNum(&vol_info,(uint8_t *)LOG_DIR_LOGS,(uint8_t *)LOG_FILENAME_PATTERN,sector,&log_last_num) != DFS_OK)
+		return LOG_ERROR;
+	_log_last_num = TRUE;
+	if (!log_last_num) return LOG_OK;
+
+	// Opening for write keeps the length, closing cuts the chain after it
+	LOG_Path(log_last_num,path);
+	if (DFS_OpenFile(&vol_info,path,DFS_WRITE,sector,&log_file) != DFS_OK) return LOG_ERROR;
+	if (DFS_CloseFile(&log_file,sector) != DFS_OK) return LOG_CLOSEERROR;
+
+	return LOG_OK;
+}
+
 // Read first sector from SD card and find first partition entry
 // return: LOG_Result (0 if everything went good)
 // note: LOG_Init() must be called before calling any other routines
@@ -54,6 +75,7 @@ LOG_Result LOG_Init(void) {
 	uint32_t result;
 
 	_logging = FALSE;
+	_log_last_num = FALSE;
 
 	pstart = DFS_GetPtnStart(0,sector,0,NULL,NULL,NULL);
 	if (pstart == DFS_ERRMISC) return LOG_NOPARTITION; // Partition not found
@@ -69,6 +91,16 @@ LOG_Result LOG_Init(void) {
 	};
 	if (result != DFS_OK) return LOG_ROOTERROR;
 
+	// The volume was not cleanly unmounted, the last log may hold space it doesn't use
+	// (FAT12 has no clean shutdown bit, then the last log is checked every time)
+#if DFS_MIRRORMAP
+	if (vol_info.unclean || (vol_info.filesystem == FAT12))
+#endif
+	{
+		result = LOG_TrimLast();
+		if (result != LOG_OK) return (LOG_Result)result;
+	}
+
 	// Looks like everything went good
 	return LOG_OK;
 }
@@ -79,43 +111,42 @@ LOG_Result LOG_Init(void) {
 // return: LOG_XXX value (LOG_OK if file created)
 // note: pNum changed only if new log file created
 uint32_t LOG_NewFile(uint32_t *pNum) {
-	DIRENT dir_entry; // Directory entry
-	char filename[12]; // Buffer for directory entry
 	uint8_t path[64]; // Full file path
-	uint32_t log_num = 0;
+	uint32_t log_num;
 	uint32_t i;
 
-	i = DFS_OpenDir(&vol_info,(uint8_t *)LOG_DIR_LOGS,&dir_info);
-	if (i == DFS_NOTFOUND) {
-		// Unable to open logs directory, try to create it
-		// In fact, this should not be because the directory had to be created in LOG_Init()
-		i = DFS_OpenFile(&vol_info,(uint8_t *)LOG_DIR_LOGS,DFS_CREATEDIR,sector,&log_file);
-		if (i == DFS_OK) {
-			// Open created directory
-			i = DFS_OpenDir(&vol_info,(uint8_t *)LOG_DIR_LOGS,&dir_info);
-		}
-	}
-	if (i != DFS_OK) return LOG_ERROR;
-
-	// Enumerate *.LOG files and determine highest number
-	while (!DFS_GetNext(&vol_info,&dir_info,&dir_entry)) {
-		if (dir_entry.name[0] && !(dir_entry.attr & ATTR_DIRECTORY)) {
-			DFS_DirToCanonical((uint8_t *)filename,dir_entry.name);
-			if (!memcmp(&filename[0],&LOG_FILENAME_TEMPLATE[0],3) &&
-					!memcmp(&filename[8],&LOG_FILENAME_TEMPLATE[8],4)) {
-				i = fn_atoi(&filename[3]);
-				if (i > log_num) log_num = i;
-			}
+	// Find the highest log number, the directory is scanned only once after LOG_Init()
+	if (!_log_last_num) {
+		i = DFS_OpenDir(&vol_info,(uint8_t *)LOG_DIR_LOGS,&dir_info);
+		if (i == DFS_NOTFOUND) {
+			// Unable to open logs directory, try to create it
+			// In fact, this should not be because the directory had to be created in LOG_Init()
+			i = DFS_OpenFile(&vol_info,(uint8_t *)LOG_DIR_LOGS,DFS_CREATEDIR,sector,&log_file);
 		}
+		if (i == DFS_OK)
+			i = DFS_GetMaxNum(&vol_info,(uint8_t *)LOG_DIR_LOGS,(uint8_t *)LOG_FILENAME_PATTERN,sector,&log_last_num);
+		if (i != DFS_OK) return LOG_ERROR;
+		_log_last_num = TRUE;
 	}
 
 	// Create .LOG file with next number
-	log_num++;
-	fn_itoa(log_num,filename);
-	strcpy((char *)path,"LOGS/");
-	strcat((char *)path,filename);
-	i = DFS_OpenFile(&vol_info,(uint8_t *)path,DFS_WRITE,sector,&log_file);
+	// (the name is known to be unused, so DOSFS doesn't have to search for it)
+	log_num = log_last_num + 1;
+	LOG_Path(log_num,path);
+	i = DFS_OpenFile(&vol_info,(uint8_t *)path,DFS_NEWFILE,sector,&log_file);
 	if (i != DFS_OK) return LOG_CREATEERROR;
+	log_last_num = log_num;
+
+	// Keep the partial sector left by LOG_FileSync() in a buffer of the log file,
+	// so appending to it doesn't read it back (without a free buffer this just
+	// goes through the sector buffer)
+	DFS_AttachBuffer(&log_file);
+
+	// Reserve contiguous space for the log, so appending data does not touch the FAT
+	// (if there is no such space the file just grows cluster by cluster)
+	DFS_Preallocate(&log_file,sector,LOG_PREALLOC_SIZE);
+	log_reserved = LOG_PREALLOC_SIZE;
+	if (DFS_Sync(&vol_info,sector) != DFS_OK) return LOG_CREATEERROR;
 
 	// Clear data buffer
 	memset(log_data,0,sizeof(log_data));
@@ -127,11 +158,18 @@ uint32_t LOG_NewFile(uint32_t *pNum) {
 	return LOG_OK;
 }
 
-// Write data buffer to SD card
+// Write data buffer to the log file
 // return: number of bytes written
-uint32_t LOG_FileSync(void) {
+// note: the FAT changes stay in the DOSFS FAT cache
+static uint32_t LOG_WriteBuffer(void) {
 	uint32_t cache = 0;
 
+	// Preallocated space is used up, reserve the next chunk
+	if (log_file.filelen + log_data_pos > log_reserved) {
+		DFS_Preallocate(&log_file,sector,LOG_PREALLOC_SIZE);
+		log_reserved = log_file.filelen + LOG_PREALLOC_SIZE;
+	}
+
 	// TODO: check for DFS_WriteFile() error
 	DFS_WriteFile(&log_file,sector,log_data,&cache,log_data_pos);
 	log_data_pos = 0;
@@ -139,20 +177,53 @@ uint32_t LOG_FileSync(void) {
 	return cache;
 }
 
+// Write data buffer to SD card
+// return: LOG_Result (LOG_SYNCERROR if the FAT, FSInfo or the file length could not be written)
+// note: also writes back the FAT sectors modified since the last sync and FSInfo
+LOG_Result LOG_FileSync(void) {
+	uint32_t result;
+
+	LOG_WriteBuffer();
+	// The second FAT copy is brought up to date only every LOG_MIRROR_SYNCS calls,
+	// in between the FAT changes go to the first copy only
+	if (++log_syncs >= LOG_MIRROR_SYNCS) {
+		result = DFS_SyncMirror(&vol_info,sector);
+		log_syncs = 0;
+	} else result = DFS_Sync(&vol_info,sector);
+
+	return (result == DFS_OK) ? LOG_OK : LOG_SYNCERROR;
+}
+
+// Write data buffer to SD card and close the log file
+// return: LOG_Result (LOG_CLOSEERROR if the file length or the FAT could not be written)
+// note: releases the preallocated space which was not used
+LOG_Result LOG_FileClose(void) {
+	LOG_WriteBuffer();
+	if (DFS_CloseFile(&log_file,sector) != DFS_OK) return LOG_CLOSEERROR;
+
+	return LOG_OK;
+}
+
 // Write binary data to data buffer
 // input:
 //   buf - pointer to the buffer with binary data
 //   len - length of the buffer
-// return: number of bytes copied into data buffer
+// return: number of bytes copied into data buffer or written to the file (0 on write error)
+// note: a block of at least LOG_DATA_BUF_SIZE bytes is not copied, it goes to DOSFS
+//       right after the collected data, the file buffer takes the partial sectors
 uint32_t LOG_WriteBin(uint8_t *buf, uint32_t len) {
 	uint32_t part_len;
 
-    if (log_data_pos + len >= LOG_DATA_BUF_SIZE) {
+	if (len >= LOG_DATA_BUF_SIZE) {
+		LOG_WriteBuffer(); // FIXME: check for error here
+		if (DFS_WriteFile(&log_file,sector,buf,&part_len,len) != DFS_OK) part_len = 0;
+		len = part_len;
+	} else if (log_data_pos + len >= LOG_DATA_BUF_SIZE) {
     	// Copy part of data into data buffer and write it to SD card
 		part_len = LOG_DATA_BUF_SIZE - log_data_pos;
 		memcpy(&log_data[log_data_pos],buf,part_len);
 		log_data_pos += part_len;
-		LOG_FileSync(); // FIXME: check for error here
+		LOG_WriteBuffer(); // FIXME: check for error here
 		// Copy rest of data into data buffer
 		len -= part_len;
 		memcpy(&log_data[log_data_pos],&buf[part_len],len);
@@ -5,7 +5,10 @@
 
 #define LOG_DIR_LOGS             "LOGS"             // Directory to store log files
 #define LOG_FILENAME_TEMPLATE    "WBC00000.LOG"     // Template for log file name
+#define LOG_FILENAME_PATTERN     "WBC?????.LOG"     // Log file names, '?' stands for a digit of the number
 #define LOG_FILE_EXTENSION       ".LOG"             // Log files extension
+#define LOG_PREALLOC_SIZE        (1024 * 1024)      // Space reserved on SD card for the log file at once
+#define LOG_MIRROR_SYNCS         60                 // LOG_FileSync() calls between updates of the FAT mirror (see DFS_SyncMirror)
 
 
 typedef enum {
@@ -14,6 +17,8 @@ typedef enum {
 	LOG_VIERROR     = 0x02,        // Error getting volume information
 	LOG_ROOTERROR   = 0x03,        // Error opening root directory
 	LOG_CREATEERROR = 0x04,        // File create error
+	LOG_CLOSEERROR  = 0x05,        // File close error
+	LOG_SYNCERROR   = 0x06,        // File sync error
 	LOG_ERROR       = 0xff         // Unknown log error
 } LOG_Result;
 
@@ -26,7 +31,8 @@ extern bool _logging;                              // TRUE if log file was creat
 // Function prototypes
 LOG_Result LOG_Init(void);
 uint32_t LOG_NewFile(uint32_t *pNum);
-uint32_t LOG_FileSync(void);
+LOG_Result LOG_FileSync(void);
+LOG_Result LOG_FileClose(void);
 
 uint32_t LOG_WriteBin(uint8_t *buf, uint32_t len);
 uint32_t LOG_WriteStr(char *str);
@@ -1,12 +1,71 @@
 #include <stm32l1xx_rcc.h>
 #include <stm32l1xx_gpio.h>
 #include <misc.h>
+#include <stddef.h> // NULL
 
 #include <spi.h>
 #include <sdcard.h>
 
 
 SDCard_TypeDef SDCard;                 // SD card parameters
+static uint8_t SD_Programming = 0;     // Nonzero while the card may still program the data of the last write
+
+
+// CRC7 lookup table (polynomial x^7 + x^3 + 1, the CRC is kept in bits [7:1])
+static const uint8_t CRC7_table[256] = {
+	0x00, 0x12, 0x24, 0x36, 0x48, 0x5a, 0x6c, 0x7e, 0x90, 0x82, 0xb4, 0xa6, 0xd8, 0xca, 0xfc, 0xee,
+	0x32, 0x20, 0x16, 0x04, 0x7a, 0x68, 0x5e, 0x4c, 0xa2, 0xb0, 0x86, 0x94, 0xea, 0xf8, 0xce, 0xdc,
+	0x64, 0x76, 0x40, 0x52, 0x2c, 0x3e, 0x08, 0x1a, 0xf4, 0xe6, 0xd0, 0xc2, 0xbc, 0xae, 0x98, 0x8a,
+	0x56, 0x44, 0x72, 0x60, 0x1e, 0x0c, 0x3a, 0x28, 0xc6, 0xd4, 0xe2, 0xf0, 0x8e, 0x9c, 0xaa, 0xb8,
+	0xc8, 0xda, 0xec, 0xfe, 0x80, 0x92, 0xa4, 0xb6, 0x58, 0x4a, 0x7c, 0x6e, 0x10, 0x02, 0x34, 0x26,
+	0xfa, 0xe8, 0xde, 0xcc, 0xb2, 0xa0, 0x96, 0x84, 0x6a, 0x78, 0x4e, 0x5c, 0x22, 0x30, 0x06, 0x14,
+	0xac, 0xbe, 0x88, 0x9a, 0xe4, 0xf6, 0xc0, 0xd2, 0x3c, 0x2e, 0x18, 0x0a, 0x74, 0x66, 0x50, 0x42,
+	0x9e, 0x8c, 0xba, 0xa8, 0xd6, 0xc4, 0xf2, 0xe0, 0x0e, 0x1c, 0x2a, 0x38, 0x46, 0x54, 0x62, 0x70,
+	0x82, 0x90, 0xa6, 0xb4, 0xca, 0xd8, 0xee, 0xfc, 0x12, 0x00, 0x36, 0x24, 0x5a, 0x48, 0x7e, 0x6c,
+	0xb0, 0xa2, 0x94, 0x86, 0xf8, 0xea, 0xdc, 0xce, 0x20, 0x32, 0x04, 0x16, 0x68, 0x7a, 0x4c, 0x5e,
+	0xe6, 0xf4, 0xc2, 0xd0, 0xae, 0xbc, 0x8a, 0x98, 0x76, 0x64, 0x52, 0x40, 0x3e, 0x2c, 0x1a, 0x08,
+	0xd4, 0xc6, 0xf0, 0xe2, 0x9c, 0x8e, 0xb8, 0xaa, 0x44, 0x56, 0x60, 0x72, 0x0c, 0x1e, 0x28, 0x3a,
+	0x4a, 0x58, 0x6e, 0x7c, 0x02, 0x10, 0x26, 0x34, 0xda, 0xc8, 0xfe, 0xec, 0x92, 0x80, 0xb6, 0xa4,
+	0x78, 0x6a, 0x5c, 0x4e, 0x30, 0x22, 0x14, 0x06, 0xe8, 0xfa, 0xcc, 0xde, 0xa0, 0xb2, 0x84, 0x96,
+	0x2e, 0x3c, 0x0a, 0x18, 0x66, 0x74, 0x42, 0x50, 0xbe, 0xac, 0x9a, 0x88, 0xf6, 0xe4, 0xd2, 0xc0,
+	0x1c, 0x0e, 0x38, 0x2a, 0x54, 0x46, 0x70, 0x62, 0x8c, 0x9e, 0xa8, 0xba, 0xc4, 0xd6, 0xe0, 0xf2
+};
+
+// CRC16 CCITT lookup table (polynomial x^16 + x^12 + x^5 + 1)
+static const uint16_t CRC16_table[256] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+	0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+	0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+	0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+	0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+	0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+	0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+	0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+	0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+	0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+	0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+	0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+	0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+	0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+	0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+	0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+	0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+	0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+	0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+	0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+	0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+	0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+	0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+	0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+	0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+	0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+	0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+	0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+	0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+	0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+	0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+	0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
+};
 
 
 // Calculate CRC7
@@ -16,16 +75,7 @@ SDCard_TypeDef SDCard;                 // SD card parameters
 //   data - byte for CRC calculation
 // return: the new CRC7
 uint8_t CRC7_one(uint8_t crcIn, uint8_t data) {
-	const uint8_t g = 0x89;
-	uint8_t i;
-
-	crcIn ^= data;
-	for (i = 0; i < 8; i++) {
-		if (crcIn & 0x80) crcIn ^= g;
-		crcIn <<= 1;
-	}
-
-	return crcIn;
+	return CRC7_table[crcIn ^ data];
 }
 
 // Calculate CRC7 value of the buffer
@@ -48,13 +98,7 @@ uint8_t CRC7_buf(uint8_t *pBuf, uint8_t len) {
 //   data - byte for CRC calculation
 // return: the CRC16 value
 uint16_t CRC16_one(uint16_t crcIn, uint8_t data) {
-	crcIn  = (uint8_t)(crcIn >> 8)|(crcIn << 8);
-	crcIn ^=  data;
-	crcIn ^= (uint8_t)(crcIn & 0xff) >> 4;
-	crcIn ^= (crcIn << 8) << 4;
-	crcIn ^= ((crcIn & 0xff) << 4) << 1;
-
-	return crcIn;
+	return (crcIn << 8) ^ CRC16_table[(uint8_t)(crcIn >> 8) ^ data];
 }
 
 // Calculate CRC16 CCITT value of the buffer
@@ -87,6 +131,110 @@ void SD_ReadBuf(uint8_t *pBuf, uint16_t len) {
 	while (len--) *pBuf++ = SPIx_SendRecv(SDCARD_SPI_PORT,0xff);
 }
 
+// Receive data block from the SD card and calculate its CRC16
+// input:
+//   pBuf - pointer to the buffer
+//   len - length of the buffer
+// return: the CRC16 value of the received data
+// note: with DMA the CRC is calculated on the bytes already received while the rest of the block comes in
+static uint16_t SD_ReadBufCRC(uint8_t *pBuf, uint16_t len) {
+	uint16_t crc = 0;
+#if (SD_USE_DMA)
+	uint16_t done = 0;
+	uint16_t received;
+
+	// Idle bytes out, data block in
+	SPIx_Configure_DMA_RX(SDCARD_SPI_PORT,pBuf,len);
+	SPIx_Configure_DMA_TX(SDCARD_SPI_PORT,NULL,len);
+	SPIx_SetDMA(SDCARD_SPI_PORT,SPI_DMA_RX | SPI_DMA_TX,ENABLE);
+
+	do {
+		received = len - SDCARD_DMA_RX_CH->CNDTR;
+		while (done < received) crc = CRC16_one(crc,pBuf[done++]);
+	} while (done < len);
+
+	SPIx_SetDMA(SDCARD_SPI_PORT,SPI_DMA_RX | SPI_DMA_TX,DISABLE);
+#else
+	SD_ReadBuf(pBuf,len);
+	crc = CRC16_buf(pBuf,len);
+#endif // SD_USE_DMA
+
+	return crc;
+}
+
+// Send data block to the SD card and calculate its CRC16
+// input:
+//   pBuf - pointer to the buffer
+//   len - length of the buffer
+// return: the CRC16 value of the sent data
+// note: with DMA the CRC is calculated while the block goes out, it's needed right after the data
+static uint16_t SD_WriteBufCRC(uint8_t *pBuf, uint16_t len) {
+	uint16_t crc;
+
+#if (SD_USE_DMA)
+	// Data block out, received bytes discarded
+	SPIx_Configure_DMA_RX(SDCARD_SPI_PORT,NULL,len);
+	SPIx_Configure_DMA_TX(SDCARD_SPI_PORT,pBuf,len);
+	SPIx_SetDMA(SDCARD_SPI_PORT,SPI_DMA_RX | SPI_DMA_TX,ENABLE);
+
+	crc = CRC16_buf(pBuf,len);
+
+	// All bytes are out when the last one has been received
+	while (SDCARD_DMA_RX_CH->CNDTR);
+
+	SPIx_SetDMA(SDCARD_SPI_PORT,SPI_DMA_RX | SPI_DMA_TX,DISABLE);
+#else
+	crc = CRC16_buf(pBuf,len);
+	SD_WriteBuf(pBuf,len);
+#endif // SD_USE_DMA
+
+	return crc;
+}
+
+// Wait while the card is busy (holds DO low)
+// return: nonzero if the card is ready, zero in case of timeout
+// note: the card must be selected
+static uint8_t SD_WaitBusy(void) {
+	uint32_t wait = 0x7fff; // Recommended timeout is 250ms (500ms for SDXC) FIXME: 0x7fff is set by sight, need calculate more adequate value
+
+	while ((SPIx_SendRecv(SDCARD_SPI_PORT,0xff) == 0) && --wait);
+
+	return (wait != 0);
+}
+
+// Wait while the card programs the data of the last write
+// The card holds DO low until it's done, SD_WriteBlock() doesn't wait for this
+// and leaves it to the next command
+// return: SDR_xxx
+SDResult_TypeDef SD_WaitReady(void) {
+	uint8_t ready;
+
+	if (!SD_Programming) return SDR_Success;
+	SD_Programming = 0;
+
+	// Select SD card
+	SDCARD_CS_L();
+
+	ready = SD_WaitBusy();
+
+	// Release SD card
+	SDCARD_CS_H();
+
+	return ready ? SDR_Success : SDR_Timeout;
+}
+
+// Check if the card still programs the data of the last write, without waiting
+// return: nonzero while the card is busy
+uint8_t SD_CardBusy(void) {
+	if (SD_Programming) {
+		SDCARD_CS_L();
+		if (SPIx_SendRecv(SDCARD_SPI_PORT,0xff) != 0) SD_Programming = 0;
+		SDCARD_CS_H();
+	}
+
+	return SD_Programming;
+}
+
 // Send command to the SD card and get response
 // input:
 //   cmd - SD card command
@@ -98,6 +246,9 @@ SDResult_TypeDef SD_Cmd(uint8_t cmd, uint32_t arg, SDCmdResp_TypeDef resp_type,
 	uint8_t rdLen = 0; // response length
 	uint8_t response;
 
+	// The card doesn't take commands until it has programmed the last write
+	if (SD_WaitReady() != SDR_Success) return SDR_Timeout;
+
 	// Determine response length
 	switch (resp_type) {
 		case SD_R1:
@@ -130,6 +281,9 @@ SDResult_TypeDef SD_Cmd(uint8_t cmd, uint32_t arg, SDCmdResp_TypeDef resp_type,
 	// Send CMD#
 	SD_WriteBuf(&buf[0],6);
 
+	// Skip the stuff byte which follows STOP_TRANSMISSION during a multiple block read
+	if (cmd == SD_CMD_STOP_TRANSMISSION) SPIx_SendRecv(SDCARD_SPI_PORT,0xff);
+
 	// Wait for a valid response
 	do {
 		response = SPIx_SendRecv(SDCARD_SPI_PORT,0xff);
@@ -148,6 +302,9 @@ SDResult_TypeDef SD_Cmd(uint8_t cmd, uint32_t arg, SDCmdResp_TypeDef resp_type,
 		response = SPIx_SendRecv(SDCARD_SPI_PORT,0xff);
 	}
 
+	// The card may stay busy after the R1b response, the next command waits for it
+	if (resp_type == SD_R1b) SD_Programming = 1;
+
 	// Release SD card
 	SDCARD_CS_H();
 
@@ -178,6 +335,11 @@ SDResult_TypeDef SD_Init(void) {
 	PORT.GPIO_Pin = SDCARD_CS_PIN;
 	GPIO_Init(SDCARD_CS_PORT,&PORT);
 
+#if (SD_USE_DMA)
+	// Enable the DMA1 peripheral clock for the SPI DMA channels
+	RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1,ENABLE);
+#endif // SD_USE_DMA
+
 	// Set low SPI speed (32MHz -> 125kHz)
 	SPIx_SetSpeed(SDCARD_SPI_PORT,SPI_BR_256);
 
@@ -414,70 +576,74 @@ SDResult_TypeDef SD_ReadCID(void) {
 	return SDR_Success;
 }
 
-// Read block of data from the SD card
+// Receive data block from the SD card
 // input:
-//   addr - start address of the block (must be power of two)
 //   pBuf - pointer to the buffer for received data
-//   len - buffer length
+//   len - length of the data block
 // return: SDR_xxx
-SDResult_TypeDef SD_ReadBlock(uint32_t addr, uint8_t *pBuf, uint32_t len) {
+// note: the card must be selected
+static SDResult_TypeDef SD_RecvData(uint8_t *pBuf, uint16_t len) {
 	uint32_t wait;
-	uint8_t cmdres;
-	uint8_t resp[5];
+	uint8_t token;
 	uint16_t CRC_rcv; // Received CRC16 of the block
 	uint16_t CRC_loc; // Calculated CRC16 of the block
 
-	// SDSC card uses byte unit address and
-	// SDHC/SDXC cards use block unit address (1 unit = 512 bytes)
-	// For SDSC card addr must be converted to byte address
-	if (SDCard.CardType != SDCT_SDHC) addr <<= 9;
-	cmdres = SD_Cmd(SD_CMD_READ_SINGLE_BLOCK,addr,SD_R1,resp); // CMD17
-	if (cmdres != SDR_Success) return cmdres;
-	if (resp[0] == 0x00) {
-		// Select SD card
-		SDCARD_CS_L();
+	// Waiting for a start block token
+	wait = 0xfff; // Recommended timeout is 100ms FIXME: 0xfff is set by sight, need calculate more adequate value
+	do {
+		token = SPIx_SendRecv(SDCARD_SPI_PORT,0xff);
+	} while (token == 0xff && --wait);
 
-		// Waiting for a start block token
-		wait = 0xfff; // Recommended timeout is 100ms FIXME: 0xfff is set by sight, need calculate more adequate value
-		do {
-			cmdres = SPIx_SendRecv(SDCARD_SPI_PORT,0xff);
-		} while (cmdres == 0xff && --wait);
-
-		if (!wait) {
-			// It was timeout
-			SPIx_SendRecv(SDCARD_SPI_PORT,0xff);
-			SDCARD_CS_H();
-			return SDR_Timeout;
+	// It was timeout
+	if (!wait) return SDR_Timeout;
+
+	if (token != SD_TOKEN_START_BLOCK) {
+		// The card respond is not a start token but a data error token
+		if (token & SD_TOKEN_READ_RANGE_ERROR) {
+			// Specified address out of range
+			return SDR_AddrError;
 		}
 
-		if (cmdres != SD_TOKEN_START_BLOCK)	{
-			// The card respond is not a start token
-			SPIx_SendRecv(SDCARD_SPI_PORT,0xff);
-			SDCARD_CS_H();
+		return SDR_ReadError;
+	}
 
-			if (cmdres & SD_TOKEN_READ_RANGE_ERROR) {
-				// Specified address out of range
-				return SDR_AddrError;
-			}
+	// Receive data block
+	CRC_loc = SD_ReadBufCRC(pBuf,len);
 
-			return SDR_ReadError;
-		}
+	// 16-bit CRC (it must be received even if CRC is off)
+	CRC_rcv  = SPIx_SendRecv(SDCARD_SPI_PORT,0xff) << 8;
+	CRC_rcv |= SPIx_SendRecv(SDCARD_SPI_PORT,0xff);
 
-		// Receive data block
-		SD_ReadBuf(pBuf,len);
+	return (CRC_rcv == CRC_loc) ? SDR_Success : SDR_CRCError;
+}
 
-		// 16-bit CRC (it must be received even if CRC is off)
-		CRC_rcv  = SPIx_SendRecv(SDCARD_SPI_PORT,0xff) << 8;
-		CRC_rcv |= SPIx_SendRecv(SDCARD_SPI_PORT,0xff);
-		CRC_loc  = CRC16_buf(pBuf,len);
+// Read block of data from the SD card
+// input:
+//   addr - start address of the block (must be power of two)
+//   pBuf - pointer to the buffer for received data
+//   len - buffer length (multiple of 512 is read by one multiple block command)
+// return: SDR_xxx
+SDResult_TypeDef SD_ReadBlock(uint32_t addr, uint8_t *pBuf, uint32_t len) {
+	uint8_t cmd = SD_CMD_READ_SINGLE_BLOCK;
+	uint8_t cmdres;
+	uint8_t resp[5];
+	uint32_t blk_count = 1; // Blocks in the transfer
+	uint16_t blk_len = len; // Length of one block
 
-		// Provide extra 8 clocks for the card (from SanDisk specification)
-		SPIx_SendRecv(SDCARD_SPI_PORT,0xff);
+	if (len > 512) {
+		cmd = SD_CMD_READ_MULT_BLOCK;
+		blk_count = len >> 9;
+		blk_len = 512;
+	}
 
-		// Release SD card
-		SDCARD_CS_H();
-	} else {
-		// CMD17 has been rejected
+	// SDSC card uses byte unit address and
+	// SDHC/SDXC cards use block unit address (1 unit = 512 bytes)
+	// For SDSC card addr must be converted to byte address
+	if (SDCard.CardType != SDCT_SDHC) addr <<= 9;
+	cmdres = SD_Cmd(cmd,addr,SD_R1,resp); // CMD17 or CMD18
+	if (cmdres != SDR_Success) return cmdres;
+	if (resp[0] != 0x00) {
+		// CMD17/CMD18 has been rejected
 		if (resp[0] & SD_R1_ADDR_ERROR) {
 			// Given address is misaligned
 			return SDR_AddrError;
@@ -490,75 +656,120 @@ SDResult_TypeDef SD_ReadBlock(uint32_t addr, uint8_t *pBuf, uint32_t len) {
 		return SDR_ReadError;
 	}
 
-	return (CRC_rcv == CRC_loc) ? SDR_Success : SDR_CRCError;
+	// Select SD card
+	SDCARD_CS_L();
+
+	// Receive data blocks
+	do {
+		cmdres = SD_RecvData(pBuf,blk_len);
+		pBuf += blk_len;
+	} while ((cmdres == SDR_Success) && --blk_count);
+
+	if (cmd == SD_CMD_READ_MULT_BLOCK) {
+		// The card sends blocks until STOP_TRANSMISSION, it releases the SD card afterwards
+		if ((SD_Cmd(SD_CMD_STOP_TRANSMISSION,0,SD_R1b,resp) != SDR_Success) && (cmdres == SDR_Success)) {
+			cmdres = SDR_ReadError;
+		}
+	} else {
+		// Provide extra 8 clocks for the card (from SanDisk specification)
+		SPIx_SendRecv(SDCARD_SPI_PORT,0xff);
+
+		// Release SD card
+		SDCARD_CS_H();
+	}
+
+	return cmdres;
 }
 
+// Send data block to the SD card
+// input:
+//   token - start block token (SD_TOKEN_START_BLOCK or SD_TOKEN_START_BLOCK_MULT)
+//   pBuf - pointer to the buffer with data
+//   len - length of the data block
+// return: SDR_xxx
+// note: the card must be selected
+static SDResult_TypeDef SD_SendData(uint8_t token, uint8_t *pBuf, uint16_t len) {
+	uint8_t cmdres;
+	uint16_t CRC_loc; // Calculated CRC16 of the block
+
+	// Send start block token
+	SPIx_SendRecv(SDCARD_SPI_PORT,token);
+
+	// Send data block
+	CRC_loc = SD_WriteBufCRC(pBuf,len);
+
+	// Send CRC
+	SPIx_SendRecv(SDCARD_SPI_PORT,CRC_loc >> 8);
+	SPIx_SendRecv(SDCARD_SPI_PORT,(uint8_t)CRC_loc);
+
+	// Get response from the SD card
+	cmdres = SPIx_SendRecv(SDCARD_SPI_PORT,0xff);
+	cmdres &= 0x1f;
+	if (cmdres == SD_TOKEN_DATA_ACCEPTED) return SDR_Success;
+
+	// Data block rejected by SD card for some reason
+	if (cmdres == SD_TOKEN_WRITE_CRC_ERROR) return SDR_WriteCRCError;
+	if (cmdres == SD_TOKEN_WRITE_ERROR) return SDR_WriteErrorInternal;
+
+	return SDR_WriteError;
+}
 
 // Write block of data to the SD card
 // input:
 //   addr - start address of the block (must be power of two)
 //   pBuf - pointer to the buffer with data
-//   len - buffer length
+//   len - buffer length (multiple of 512 is written by one multiple block command)
 // return: SDR_xxx
 SDResult_TypeDef SD_WriteBlock(uint32_t addr, uint8_t *pBuf, uint32_t len) {
-	uint32_t wait;
+	uint8_t cmd = SD_CMD_WRITE_SINGLE_BLOCK;
 	uint8_t cmdres;
 	uint8_t resp[5];
-	uint16_t CRC_loc; // Calculated CRC16 of the block
+	uint32_t blk_count = 1; // Blocks in the transfer
+	uint16_t blk_len = len; // Length of one block
 
-	// Calculate 16-bit CRC
-	CRC_loc = CRC16_buf(pBuf,len);
+	if (len > 512) {
+		cmd = SD_CMD_WRITE_MULT_BLOCK;
+		blk_count = len >> 9;
+		blk_len = 512;
+	}
 
 	// SDSC card uses byte unit address and
 	// SDHC/SDXC cards use block unit address (1 unit = 512 bytes)
 	// For SDSC card addr must be converted to byte address
 	if (SDCard.CardType != SDCT_SDHC) addr <<= 9;
-	cmdres = SD_Cmd(SD_CMD_WRITE_SINGLE_BLOCK,addr,SD_R1,resp); // CMD24
+	cmdres = SD_Cmd(cmd,addr,SD_R1,resp); // CMD24 or CMD25
 	if (cmdres != SDR_Success) return cmdres;
-	if (resp[0] == 0x00) {
-		// Select SD card
-		SDCARD_CS_L();
-
-		// Send start block token
-		SPIx_SendRecv(SDCARD_SPI_PORT,SD_TOKEN_START_BLOCK);
-
-		// Send data block
-		SD_WriteBuf(pBuf,len);
-
-		// Send CRC
-		SPIx_SendRecv(SDCARD_SPI_PORT,CRC_loc >> 8);
-		SPIx_SendRecv(SDCARD_SPI_PORT,(uint8_t)CRC_loc);
+	if (resp[0] != 0x00) {
+		// Card rejected CMD24/CMD25
+		if ((resp[0] & SD_R1_ADDR_ERROR) || (resp[0] & SD_R1_PARAM_ERROR)) return SDR_AddrError;
+		return SDR_WriteError;
+	}
 
-		// Get response from the SD card
-		cmdres = SPIx_SendRecv(SDCARD_SPI_PORT,0xff);
-		cmdres &= 0x1f;
-		if (cmdres != SD_TOKEN_DATA_ACCEPTED) {
-			// Data block rejected by SD card for some reason
-			// Release SD card
-			SPIx_SendRecv(SDCARD_SPI_PORT,0xff);
-			SDCARD_CS_H();
-
-			if (cmdres & SD_TOKEN_WRITE_CRC_ERROR) return SDR_WriteCRCError;
-			if (cmdres & SD_TOKEN_WRITE_ERROR) return SDR_WriteErrorInternal;
-			return SDR_WriteError;
-		}
+	// Select SD card
+	SDCARD_CS_L();
 
-		// Wait while the SD card is busy by data programming
-		wait = 0x7fff; // Recommended timeout is 250ms (500ms for SDXC) FIXME: 0x7fff is set by sight, need calculate more adequate value
+	if (cmd == SD_CMD_WRITE_MULT_BLOCK) {
 		do {
-			cmdres = SPIx_SendRecv(SDCARD_SPI_PORT,0xff);
-		} while (cmdres == 0 && --wait);
+			cmdres = SD_SendData(SD_TOKEN_START_BLOCK_MULT,pBuf,blk_len);
+			pBuf += blk_len;
 
-		// Provide extra 8 clocks for the card (from SanDisk specification)
-		SPIx_SendRecv(SDCARD_SPI_PORT,0xff);
+			// The card takes the next block after it has programmed this one
+			if ((cmdres == SDR_Success) && !SD_WaitBusy()) cmdres = SDR_Timeout;
+		} while ((cmdres == SDR_Success) && --blk_count);
 
-		// Release SD card
-		SDCARD_CS_H();
+		// Terminate the multiple block write, the card goes busy one byte after the token
+		SPIx_SendRecv(SDCARD_SPI_PORT,SD_TOKEN_STOP_TRAN);
+		SPIx_SendRecv(SDCARD_SPI_PORT,0xff);
 	} else {
-		// Card rejected CMD24
-		if ((resp[0] & SD_R1_ADDR_ERROR) || (resp[0] & SD_R1_PARAM_ERROR)) return SDR_AddrError;
-		return SDR_WriteError;
+		cmdres = SD_SendData(SD_TOKEN_START_BLOCK,pBuf,blk_len);
 	}
 
-	return SDR_Success;
+	// Provide extra 8 clocks for the card (from SanDisk specification)
+	SPIx_SendRecv(SDCARD_SPI_PORT,0xff);
+
+	// Release SD card, it programs the data now and the next command waits for it
+	SDCARD_CS_H();
+	SD_Programming = 1;
+
+	return cmdres;
 }
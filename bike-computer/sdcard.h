@@ -6,6 +6,14 @@
 // SDCARD SPI peripheral
 #define SDCARD_SPI_PORT      SPI1
 
+// SDCARD SPI DMA channel which receives the data (see spi.h)
+#define SDCARD_DMA_RX_CH     SPI1_DMA_RX_CH
+
+// Transfer data blocks using the SPI DMA
+//   0 - data is transferred byte by byte
+//   1 - data is transferred by the DMA channels of the SPI port
+#define SD_USE_DMA           1
+
 // SDCARD GPIO peripherals
 #define SDCARD_PORT_PERIPH   RCC_AHBPeriph_GPIOB
 
@@ -71,6 +79,8 @@
 
 // Control tokens
 #define SD_TOKEN_START_BLOCK                       ((uint8_t)0xfe) // Start block
+#define SD_TOKEN_START_BLOCK_MULT                  ((uint8_t)0xfc) // Start block of a multiple block write
+#define SD_TOKEN_STOP_TRAN                         ((uint8_t)0xfd) // Stop of a multiple block write
 #define SD_TOKEN_DATA_ACCEPTED                     ((uint8_t)0x05) // Data accepted
 #define SD_TOKEN_WRITE_CRC_ERROR                   ((uint8_t)0x0b) // Data rejected due to a CRC error
 #define SD_TOKEN_WRITE_ERROR                       ((uint8_t)0x0d) // Data rejected due to a write error
@@ -137,6 +147,8 @@ extern SDCard_TypeDef SDCard;                 // SD card parameters
 uint16_t CRC16_buf(const uint8_t * pBuf, uint16_t len);
 
 SDResult_TypeDef SD_Init(void);
+SDResult_TypeDef SD_WaitReady(void);
+uint8_t SD_CardBusy(void);
 
 SDResult_TypeDef SD_ReadCSD(void);
 SDResult_TypeDef SD_ReadCID(void);
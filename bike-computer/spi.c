@@ -4,6 +4,10 @@
 #include <spi.h>
 
 
+static const uint8_t SPIx_DMA_Idle = 0xff; // Sent by the TX DMA when there is no data buffer
+static uint8_t SPIx_DMA_Sink;              // Received by the RX DMA when there is no data buffer
+
+
 // SPI peripheral initialization
 // input:
 //   SPI - pointer to the SPI port (SPI1, SPI2, etc.)
@@ -70,3 +74,78 @@ uint8_t SPIx_SendRecv(SPI_TypeDef *SPI, uint8_t data) {
 
 	return SPI->DR; // Received byte
 }
+
+// Configure the TX DMA channel of the SPI port
+// input:
+//   SPI - pointer to the SPI port (SPI1 or SPI2)
+//   pBuf - pointer to the data buffer (NULL - send 0xff bytes, e.g. to clock in a data block)
+//   length - number of bytes to send
+// note: the DMA1 peripheral clock must be already enabled
+void SPIx_Configure_DMA_TX(SPI_TypeDef *SPI, const uint8_t *pBuf, uint16_t length) {
+	DMA_Channel_TypeDef *CH = (SPI == SPI1) ? SPI1_DMA_TX_CH : SPI2_DMA_TX_CH;
+
+	// DMA: memory -> SPI, no circular mode, 8-bits, medium channel priority, channel disabled
+	CH->CCR = DMA_CCR1_DIR | DMA_CCR1_PL_0;
+	if (pBuf) {
+		CH->CCR |= DMA_CCR1_MINC; // Memory increment
+	} else {
+		pBuf = &SPIx_DMA_Idle;
+	}
+	CH->CPAR  = (uint32_t)(&(SPI->DR)); // Address of the peripheral data register
+	CH->CMAR  = (uint32_t)pBuf; // Memory address
+	CH->CNDTR = length; // Number of data
+}
+
+// Configure the RX DMA channel of the SPI port
+// input:
+//   SPI - pointer to the SPI port (SPI1 or SPI2)
+//   pBuf - pointer to the data buffer (NULL - discard the received bytes)
+//   length - number of bytes to receive
+// note: the DMA1 peripheral clock must be already enabled
+void SPIx_Configure_DMA_RX(SPI_TypeDef *SPI, uint8_t *pBuf, uint16_t length) {
+	DMA_Channel_TypeDef *CH = (SPI == SPI1) ? SPI1_DMA_RX_CH : SPI2_DMA_RX_CH;
+
+	// DMA: SPI -> memory, no circular mode, 8-bits, high channel priority, channel disabled
+	// RX has higher priority than TX to not lose the received bytes
+	CH->CCR = DMA_CCR1_PL_1;
+	if (pBuf) {
+		CH->CCR |= DMA_CCR1_MINC; // Memory increment
+	} else {
+		pBuf = &SPIx_DMA_Sink;
+	}
+	CH->CPAR  = (uint32_t)(&(SPI->DR)); // Address of the peripheral data register
+	CH->CMAR  = (uint32_t)pBuf; // Memory address
+	CH->CNDTR = length; // Number of data
+}
+
+// Enable/disable SPI RX/TX DMA channels
+// input:
+//   SPI - pointer to the SPI port (SPI1 or SPI2)
+//   SPI_DMA_DIR - channels to enable/disable (combination of SPI_DMA_TX and SPI_DMA_RX)
+//   NewState - new state of channels (ENABLE/DISABLE)
+// note: the RX channel must be enabled together with or before the TX channel,
+//       the SPI transfer starts as soon as the TX DMA is enabled
+void SPIx_SetDMA(SPI_TypeDef *SPI, uint8_t SPI_DMA_DIR, FunctionalState NewState) {
+	DMA_Channel_TypeDef *CH_RX = (SPI == SPI1) ? SPI1_DMA_RX_CH : SPI2_DMA_RX_CH;
+	DMA_Channel_TypeDef *CH_TX = (SPI == SPI1) ? SPI1_DMA_TX_CH : SPI2_DMA_TX_CH;
+
+	if (NewState == ENABLE) {
+		if (SPI_DMA_DIR & SPI_DMA_RX) {
+			CH_RX->CCR |= DMA_CCR1_EN;
+			SPI->CR2 |= SPI_CR2_RXDMAEN;
+		}
+		if (SPI_DMA_DIR & SPI_DMA_TX) {
+			CH_TX->CCR |= DMA_CCR1_EN;
+			SPI->CR2 |= SPI_CR2_TXDMAEN;
+		}
+	} else {
+		if (SPI_DMA_DIR & SPI_DMA_TX) {
+			SPI->CR2 &= ~SPI_CR2_TXDMAEN;
+			CH_TX->CCR &= ~DMA_CCR1_EN;
+		}
+		if (SPI_DMA_DIR & SPI_DMA_RX) {
+			SPI->CR2 &= ~SPI_CR2_RXDMAEN;
+			CH_RX->CCR &= ~DMA_CCR1_EN;
+		}
+	}
+}
@@ -9,6 +9,7 @@ uint8_t  USBD_CDC_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req);
 uint8_t  USBD_CDC_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum);
 uint8_t  USBD_CDC_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum);
 uint8_t  USBD_CDC_EP0_RxReady(USBD_HandleTypeDef *pdev);
+uint8_t  USBD_CDC_SOF(USBD_HandleTypeDef *pdev);
 uint8_t *USBD_CDC_GetFSCfgDesc(uint16_t *length);
 uint8_t *USBD_CDC_GetHSCfgDesc(uint16_t *length);
 uint8_t *USBD_CDC_GetOtherSpeedCfgDesc(uint16_t *length);
@@ -38,7 +39,7 @@ USBD_ClassTypeDef USBD_CDC = {
 		USBD_CDC_EP0_RxReady,
 		USBD_CDC_DataIn,
 		USBD_CDC_DataOut,
-		NULL,                 // SOF
+		USBD_CDC_SOF,
 		NULL,                 // IsoINIncomplete
 		NULL,                 // IsoOutIncomplete
 		USBD_CDC_GetHSCfgDesc,
@@ -364,12 +365,8 @@ uint8_t USBD_CDC_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx) {
 		hcdc->TxState = 0;
 		hcdc->RxState = 0;
 
-		// Prepare OUT endpoint to receive next packet
-		if (pdev->dev_speed == USBD_SPEED_HIGH) {
-			USBD_LL_PrepareReceive(pdev,CDC_OUT_EP,hcdc->RxBuffer,CDC_DATA_HS_OUT_PACKET_SIZE);
-		} else {
-			USBD_LL_PrepareReceive(pdev,CDC_OUT_EP,hcdc->RxBuffer,CDC_DATA_FS_OUT_PACKET_SIZE);
-		}
+		// Prepare OUT endpoint to receive next packet, unless the interface has no buffer for it yet
+		if (hcdc->RxBuffer != NULL) USBD_CDC_ReceivePacket(pdev);
 	}
 
 	return ret;
@@ -450,6 +447,9 @@ uint8_t USBD_CDC_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum) {
 	if (pdev->pClassData != NULL) {
 		hcdc->TxState = 0;
 
+		// The interface may start the next transfer
+		((USBD_CDC_ItfTypeDef *)pdev->pUserData)->TransmitCplt(hcdc->TxBuffer,&hcdc->TxLength);
+
 		return USBD_OK;
 	}
 
@@ -491,6 +491,19 @@ uint8_t USBD_CDC_EP0_RxReady(USBD_HandleTypeDef *pdev) {
 	return USBD_OK;
 }
 
+// Handle the start of frame
+// input:
+//   pdev - pointer to the device instance
+uint8_t USBD_CDC_SOF(USBD_HandleTypeDef *pdev) {
+	if (pdev->pClassData != NULL) {
+		((USBD_CDC_ItfTypeDef *)pdev->pUserData)->SOF();
+
+		return USBD_OK;
+	}
+
+	return USBD_FAIL;
+}
+
 // Return configuration descriptor for FullSpeed USB interface
 // input:
 //   length - pointer to the variable with data length value
@@ -12,19 +12,41 @@ USBD_CDC_LineCodingTypeDef LineCoding = {
 		0x08    // number of bits: 8
 };
 
-// RX buffer size (must be greater or equal to CDC_DATA_FS_OUT_PACKET_SIZE)
-#define APP_RX_DATA_SIZE  1024
-// TX buffer size
-#define APP_TX_DATA_SIZE  1024
+// The data goes through two lock-free rings with one producer and one consumer each,
+// shared by the USB interrupt and the application:
+//   RX - ring of packets, the OUT endpoint receives straight into the free packet at the head,
+//        the application reads the packets at the tail in place. When the ring is full the
+//        endpoint is left unarmed (the host gets NAK) until the SOF after a packet is released.
+//   TX - ring of bytes, the application writes at the head, the IN endpoint sends straight from
+//        the tail. The transfers are started on SOF, so the data written during a frame goes in
+//        full packets, or right after a transfer while there is a full packet to send.
+//        A transfer ending with a full packet is followed by a ZLP when nothing else is sent.
+// The indexes are free running counters, each written by one side only.
 
-// Received data from CDC will be stored in this buffer
-uint8_t UserRXBuf[APP_RX_DATA_SIZE];
-uint32_t UserRXBufCur = 0; // Points to next available character in RX buffer
-uint32_t UserRXBufLen = 0; // Counts number of valid characters in RX buffer
+// Number of packets in the RX ring (power of 2)
+#define CDC_RX_PACKETS    8
+// Size of the TX ring in bytes (power of 2)
+#define CDC_TX_SIZE       1024
+// Longest IN transfer, the ring space is released at the end of the transfer
+#define CDC_TX_XFER_MAX   (CDC_TX_SIZE / 2)
 
-// Buffer to store data to be transfered to CDC
-uint8_t UserTXBuf[APP_TX_DATA_SIZE];
-uint32_t UserTXBufCur = 0;
+// Memory barrier: the ring data is stored before the index that publishes it
+#define CDC_DMB()         __ASM volatile ("dmb" ::: "memory")
+
+// RX ring
+static uint8_t CDC_RxBuf[CDC_RX_PACKETS][CDC_DATA_FS_OUT_PACKET_SIZE];
+static uint32_t CDC_RxLen[CDC_RX_PACKETS]; // Length of each received packet
+static __IO uint32_t CDC_RxHead = 0; // Packets received (USB interrupt)
+static __IO uint32_t CDC_RxTail = 0; // Packets released (application)
+static uint32_t CDC_RxOffset = 0;    // Bytes of the tail packet taken by CDC_Itf_Read (application)
+static uint8_t CDC_RxNAK = 0;        // The OUT endpoint is not armed, the ring was full (USB interrupt)
+
+// TX ring
+static uint8_t CDC_TxBuf[CDC_TX_SIZE];
+static __IO uint32_t CDC_TxHead = 0; // Bytes written (application)
+static __IO uint32_t CDC_TxTail = 0; // Bytes sent (USB interrupt)
+static uint32_t CDC_TxXfer = 0;      // Length of the IN transfer in progress (USB interrupt)
+static uint8_t CDC_TxZLP = 0;        // The last IN transfer ended with a full packet (USB interrupt)
 
 
 // Private function prototypes
@@ -32,6 +54,10 @@ static int8_t CDC_Itf_Init(void);
 static int8_t CDC_Itf_DeInit(void);
 static int8_t CDC_Itf_Control(uint8_t cmd, uint8_t* pbuf, uint16_t length);
 static int8_t CDC_Itf_Receive(uint8_t* pbuf, uint32_t *Len);
+static int8_t CDC_Itf_TransmitCplt(uint8_t* pbuf, uint32_t *Len);
+static int8_t CDC_Itf_SOF(void);
+static void CDC_Itf_RxStart(void);
+static void CDC_Itf_TxStart(void);
 
 
 // CDC interface control procedures
@@ -39,19 +65,29 @@ USBD_CDC_ItfTypeDef USBD_CDC_fops = {
 		CDC_Itf_Init,
 		CDC_Itf_DeInit,
 		CDC_Itf_Control,
-		CDC_Itf_Receive
+		CDC_Itf_Receive,
+		CDC_Itf_TransmitCplt,
+		CDC_Itf_SOF
 };
 
 
 // Initialize the CDC media low layer
+// note: called from the USB interrupt on every configuration of the device, the packets not read
+//       by the application stay in the RX ring, the data not sent yet is dropped from the TX ring
 static int8_t CDC_Itf_Init(void) {
-	// Set Application Buffers
-	USBD_CDC_SetTxBuffer(&USBD_Device,UserTXBuf,0);
-	USBD_CDC_SetRxBuffer(&USBD_Device,UserRXBuf);
+	// Nothing in flight
+	CDC_TxTail = CDC_TxHead;
+	CDC_TxXfer = 0;
+	CDC_TxZLP = 0;
 
-	// Initialize buffer pointers
-	UserRXBufCur = 0;
-	UserRXBufLen = 0;
+	// The class starts the reception into the head packet of the RX ring, if it is free
+	if (CDC_RxHead - CDC_RxTail < CDC_RX_PACKETS) {
+		USBD_CDC_SetRxBuffer(&USBD_Device,CDC_RxBuf[CDC_RxHead & (CDC_RX_PACKETS - 1)]);
+		CDC_RxNAK = 0;
+	} else {
+		USBD_CDC_SetRxBuffer(&USBD_Device,NULL);
+		CDC_RxNAK = 1;
+	}
 
 	return (USBD_OK);
 }
@@ -116,34 +152,177 @@ static int8_t CDC_Itf_Control(uint8_t cmd, uint8_t* pbuf, uint16_t length) {
 
 // Process data received from CDC interface
 // input:
-//   pBuf - pointer to the data buffer
+//   pBuf - pointer to the data buffer (the head packet of the RX ring)
 //   length - pointer to the variable with a size of buffer
 static int8_t CDC_Itf_Receive(uint8_t* pBuf, uint32_t *length) {
-	uint32_t i;
+	// A zero length packet is not worth a slot, receive again into the same one
+	if (*length) {
+		// Publish the packet
+		CDC_RxLen[CDC_RxHead & (CDC_RX_PACKETS - 1)] = *length;
+		CDC_DMB();
+		CDC_RxHead++;
+	}
 
-	// Copy received data from the RX buffer to the RX buffer
-	for (i = 0; i < *length; i++) UserTXBuf[i] = UserRXBuf[i];
+	// Receive the next packet if the ring has room for it, otherwise NAK until a SOF finds a free packet
+	CDC_RxNAK = 1;
+	CDC_Itf_RxStart();
 
-	// Transmit received data back (loop-back mode)
-	USBD_CDC_SetTxBuffer(&USBD_Device,&UserTXBuf[0],*length);
-	USBD_CDC_TransmitPacket(&USBD_Device);
+	return (USBD_OK);
+}
+
+// Process the end of the IN transfer
+// input:
+//   pBuf - pointer to the data buffer
+//   length - pointer to the variable with a size of buffer
+static int8_t CDC_Itf_TransmitCplt(uint8_t* pBuf, uint32_t *length) {
+	// Release the sent data
+	CDC_TxTail += CDC_TxXfer;
+	CDC_TxZLP = (CDC_TxXfer && !(CDC_TxXfer % CDC_DATA_FS_IN_PACKET_SIZE));
+	CDC_TxXfer = 0;
+
+	if ((CDC_TxHead - CDC_TxTail >= CDC_DATA_FS_IN_PACKET_SIZE) || CDC_TxZLP) {
+		// Full packets go at once, the end of the host transfer can't wait for the SOF
+		CDC_Itf_TxStart();
+	}
 
-	// Initiate next USB packet transfer
-	USBD_CDC_SetRxBuffer(&USBD_Device,&UserRXBuf[0]);
-	USBD_CDC_ReceivePacket(&USBD_Device);
+	return (USBD_OK);
+}
+
+// Process the start of frame (every 1ms)
+static int8_t CDC_Itf_SOF(void) {
+	CDC_Itf_RxStart();
+	CDC_Itf_TxStart();
 
 	return (USBD_OK);
 }
 
+// Arm the OUT endpoint if it waits for a free packet of the RX ring
+static void CDC_Itf_RxStart(void) {
+	if (CDC_RxNAK && (CDC_RxHead - CDC_RxTail < CDC_RX_PACKETS)) {
+		CDC_RxNAK = 0;
+		USBD_CDC_SetRxBuffer(&USBD_Device,CDC_RxBuf[CDC_RxHead & (CDC_RX_PACKETS - 1)]);
+		USBD_CDC_ReceivePacket(&USBD_Device);
+	}
+}
+
+// Start an IN transfer from the tail of the TX ring, or a ZLP after a full packet
+// note: does nothing while the IN endpoint is busy
+static void CDC_Itf_TxStart(void) {
+	USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef *)USBD_Device.pClassData;
+	uint32_t tail;
+	uint32_t length;
+
+	if ((hcdc == NULL) || hcdc->TxState) return;
+
+	tail = CDC_TxTail & (CDC_TX_SIZE - 1);
+	length = CDC_TxHead - CDC_TxTail;
+	if (length) {
+		// Contiguous data up to the end of the ring
+		if (length > CDC_TX_SIZE - tail) length = CDC_TX_SIZE - tail;
+		if (length > CDC_TX_XFER_MAX) length = CDC_TX_XFER_MAX;
+	} else if (!CDC_TxZLP) {
+		return;
+	}
+
+	CDC_TxXfer = length;
+	CDC_TxZLP = 0;
+	USBD_CDC_SetTxBuffer(&USBD_Device,&CDC_TxBuf[tail],length);
+	USBD_CDC_TransmitPacket(&USBD_Device);
+}
+
+// Get the oldest received packet, it stays in the RX ring until CDC_Itf_RxRelease()
+// input:
+//   length - pointer to the variable for the packet length
+// return: pointer to the packet data or NULL if nothing received
+uint8_t *CDC_Itf_RxPacket(uint32_t *length) {
+	if (CDC_RxHead == CDC_RxTail) return NULL;
+
+	*length = CDC_RxLen[CDC_RxTail & (CDC_RX_PACKETS - 1)];
+
+	return CDC_RxBuf[CDC_RxTail & (CDC_RX_PACKETS - 1)];
+}
+
+// Release the oldest received packet
+void CDC_Itf_RxRelease(void) {
+	if (CDC_RxHead == CDC_RxTail) return;
+
+	CDC_RxOffset = 0;
+	CDC_DMB();
+	CDC_RxTail++;
+}
+
+// Read the received data
+// input:
+//   pBuf - pointer to the buffer
+//   length - size of buffer
+// return: number of bytes read
+uint32_t CDC_Itf_Read(uint8_t *pBuf, uint32_t length) {
+	uint8_t *pPacket;
+	uint32_t packet_len;
+	uint32_t count = 0;
+
+	while ((count < length) && ((pPacket = CDC_Itf_RxPacket(&packet_len)) != NULL)) {
+		while ((count < length) && (CDC_RxOffset < packet_len)) pBuf[count++] = pPacket[CDC_RxOffset++];
+		if (CDC_RxOffset == packet_len) CDC_Itf_RxRelease();
+	}
+
+	return count;
+}
+
+// Get the free space at the head of the TX ring to write data in place
+// input:
+//   length - pointer to the variable for the contiguous free space
+// return: pointer to the free space, the data is sent after CDC_Itf_TxCommit()
+uint8_t *CDC_Itf_TxAlloc(uint32_t *length) {
+	uint32_t head = CDC_TxHead & (CDC_TX_SIZE - 1);
+
+	*length = CDC_TX_SIZE - (CDC_TxHead - CDC_TxTail);
+	if (*length > CDC_TX_SIZE - head) *length = CDC_TX_SIZE - head;
+
+	return &CDC_TxBuf[head];
+}
+
+// Pass the data written in place to the TX ring
+// input:
+//   length - number of bytes written at the pointer from CDC_Itf_TxAlloc()
+void CDC_Itf_TxCommit(uint32_t length) {
+	CDC_DMB();
+	CDC_TxHead += length;
+}
+
+// Write data to the TX ring
+// input:
+//   pBuf - pointer to the data buffer
+//   length - size of buffer
+// return: number of bytes written, less than length when the ring is full
+uint32_t CDC_Itf_Write(const uint8_t *pBuf, uint32_t length) {
+	uint8_t *pFree;
+	uint32_t free_len;
+	uint32_t count = 0;
+	uint32_t i;
+
+	// At most two pieces: up to the end of the ring and from its start
+	while (count < length) {
+		pFree = CDC_Itf_TxAlloc(&free_len);
+		if (free_len == 0) break;
+		if (free_len > length - count) free_len = length - count;
+		for (i = 0; i < free_len; i++) pFree[i] = pBuf[count + i];
+		CDC_Itf_TxCommit(free_len);
+		count += free_len;
+	}
+
+	return count;
+}
+
 // Send data from specified buffer over CDC interface
 // input:
 //   pBuf - pointer to the data buffer
 //   length - size of buffer
+// return: USBD_OK if the data is in the TX ring, USBD_BUSY if there is no room for all of it
 uint8_t CDC_Itf_Transmit(uint8_t* pBuf, uint16_t length) {
-	uint8_t result = USBD_OK;
+	if (CDC_TX_SIZE - (CDC_TxHead - CDC_TxTail) < length) return USBD_BUSY;
 
-	USBD_CDC_SetTxBuffer(&USBD_Device,pBuf,length);
-	result = USBD_CDC_TransmitPacket(&USBD_Device);
+	CDC_Itf_Write(pBuf,length);
 
-	return result;
+	return USBD_OK;
 }
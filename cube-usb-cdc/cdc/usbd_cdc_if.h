@@ -11,6 +11,12 @@ extern USBD_CDC_ItfTypeDef USBD_CDC_fops;
 
 
 // Function prototypes
+uint8_t *CDC_Itf_RxPacket(uint32_t *length);
+void CDC_Itf_RxRelease(void);
+uint32_t CDC_Itf_Read(uint8_t *pBuf, uint32_t length);
+uint8_t *CDC_Itf_TxAlloc(uint32_t *length);
+void CDC_Itf_TxCommit(uint32_t length);
+uint32_t CDC_Itf_Write(const uint8_t *pBuf, uint32_t length);
 uint8_t CDC_Itf_Transmit(uint8_t* pBuf, uint16_t length);
 
 #endif // __USBD_CDC_IF_H
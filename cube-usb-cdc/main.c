@@ -4,10 +4,10 @@
 USBD_HandleTypeDef USBD_Device;
 
 
-uint8_t CDC_BUF[128];
-
-
 int main(void) {
+	uint8_t *pPacket;
+	uint32_t length;
+
 	// Initialize the UART
 	UARTx_Init(USART2,USART_TX,1382400);
 	printf("--- STM32L151RDT6 ---\r\n");
@@ -22,22 +22,9 @@ int main(void) {
 	// Start Device Process
 	USBD_Start(&USBD_Device);
 
-	// Stuff the buffer
-	CDC_BUF[0]  = 'H';
-	CDC_BUF[1]  = 'E';
-	CDC_BUF[2]  = 'L';
-	CDC_BUF[3]  = 'L';
-	CDC_BUF[4]  = 'O';
-	CDC_BUF[5]  = ' ';
-	CDC_BUF[6]  = 'C';
-	CDC_BUF[7]  = 'D';
-	CDC_BUF[8]  = 'C';
-	CDC_BUF[9]  = '\r';
-	CDC_BUF[10] = '\n';
-
-	uint32_t i;
+	// Loop-back: every received packet goes back from the RX ring once the TX ring has room for it
 	while(1) {
-		CDC_Itf_Transmit(CDC_BUF,11);
-		for (i = 0x008FFFFF; i--; );
+		pPacket = CDC_Itf_RxPacket(&length);
+		if (pPacket && (CDC_Itf_Transmit(pPacket,length) == USBD_OK)) CDC_Itf_RxRelease();
 	}
 }
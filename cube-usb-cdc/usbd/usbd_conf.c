@@ -165,8 +165,8 @@ USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef *pdev) {
 	// Set buffer table address
 	husb.Instance->BTABLE = BTABLE_ADDRESS;
 
-	// Set wInterrupt_Mask global variable
-	wInterrupt_Mask = USB_CNTR_CTRM | USB_CNTR_WKUPM | USB_CNTR_SUSPM | USB_CNTR_ERRM | USB_CNTR_ESOFM | USB_CNTR_RESETM;
+	// Set wInterrupt_Mask global variable (SOF paces the CDC transfers)
+	wInterrupt_Mask = USB_CNTR_CTRM | USB_CNTR_WKUPM | USB_CNTR_SUSPM | USB_CNTR_ERRM | USB_CNTR_SOFM | USB_CNTR_ESOFM | USB_CNTR_RESETM;
 
 	// Set interrupt mask
 	husb.Instance->CNTR = wInterrupt_Mask;
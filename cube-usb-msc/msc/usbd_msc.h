@@ -27,6 +27,11 @@ typedef struct _USBD_STORAGE {
 	int8_t (*IsWriteProtected)(uint8_t lun);
 	int8_t (*Read)(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
 	int8_t (*Write)(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+	int8_t (*ReadStart)(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+	int8_t (*WriteStart)(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+	int8_t (*IsBusy)(uint8_t lun);
+	int8_t (*Complete)(uint8_t lun);
+	int8_t (*Flush)(uint8_t lun);
 	int8_t (*GetMaxLun)(void);
 	int8_t *pInquiry;
 } USBD_StorageTypeDef;
@@ -38,7 +43,7 @@ typedef struct {
 	uint8_t                  bot_state;
 	uint8_t                  bot_status;
 	uint16_t                 bot_data_length;
-	uint8_t                  bot_data[MSC_MEDIA_PACKET];
+	uint8_t                  bot_data[MSC_MEDIA_PACKET * MSC_MEDIA_BUFFERS];
 	USBD_MSC_BOT_CBWTypeDef  cbw;
 	USBD_MSC_BOT_CSWTypeDef  csw;
 	USBD_SCSI_SenseTypeDef   scsi_sense[SENSE_LIST_DEEPTH];
@@ -48,6 +53,14 @@ typedef struct {
 	uint32_t                 scsi_blk_nbr;
 	uint32_t                 scsi_blk_addr;
 	uint32_t                 scsi_blk_len;
+	uint32_t                 scsi_media_addr;  // READ(10)/WRITE(10) pipeline: next media transfer (bytes)
+	uint32_t                 scsi_media_len;   // bytes not yet passed to the media
+	uint8_t                  scsi_media_buf;   // buffer of the next media transfer
+	uint8_t                  scsi_media_busy;  // a media transfer is in progress
+	int8_t                   scsi_media_err;   // a read ahead failed
+	uint8_t                  scsi_usb_buf;     // buffer of the next USB packet
+	uint8_t                  scsi_usb_busy;    // the USB sends a packet from scsi_usb_buf
+	uint8_t                  scsi_buf_ready;   // buffers read and not sent yet, or received and not written yet
 } USBD_MSC_BOT_HandleTypeDef;
 
 
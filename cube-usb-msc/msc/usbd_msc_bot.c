@@ -116,6 +116,9 @@ static void MSC_BOT_CBW_Decode(USBD_HandleTypeDef *pdev) {
 				hmsc->bot_status = USBD_BOT_STATUS_ERROR;
 				MSC_BOT_Abort(pdev);
 	} else {
+		// A media transfer of an aborted READ(10)/WRITE(10) may still use the data buffer
+		SCSI_MediaDrain(pdev,hmsc->cbw.bLUN);
+
 		if (SCSI_ProcessCmd(pdev,hmsc->cbw.bLUN,&hmsc->cbw.CB[0]) < 0) {
 			if (hmsc->bot_state == USBD_BOT_NO_DATA) {
 				MSC_BOT_SendCSW(pdev,USBD_CSW_CMD_FAILED);
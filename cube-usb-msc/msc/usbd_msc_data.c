@@ -12,10 +12,18 @@ const uint8_t MSC_Page00_Inquiry_Data[] = {
 		0x83
 };
 
-// USB mass storage sense 6 data
+// USB mass storage sense 6 data (mode parameter header, the length is set by the command)
 const uint8_t MSC_Mode_Sense6_data[] = {
+		0x03,
 		0x00,
 		0x00,
+		0x00
+};
+
+// USB mass storage sense 10 data
+const uint8_t MSC_Mode_Sense10_data[] = {
+		0x00,
+		0x06,
 		0x00,
 		0x00,
 		0x00,
@@ -24,10 +32,22 @@ const uint8_t MSC_Mode_Sense6_data[] = {
 		0x00
 };
 
-// USB mass storage sense 10 data
-const uint8_t MSC_Mode_Sense10_data[] = {
+// USB mass storage caching mode page
+const uint8_t MSC_Mode_Sense_Caching_data[] = {
+		0x08,                                 // Page code
+		(MODE_SENSE_CACHING_LEN - 2),         // Page length
+		(MSC_WCACHE_BLOCKS ? 0x04 : 0x00),    // WCE: write cache enabled
+		0x00,
+		0x00,
+		0x00,
+		0x00,
+		0x00,
+		0x00,
+		0x00,
+		0x00,
+		0x00,
+		0x00,
 		0x00,
-		0x06,
 		0x00,
 		0x00,
 		0x00,
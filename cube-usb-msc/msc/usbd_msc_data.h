@@ -5,8 +5,9 @@
 #include "usbd_conf.h"
 
 
-#define MODE_SENSE6_LEN           8
+#define MODE_SENSE6_LEN           4
 #define MODE_SENSE10_LEN          8
+#define MODE_SENSE_CACHING_LEN    20
 #define LENGTH_INQUIRY_PAGE00     7
 #define LENGTH_FORMAT_CAPACITIES  20
 
@@ -14,5 +15,6 @@
 extern const uint8_t MSC_Page00_Inquiry_Data[];  
 extern const uint8_t MSC_Mode_Sense6_data[];
 extern const uint8_t MSC_Mode_Sense10_data[] ;
+extern const uint8_t MSC_Mode_Sense_Caching_data[];
 
 #endif // __USBD_MSC_DATA_H
@@ -10,6 +10,10 @@ static int8_t SCSI_ReadFormatCapacity(USBD_HandleTypeDef *pdev, uint8_t lun, uin
 static int8_t SCSI_ReadCapacity10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params);
 static int8_t SCSI_RequestSense (USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params);
 static int8_t SCSI_StartStopUnit(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params);
+static int8_t SCSI_AllowMediumRemoval(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params);
+static int8_t SCSI_SynchronizeCache10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params);
+static int8_t SCSI_Flush(USBD_HandleTypeDef *pdev, uint8_t lun);
+static uint16_t SCSI_ModePages(USBD_MSC_BOT_HandleTypeDef *hmsc, uint16_t len, uint8_t page);
 static int8_t SCSI_ModeSense6 (USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params);
 static int8_t SCSI_ModeSense10 (USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params);
 static int8_t SCSI_Write10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params);
@@ -18,6 +22,10 @@ static int8_t SCSI_Verify10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *para
 static int8_t SCSI_CheckAddressRange (USBD_HandleTypeDef *pdev, uint8_t lun, uint32_t blk_offset, uint16_t blk_nbr);
 static int8_t SCSI_ProcessRead(USBD_HandleTypeDef *pdev, uint8_t lun);
 static int8_t SCSI_ProcessWrite(USBD_HandleTypeDef *pdev, uint8_t lun);
+static void SCSI_MediaInit(USBD_HandleTypeDef *pdev);
+static int8_t SCSI_MediaStart(USBD_HandleTypeDef *pdev, uint8_t lun);
+static int8_t SCSI_MediaWait(USBD_HandleTypeDef *pdev, uint8_t lun);
+static int8_t SCSI_WriteFault(USBD_HandleTypeDef *pdev, uint8_t lun);
 
 
 // Process a SCSI command
@@ -36,7 +44,9 @@ int8_t SCSI_ProcessCmd(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params) {
 		case SCSI_START_STOP_UNIT:
 			return SCSI_StartStopUnit(pdev,lun,params);
 		case SCSI_ALLOW_MEDIUM_REMOVAL:
-			return SCSI_StartStopUnit(pdev,lun,params);
+			return SCSI_AllowMediumRemoval(pdev,lun,params);
+		case SCSI_SYNCHRONIZE_CACHE10:
+			return SCSI_SynchronizeCache10(pdev,lun,params);
 		case SCSI_MODE_SENSE6:
 			return SCSI_ModeSense6(pdev,lun,params);
 		case SCSI_MODE_SENSE10:
@@ -80,7 +90,8 @@ static int8_t SCSI_TestUnitReady(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t
 	}
 	hmsc->bot_data_length = 0;
 
-	return 0;
+	// The host polls the unit when idle, a good time to write the cache
+	return SCSI_Flush(pdev,lun);
 }
 
 // Process SCSI INQUIRY command
@@ -179,14 +190,15 @@ static int8_t SCSI_ReadFormatCapacity(USBD_HandleTypeDef *pdev, uint8_t lun, uin
 //   params - pointer to the buffer with command parameters
 static int8_t SCSI_ModeSense6(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params) {
 	USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
-	uint16_t len = 8 ;
-
-	hmsc->bot_data_length = len;
+	uint16_t len = MODE_SENSE6_LEN;
 
 	while (len) {
 		len--;
 		hmsc->bot_data[len] = MSC_Mode_Sense6_data[len];
 	}
+	len = SCSI_ModePages(hmsc,MODE_SENSE6_LEN,params[2]);
+	hmsc->bot_data[0] = len - 1;
+	hmsc->bot_data_length = MIN(len,params[4]);
 
 	return 0;
 }
@@ -198,17 +210,40 @@ static int8_t SCSI_ModeSense6(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *pa
 //   params - pointer to the buffer with command parameters
 static int8_t SCSI_ModeSense10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params) {
 	USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
-	uint16_t len = 8;
+	uint16_t len = MODE_SENSE10_LEN;
 
-	hmsc->bot_data_length = len;
 	while (len) {
 		len--;
 		hmsc->bot_data[len] = MSC_Mode_Sense10_data[len];
 	}
+	len = SCSI_ModePages(hmsc,MODE_SENSE10_LEN,params[2]);
+	hmsc->bot_data[0] = (len - 2) >> 8;
+	hmsc->bot_data[1] = (len - 2) & 0xFF;
+	hmsc->bot_data_length = MIN(len,(params[7] << 8) | params[8]);
 
 	return 0;
 }
 
+// Append the mode pages requested by MODE SENSE to the mode parameter header in bot_data
+// input:
+//   hmsc - pointer to the BOT state machine
+//   len - length of the mode parameter header
+//   page - PC and PAGE CODE field of the command
+// return: length of the mode parameter data
+static uint16_t SCSI_ModePages(USBD_MSC_BOT_HandleTypeDef *hmsc, uint16_t len, uint8_t page) {
+	uint16_t i;
+
+	// Caching page (or all pages): the WCE bit tells the host to synchronize the cache
+	if (((page & 0x3F) == 0x08) || ((page & 0x3F) == 0x3F)) {
+		for (i = 0; i < MODE_SENSE_CACHING_LEN; i++) hmsc->bot_data[len + i] = MSC_Mode_Sense_Caching_data[i];
+		// The changeable values: none, there is no MODE SELECT
+		if ((page & 0xC0) == 0x40) hmsc->bot_data[len + 2] = 0x00;
+		len += MODE_SENSE_CACHING_LEN;
+	}
+
+	return len;
+}
+
 // Process SCSI request sense command
 // input:
 //   pdev - pointer to the USB device handle
@@ -261,6 +296,62 @@ static int8_t SCSI_StartStopUnit(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t
 	USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
 	hmsc->bot_data_length = 0;
 
+	// START = 0: stop or eject (LOEJ = 1), write the cache before the medium goes away
+	if (!(params[4] & 0x01)) return SCSI_Flush(pdev,lun);
+
+	return 0;
+}
+
+// Process SCSI PREVENT ALLOW MEDIUM REMOVAL command
+// input:
+//   pdev - pointer to the USB device handle
+//   lun - logical unit number
+//   params - pointer to the buffer with command parameters
+static int8_t SCSI_AllowMediumRemoval(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params) {
+	USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+	hmsc->bot_data_length = 0;
+
+	// PREVENT = 0: the medium can be removed after this command
+	if (!(params[4] & 0x03)) return SCSI_Flush(pdev,lun);
+
+	return 0;
+}
+
+// Process SCSI SYNCHRONIZE CACHE(10) command
+// input:
+//   pdev - pointer to the USB device handle
+//   lun - logical unit number
+//   params - pointer to the buffer with command parameters
+// note: the whole cache is written regardless of the LBA range
+static int8_t SCSI_SynchronizeCache10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params) {
+	USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+
+	// case 9 : Hi > D0
+	if (hmsc->cbw.dDataLength != 0) {
+		SCSI_SenseCode(pdev,hmsc->cbw.bLUN,ILLEGAL_REQUEST,INVALID_CDB);
+
+		return -1;
+	}
+	hmsc->bot_data_length = 0;
+
+	return SCSI_Flush(pdev,lun);
+}
+
+// Write the cached data of the storage to the medium
+// input:
+//   pdev - pointer to the USB device handle
+//   lun - logical unit number
+// return: 0 = OK | -1 = ERROR (sense code set)
+static int8_t SCSI_Flush(USBD_HandleTypeDef *pdev, uint8_t lun) {
+	USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+
+	if (((USBD_StorageTypeDef *)pdev->pUserData)->Flush(lun) < 0) {
+		SCSI_SenseCode(pdev,lun,HARDWARE_ERROR,WRITE_FAULT);
+		hmsc->bot_state = USBD_BOT_NO_DATA;
+
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -302,6 +393,8 @@ static int8_t SCSI_Read10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params
 
 			return -1;
 		}
+
+		SCSI_MediaInit(pdev);
 	}
 
 	hmsc->bot_data_length = MSC_MEDIA_PACKET;
@@ -357,6 +450,7 @@ static int8_t SCSI_Write10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *param
     
 		// Prepare endpoint to receive first data packet
 		hmsc->bot_state = USBD_BOT_DATA_OUT;
+		SCSI_MediaInit(pdev);
 		USBD_LL_PrepareReceive(pdev,MSC_EPOUT_ADDR,hmsc->bot_data,MIN(hmsc->scsi_blk_len,MSC_MEDIA_PACKET));
 	} else {
 		// Write Process ongoing
@@ -405,6 +499,100 @@ static int8_t SCSI_CheckAddressRange(USBD_HandleTypeDef *pdev, uint8_t lun, uint
 	return 0;
 }
 
+// The READ(10)/WRITE(10) data goes through a ring of MSC_MEDIA_BUFFERS packet buffers in bot_data:
+// the media transfer of one buffer runs while the USB transfers another one. Only one media transfer
+// is in progress at a time (ReadStart/WriteStart ... Complete of the storage), it is started from the
+// USB callbacks and waited for only when its buffer is needed.
+
+// Pointer to the packet buffer
+#define SCSI_BUF(hmsc,idx)   (&(hmsc)->bot_data[(idx) * MSC_MEDIA_PACKET])
+
+// Next packet buffer in the ring
+#define SCSI_BUF_NEXT(idx)   (((idx) + 1 < MSC_MEDIA_BUFFERS) ? (idx) + 1 : 0)
+
+// Reset the READ(10)/WRITE(10) pipeline for a new transfer
+// input:
+//   pdev - pointer to the USB device handle
+// note: scsi_blk_addr and scsi_blk_len must be already set
+static void SCSI_MediaInit(USBD_HandleTypeDef *pdev) {
+	USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+
+	hmsc->scsi_media_addr = hmsc->scsi_blk_addr;
+	hmsc->scsi_media_len  = hmsc->scsi_blk_len;
+	hmsc->scsi_media_buf  = 0;
+	hmsc->scsi_media_err  = 0;
+	hmsc->scsi_usb_buf    = 0;
+	hmsc->scsi_usb_busy   = 0;
+	hmsc->scsi_buf_ready  = 0;
+}
+
+// Start the media transfer of the next packet if the media is idle and there is a buffer for it
+// input:
+//   pdev - pointer to the USB device handle
+//   lun - logical unit number
+// return: 0 = OK or nothing to do | -1 = ERROR
+static int8_t SCSI_MediaStart(USBD_HandleTypeDef *pdev, uint8_t lun) {
+	USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+	USBD_StorageTypeDef *fops = (USBD_StorageTypeDef *)pdev->pUserData;
+	uint32_t len;
+	int8_t result;
+
+	if (hmsc->scsi_media_busy || (hmsc->scsi_media_len == 0)) return 0;
+
+	len = MIN(hmsc->scsi_media_len,MSC_MEDIA_PACKET);
+	if (hmsc->bot_state == USBD_BOT_DATA_OUT) {
+		// Write the oldest received packet
+		if (hmsc->scsi_buf_ready == 0) return 0;
+		result = fops->WriteStart(lun,SCSI_BUF(hmsc,hmsc->scsi_media_buf),hmsc->scsi_media_addr / hmsc->scsi_blk_size,len / hmsc->scsi_blk_size);
+		hmsc->scsi_buf_ready--;
+	} else {
+		// Read ahead into a free buffer
+		if (hmsc->scsi_buf_ready + hmsc->scsi_usb_busy >= MSC_MEDIA_BUFFERS) return 0;
+		result = fops->ReadStart(lun,SCSI_BUF(hmsc,hmsc->scsi_media_buf),hmsc->scsi_media_addr / hmsc->scsi_blk_size,len / hmsc->scsi_blk_size);
+	}
+	if (result < 0) return -1;
+
+	hmsc->scsi_media_busy  = 1;
+	hmsc->scsi_media_buf   = SCSI_BUF_NEXT(hmsc->scsi_media_buf);
+	hmsc->scsi_media_addr += len;
+	hmsc->scsi_media_len  -= len;
+
+	return 0;
+}
+
+// Wait for the media transfer in progress
+// input:
+//   pdev - pointer to the USB device handle
+//   lun - logical unit number
+// return: 0 = OK or nothing to do | -1 = ERROR
+static int8_t SCSI_MediaWait(USBD_HandleTypeDef *pdev, uint8_t lun) {
+	USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+
+	if (!hmsc->scsi_media_busy) return 0;
+
+	hmsc->scsi_media_busy = 0;
+	if (((USBD_StorageTypeDef *)pdev->pUserData)->Complete(lun) < 0) return -1;
+
+	// The buffer is read and can be sent
+	if (hmsc->bot_state != USBD_BOT_DATA_OUT) hmsc->scsi_buf_ready++;
+
+	return 0;
+}
+
+// Finish the media transfer left by an aborted READ(10)/WRITE(10)
+// input:
+//   pdev - pointer to the USB device handle
+//   lun - logical unit number
+// note: must be called before bot_data is used for anything else
+void SCSI_MediaDrain(USBD_HandleTypeDef *pdev, uint8_t lun) {
+	USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+
+	if (hmsc->scsi_media_busy) {
+		hmsc->scsi_media_busy = 0;
+		((USBD_StorageTypeDef *)pdev->pUserData)->Complete(lun);
+	}
+}
+
 // Handle read process
 // input:
 //   pdev - pointer to the USB device handle
@@ -413,13 +601,27 @@ static int8_t SCSI_ProcessRead(USBD_HandleTypeDef *pdev, uint8_t lun) {
 	USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
 	uint32_t len;
 
-	len = MIN(hmsc->scsi_blk_len,MSC_MEDIA_PACKET);
-	if (((USBD_StorageTypeDef *)pdev->pUserData)->Read(lun,hmsc->bot_data,hmsc->scsi_blk_addr / hmsc->scsi_blk_size,len / hmsc->scsi_blk_size) < 0) {
+	// The packet sent before is done, its buffer is free
+	if (hmsc->scsi_usb_busy) {
+		hmsc->scsi_usb_busy = 0;
+		hmsc->scsi_usb_buf  = SCSI_BUF_NEXT(hmsc->scsi_usb_buf);
+	}
+
+	// The packet to send must be read completely
+	if ((hmsc->scsi_buf_ready == 0) && ((SCSI_MediaStart(pdev,lun) < 0) || (SCSI_MediaWait(pdev,lun) < 0))) {
+		hmsc->scsi_media_err = -1;
+	}
+	if (hmsc->scsi_media_err < 0) {
+		SCSI_MediaDrain(pdev,lun);
 		SCSI_SenseCode(pdev,lun,HARDWARE_ERROR,UNRECOVERED_READ_ERROR);
 
 		return -1;
 	}
-	USBD_LL_Transmit(pdev,MSC_EPIN_ADDR,hmsc->bot_data,len);
+
+	len = MIN(hmsc->scsi_blk_len,MSC_MEDIA_PACKET);
+	USBD_LL_Transmit(pdev,MSC_EPIN_ADDR,SCSI_BUF(hmsc,hmsc->scsi_usb_buf),len);
+	hmsc->scsi_usb_busy = 1;
+	hmsc->scsi_buf_ready--;
 
 	hmsc->scsi_blk_addr += len;
 	hmsc->scsi_blk_len  -= len;
@@ -428,9 +630,27 @@ static int8_t SCSI_ProcessRead(USBD_HandleTypeDef *pdev, uint8_t lun) {
 	hmsc->csw.dDataResidue -= len;
 	if (hmsc->scsi_blk_len == 0) hmsc->bot_state = USBD_BOT_LAST_DATA_IN;
 
+	// Read ahead while the USB sends the packet, a failure is reported when its packet is due
+	if (hmsc->scsi_media_busy && !((USBD_StorageTypeDef *)pdev->pUserData)->IsBusy(lun)) {
+		if (SCSI_MediaWait(pdev,lun) < 0) hmsc->scsi_media_err = -1;
+	}
+	if ((hmsc->scsi_media_err == 0) && (SCSI_MediaStart(pdev,lun) < 0)) hmsc->scsi_media_err = -1;
+
 	return 0;
 }
 
+// Abort the write process on a media failure
+// input:
+//   pdev - pointer to the USB device handle
+//   lun - logical unit number
+// return: -1
+static int8_t SCSI_WriteFault(USBD_HandleTypeDef *pdev, uint8_t lun) {
+	SCSI_MediaDrain(pdev,lun);
+	SCSI_SenseCode(pdev,lun,HARDWARE_ERROR,WRITE_FAULT);
+
+	return -1;
+}
+
 // Handle write process
 // input:
 //   pdev - pointer to the USB device handle
@@ -439,24 +659,35 @@ static int8_t SCSI_ProcessWrite(USBD_HandleTypeDef *pdev, uint8_t lun) {
 	USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
 	uint32_t len;
 
+	// The packet is received
 	len = MIN(hmsc->scsi_blk_len,MSC_MEDIA_PACKET);
-
-	if (((USBD_StorageTypeDef *)pdev->pUserData)->Write(lun,hmsc->bot_data,hmsc->scsi_blk_addr / hmsc->scsi_blk_size,len / hmsc->scsi_blk_size) < 0) {
-		SCSI_SenseCode(pdev,lun,HARDWARE_ERROR,WRITE_FAULT);
-
-		return -1;
-	}
+	hmsc->scsi_usb_buf = SCSI_BUF_NEXT(hmsc->scsi_usb_buf);
+	hmsc->scsi_buf_ready++;
 
 	hmsc->scsi_blk_addr += len;
 	hmsc->scsi_blk_len  -= len;
-  
+
 	// case 12 : Ho = Do
 	hmsc->csw.dDataResidue -= len;
+
+	// Write it if the media is idle
+	if (hmsc->scsi_media_busy && !((USBD_StorageTypeDef *)pdev->pUserData)->IsBusy(lun)) {
+		if (SCSI_MediaWait(pdev,lun) < 0) return SCSI_WriteFault(pdev,lun);
+	}
+	if (SCSI_MediaStart(pdev,lun) < 0) return SCSI_WriteFault(pdev,lun);
+
 	if (hmsc->scsi_blk_len == 0) {
+		// Last packet: write everything before the status
+		while (hmsc->scsi_media_busy) {
+			if ((SCSI_MediaWait(pdev,lun) < 0) || (SCSI_MediaStart(pdev,lun) < 0)) return SCSI_WriteFault(pdev,lun);
+		}
 		MSC_BOT_SendCSW(pdev,USBD_CSW_CMD_PASSED);
 	} else {
-		// Prepare endpoint to receive next packet
-		USBD_LL_PrepareReceive(pdev,MSC_EPOUT_ADDR,hmsc->bot_data,MIN(hmsc->scsi_blk_len,MSC_MEDIA_PACKET));
+		// Wait for a free buffer and prepare endpoint to receive next packet into it
+		while (hmsc->scsi_buf_ready + hmsc->scsi_media_busy >= MSC_MEDIA_BUFFERS) {
+			if ((SCSI_MediaWait(pdev,lun) < 0) || (SCSI_MediaStart(pdev,lun) < 0)) return SCSI_WriteFault(pdev,lun);
+		}
+		USBD_LL_PrepareReceive(pdev,MSC_EPOUT_ADDR,SCSI_BUF(hmsc,hmsc->scsi_usb_buf),MIN(hmsc->scsi_blk_len,MSC_MEDIA_PACKET));
 	}
 
 	return 0;
@@ -32,6 +32,7 @@
 #define SCSI_VERIFY12                               0xAF
 #define SCSI_VERIFY16                               0x8F
 #define SCSI_SEND_DIAGNOSTIC                        0x1D
+#define SCSI_SYNCHRONIZE_CACHE10                    0x35
 #define SCSI_READ_FORMAT_CAPACITIES                 0x23
 
 #define NO_SENSE                                    0
@@ -92,5 +93,6 @@ typedef struct _SENSE_ITEM {
 
 int8_t SCSI_ProcessCmd(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *cmd);
 void SCSI_SenseCode(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t sKey, uint8_t ASC);
+void SCSI_MediaDrain(USBD_HandleTypeDef *pdev, uint8_t lun);
 
 #endif // __USBD_MSC_SCSI_H
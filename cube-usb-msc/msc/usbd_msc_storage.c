@@ -12,9 +12,35 @@ int8_t STORAGE_IsReady(uint8_t lun);
 int8_t STORAGE_IsWriteProtected(uint8_t lun);
 int8_t STORAGE_Read(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
 int8_t STORAGE_Write(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+int8_t STORAGE_ReadStart(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+int8_t STORAGE_WriteStart(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+int8_t STORAGE_IsBusy(uint8_t lun);
+int8_t STORAGE_Complete(uint8_t lun);
+int8_t STORAGE_Flush(uint8_t lun);
 int8_t STORAGE_GetMaxLun(void);
 
 
+// Transfer started by STORAGE_ReadStart()/STORAGE_WriteStart()
+static uint32_t STORAGE_XferLength; // Length in bytes, zero when no transfer started
+static uint8_t  STORAGE_XferWrite;  // Nonzero for a write
+
+#if (MSC_WCACHE_BLOCKS)
+// Write-back cache: the written blocks stay in RAM and go to the card when the cache is full or flushed.
+// The lines are taken in order, so a sequential write fills consecutive lines and goes to the card as one
+// multiple block write, a rewritten block (FAT, directory) only updates its line. A read gets the cached
+// blocks over the data from the card. Works with STORAGE_BLK_SIZ blocks only, other cards are written through.
+static uint32_t STORAGE_Cache[MSC_WCACHE_BLOCKS][STORAGE_BLK_SIZ / 4]; // Cached blocks
+static uint32_t STORAGE_CacheLBA[MSC_WCACHE_BLOCKS]; // Block address of each line
+static uint16_t STORAGE_CacheUsed;     // Lines in use
+static uint8_t  STORAGE_CacheFlushing; // The transfer in progress writes the last run of the cache
+
+// Read started by STORAGE_ReadStart(), the cached blocks are copied over it by STORAGE_Complete()
+static uint8_t *STORAGE_XferBuf;
+static uint32_t STORAGE_XferAddr;
+static uint16_t STORAGE_XferBlocks;
+#endif
+
+
 // USB Mass storage standard inquiry data
 int8_t STORAGE_Inquirydata[] = {
 		// LUN 0
@@ -39,6 +65,11 @@ USBD_StorageTypeDef USBD_MSC_fops = {
 		STORAGE_IsWriteProtected,
 		STORAGE_Read,
 		STORAGE_Write,
+		STORAGE_ReadStart,
+		STORAGE_WriteStart,
+		STORAGE_IsBusy,
+		STORAGE_Complete,
+		STORAGE_Flush,
 		STORAGE_GetMaxLun,
 		STORAGE_Inquirydata,
 };
@@ -52,6 +83,12 @@ int8_t STORAGE_Init(uint8_t lun) {
 	int8_t result = -1;
 	SDResult SDRes;
 
+	// Called again on every configuration of the device (a USB bus reset is the host's error recovery):
+	// the host already has the good status for the cached blocks, so finish the transfer in progress
+	// and write the cache to the card before initializing it again. Only a failed write (the card is
+	// gone or changed) drops the cached blocks.
+	STORAGE_Flush(lun);
+
 	// Initialize the SDIO peripheral GPIO pins
 	SD_SDIO_GPIO_Init();
 
@@ -113,19 +150,9 @@ int8_t STORAGE_IsWriteProtected(uint8_t lun) {
 //   blk_len - blocks number
 // return: 0 = OK | -1 = ERROR
 int8_t STORAGE_Read(uint8_t lun, uint8_t *pBuf, uint32_t blk_addr, uint16_t blk_len) {
-	uint32_t read_length = blk_len * SDCard.BlockSize;
-	SDResult SDRes;
-	int8_t result = -1;
+	if (STORAGE_ReadStart(lun,pBuf,blk_addr,blk_len) < 0) return -1;
 
-	// Start block reading from the SD card
-	SDRes = SD_ReadBlock_DMA(blk_addr * SDCard.BlockSize,(uint32_t *)pBuf,read_length);
-	if (SDRes == SDR_Success) {
-		// Wait while data transfered by DMA
-		SDRes = SD_CheckRead(read_length);
-		if (SDRes == SDR_Success) result = 0;
-	}
-
-	return result;
+	return STORAGE_Complete(lun);
 }
 
 // Write data to the medium
@@ -136,17 +163,196 @@ int8_t STORAGE_Read(uint8_t lun, uint8_t *pBuf, uint32_t blk_addr, uint16_t blk_
 //   blk_len - blocks number
 // return: 0 = OK | -1 = ERROR
 int8_t STORAGE_Write(uint8_t lun, uint8_t *pBuf, uint32_t blk_addr, uint16_t blk_len) {
-	uint32_t read_length = blk_len * SDCard.BlockSize;
+	if (STORAGE_WriteStart(lun,pBuf,blk_addr,blk_len) < 0) return -1;
+
+	return STORAGE_Complete(lun);
+}
+
+#if (MSC_WCACHE_BLOCKS)
+// Find the cache line of a block
+// input:
+//   blk_addr - logical block address
+// return: line number or MSC_WCACHE_BLOCKS if the block is not cached
+static uint16_t STORAGE_CacheFind(uint32_t blk_addr) {
+	uint16_t i;
+
+	for (i = 0; i < STORAGE_CacheUsed; i++) {
+		if (STORAGE_CacheLBA[i] == blk_addr) break;
+	}
+
+	return (i < STORAGE_CacheUsed) ? i : MSC_WCACHE_BLOCKS;
+}
+
+// Write the cached blocks to the card, one multiple block write for each run of consecutive blocks
+// input:
+//   wait - nonzero to wait for the last run, otherwise STORAGE_Complete() waits for it and empties the cache
+// return: 0 = OK | -1 = ERROR
+// note: the cache is dropped on a failure, the error is reported to the host instead
+static int8_t STORAGE_CacheWrite(uint8_t wait) {
+	uint16_t first = 0;
+	uint16_t last;
+
+	while (first < STORAGE_CacheUsed) {
+		// Run of lines with consecutive block addresses
+		last = first + 1;
+		while ((last < STORAGE_CacheUsed) && (STORAGE_CacheLBA[last] == STORAGE_CacheLBA[last - 1] + 1)) last++;
+
+		STORAGE_XferLength = (last - first) * STORAGE_BLK_SIZ;
+		STORAGE_XferWrite = 1;
+		if (SD_WriteBlock_DMA(STORAGE_CacheLBA[first] * STORAGE_BLK_SIZ,STORAGE_Cache[first],STORAGE_XferLength) != SDR_Success) {
+			STORAGE_XferLength = 0;
+			STORAGE_CacheUsed = 0;
+
+			return -1;
+		}
+		if ((last == STORAGE_CacheUsed) && !wait) {
+			// The card writes the last run in the background
+			STORAGE_CacheFlushing = 1;
+
+			return 0;
+		}
+		if (SD_CheckWrite(STORAGE_XferLength) != SDR_Success) {
+			STORAGE_XferLength = 0;
+			STORAGE_CacheUsed = 0;
+
+			return -1;
+		}
+		first = last;
+	}
+	STORAGE_XferLength = 0;
+	STORAGE_CacheUsed = 0;
+
+	return 0;
+}
+#endif
+
+// Start reading data from the medium, the data is in the buffer after STORAGE_Complete()
+// input:
+//   lun - logical unit number
+//   pBuf - pointer to the data buffer (word aligned)
+//   blk_addr - logical block address
+//   blk_len - blocks number
+// return: 0 = OK | -1 = ERROR
+int8_t STORAGE_ReadStart(uint8_t lun, uint8_t *pBuf, uint32_t blk_addr, uint16_t blk_len) {
+	STORAGE_XferLength = blk_len * SDCard.BlockSize;
+	STORAGE_XferWrite = 0;
+#if (MSC_WCACHE_BLOCKS)
+	STORAGE_XferBuf = pBuf;
+	STORAGE_XferAddr = blk_addr;
+	STORAGE_XferBlocks = blk_len;
+#endif
+
+	// Start block reading from the SD card, the DMA transfers the data in the background
+	if (SD_ReadBlock_DMA(blk_addr * SDCard.BlockSize,(uint32_t *)pBuf,STORAGE_XferLength) != SDR_Success) {
+		STORAGE_XferLength = 0;
+
+		return -1;
+	}
+
+	return 0;
+}
+
+// Start writing data to the medium, the buffer must stay intact until STORAGE_Complete()
+// input:
+//   lun - logical unit number
+//   pBuf - pointer to the data buffer (word aligned)
+//   blk_addr - logical block address
+//   blk_len - blocks number
+// return: 0 = OK | -1 = ERROR
+// note: with the write cache the data is copied into the cache, a full cache is written to the card
+int8_t STORAGE_WriteStart(uint8_t lun, uint8_t *pBuf, uint32_t blk_addr, uint16_t blk_len) {
+#if (MSC_WCACHE_BLOCKS)
+	uint16_t line;
+	uint16_t i;
+
+	if (SDCard.BlockSize == STORAGE_BLK_SIZ) {
+		while (blk_len--) {
+			line = STORAGE_CacheFind(blk_addr);
+			if (line == MSC_WCACHE_BLOCKS) {
+				// Not cached, take the next line
+				if ((STORAGE_CacheUsed == MSC_WCACHE_BLOCKS) && (STORAGE_CacheWrite(1) < 0)) return -1;
+				line = STORAGE_CacheUsed++;
+				STORAGE_CacheLBA[line] = blk_addr;
+			}
+			for (i = 0; i < STORAGE_BLK_SIZ / 4; i++) STORAGE_Cache[line][i] = ((uint32_t *)pBuf)[i];
+			pBuf += STORAGE_BLK_SIZ;
+			blk_addr++;
+		}
+
+		// Start writing the cache when the next packet may not fit, the USB receives it meanwhile
+		if (MSC_WCACHE_BLOCKS - STORAGE_CacheUsed < MSC_MEDIA_PACKET / STORAGE_BLK_SIZ) return STORAGE_CacheWrite(0);
+
+		return 0;
+	}
+#endif
+	STORAGE_XferLength = blk_len * SDCard.BlockSize;
+	STORAGE_XferWrite = 1;
+
+	// Start block write to the SD card, the DMA transfers the data in the background
+	if (SD_WriteBlock_DMA(blk_addr * SDCard.BlockSize,(uint32_t *)pBuf,STORAGE_XferLength) != SDR_Success) {
+		STORAGE_XferLength = 0;
+
+		return -1;
+	}
+
+	return 0;
+}
+
+// Check whether the transfer started by STORAGE_ReadStart()/STORAGE_WriteStart() still moves data
+// input:
+//   lun - logical unit number
+// return: 1 = the data transfer is in progress | 0 = STORAGE_Complete() won't wait for the data
+int8_t STORAGE_IsBusy(uint8_t lun) {
+	// DATAEND or an error, DBCKEND comes after every block of a multiple block transfer
+	return (STORAGE_XferLength && !(SDIO->STA & (SDIO_XFER_FLAGS & ~SDIO_STA_DBCKEND))) ? 1 : 0;
+}
+
+// Wait for the end of the transfer started by STORAGE_ReadStart()/STORAGE_WriteStart()
+// input:
+//   lun - logical unit number
+// return: 0 = OK | -1 = ERROR
+int8_t STORAGE_Complete(uint8_t lun) {
 	SDResult SDRes;
-	int8_t result = -1;
 
-	// Start block write to the SD card
-	SDRes = SD_WriteBlock_DMA(blk_addr * SDCard.BlockSize,(uint32_t *)pBuf,read_length);
-	if (SDRes == SDR_Success) {
-		// Wait while data transfered by DMA
-		SDRes = SD_CheckWrite(read_length);
-		if (SDRes == SDR_Success) result = 0;
+	if (!STORAGE_XferLength) return 0;
+
+	// Wait while data transfered by DMA and, for a write, while the card programs it
+	SDRes = STORAGE_XferWrite ? SD_CheckWrite(STORAGE_XferLength) : SD_CheckRead(STORAGE_XferLength);
+	STORAGE_XferLength = 0;
+
+#if (MSC_WCACHE_BLOCKS)
+	if (STORAGE_CacheFlushing) {
+		// The last run of the cache is written (or failed and is dropped)
+		STORAGE_CacheFlushing = 0;
+		STORAGE_CacheUsed = 0;
+	} else if (!STORAGE_XferWrite && (SDRes == SDR_Success)) {
+		// The cached blocks are newer than the card
+		uint16_t line;
+		uint16_t i;
+
+		for (line = 0; line < STORAGE_CacheUsed; line++) {
+			if ((STORAGE_CacheLBA[line] - STORAGE_XferAddr) < STORAGE_XferBlocks) {
+				for (i = 0; i < STORAGE_BLK_SIZ / 4; i++) {
+					((uint32_t *)STORAGE_XferBuf)[(STORAGE_CacheLBA[line] - STORAGE_XferAddr) * (STORAGE_BLK_SIZ / 4) + i] = STORAGE_Cache[line][i];
+				}
+			}
+		}
 	}
+#endif
+
+	return (SDRes == SDR_Success) ? 0 : -1;
+}
+
+// Write the cached data to the medium
+// input:
+//   lun - logical unit number
+// return: 0 = OK | -1 = ERROR
+int8_t STORAGE_Flush(uint8_t lun) {
+	int8_t result = STORAGE_Complete(lun);
+
+#if (MSC_WCACHE_BLOCKS)
+	if (STORAGE_CacheWrite(1) < 0) result = -1;
+#endif
 
 	return result;
 }
@@ -1,4 +1,5 @@
 #include "usb_ll.h"
+#include "usb_pma.h"
 
 
 USB_HandleTypeDef husb; // USB device handle
@@ -86,17 +87,7 @@ void HAL_USB_SetAddress(USB_HandleTypeDef *husb, uint8_t address) {
 //   wPMABufAddr - address in PMA
 //   wNBytes - number of bytes to be copied
 static void USB_WritePMA(USB_TypeDef *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes) {
-	uint16_t *pdwVal = (uint16_t *)((wPMABufAddr << 1) + (uint32_t)USBx + 0x400);
-	uint32_t i,temp1,temp2;
-
-	for (i = (wNBytes + 1) >> 1; i--; ) {
-		temp1 = (uint16_t) * pbUsrBuf;
-		pbUsrBuf++;
-		temp2 = temp1 | (uint16_t) * pbUsrBuf << 8;
-		*pdwVal++ = temp2;
-		pdwVal++;
-		pbUsrBuf++;
-	}
+	PMA_Write((uint32_t *)((wPMABufAddr << 1) + (uint32_t)USBx + 0x400),pbUsrBuf,wNBytes);
 }
 
 // Copy a data from the USB packet memory area to the user memory area
@@ -106,13 +97,7 @@ static void USB_WritePMA(USB_TypeDef *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufA
 //   wPMABufAddr - address in PMA
 //   wNBytes - number of bytes to be copied
 static void USB_ReadPMA(USB_TypeDef *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes) {
-	uint32_t *pdwVal = (uint32_t *)((wPMABufAddr << 1) + (uint32_t)USBx + 0x400);
-	uint32_t i;
-
-	for (i = (wNBytes + 1) >> 1; i--; ) {
-		*(uint16_t*)pbUsrBuf++ = *pdwVal++;
-		pbUsrBuf++;
-	}
+	PMA_Read((uint32_t *)((wPMABufAddr << 1) + (uint32_t)USBx + 0x400),pbUsrBuf,wNBytes);
 }
 
 // Receive an amount of data
@@ -20,6 +20,18 @@ extern USB_HandleTypeDef husb;
 // MSC packet size (bigger size -> better performance)
 #define MSC_MEDIA_PACKET             2048
 
+// Number of MSC_MEDIA_PACKET buffers for READ(10)/WRITE(10)
+//   1 - stop-and-wait: the media and the USB take turns
+//   2 - double buffering: the media transfer of the next packet runs while the USB transfers the current one
+//   3 - triple buffering: also absorbs the media latency spikes (e.g. SD card garbage collection)
+#define MSC_MEDIA_BUFFERS            2
+
+// Size of the write-back cache of the storage in 512-byte blocks (0 = write through)
+// Adjacent writes are merged into multiple block writes of the card, rewrites of the same block stay in RAM.
+// The cache is written when full, on SYNCHRONIZE CACHE, TEST UNIT READY (polled by the host when idle),
+// stop/eject and when the host allows the medium removal. Use at least MSC_MEDIA_PACKET / 512 blocks.
+#define MSC_WCACHE_BLOCKS            16
+
 
 // Memory management macros
 
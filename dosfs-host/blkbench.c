@@ -0,0 +1,230 @@
+/*
+	Block device benchmark on the host
+	Runs the benchmark of stm32l4-sdio/src/sdbench.c against a simulated card: the
+	blocks live in an image file and every command takes the time of a simple
+	latency model. The time is simulated, so the figures depend only on the model
+	and the access pattern, not on the host.
+
+	Build from this directory:
+	  cc -O2 -DHOSTVER -I../stm32l4-sdio/src -o blkbench blkbench.c ../stm32l4-sdio/src/sdbench.c
+
+	Usage: blkbench [-spi] [-t <ms>] [-m <item>=<value>]... [image file]
+	  -spi  SPI card preset instead of SDIO
+	  -t    simulated duration of every test in ms (default 1000)
+	  -m    change an item of the latency model (us unless noted):
+	          rd_cmd, rd_sector, wr_cmd, wr_sector - cost of a command and of each sector
+	          au_sectors - size of the allocation unit (sectors)
+	          au_switch - extra cost of a write outside of the last written allocation unit
+	          gc_sectors, gc_busy - busy time after every gc_sectors written sectors
+	          jitter - random extra time of up to this per command
+	          er_cmd, er_au - cost of an erase command and of each allocation unit it touches
+	          wr_erased - cost of each sector written to erased blocks (no garbage collection)
+	The image file (default blkbench.img) is overwritten.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "sdbench.h"
+
+
+#define AREA_BLOCKS		32768		// size of the test area (16MB)
+
+// Latency model of the simulated card
+typedef struct {
+	uint32_t rd_cmd;			// cost of a read command
+	uint32_t rd_sector;			// cost of each sector read
+	uint32_t wr_cmd;			// cost of a write command
+	uint32_t wr_sector;			// cost of each sector written
+	uint32_t au_sectors;		// allocation unit size (sectors)
+	uint32_t au_switch;			// cost of a write to another allocation unit
+	uint32_t gc_sectors;		// written sectors between the garbage collections
+	uint32_t gc_busy;			// cost of a garbage collection
+	uint32_t jitter;			// maximal random extra cost of a command
+	uint32_t er_cmd;			// cost of an erase command
+	uint32_t er_au;				// cost of each allocation unit erased
+	uint32_t wr_erased;			// cost of each sector written to erased blocks
+} SIMMODEL;
+
+// Rough figures of a class 10 card, 4-bit SDIO at 24MHz and SPI at 16MHz
+static const SIMMODEL model_sdio = { 150, 45, 250, 50, 8192, 3000, 4096, 20000, 20, 1500, 2000, 30 };
+static const SIMMODEL model_spi  = { 200, 270, 300, 270, 8192, 3000, 4096, 20000, 20, 1500, 2000, 250 };
+
+static SIMMODEL model;
+static int simfd = -1;
+static uint32_t simtime;			// simulated time (us)
+static uint32_t simseed = 1;		// jitter random numbers
+static uint32_t lastau = 0xffffffff;	// allocation unit of the last write
+static uint32_t written;			// sectors written since the last garbage collection
+static uint8_t erased[AREA_BLOCKS / 8];	// blocks erased and not written since
+
+static uint8_t buf[BENCH_MAX_COUNT * BENCH_BLOCK_SIZE] __attribute__((aligned(4)));
+
+
+static uint32_t sim_jitter(void) {
+	simseed = simseed * 1103515245 + 12345;
+	return model.jitter ? ((simseed >> 8) % (model.jitter + 1)) : 0;
+}
+
+static uint32_t sim_ticks(void) {
+	return simtime;
+}
+
+// Check whether all blocks of the range are erased and mark them written
+static int sim_take_erased(uint32_t block, uint32_t count) {
+	int all = 1;
+	uint32_t i;
+
+	for (i = block; i < block + count; i++) {
+		if (i >= AREA_BLOCKS || !(erased[i >> 3] & (1 << (i & 7))))
+			all = 0;
+		else
+			erased[i >> 3] &= ~(1 << (i & 7));
+	}
+
+	return all;
+}
+
+static uint32_t sim_read(void *ctx, uint8_t *buffer, uint32_t block, uint32_t count) {
+	size_t len = (size_t) count * BENCH_BLOCK_SIZE;
+
+	if (pread(simfd, buffer, len, (off_t) block * BENCH_BLOCK_SIZE) != (ssize_t) len)
+		return 1;
+	simtime += model.rd_cmd + count * model.rd_sector + sim_jitter();
+
+	return 0;
+}
+
+static uint32_t sim_write(void *ctx, uint8_t *buffer, uint32_t block, uint32_t count) {
+	size_t len = (size_t) count * BENCH_BLOCK_SIZE;
+
+	if (pwrite(simfd, buffer, len, (off_t) block * BENCH_BLOCK_SIZE) != (ssize_t) len)
+		return 1;
+
+	// Erased blocks are programmed faster and leave nothing to clean up
+	if (sim_take_erased(block, count)) {
+		simtime += model.wr_cmd + count * model.wr_erased + sim_jitter();
+		if (model.au_sectors)
+			lastau = (block + count - 1) / model.au_sectors;
+		return 0;
+	}
+	simtime += model.wr_cmd + count * model.wr_sector + sim_jitter();
+
+	// A write to another allocation unit makes the card close the open one
+	if (model.au_sectors && block / model.au_sectors != lastau) {
+		if (lastau != 0xffffffff)
+			simtime += model.au_switch;
+		lastau = (block + count - 1) / model.au_sectors;
+	}
+
+	// Now and then the card cleans up and stays busy for a while
+	written += count;
+	if (model.gc_sectors && written >= model.gc_sectors) {
+		written -= model.gc_sectors;
+		simtime += model.gc_busy;
+	}
+
+	return 0;
+}
+
+static uint32_t sim_erase(void *ctx, uint32_t block, uint32_t count) {
+	static const uint8_t zero[BENCH_BLOCK_SIZE];
+	uint32_t aus = 1;
+	uint32_t i;
+
+	if (block + count > AREA_BLOCKS)
+		return 1;
+	for (i = block; i < block + count; i++) {
+		if (pwrite(simfd, zero, BENCH_BLOCK_SIZE, (off_t) i * BENCH_BLOCK_SIZE) != BENCH_BLOCK_SIZE)
+			return 1;
+		erased[i >> 3] |= 1 << (i & 7);
+	}
+	if (model.au_sectors && count)
+		aus = (block + count - 1) / model.au_sectors - block / model.au_sectors + 1;
+	simtime += model.er_cmd + aus * model.er_au + sim_jitter();
+
+	return 0;
+}
+
+static int set_item(char *arg) {
+	static const struct {
+		char *name;
+		size_t offset;
+	} items[] = {
+		{ "rd_cmd", offsetof(SIMMODEL, rd_cmd) },
+		{ "rd_sector", offsetof(SIMMODEL, rd_sector) },
+		{ "wr_cmd", offsetof(SIMMODEL, wr_cmd) },
+		{ "wr_sector", offsetof(SIMMODEL, wr_sector) },
+		{ "au_sectors", offsetof(SIMMODEL, au_sectors) },
+		{ "au_switch", offsetof(SIMMODEL, au_switch) },
+		{ "gc_sectors", offsetof(SIMMODEL, gc_sectors) },
+		{ "gc_busy", offsetof(SIMMODEL, gc_busy) },
+		{ "jitter", offsetof(SIMMODEL, jitter) },
+		{ "er_cmd", offsetof(SIMMODEL, er_cmd) },
+		{ "er_au", offsetof(SIMMODEL, er_au) },
+		{ "wr_erased", offsetof(SIMMODEL, wr_erased) },
+	};
+	char *value = strchr(arg, '=');
+	unsigned i;
+
+	if (!value)
+		return -1;
+	*value++ = 0;
+	for (i = 0; i < sizeof(items) / sizeof(items[0]); i++) {
+		if (!strcmp(arg, items[i].name)) {
+			*(uint32_t *) ((uint8_t *) &model + items[i].offset) = strtoul(value, NULL, 0);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+int main(int argc, char **argv) {
+	BENCH_Dev_TypeDef dev = { "SIM", sim_read, sim_write, sim_erase, NULL, 0, AREA_BLOCKS };
+	char *image = "blkbench.img";
+	char *media = "SDIO";
+	uint32_t duration = 1000;
+	uint32_t errors;
+	int i;
+
+	model = model_sdio;
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-spi")) {
+			model = model_spi;
+			media = "SPI";
+		}
+		else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+			duration = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-m") && i + 1 < argc && !set_item(argv[i + 1]))
+			i++;
+		else if (argv[i][0] != '-')
+			image = argv[i];
+		else {
+			printf("usage: %s [-spi] [-t <ms>] [-m <item>=<value>]... [image file]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	// The file is sparse, only the written blocks take up space
+	simfd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (simfd < 0 || ftruncate(simfd, (off_t) AREA_BLOCKS * BENCH_BLOCK_SIZE)) {
+		printf("can't make %s\n", image);
+		return 1;
+	}
+
+	printf("media: %s, rd %u+%u/sector, wr %u+%u/sector, AU %u sectors +%u, GC %u sectors +%u, jitter %u (us)\n",
+	  media, model.rd_cmd, model.rd_sector, model.wr_cmd, model.wr_sector, model.au_sectors,
+	  model.au_switch, model.gc_sectors, model.gc_busy, model.jitter);
+	printf("erase %u+%u/AU, wr erased %u/sector (us)\n", model.er_cmd, model.er_au, model.wr_erased);
+	BENCH_Init(sim_ticks, 1);
+	errors = BENCH_RunAll(&dev, BENCH_Tests, BENCH_TESTS, buf, duration);
+
+	close(simfd);
+
+	return errors ? 1 : 0;
+}
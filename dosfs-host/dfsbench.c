@@ -0,0 +1,395 @@
+/*
+	DOSFS filesystem benchmark
+	Runs a fixed set of access patterns against freshly made FAT12, FAT16 and FAT32
+	images and reports for each the media commands and sectors (DFS_IOStats) and the
+	simulated media time (DFS_HostTime, see hostemu.h). The numbers depend only on the
+	DOSFS copy and its configurable items, not on the host, so runs before and after
+	a change can be compared directly.
+	For each volume a second table shows the sectors per read command of DFS_ReadFile
+	for several request sizes, and the gain over the same media with single sector
+	commands only.
+
+	Build against one of the DOSFS copies, e.g. from this directory:
+	  cc -O2 -DHOSTVER -I. -I../stm32l151rdt6-dev/dosfs -o dfsbench dfsbench.c hostemu.c ../stm32l151rdt6-dev/dosfs/dosfs.c
+
+	Usage: dfsbench [-spi] [-k <file size in KB>] [image file]
+	  -spi  SPI media model instead of SDIO
+	  -k    size of the file used by the sequential and random tests (default 1024)
+	The image file (default dfsbench.img) is overwritten.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dosfs.h"
+
+
+#define RANDOM_OPS		256			// reads/writes of the random tests
+#define RANDOM_LEN		512			// bytes per random read/write (at any offset)
+#define CHUNK			4096		// bytes per sequential read/write
+#define RECORD			64			// bytes per record of the append and record read tests
+#define SYNC_EVERY		16			// records between DFS_Sync calls
+#define SEEK_OPS		1000		// seeks of the seek test
+#define DIR_FILES		64			// files in the directory of the scan tests
+#define READ_MAX		32768		// largest request of the read size test
+
+static uint8_t scratch[SECTOR_SIZE] __attribute__((aligned(4)));
+static uint8_t data[CHUNK] __attribute__((aligned(4)));
+static uint8_t bigdata[READ_MAX] __attribute__((aligned(4)));
+static VOLINFO vi;
+static uint32_t filesize;
+static uint32_t seed = 1;
+
+static const struct {
+	char *name;
+	uint8_t fstype;
+	uint32_t sectors;
+	uint8_t secperclus;
+} volumes[] = {
+	{ "FAT12", FAT12, 8160, 2 },		// 4MB, 1KB clusters
+	{ "FAT16", FAT16, 131072, 4 },		// 64MB, 2KB clusters
+	{ "FAT32", FAT32, 1048576, 8 },		// 512MB, 4KB clusters
+};
+
+
+// Repeatable pseudo random numbers, so every run does the same I/O
+static uint32_t rnd(void) {
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) & 0xffffff;
+}
+
+// Start measuring a test
+static void start(void) {
+#ifdef DFS_STATS
+	memset(&DFS_IOStats, 0, sizeof(DFS_IOStats));
+#endif
+	DFS_HostTime = 0;
+}
+
+// Print the figures of a test, bytes - file data moved (0 - no throughput)
+static void report(char *test, uint32_t bytes, uint32_t result) {
+	printf("%-12s %9u", test, bytes);
+#ifdef DFS_STATS
+	printf(" %7u %7u %7u %7u", DFS_IOStats.rd_cmds, DFS_IOStats.rd_sectors,
+	  DFS_IOStats.wr_cmds, DFS_IOStats.wr_sectors);
+#if DFS_BLKCACHE
+	printf(" %7u %7u", DFS_IOStats.blk_hits, DFS_IOStats.blk_prefetched);
+#endif
+#endif
+	printf(" %10.1f", DFS_HostTime / 1000.0);
+	if (bytes && DFS_HostTime)
+		printf(" %8.0f", bytes / 1024.0 / (DFS_HostTime / 1e6));
+	else
+		printf(" %8s", "-");
+	printf("%s\n", result ? "  FAILED" : "");
+}
+
+static uint32_t test_seq_write(void) {
+	FILEINFO fi;
+	uint32_t i, n, result;
+
+	result = DFS_OpenFile(&vi, (uint8_t *) "BENCH.DAT", DFS_WRITE, scratch, &fi);
+	for (i = 0; i < filesize && !result; i += n) {
+		memset(data, i / CHUNK, CHUNK);
+		result = DFS_WriteFile(&fi, scratch, data, &n, CHUNK);
+	}
+	if (!result)
+		result = DFS_CloseFile(&fi, scratch);
+
+	return result;
+}
+
+static uint32_t test_seq_read(void) {
+	FILEINFO fi;
+	uint32_t i, n, result;
+
+	result = DFS_OpenFile(&vi, (uint8_t *) "BENCH.DAT", DFS_READ, scratch, &fi);
+	for (i = 0; i < filesize && !result; i += n) {
+		result = DFS_ReadFile(&fi, scratch, data, &n, CHUNK);
+		if (!result && (n != CHUNK || data[0] != (uint8_t) (i / CHUNK) || data[CHUNK - 1] != data[0]))
+			result = DFS_ERRMISC;
+	}
+
+	return result;
+}
+
+// Read the whole file in requests of the given size
+static uint32_t test_read_size(uint32_t size) {
+	FILEINFO fi;
+	uint32_t i, j, n, result;
+
+	result = DFS_OpenFile(&vi, (uint8_t *) "BENCH.DAT", DFS_READ, scratch, &fi);
+	for (i = 0; i < filesize && !result; i += n) {
+		result = DFS_ReadFile(&fi, scratch, bigdata, &n, size);
+		if (!result && n != size)
+			result = DFS_ERRMISC;
+		for (j = 0; j < n && !result; j += SECTOR_SIZE)
+			if (bigdata[j] != (uint8_t) ((i + j) / CHUNK))
+				result = DFS_ERRMISC;
+	}
+
+	return result;
+}
+
+// Sectors per read command of DFS_ReadFile for several request sizes, against the
+// same media limited to single sector commands (the one sector per command read path)
+static void bench_read_sizes(PHOSTMEDIA media) {
+	static const uint32_t sizes[] = { SECTOR_SIZE, 4096, READ_MAX };
+	HOSTMEDIA single;
+	uint64_t multi_time;
+	uint32_t s, result;
+
+	single = *media;
+	single.maxrun = 1;
+	single.sg = 0;
+
+	// The random tests changed the file, write the known pattern again
+	if (test_seq_write()) {
+		printf("read size: can't write the file\n");
+		return;
+	}
+
+	printf("%-12s %9s %8s %8s %8s %8s %6s\n", "read size", "bytes", "sec/cmd", "KB/s",
+	  "1sec/cmd", "KB/s", "gain");
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		printf("%-12u %9u", sizes[s], filesize);
+
+		start();
+		result = test_read_size(sizes[s]);
+#ifdef DFS_STATS
+		printf(" %8.1f", DFS_IOStats.rd_cmds ? (double) DFS_IOStats.rd_sectors / DFS_IOStats.rd_cmds : 0);
+#else
+		printf(" %8s", "-");
+#endif
+		printf(" %8.0f", filesize / 1024.0 / (DFS_HostTime / 1e6));
+		multi_time = DFS_HostTime;
+
+		DFS_HostSetMedia(&single);
+		start();
+		result |= test_read_size(sizes[s]);
+		DFS_HostSetMedia(media);
+#ifdef DFS_STATS
+		printf(" %8.1f", DFS_IOStats.rd_cmds ? (double) DFS_IOStats.rd_sectors / DFS_IOStats.rd_cmds : 0);
+#else
+		printf(" %8s", "-");
+#endif
+		printf(" %8.0f", filesize / 1024.0 / (DFS_HostTime / 1e6));
+		printf(" %5.1fx%s\n", (double) DFS_HostTime / multi_time, result ? "  FAILED" : "");
+	}
+}
+
+// Stream reading in small records, the file goes through scratch one sector at a time
+static uint32_t test_record_read(uint32_t bytes) {
+	FILEINFO fi;
+	uint32_t i, n, result;
+
+	result = DFS_OpenFile(&vi, (uint8_t *) "BENCH.DAT", DFS_READ, scratch, &fi);
+	for (i = 0; i < bytes && !result; i += n) {
+		result = DFS_ReadFile(&fi, scratch, data, &n, RECORD);
+		if (!result && (n != RECORD || data[0] != (uint8_t) (i / CHUNK)))
+			result = DFS_ERRMISC;
+	}
+
+	return result;
+}
+
+static uint32_t test_random(uint32_t write) {
+	FILEINFO fi;
+	uint32_t i, n, result;
+
+	result = DFS_OpenFile(&vi, (uint8_t *) "BENCH.DAT", write ? DFS_WRITE : DFS_READ, scratch, &fi);
+	for (i = 0; i < RANDOM_OPS && !result; i++) {
+		DFS_Seek(&fi, rnd() % (filesize - RANDOM_LEN), scratch);
+		if (write)
+			result = DFS_WriteFile(&fi, scratch, data, &n, RANDOM_LEN);
+		else
+			result = DFS_ReadFile(&fi, scratch, data, &n, RANDOM_LEN);
+		if (!result && n != RANDOM_LEN)
+			result = DFS_ERRMISC;
+	}
+	if (write && !result)
+		result = DFS_CloseFile(&fi, scratch);
+
+	return result;
+}
+
+// Log style appending: small records, synced now and then
+static uint32_t test_append(uint32_t bytes) {
+	FILEINFO fi;
+	uint32_t i, n, result;
+
+	memset(data, 'L', RECORD);
+	result = DFS_OpenFile(&vi, (uint8_t *) "APPEND.LOG", DFS_WRITE, scratch, &fi);
+	// without a free buffer the file just goes through scratch
+	DFS_AttachBuffer(&fi);
+	for (i = 0; i < bytes / RECORD && !result; i++) {
+		result = DFS_WriteFile(&fi, scratch, data, &n, RECORD);
+		if (!result && i % SYNC_EVERY == SYNC_EVERY - 1)
+			result = DFS_Sync(&vi, scratch);
+	}
+	if (!result)
+		result = DFS_CloseFile(&fi, scratch);
+
+	return result;
+}
+
+static uint32_t test_seek(void) {
+	FILEINFO fi;
+	uint32_t i, offset, result;
+
+	result = DFS_OpenFile(&vi, (uint8_t *) "BENCH.DAT", DFS_READ, scratch, &fi);
+	for (i = 0; i < SEEK_OPS && !result; i++) {
+		offset = rnd() % filesize;
+		DFS_Seek(&fi, offset, scratch);
+		if (fi.pointer != offset)
+			result = DFS_ERRMISC;
+	}
+
+	return result;
+}
+
+// Log rotation: delete the old log and write the new one, the time counts from the
+// deletion on
+static uint32_t test_rotate(uint32_t bytes) {
+	FILEINFO fi;
+	uint32_t i, n, result;
+
+	memset(data, 'R', CHUNK);
+	result = DFS_OpenFile(&vi, (uint8_t *) "ROTATE.OLD", DFS_WRITE, scratch, &fi);
+	for (i = 0; i < bytes && !result; i += n)
+		result = DFS_WriteFile(&fi, scratch, data, &n, CHUNK);
+	if (!result)
+		result = DFS_CloseFile(&fi, scratch);
+
+	start();
+	if (!result)
+		result = DFS_UnlinkFile(&vi, (uint8_t *) "ROTATE.OLD", scratch);
+	if (!result)
+		result = DFS_OpenFile(&vi, (uint8_t *) "ROTATE.NEW", DFS_WRITE, scratch, &fi);
+	for (i = 0; i < bytes && !result; i += n)
+		result = DFS_WriteFile(&fi, scratch, data, &n, CHUNK);
+	if (!result)
+		result = DFS_CloseFile(&fi, scratch);
+
+	return result;
+}
+
+static void dir_file(char *path, uint32_t i) {
+	sprintf(path, "SCAN/F%07u.TXT", i);
+}
+
+static uint32_t test_dir_create(void) {
+	FILEINFO fi;
+	char path[32];
+	uint32_t i, n, result;
+
+	result = DFS_OpenFile(&vi, (uint8_t *) "SCAN", DFS_CREATEDIR, scratch, &fi);
+	for (i = 0; i < DIR_FILES && !result; i++) {
+		dir_file(path, i);
+		result = DFS_OpenFile(&vi, (uint8_t *) path, DFS_WRITE, scratch, &fi);
+		if (!result)
+			result = DFS_WriteFile(&fi, scratch, (uint8_t *) path, &n, strlen(path));
+		if (!result)
+			result = DFS_CloseFile(&fi, scratch);
+	}
+
+	return result;
+}
+
+static uint32_t test_dir_scan(void) {
+	DIRINFO di;
+	DIRENT de;
+	uint32_t found = 0, result;
+
+	di.scratch = scratch;
+	result = DFS_OpenDir(&vi, (uint8_t *) "SCAN", &di);
+	while (!result) {
+		result = DFS_GetNext(&vi, &di, &de);
+		if (!result && de.name[0] && de.name[0] != '.')
+			found++;
+	}
+
+	return (result == DFS_EOF && found == DIR_FILES) ? DFS_OK : DFS_ERRMISC;
+}
+
+static uint32_t test_dir_lookup(void) {
+	FILEINFO fi;
+	char path[32];
+	uint32_t i, result = DFS_OK;
+
+	for (i = 0; i < DIR_FILES && !result; i++) {
+		dir_file(path, rnd() % DIR_FILES);
+		result = DFS_OpenFile(&vi, (uint8_t *) path, DFS_READ, scratch, &fi);
+	}
+
+	return result;
+}
+
+int main(int argc, char **argv) {
+	char *image = "dfsbench.img";
+	PHOSTMEDIA media = &DFS_HostSDIO;
+	uint32_t v, result;
+	int i;
+
+	filesize = 1024 * 1024;
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-spi"))
+			media = &DFS_HostSPI;
+		else if (!strcmp(argv[i], "-k") && i + 1 < argc)
+			filesize = atoi(argv[++i]) * 1024;
+		else if (argv[i][0] != '-')
+			image = argv[i];
+		else {
+			printf("usage: %s [-spi] [-k <file size in KB>] [image file]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (filesize < CHUNK)
+		filesize = CHUNK;
+	filesize -= filesize % CHUNK;
+
+	DFS_HostSetMedia(media);
+	printf("media: %s, %u sectors per command, file size %uKB\n",
+	  (media == &DFS_HostSPI) ? "SPI" : "SDIO", media->maxrun, filesize / 1024);
+
+	for (v = 0; v < sizeof(volumes) / sizeof(volumes[0]); v++) {
+		if (DFS_HostMakeImage(image, volumes[v].fstype, volumes[v].sectors, volumes[v].secperclus) ||
+		    DFS_HostAttach(image) ||
+		    DFS_GetVolInfo(0, scratch, 0, &vi)) {
+			printf("%s: can't make or mount %s\n", volumes[v].name, image);
+			return 1;
+		}
+
+		printf("\n%s: %uKB, %u bytes per cluster, %u clusters\n", volumes[v].name,
+		  volumes[v].sectors / 2, volumes[v].secperclus * SECTOR_SIZE, vi.numclusters);
+		printf("%-12s %9s", "test", "bytes");
+#ifdef DFS_STATS
+		printf(" %7s %7s %7s %7s", "rd cmd", "rd sec", "wr cmd", "wr sec");
+#if DFS_BLKCACHE
+		printf(" %7s %7s", "hits", "ahead");
+#endif
+#endif
+		printf(" %10s %8s\n", "media ms", "KB/s");
+
+		seed = 1;
+		start(); result = test_seq_write();  report("seq write", filesize, result);
+		start(); result = test_seq_read();   report("seq read", filesize, result);
+		start(); result = test_record_read(filesize / 4); report("record read", filesize / 4, result);
+		start(); result = test_random(1);    report("rand write", RANDOM_OPS * RANDOM_LEN, result);
+		start(); result = test_random(0);    report("rand read", RANDOM_OPS * RANDOM_LEN, result);
+		start(); result = test_append(filesize / 4); report("append+sync", filesize / 4, result);
+		result = test_rotate(filesize / 4); report("rotate", filesize / 4, result);
+		start(); result = test_seek();       report("seek", 0, result);
+		start(); result = test_dir_create(); report("dir create", 0, result);
+		start(); result = test_dir_scan();   report("dir scan", 0, result);
+		start(); result = test_dir_lookup(); report("dir lookup", 0, result);
+
+		printf("\n");
+		bench_read_sizes(media);
+
+		DFS_HostDetach();
+	}
+
+	return 0;
+}
@@ -0,0 +1,361 @@
+/*
+	DOSFS Embedded FAT-Compatible Filesystem
+	Host-side emulation of the sector I/O
+	(C) 2005 Lewin A.R.W. Edwards (sysadm@zws.com)
+
+	You are permitted to modify and/or use this code in your own projects without
+	payment of royalty, regardless of the license(s) you choose for those projects.
+
+	You cannot re-copyright or restrict use of the code as released by Lewin Edwards.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dosfs.h"
+
+
+// Rough figures of a class 10 card, good enough to compare access patterns
+HOSTMEDIA DFS_HostSDIO = { DFS_MAXRUN, 150, 45, 900, 50, 1, 1500, 300 };
+HOSTMEDIA DFS_HostSPI = { DFS_MAXRUN, 200, 270, 800, 270, 0, 0, 0 };
+
+uint64_t DFS_HostTime;
+
+static int hostfd = -1;
+static uint8_t *hostimage = NULL;	// the mapped image
+static uint32_t hostsectors;		// image size in sectors
+static uint8_t *hosterased = NULL;	// bit map of the erased sectors
+static PHOSTMEDIA hostmedia = &DFS_HostSDIO;
+
+
+/*
+	Read sectors from the disk image
+*/
+static uint32_t DFS_HostRead(void *ctx, uint8_t *buffer, uint32_t sector, uint32_t count)
+{
+	if (hostimage == NULL || sector >= hostsectors || count > hostsectors - sector)
+		return 1;
+
+	memcpy(buffer, hostimage + (size_t) sector * SECTOR_SIZE, (size_t) count * SECTOR_SIZE);
+	DFS_HostTime += hostmedia->rd_cmd_us + (uint64_t) count * hostmedia->rd_sector_us;
+
+	return 0;
+}
+
+/*
+	Cost of a write command, less if all its sectors were erased
+	The sectors are not erased anymore afterwards.
+*/
+static uint32_t DFS_HostWriteCost(uint32_t sector, uint32_t count)
+{
+	uint32_t erased = (hosterased != NULL);
+	uint32_t i;
+
+	for (i = sector; i < sector + count && hosterased; i++) {
+		if (!(hosterased[i >> 3] & (1 << (i & 7))))
+			erased = 0;
+		hosterased[i >> 3] &= ~(1 << (i & 7));
+	}
+
+	return erased ? hostmedia->wr_erased_us : hostmedia->wr_cmd_us;
+}
+
+/*
+	Write sectors to the disk image
+*/
+static uint32_t DFS_HostWrite(void *ctx, uint8_t *buffer, uint32_t sector, uint32_t count)
+{
+	if (hostimage == NULL || sector >= hostsectors || count > hostsectors - sector)
+		return 1;
+
+	memcpy(hostimage + (size_t) sector * SECTOR_SIZE, buffer, (size_t) count * SECTOR_SIZE);
+	DFS_HostTime += DFS_HostWriteCost(sector, count) + (uint64_t) count * hostmedia->wr_sector_us;
+
+	return 0;
+}
+
+/*
+	Read sectors from the disk image into a list of buffers, one command
+*/
+static uint32_t DFS_HostReadV(void *ctx, PSECTORSEG seg, uint32_t segs, uint32_t sector)
+{
+	uint32_t count = 0;
+	uint32_t i;
+
+	for (i = 0; i < segs; i++)
+		count += seg[i].count;
+	if (hostimage == NULL || sector >= hostsectors || count > hostsectors - sector)
+		return 1;
+
+	for (i = 0; i < segs; i++) {
+		memcpy(seg[i].buffer, hostimage + (size_t) sector * SECTOR_SIZE, (size_t) seg[i].count * SECTOR_SIZE);
+		sector += seg[i].count;
+	}
+	DFS_HostTime += hostmedia->rd_cmd_us + (uint64_t) count * hostmedia->rd_sector_us;
+
+	return 0;
+}
+
+/*
+	Write sectors from a list of buffers to the disk image, one command
+*/
+static uint32_t DFS_HostWriteV(void *ctx, PSECTORSEG seg, uint32_t segs, uint32_t sector)
+{
+	uint32_t count = 0;
+	uint32_t i;
+
+	for (i = 0; i < segs; i++)
+		count += seg[i].count;
+	if (hostimage == NULL || sector >= hostsectors || count > hostsectors - sector)
+		return 1;
+
+	DFS_HostTime += DFS_HostWriteCost(sector, count) + (uint64_t) count * hostmedia->wr_sector_us;
+	for (i = 0; i < segs; i++) {
+		memcpy(hostimage + (size_t) sector * SECTOR_SIZE, seg[i].buffer, (size_t) seg[i].count * SECTOR_SIZE);
+		sector += seg[i].count;
+	}
+
+	return 0;
+}
+
+/*
+	Erase sectors of the disk image, they read as zeros afterwards
+*/
+static uint32_t DFS_HostErase(void *ctx, uint32_t sector, uint32_t count)
+{
+	uint32_t i;
+
+	if (hostimage == NULL || sector >= hostsectors || count > hostsectors - sector)
+		return 1;
+
+	memset(hostimage + (size_t) sector * SECTOR_SIZE, 0, (size_t) count * SECTOR_SIZE);
+	for (i = sector; i < sector + count && hosterased; i++)
+		hosterased[i >> 3] |= 1 << (i & 7);
+	DFS_HostTime += hostmedia->er_cmd_us;
+
+	return 0;
+}
+
+static BLOCKDEV hostdev = { DFS_HostRead, DFS_HostWrite, DFS_MAXRUN, NULL, NULL, NULL, NULL };
+
+/*
+	Set up the device for the media model
+*/
+static void DFS_HostDevice(PHOSTMEDIA media)
+{
+	hostdev.maxrun = media->maxrun;
+	hostdev.readv = media->sg ? DFS_HostReadV : NULL;
+	hostdev.writev = media->sg ? DFS_HostWriteV : NULL;
+	hostdev.erase = media->er_cmd_us ? DFS_HostErase : NULL;
+}
+
+
+/*
+	Attach a disk image file (raw dump of the card or of a single partition) as unit 0
+	Returns 0 OK, nonzero for any error
+*/
+int DFS_HostAttach(char *imagefile)
+{
+	struct stat st;
+	void *image;
+
+	DFS_HostDetach();
+
+	hostfd = open(imagefile, O_RDWR);
+	if (hostfd < 0)
+		return -1;
+
+	if (fstat(hostfd, &st) || st.st_size < SECTOR_SIZE) {
+		DFS_HostDetach();
+		return -1;
+	}
+
+	image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, hostfd, 0);
+	if (image == MAP_FAILED) {
+		DFS_HostDetach();
+		return -1;
+	}
+	hostimage = image;
+	hostsectors = st.st_size / SECTOR_SIZE;
+	hosterased = calloc((hostsectors + 7) / 8, 1);
+	DFS_HostTime = 0;
+
+	DFS_HostDevice(hostmedia);
+	return DFS_AttachDevice(0, &hostdev) ? -1 : 0;
+}
+
+/*
+	Detach the disk image file
+*/
+void DFS_HostDetach(void)
+{
+	if (hostimage) {
+		DFS_AttachDevice(0, NULL);
+		msync(hostimage, (size_t) hostsectors * SECTOR_SIZE, MS_SYNC);
+		munmap(hostimage, (size_t) hostsectors * SECTOR_SIZE);
+		hostimage = NULL;
+		free(hosterased);
+		hosterased = NULL;
+	}
+	if (hostfd >= 0) {
+		close(hostfd);
+		hostfd = -1;
+	}
+}
+
+/*
+	Select the media model
+*/
+void DFS_HostSetMedia(PHOSTMEDIA media)
+{
+	hostmedia = media;
+	DFS_HostDevice(media);
+}
+
+/*
+	Create an image file with an empty FAT volume at sector 0
+	Returns 0 OK, nonzero for any error
+*/
+int DFS_HostMakeImage(char *imagefile, uint8_t fstype, uint32_t sectors, uint8_t secperclus)
+{
+	uint8_t sector[SECTOR_SIZE];
+	PLBR lbr = (PLBR) sector;
+	PFSINFO fsi = (PFSINFO) sector;
+	uint32_t reserved, rootsecs, secperfat, need, numclusters, fatbytes, i;
+	int fd, result = 0;
+
+	if (!secperclus || sectors < 64)
+		return -1;
+
+	reserved = (fstype == FAT32) ? 32 : 1;
+	rootsecs = (fstype == FAT32) ? 0 : 512 * 32 / SECTOR_SIZE;
+
+	// The FAT has to cover the clusters which are left beside the FATs themselves
+	secperfat = 1;
+	for (;;) {
+		numclusters = (sectors - reserved - 2 * secperfat - rootsecs) / secperclus;
+		switch (fstype) {
+			case FAT12: fatbytes = (numclusters + 2) * 3 / 2 + 1; break;
+			case FAT16: fatbytes = (numclusters + 2) * 2; break;
+			case FAT32: fatbytes = (numclusters + 2) * 4; break;
+			default:    return -1;
+		}
+		need = (fatbytes + SECTOR_SIZE - 1) / SECTOR_SIZE;
+		if (need <= secperfat)
+			break;
+		secperfat = need;
+	}
+
+	// Same thresholds as DFS_GetVolInfo
+	if ((fstype == FAT12 && numclusters >= 4085) ||
+	    (fstype == FAT16 && (numclusters < 4085 || numclusters >= 65525)) ||
+	    (fstype == FAT32 && numclusters < 65525))
+		return -1;
+
+	fd = open(imagefile, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	// The file is sparse, only the sectors written below take up space
+	if (ftruncate(fd, (off_t) sectors * SECTOR_SIZE)) {
+		close(fd);
+		return -1;
+	}
+
+	// Boot sector
+	memset(sector, 0, SECTOR_SIZE);
+	lbr->jump[0] = 0xeb;
+	lbr->jump[1] = 0x58;
+	lbr->jump[2] = 0x90;
+	memcpy(lbr->oemid, "DOSFS   ", 8);
+	lbr->bpb.bytepersec_l = SECTOR_SIZE & 0xff;
+	lbr->bpb.bytepersec_h = (SECTOR_SIZE & 0xff00) >> 8;
+	lbr->bpb.secperclus = secperclus;
+	lbr->bpb.reserved_l = reserved & 0xff;
+	lbr->bpb.reserved_h = (reserved & 0xff00) >> 8;
+	lbr->bpb.numfats = 2;
+	lbr->bpb.rootentries_l = (rootsecs * SECTOR_SIZE / 32) & 0xff;
+	lbr->bpb.rootentries_h = ((rootsecs * SECTOR_SIZE / 32) & 0xff00) >> 8;
+	lbr->bpb.mediatype = 0xf8;
+	lbr->bpb.secpertrk_l = 63;
+	lbr->bpb.heads_l = 255;
+	if (fstype != FAT32 && sectors < 65536) {
+		lbr->bpb.sectors_s_l = sectors & 0xff;
+		lbr->bpb.sectors_s_h = (sectors & 0xff00) >> 8;
+	}
+	else {
+		lbr->bpb.sectors_l_0 = sectors & 0xff;
+		lbr->bpb.sectors_l_1 = (sectors & 0xff00) >> 8;
+		lbr->bpb.sectors_l_2 = (sectors & 0xff0000) >> 16;
+		lbr->bpb.sectors_l_3 = (sectors & 0xff000000) >> 24;
+	}
+	if (fstype == FAT32) {
+		lbr->ebpb.ebpb32.fatsize_0 = secperfat & 0xff;
+		lbr->ebpb.ebpb32.fatsize_1 = (secperfat & 0xff00) >> 8;
+		lbr->ebpb.ebpb32.fatsize_2 = (secperfat & 0xff0000) >> 16;
+		lbr->ebpb.ebpb32.fatsize_3 = (secperfat & 0xff000000) >> 24;
+		lbr->ebpb.ebpb32.root_0 = 2;
+		lbr->ebpb.ebpb32.fsinfo_l = 1;
+		lbr->ebpb.ebpb32.bkboot_l = 6;
+		lbr->ebpb.ebpb32.signature = 0x29;
+		memcpy(lbr->ebpb.ebpb32.label, "NO NAME    ", 11);
+		memcpy(lbr->ebpb.ebpb32.system, "FAT32   ", 8);
+	}
+	else {
+		lbr->bpb.secperfat_l = secperfat & 0xff;
+		lbr->bpb.secperfat_h = (secperfat & 0xff00) >> 8;
+		lbr->ebpb.ebpb.signature = 0x29;
+		memcpy(lbr->ebpb.ebpb.label, "NO NAME    ", 11);
+		memcpy(lbr->ebpb.ebpb.system, (fstype == FAT12) ? "FAT12   " : "FAT16   ", 8);
+	}
+	lbr->sig_55 = 0x55;
+	lbr->sig_aa = 0xaa;
+	if (pwrite(fd, sector, SECTOR_SIZE, 0) != SECTOR_SIZE)
+		result = -1;
+
+	if (fstype == FAT32) {
+		// Backup boot sector
+		if (pwrite(fd, sector, SECTOR_SIZE, 6 * SECTOR_SIZE) != SECTOR_SIZE)
+			result = -1;
+
+		// FSInfo: the root directory cluster is the only one in use
+		memset(sector, 0, SECTOR_SIZE);
+		memcpy(fsi->leadsig, "RRaA", 4);
+		memcpy(fsi->strucsig, "rrAa", 4);
+		fsi->freecount_0 = (numclusters - 1) & 0xff;
+		fsi->freecount_1 = ((numclusters - 1) & 0xff00) >> 8;
+		fsi->freecount_2 = ((numclusters - 1) & 0xff0000) >> 16;
+		fsi->freecount_3 = ((numclusters - 1) & 0xff000000) >> 24;
+		fsi->nextfree_0 = 3;
+		fsi->trailsig[2] = 0x55;
+		fsi->trailsig[3] = 0xaa;
+		if (pwrite(fd, sector, SECTOR_SIZE, SECTOR_SIZE) != SECTOR_SIZE)
+			result = -1;
+	}
+
+	// First sector of both FATs: media descriptor, end of chain marker and, on FAT32,
+	// the end of the root directory chain
+	memset(sector, 0, SECTOR_SIZE);
+	switch (fstype) {
+		case FAT12:
+			memcpy(sector, "\xf8\xff\xff", 3);
+			break;
+		case FAT16:
+			memcpy(sector, "\xf8\xff\xff\xff", 4);
+			break;
+		case FAT32:
+			memcpy(sector, "\xf8\xff\xff\x0f\xff\xff\xff\x0f\xff\xff\xff\x0f", 12);
+			break;
+	}
+	for (i = 0; i < 2; i++)
+		if (pwrite(fd, sector, SECTOR_SIZE, (off_t) (reserved + i * secperfat) * SECTOR_SIZE) != SECTOR_SIZE)
+			result = -1;
+
+	if (close(fd))
+		result = -1;
+
+	return result;
+}
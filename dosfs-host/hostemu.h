@@ -0,0 +1,68 @@
+/*
+	DOSFS Embedded FAT-Compatible Filesystem
+	Host-side emulation of the sector I/O
+	(C) 2005 Lewin A.R.W. Edwards (sysadm@zws.com)
+*/
+
+#ifndef _HOSTEMU_H
+#define _HOSTEMU_H
+
+#include <stdint.h>
+
+// Compile one of the dosfs.c copies and hostemu.c with HOSTVER defined to run DOSFS
+// against a raw disk image file instead of the SD card, e.g. from this directory:
+//   cc -DHOSTVER -I. -I../stm32l151rdt6-dev/dosfs ../stm32l151rdt6-dev/dosfs/dosfs.c hostemu.c ...
+// The image is memory-mapped, so this builds on Linux and other POSIX hosts.
+
+/*
+	Media model of the emulated card
+	Every read or write command costs cmd_us plus sector_us per sector it moves,
+	the sum of these is kept in DFS_HostTime. No real delay takes place.
+	A write command whose sectors were all erased before (see the erase function of
+	BLOCKDEV) costs wr_erased_us instead of wr_cmd_us, the card doesn't have to
+	erase them itself then.
+*/
+typedef struct _tagHOSTMEDIA {
+	uint32_t maxrun;			// sectors per command (1 - single block commands only)
+	uint32_t rd_cmd_us;			// cost of a read command
+	uint32_t rd_sector_us;		// cost of each sector read
+	uint32_t wr_cmd_us;			// cost of a write command (incl. programming busy)
+	uint32_t wr_sector_us;		// cost of each sector written
+	uint32_t sg;				// nonzero if a list of buffers goes with one command
+	uint32_t er_cmd_us;			// cost of an erase command (0 - the media can't erase)
+	uint32_t wr_erased_us;		// cost of a write command to erased sectors
+} HOSTMEDIA, *PHOSTMEDIA;
+
+extern HOSTMEDIA DFS_HostSDIO;	// 4-bit SDIO at 24MHz, multiple block, scatter-gather and erase commands
+extern HOSTMEDIA DFS_HostSPI;	// SPI at 16MHz with DMA, multiple block commands
+
+// Simulated media time in microseconds since DFS_HostAttach (may be reset by the caller)
+extern uint64_t DFS_HostTime;
+
+/*
+	Attach a disk image file (raw dump of the card or of a single partition) as unit 0
+	The media model is DFS_HostSDIO unless DFS_HostSetMedia selects another one.
+	Returns 0 OK, nonzero for any error
+*/
+int DFS_HostAttach(char *imagefile);
+
+/*
+	Detach the disk image file (all changes are in the file afterwards)
+*/
+void DFS_HostDetach(void);
+
+/*
+	Select the media model, the structure must stay valid while it is in use
+*/
+void DFS_HostSetMedia(PHOSTMEDIA media);
+
+/*
+	Create an image file with an empty FAT12, FAT16 or FAT32 volume (no partition
+	table, the volume starts at sector 0) of the given size in sectors
+	The FAT type follows from the number of clusters, so fstype only checks that
+	sectors and secperclus give the type asked for.
+	Returns 0 OK, nonzero for any error (also if the cluster count doesn't fit fstype)
+*/
+int DFS_HostMakeImage(char *imagefile, uint8_t fstype, uint32_t sectors, uint8_t secperclus);
+
+#endif // _HOSTEMU_H
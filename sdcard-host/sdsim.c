@@ -0,0 +1,837 @@
+/*
+	Register level simulator of the SDIO peripheral, its DMA channel and an SD card
+	See sdsim.h. The model is simple but strict enough to catch driver mistakes:
+	- commands complete at once, the card answers according to its state and
+	  refuses data commands while it is programming (ILLEGAL_COMMAND)
+	- the data path has the 32-word FIFO with its flags, the card moves a few words
+	  per step, the DMA channel moves as many as the FIFO allows
+	- without hardware flow control a FIFO the DMA doesn't serve overruns/underruns
+	- data blocks fail the CRC check if the bus width or the High-Speed mode of the
+	  card doesn't match the SDIO configuration
+	- the data end and the DMA transfer complete interrupts come in either order
+	  (SIM_ORD_xx), the order seen by the driver is recorded
+	One step is taken on every register access and in SDIO_IDLE(), after the step the
+	pending interrupts are delivered to the handlers of the driver (not nested).
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard.h"
+
+
+#define SIM_FIFO_WORDS		32			// size of the SDIO FIFO
+#define SIM_WORDS_STEP		4			// words the card moves per step
+#define SIM_NAC_STEPS		8			// steps from a read command to the first data word
+#define SIM_STALL_STEPS		64			// steps the bus waits for the FIFO without flow control
+#define SIM_TIMER_SCALE		256			// DTIMER counts per step without data
+#define SIM_PRG_POLLS		3			// SEND_STATUS polls the card is busy after a write or erase
+#define SIM_ACMD41_BUSY		3			// ACMD41 calls until the card is ready
+#define SIM_RCA				0x5A5A		// relative card address the card publishes
+
+// Interrupt handler running
+#define SIM_IN_NONE			0
+#define SIM_IN_SDIO			1
+#define SIM_IN_DMA			2
+
+// Card status bits (R1)
+#define CS_READY_FOR_DATA	0x00000100
+#define CS_APP_CMD			0x00000020
+
+// Data transfer of the card
+#define XF_NONE				0			// none
+#define XF_SHORT			1			// sending a register (SCR, switch status)
+#define XF_READ				2			// sending blocks
+#define XF_WRITE			3			// receiving blocks
+
+// SDIO peripheral
+static struct {
+	uint32_t reg[SIM_REGS];			// register values (static flags in STA)
+	uint32_t fifo[SIM_FIFO_WORDS];
+	uint32_t fifo_head;
+	uint32_t fifo_count;
+	uint8_t fifo_rx;				// the FIFO holds received data
+	uint8_t dpsm;					// data path enabled
+	uint8_t dpsm_rx;				// data path direction is card -> controller
+	uint32_t dleft;					// bytes left in the data transfer
+	uint32_t bleft;					// bytes left in the current block
+	uint32_t bsize;					// block size
+	uint32_t stall;					// steps the bus waits for the FIFO
+	uint32_t idle;					// steps without data
+} sdio;
+
+// SDIO DMA channel
+static struct {
+	uint8_t en;
+	uint8_t irq;
+	uint8_t flags;
+	uint8_t dir;
+	uint32_t *mem;
+	uint32_t count;					// words left
+} dma;
+
+// SD card
+static struct {
+	uint8_t type;
+	uint8_t nohs;					// no High-Speed function
+	uint8_t state;
+	uint8_t app;					// the next command is an ACMD
+	uint8_t busy;					// ACMD41 calls until ready
+	uint8_t wide;					// 4-bit bus selected
+	uint8_t hs;						// High-Speed mode selected
+	uint8_t prg;					// SEND_STATUS polls until the programming is done
+	uint16_t rca;
+	uint32_t blocks;
+	uint8_t *image;
+	uint8_t xfer;					// data transfer (XF_xx)
+	uint8_t nac;					// steps until the card starts sending
+	uint8_t multi;					// multiple block transfer
+	uint32_t addr;					// byte offset in the image
+	uint8_t buf[512];				// register data or the block being received
+	uint32_t len;
+	uint32_t pos;
+	uint32_t erase_start;
+	uint32_t erase_end;
+	uint8_t cid[16];
+	uint8_t csd[16];
+} card;
+
+static uint32_t errors;				// injected errors (SIM_ERR_xx)
+static uint8_t in_irq;				// an interrupt handler is running (SIM_IN_xx)
+static uint8_t irq_order;			// order of the data end and DMA transfer complete interrupts (SIM_IRQ_xx)
+
+uint32_t SIM_CmdCount[128];
+
+
+static void fifo_reset(void) {
+	sdio.fifo_head = 0;
+	sdio.fifo_count = 0;
+}
+
+static void fifo_push(uint32_t w) {
+	sdio.fifo[(sdio.fifo_head + sdio.fifo_count) % SIM_FIFO_WORDS] = w;
+	sdio.fifo_count++;
+}
+
+static uint32_t fifo_pop(void) {
+	uint32_t w = sdio.fifo[sdio.fifo_head];
+
+	sdio.fifo_head = (sdio.fifo_head + 1) % SIM_FIFO_WORDS;
+	sdio.fifo_count--;
+
+	return w;
+}
+
+// Status register with the dynamic flags
+static uint32_t sta(void) {
+	uint32_t s = sdio.reg[SIM_STA];
+
+	if (sdio.fifo_rx) {
+		if (sdio.fifo_count) s |= SD_STA_RXDAVL;
+		if (sdio.fifo_count >= 8) s |= SD_STA_RXFIFOHF;
+	} else if (sdio.dpsm) {
+		s |= SD_STA_TXACT;
+		if (sdio.fifo_count <= SIM_FIFO_WORDS - 8) s |= SD_STA_TXFIFOHE;
+	}
+
+	return s;
+}
+
+// Card status with the state the card was in when the command came
+static uint32_t card_status(uint8_t state) {
+	uint32_t cs = (uint32_t)state << 9;
+
+	if (state != SD_STATE_PRG) cs |= CS_READY_FOR_DATA;
+	if (card.app) cs |= CS_APP_CMD;
+
+	return cs;
+}
+
+static void resp_short(uint8_t cmd, uint32_t value) {
+	sdio.reg[SIM_RESPCMD] = cmd;
+	sdio.reg[SIM_RESP1] = value;
+	sdio.reg[SIM_STA] |= SD_STA_CMDREND;
+}
+
+// R3 has no CRC, the SDIO always flags it as failed
+static void resp_r3(uint32_t ocr) {
+	sdio.reg[SIM_RESPCMD] = 0x3F;
+	sdio.reg[SIM_RESP1] = ocr;
+	sdio.reg[SIM_STA] |= SD_STA_CCRCFAIL;
+}
+
+static void resp_long(const uint8_t *reg) {
+	int i;
+
+	sdio.reg[SIM_RESPCMD] = 0x3F;
+	for (i = 0; i < 4; i++)
+		sdio.reg[SIM_RESP1 + i] = ((uint32_t)reg[i * 4] << 24) | (reg[i * 4 + 1] << 16) | (reg[i * 4 + 2] << 8) | reg[i * 4 + 3];
+	sdio.reg[SIM_STA] |= SD_STA_CMDREND;
+}
+
+// Convert the address argument of a data command to the byte offset in the image
+// return: zero or the card status error bit
+static uint32_t card_addr(uint32_t arg, uint32_t *offset) {
+	if (card.type == SIM_CARD_SDHC) {
+		if (arg >= card.blocks) return SD_OCR_OUT_OF_RANGE;
+		*offset = arg << 9;
+	} else {
+		if (arg & 511) return SD_OCR_ADDRESS_ERROR;
+		if ((arg >> 9) >= card.blocks) return SD_OCR_OUT_OF_RANGE;
+		*offset = arg;
+	}
+
+	return 0;
+}
+
+// Switch function status (CMD6)
+static void card_switch(uint32_t arg) {
+	uint8_t fn = arg & 0x0F;
+	uint8_t hs_ok = !card.nohs;
+	uint8_t sel;
+
+	if (fn == 0x0F)
+		sel = card.hs;
+	else if ((fn == 0) || ((fn == 1) && hs_ok))
+		sel = fn;
+	else
+		sel = 0x0F;
+
+	memset(card.buf, 0, 64);
+	card.buf[1] = 100;						// maximum current (mA)
+	card.buf[12] = 0x80;
+	card.buf[13] = hs_ok ? 0x03 : 0x01;		// function group 1 support: default, High-Speed
+	card.buf[16] = sel;						// function group 1 selection
+	if ((arg & 0x80000000) && (sel != 0x0F)) card.hs = sel;
+
+	card.len = 64;
+	card.pos = 0;
+	card.xfer = XF_SHORT;
+	card.nac = SIM_NAC_STEPS;
+}
+
+// Application specific commands the card knows, other commands after APP_CMD are the standard ones
+static int card_acmd(uint8_t cmd) {
+	return (cmd == SD_CMD_SET_BUS_WIDTH) || (cmd == SD_CMD_SET_WR_BLK_ERASE_COUNT) || (cmd == SD_CMD_SD_SEND_OP_COND) ||
+			(cmd == SD_CMD_SET_CLR_CARD_DETECT) || (cmd == SD_CMD_SEND_SCR);
+}
+
+static void card_reset(void) {
+	card.state = SD_STATE_IDLE;
+	card.app = 0;
+	card.busy = SIM_ACMD41_BUSY;
+	card.wide = 0;
+	card.hs = 0;
+	card.rca = 0;
+	card.xfer = XF_NONE;
+}
+
+// Execute a command
+static void card_command(uint8_t cmd, uint32_t arg, uint32_t resp) {
+	uint8_t state = card.state;
+	uint8_t app = card.app && card_acmd(cmd);
+	uint32_t err = 0;
+	uint32_t ocr;
+	uint32_t i;
+
+	if ((errors & SIM_ERR_NOCARD) || ((sdio.reg[SIM_POWER] & SD_PWR_ON) != SD_PWR_ON)) {
+		sdio.reg[SIM_STA] |= resp ? SD_STA_CTIMEOUT : SD_STA_CMDSENT;
+		return;
+	}
+	if ((cmd == SD_CMD_STOP_TRANSMISSION) && (errors & SIM_ERR_CMD12)) {
+		// The card keeps the transfer going
+		errors &= ~SIM_ERR_CMD12;
+		sdio.reg[SIM_STA] |= SD_STA_CTIMEOUT;
+		return;
+	}
+	SIM_CmdCount[app ? 64 + cmd : cmd]++;
+	card.app = 0;
+
+	if (cmd == SD_CMD_GO_IDLE_STATE) {
+		card_reset();
+		sdio.reg[SIM_STA] |= SD_STA_CMDSENT;
+		return;
+	}
+
+	// Data commands are refused while the card is busy
+	if ((state == SD_STATE_PRG) && (cmd != SD_CMD_SEND_STATUS) && (cmd != SD_CMD_STOP_TRANSMISSION)) {
+		resp_short(cmd, card_status(state) | SD_OCR_ILLEGAL_COMMAND);
+		return;
+	}
+
+	if (app) {
+		switch (cmd) {
+			case SD_CMD_SD_SEND_OP_COND: // ACMD41
+				if (state != SD_STATE_IDLE) break;
+				ocr = 0x00FF8000;
+				if (card.busy && !--card.busy) {
+					ocr |= 0x80000000;
+					if ((card.type == SIM_CARD_SDHC) && (arg & SD_HIGH_CAPACITY)) ocr |= SD_HIGH_CAPACITY;
+					card.state = SD_STATE_READY;
+				}
+				resp_r3(ocr);
+				return;
+			case SD_CMD_SET_BUS_WIDTH: // ACMD6
+				if (state != SD_STATE_TRAN) break;
+				card.wide = ((arg & 3) == 2);
+				resp_short(cmd, card_status(state));
+				return;
+			case SD_CMD_SET_CLR_CARD_DETECT: // ACMD42
+			case SD_CMD_SET_WR_BLK_ERASE_COUNT: // ACMD23
+				if (state != SD_STATE_TRAN) break;
+				resp_short(cmd, card_status(state));
+				return;
+			case SD_CMD_SEND_SCR: // ACMD51
+				if (state != SD_STATE_TRAN) break;
+				memset(card.buf, 0, 8);
+				card.buf[0] = (card.type == SIM_CARD_SDV1) ? 0x00 : 0x02;	// SD_SPEC
+				card.buf[1] = 0x35;											// security, bus widths 1 and 4
+				card.len = 8;
+				card.pos = 0;
+				card.xfer = XF_SHORT;
+				card.nac = SIM_NAC_STEPS;
+				card.state = SD_STATE_DATA;
+				resp_short(cmd, card_status(state));
+				return;
+		}
+		// Not for this state, the card doesn't answer
+		sdio.reg[SIM_STA] |= resp ? SD_STA_CTIMEOUT : SD_STA_CMDSENT;
+		return;
+	}
+
+	switch (cmd) {
+		case SD_CMD_HS_SEND_EXT_CSD: // CMD8
+			if ((card.type == SIM_CARD_SDV1) || (state != SD_STATE_IDLE)) break;
+			resp_short(cmd, arg & 0xFFF);
+			return;
+		case SD_CMD_APP_CMD: // CMD55
+			card.app = 1;
+			resp_short(cmd, card_status(state));
+			return;
+		case SD_CMD_ALL_SEND_CID: // CMD2
+			if (state != SD_STATE_READY) break;
+			card.state = SD_STATE_IDENT;
+			resp_long(card.cid);
+			return;
+		case SD_CMD_SEND_REL_ADDR: // CMD3
+			if ((state != SD_STATE_IDENT) && (state != SD_STATE_STBY)) break;
+			card.rca = SIM_RCA;
+			card.state = SD_STATE_STBY;
+			resp_short(cmd, ((uint32_t)card.rca << 16) | (card_status(state) & 0x1FFF));
+			return;
+		case SD_CMD_SEND_CSD: // CMD9
+			if ((state != SD_STATE_STBY) || ((arg >> 16) != card.rca)) break;
+			resp_long(card.csd);
+			return;
+		case SD_CMD_SEL_DESEL_CARD: // CMD7
+			if ((arg >> 16) != card.rca) break;
+			if (state == SD_STATE_STBY) card.state = SD_STATE_TRAN;
+			resp_short(cmd, card_status(state));
+			return;
+		case SD_CMD_SEND_STATUS: // CMD13
+			if ((arg >> 16) != card.rca) break;
+			if ((state == SD_STATE_PRG) && !--card.prg) card.state = SD_STATE_TRAN;
+			resp_short(cmd, card_status(state));
+			return;
+		case SD_CMD_SWITCH_FUNC: // CMD6
+			if (card.type == SIM_CARD_SDV1) break;
+			if (state != SD_STATE_TRAN) {
+				err = SD_OCR_ILLEGAL_COMMAND;
+			} else {
+				card_switch(arg);
+				card.state = SD_STATE_DATA;
+			}
+			resp_short(cmd, card_status(state) | err);
+			return;
+		case SD_CMD_SET_BLOCKLEN: // CMD16
+			if (state != SD_STATE_TRAN) err = SD_OCR_ILLEGAL_COMMAND;
+			resp_short(cmd, card_status(state) | err);
+			return;
+		case SD_CMD_READ_SINGLE_BLOCK: // CMD17
+		case SD_CMD_READ_MULT_BLOCK: // CMD18
+		case SD_CMD_WRITE_BLOCK: // CMD24
+		case SD_CMD_WRITE_MULTIPLE_BLOCK: // CMD25
+			if (state != SD_STATE_TRAN) {
+				err = SD_OCR_ILLEGAL_COMMAND;
+			} else {
+				err = card_addr(arg, &card.addr);
+			}
+			if (!err) {
+				card.multi = (cmd == SD_CMD_READ_MULT_BLOCK) || (cmd == SD_CMD_WRITE_MULTIPLE_BLOCK);
+				card.pos = 0;
+				if ((cmd == SD_CMD_READ_SINGLE_BLOCK) || (cmd == SD_CMD_READ_MULT_BLOCK)) {
+					card.xfer = XF_READ;
+					card.nac = SIM_NAC_STEPS;
+					card.state = SD_STATE_DATA;
+				} else {
+					card.xfer = XF_WRITE;
+					card.state = SD_STATE_RCV;
+				}
+			}
+			resp_short(cmd, card_status(state) | err);
+			return;
+		case SD_CMD_STOP_TRANSMISSION: // CMD12
+			if (state == SD_STATE_DATA) {
+				card.state = SD_STATE_TRAN;
+			} else if (state == SD_STATE_RCV) {
+				card.state = SD_STATE_PRG;
+				card.prg = SIM_PRG_POLLS;
+			} else {
+				err = SD_OCR_ILLEGAL_COMMAND;
+			}
+			card.xfer = XF_NONE;
+			resp_short(cmd, card_status(state) | err);
+			return;
+		case SD_CMD_ERASE_WR_BLK_START: // CMD32
+		case SD_CMD_ERASE_WR_BLK_END: // CMD33
+			if (state != SD_STATE_TRAN) {
+				err = SD_OCR_ILLEGAL_COMMAND;
+			} else {
+				err = card_addr(arg, &i);
+			}
+			if (!err) {
+				if (cmd == SD_CMD_ERASE_WR_BLK_START)
+					card.erase_start = i >> 9;
+				else
+					card.erase_end = i >> 9;
+			}
+			resp_short(cmd, card_status(state) | err);
+			return;
+		case SD_CMD_ERASE: // CMD38
+			if (state != SD_STATE_TRAN) {
+				err = SD_OCR_ILLEGAL_COMMAND;
+			} else if (card.erase_end < card.erase_start) {
+				err = SD_OCR_ERASE_SEQ_ERROR;
+			} else {
+				memset(card.image + ((size_t)card.erase_start << 9), 0, (size_t)(card.erase_end - card.erase_start + 1) << 9);
+				card.state = SD_STATE_PRG;
+				card.prg = SIM_PRG_POLLS;
+			}
+			resp_short(cmd, card_status(state) | err);
+			return;
+	}
+
+	// Unknown command or not for this state, the card doesn't answer
+	sdio.reg[SIM_STA] |= resp ? SD_STA_CTIMEOUT : SD_STA_CMDSENT;
+}
+
+// Check a data block against the bus configuration
+// return: nonzero if the block fails the CRC check
+static int block_bad(void) {
+	uint32_t clkcr = sdio.reg[SIM_CLKCR];
+
+	if (errors & SIM_ERR_DCRC) {
+		errors &= ~SIM_ERR_DCRC;
+		return 1;
+	}
+	if ((clkcr & SD_CLKCR_BYPASS) && (!card.hs || (errors & SIM_ERR_HSFAIL))) return 1;
+	if (((clkcr & SD_CLKCR_WIDBUS) == SD_BUS_4BIT) != card.wide) return 1;
+
+	return 0;
+}
+
+// Next word the card sends
+static uint32_t card_read_word(void) {
+	uint8_t *p = (card.xfer == XF_SHORT) ? card.buf + card.pos : card.image + card.addr;
+	uint32_t w = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+
+	if (card.xfer == XF_SHORT) {
+		card.pos += 4;
+		if (card.pos == card.len) {
+			card.xfer = XF_NONE;
+			card.state = SD_STATE_TRAN;
+		}
+	} else {
+		card.addr += 4;
+		if (!(card.addr & 511)) {
+			if (!card.multi) {
+				card.xfer = XF_NONE;
+				card.state = SD_STATE_TRAN;
+			} else if ((card.addr >> 9) >= card.blocks) {
+				// End of the card, it waits for STOP_TRANSMISSION
+				card.xfer = XF_NONE;
+			}
+		}
+	}
+
+	return w;
+}
+
+// Word the card receives
+static void card_write_word(uint32_t w) {
+	card.buf[card.pos++] = w;
+	card.buf[card.pos++] = w >> 8;
+	card.buf[card.pos++] = w >> 16;
+	card.buf[card.pos++] = w >> 24;
+}
+
+// End of a received block
+static void card_write_block(int bad) {
+	card.pos = 0;
+	if (!bad) {
+		memcpy(card.image + card.addr, card.buf, 512);
+		card.addr += 512;
+	}
+	if (!card.multi) {
+		card.xfer = XF_NONE;
+		card.state = SD_STATE_PRG;
+		card.prg = SIM_PRG_POLLS;
+	} else if ((card.addr >> 9) >= card.blocks) {
+		card.xfer = XF_NONE;
+	}
+}
+
+// Card -> FIFO
+// return: number of words moved
+static uint32_t data_rx(void) {
+	uint32_t n;
+
+	if (card.nac) {
+		card.nac--;
+		return 0;
+	}
+	for (n = 0; n < SIM_WORDS_STEP; n++) {
+		if (!sdio.dpsm || ((card.xfer != XF_SHORT) && (card.xfer != XF_READ))) break;
+		if (sdio.fifo_count == SIM_FIFO_WORDS) {
+			// Without flow control the bus doesn't wait for the FIFO for long
+			if (!(sdio.reg[SIM_CLKCR] & SD_CLKCR_HWFC_EN) && (++sdio.stall > SIM_STALL_STEPS)) {
+				sdio.reg[SIM_STA] |= SD_STA_RXOVERR;
+				sdio.dpsm = 0;
+			}
+			break;
+		}
+		sdio.stall = 0;
+		fifo_push(card_read_word());
+		sdio.dleft -= 4;
+		sdio.bleft -= 4;
+		if (!sdio.bleft) {
+			if (block_bad()) {
+				sdio.reg[SIM_STA] |= SD_STA_DCRCFAIL;
+				sdio.dpsm = 0;
+				n++;
+				break;
+			}
+			sdio.reg[SIM_STA] |= SD_STA_DBCKEND;
+			sdio.bleft = sdio.bsize;
+		}
+		if (!sdio.dleft) {
+			sdio.reg[SIM_STA] |= SD_STA_DATAEND;
+			sdio.dpsm = 0;
+			n++;
+			break;
+		}
+	}
+
+	return n;
+}
+
+// FIFO -> card
+// return: number of words moved
+static uint32_t data_tx(void) {
+	uint32_t n;
+	int bad;
+
+	for (n = 0; n < SIM_WORDS_STEP; n++) {
+		if (!sdio.dpsm || (card.xfer != XF_WRITE)) break;
+		if (!sdio.fifo_count) {
+			if (!(sdio.reg[SIM_CLKCR] & SD_CLKCR_HWFC_EN) && (++sdio.stall > SIM_STALL_STEPS)) {
+				sdio.reg[SIM_STA] |= SD_STA_TXUNDERR;
+				sdio.dpsm = 0;
+			}
+			break;
+		}
+		sdio.stall = 0;
+		card_write_word(fifo_pop());
+		sdio.dleft -= 4;
+		sdio.bleft -= 4;
+		if (!sdio.bleft) {
+			bad = block_bad();
+			card_write_block(bad);
+			if (bad) {
+				sdio.reg[SIM_STA] |= SD_STA_DCRCFAIL;
+				sdio.dpsm = 0;
+				n++;
+				break;
+			}
+			sdio.reg[SIM_STA] |= SD_STA_DBCKEND;
+			sdio.bleft = sdio.bsize;
+		}
+		if (!sdio.dleft) {
+			sdio.reg[SIM_STA] |= SD_STA_DATAEND;
+			sdio.dpsm = 0;
+			n++;
+			break;
+		}
+	}
+
+	return n;
+}
+
+// DMA requests of the SDIO FIFO
+static void dma_step(void) {
+	if (!dma.en || !dma.count || !(sdio.reg[SIM_DCTRL] & SD_DCTRL_DMAEN) || (errors & SIM_ERR_DMASTALL)) return;
+	// SIM_ORD_DMALAST: the DMA lags, the last words stay in the FIFO until the data end interrupt is handled
+	if ((errors & SIM_ORD_DMALAST) && dma.irq && ((sdio.reg[SIM_STA] & SD_STA_DATAEND) || (in_irq == SIM_IN_SDIO))) return;
+	if (dma.dir == SDIO_DMA_DIR_RX) {
+		if (!sdio.fifo_rx || !sdio.fifo_count) return;
+	} else {
+		if (!sdio.dpsm || sdio.dpsm_rx || (sdio.fifo_count == SIM_FIFO_WORDS)) return;
+	}
+	if (errors & SIM_ERR_DMA) {
+		// The channel is disabled by the transfer error
+		errors &= ~SIM_ERR_DMA;
+		dma.flags |= SIM_DMA_TE;
+		dma.en = 0;
+		return;
+	}
+
+	while (dma.count) {
+		if (dma.dir == SDIO_DMA_DIR_RX) {
+			if (!sdio.fifo_count) break;
+			*dma.mem++ = fifo_pop();
+		} else {
+			if (sdio.fifo_count == SIM_FIFO_WORDS) break;
+			fifo_push(*dma.mem++);
+		}
+		dma.count--;
+	}
+	if (!dma.count) dma.flags |= SIM_DMA_TC;
+}
+
+// SDIO interrupt request
+static int sdio_irq(void) {
+	uint32_t s = sta() & sdio.reg[SIM_MASK];
+
+	// The data end waits for the DMA transfer complete interrupt
+	if ((errors & SIM_ORD_DMAFIRST) && (s & SD_STA_DATAEND) && dma.irq && (irq_order == SIM_IRQ_NONE)) return 0;
+
+	return s != 0;
+}
+
+// DMA channel interrupt request
+static int dma_irq(void) {
+	if (!dma.irq || !(dma.flags & (SIM_DMA_TC | SIM_DMA_TE))) return 0;
+
+	// The transfer complete waits for the end of the data path and its interrupt
+	if ((errors & SIM_ORD_DMALAST) && !(dma.flags & SIM_DMA_TE) && (sdio.dpsm || (sta() & sdio.reg[SIM_MASK]))) return 0;
+
+	return 1;
+}
+
+// Deliver the pending interrupts
+static void irq_dispatch(void) {
+	int n;
+
+	if (in_irq) return;
+	for (n = 0; n < 16; n++) {
+		if (sdio_irq()) {
+			if ((irq_order == SIM_IRQ_NONE) && (sta() & SD_STA_DATAEND)) irq_order = SIM_IRQ_DATAEND_FIRST;
+			in_irq = SIM_IN_SDIO;
+			SDIO_IRQHandler();
+		} else if (dma_irq()) {
+			if ((irq_order == SIM_IRQ_NONE) && (dma.flags & SIM_DMA_TC)) irq_order = SIM_IRQ_TC_FIRST;
+			in_irq = SIM_IN_DMA;
+			SDIO_DMA_IRQHandler();
+		} else break;
+	}
+	in_irq = SIM_IN_NONE;
+}
+
+// Advance the simulation by one step
+void SIM_Step(void) {
+	uint32_t moved = 0;
+
+	dma_step();
+	if (sdio.dpsm) {
+		moved = sdio.dpsm_rx ? data_rx() : data_tx();
+
+		// Data timeout
+		if (moved) {
+			sdio.idle = 0;
+		} else if (sdio.dpsm && (++sdio.idle * SIM_TIMER_SCALE >= sdio.reg[SIM_DTIMER])) {
+			sdio.reg[SIM_STA] |= SD_STA_DTIMEOUT;
+			sdio.dpsm = 0;
+		}
+	}
+	dma_step();
+	irq_dispatch();
+}
+
+uint32_t SIM_Read(uint32_t reg) {
+	uint32_t value;
+
+	SIM_Step();
+	switch (reg) {
+		case SIM_STA:
+			value = sta();
+			break;
+		case SIM_FIFO:
+			value = sdio.fifo_count ? fifo_pop() : 0;
+			break;
+		case SIM_DCOUNT:
+			value = sdio.dleft;
+			break;
+		default:
+			value = sdio.reg[reg];
+			break;
+	}
+
+	return value;
+}
+
+void SIM_Write(uint32_t reg, uint32_t value) {
+	switch (reg) {
+		case SIM_ICR:
+			sdio.reg[SIM_STA] &= ~value;
+			break;
+		case SIM_CMD:
+			sdio.reg[SIM_CMD] = value;
+			if (value & SD_CMD_CPSMEN) card_command(value & 0x3F, sdio.reg[SIM_ARG], value & SD_RESP_LONG);
+			break;
+		case SIM_DCTRL:
+			sdio.reg[SIM_DCTRL] = value;
+			fifo_reset();
+			sdio.dpsm = value & SD_DCTRL_DTEN;
+			sdio.dpsm_rx = (value & SD_DCTRL_DTDIR) ? 1 : 0;
+			sdio.fifo_rx = sdio.dpsm && sdio.dpsm_rx;
+			if (sdio.dpsm) {
+				sdio.dleft = sdio.reg[SIM_DLEN];
+				sdio.bsize = 1 << ((value >> 4) & 0x0F);
+				sdio.bleft = sdio.bsize;
+				sdio.stall = 0;
+				sdio.idle = 0;
+			}
+			break;
+		case SIM_FIFO:
+			if (sdio.fifo_count < SIM_FIFO_WORDS) fifo_push(value);
+			break;
+		case SIM_STA:
+		case SIM_RESPCMD:
+		case SIM_DCOUNT:
+			// Read only
+			break;
+		default:
+			sdio.reg[reg] = value;
+			break;
+	}
+	SIM_Step();
+}
+
+void SIM_DMA_Enable(uint8_t enable) {
+	dma.en = enable;
+}
+
+void SIM_DMA_Buffer(uint32_t *pBuf, uint32_t length) {
+	dma.mem = pBuf;
+	dma.count = length >> 2;
+	irq_order = SIM_IRQ_NONE;
+}
+
+void SIM_DMA_IRQ(uint8_t enable) {
+	dma.irq = enable;
+}
+
+uint32_t SIM_DMA_Flags(void) {
+	return dma.flags;
+}
+
+void SIM_DMA_Clear(void) {
+	dma.flags = 0;
+}
+
+// Insert a new card
+// input:
+//   type - one of SIM_CARD_xx values, optionally with SIM_CARD_NOHS
+//   blocks - capacity in 512-byte blocks (multiple of 1024)
+void SIM_Init(uint8_t type, uint32_t blocks) {
+	uint32_t c_size;
+
+	free(card.image);
+	memset(&sdio, 0, sizeof(sdio));
+	memset(&dma, 0, sizeof(dma));
+	memset(&card, 0, sizeof(card));
+	memset(SIM_CmdCount, 0, sizeof(SIM_CmdCount));
+	errors = 0;
+	irq_order = SIM_IRQ_NONE;
+
+	card.type = type & ~SIM_CARD_NOHS;
+	card.nohs = (type & SIM_CARD_NOHS) || (card.type == SIM_CARD_SDV1);
+	card.blocks = blocks;
+	card.image = calloc(blocks, 512);
+	card_reset();
+
+	// CID: manufacturer, OEM, product name, revision, serial number, date
+	memcpy(card.cid, "\x03SDSIMSD\x10\x12\x34\x56\x78\x01\x4A\x00", 16);
+
+	// CSD: TAAC, NSAC, TRAN_SPEED 25MHz, CCC (classes 0,2,4,5,7,8 and 10 if it can switch), READ_BL_LEN 512
+	card.csd[1] = 0x0E;
+	card.csd[3] = 0x32;
+	card.csd[4] = card.nohs ? 0x1B : 0x5B;
+	card.csd[5] = 0x59;
+	if (card.type == SIM_CARD_SDHC) {
+		// CSD v2.0, C_SIZE in units of 512KB
+		c_size = (blocks >> 10) - 1;
+		card.csd[0] = 0x40;
+		card.csd[7] = (c_size >> 16) & 0x3F;
+		card.csd[8] = c_size >> 8;
+		card.csd[9] = c_size;
+	} else {
+		// CSD v1.0, C_SIZE_MULT 7 (512 blocks per C_SIZE unit)
+		c_size = (blocks >> 9) - 1;
+		card.csd[6] = 0x80 | ((c_size >> 10) & 0x03);
+		card.csd[7] = c_size >> 2;
+		card.csd[8] = ((c_size & 0x03) << 6) | 0x3F;
+		card.csd[9] = 0xFC | 0x03;
+		card.csd[10] = 0x80;
+	}
+}
+
+// Inject errors
+// input:
+//   errors - combination of SIM_ERR_xx values, replaces the current set
+void SIM_Inject(uint32_t value) {
+	errors = value;
+}
+
+// Contents of the card
+uint8_t *SIM_Image(void) {
+	return card.image;
+}
+
+// Order of the data end and DMA transfer complete interrupts since the DMA buffer was set (SIM_IRQ_xx)
+uint8_t SIM_IrqOrder(void) {
+	return irq_order;
+}
+
+// Current state of the card (SD_STATE_xx)
+uint8_t SIM_CardState(void) {
+	return card.state;
+}
+
+
+// Target layer functions of the driver
+
+void SD_GPIO_Init(void) {
+}
+
+void SD_GPIO_DeInit(void) {
+}
+
+// Same configuration as on the STM32L4: 1-bit bus, 400kHz, hardware flow control
+void SD_SDIO_Init(void) {
+	sdio.reg[SIM_CLKCR] = SD_BUS_1BIT | SD_CLK_DIV_INIT | SD_CLKCR_CLKEN | SD_CLKCR_PWRSAV | SD_CLKCR_HWFC_EN;
+	sdio.reg[SIM_POWER] = SD_PWR_OFF;
+}
+
+void SD_SDIO_DeInit(void) {
+	sdio.reg[SIM_POWER] = SD_PWR_OFF;
+}
+
+void SD_Configure_DMA(uint32_t *pBuf, uint32_t length, uint8_t direction) {
+	dma.en = 0;
+	dma.dir = direction;
+	dma.mem = pBuf;
+	dma.count = length >> 2;
+	dma.flags = 0;
+	irq_order = SIM_IRQ_NONE;
+}
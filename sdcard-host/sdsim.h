@@ -0,0 +1,105 @@
+#ifndef __SDSIM_H
+#define __SDSIM_H
+
+
+#include <stdint.h>
+
+
+// Register level simulator of the SDIO peripheral, its DMA channel and an SD card
+// Target layer of the SD card driver (sdcard.h) for builds with HOSTVER defined:
+// every register access of the driver goes to the simulator, which advances the
+// card and the DMA by one step and calls the interrupt handlers of the driver.
+
+
+// Driver options
+#define SDIO_USE_4BIT                 1
+#define SDIO_USE_DMA                  1
+#define SDIO_USE_IRQ                  1
+#define SDIO_USE_HIGHSPEED            1
+
+// SDIO kernel clock and bus clocks
+#define SD_SDIOCLK                    ((uint32_t)48000000U)
+#define SD_CLK_DIV_INIT               (SD_CLK_DIV_400K)
+#define SD_CLK_DIV_TRAN               (SD_CLK_DIV_24M)
+
+// Registers of the simulated SDIO peripheral
+enum {
+	SIM_POWER, SIM_CLKCR, SIM_ARG, SIM_CMD, SIM_RESPCMD, SIM_RESP1, SIM_RESP2, SIM_RESP3, SIM_RESP4,
+	SIM_DTIMER, SIM_DLEN, SIM_DCTRL, SIM_DCOUNT, SIM_STA, SIM_ICR, SIM_MASK, SIM_FIFO, SIM_REGS
+};
+
+// Access to the SDIO registers
+#define SDIO_RD(reg)                  SIM_Read(SIM_##reg)
+#define SDIO_WR(reg,value)            SIM_Write(SIM_##reg,(value))
+
+// Interrupt vectors, called by the simulator
+#define SDIO_IRQHandler               SIM_SDIO_IRQHandler
+#define SDIO_DMA_IRQHandler           SIM_DMA_IRQHandler
+
+// The loops waiting for an interrupt let the simulation run
+#define SDIO_IDLE()                   SIM_Step()
+
+// SDIO DMA channel
+#define SDIO_DMA_DIR_RX               0x00 // SDIO -> MEMORY
+#define SDIO_DMA_DIR_TX               0x01 // MEMORY -> SDIO
+#define SDIO_DMA_ENABLE()             SIM_DMA_Enable(1)
+#define SDIO_DMA_DISABLE()            SIM_DMA_Enable(0)
+#define SDIO_DMA_BUFFER(pBuf,length)  SIM_DMA_Buffer(pBuf,length)
+#define SDIO_DMA_IRQ_ON()             SIM_DMA_IRQ(1)
+#define SDIO_DMA_IRQ_OFF()            SIM_DMA_IRQ(0)
+#define SDIO_DMA_TC()                 (SIM_DMA_Flags() & SIM_DMA_TC)
+#define SDIO_DMA_TE()                 (SIM_DMA_Flags() & SIM_DMA_TE)
+#define SDIO_DMA_CLEAR()              SIM_DMA_Clear()
+#define SDIO_DMA_TX_START(dctrl)      SDIO_WR(DCTRL,dctrl)
+
+// DMA channel flags
+#define SIM_DMA_TC                    0x01 // Transfer complete
+#define SIM_DMA_TE                    0x02 // Transfer error
+
+
+// Simulated card types
+#define SIM_CARD_SDHC                 0x00 // SD v2.0 high capacity
+#define SIM_CARD_SDSC                 0x01 // SD v2.0 standard capacity
+#define SIM_CARD_SDV1                 0x02 // SD v1.x (no CMD8, no CMD6)
+#define SIM_CARD_NOHS                 0x10 // Flag: the card doesn't support High-Speed
+
+// Error injection (SIM_Inject), cleared by SIM_Init
+#define SIM_ERR_NOCARD                0x01 // No card: all commands time out
+#define SIM_ERR_DCRC                  0x02 // The next data block fails the CRC check (one-shot)
+#define SIM_ERR_HSFAIL                0x04 // Data blocks at the 48MHz bus clock fail the CRC check
+#define SIM_ERR_DMA                   0x08 // The next DMA access fails with transfer error (one-shot)
+#define SIM_ERR_DMASTALL              0x10 // The DMA doesn't serve the SDIO FIFO
+#define SIM_ERR_CMD12                 0x20 // The card doesn't answer the next STOP_TRANSMISSION (one-shot)
+
+// Interrupt order (SIM_Inject), the SDIO and the DMA interrupts have the same priority
+#define SIM_ORD_DMAFIRST              0x40 // The data end interrupt waits for the DMA transfer complete interrupt
+#define SIM_ORD_DMALAST               0x80 // The DMA transfer complete interrupt waits until the data path ends and its interrupt is handled
+
+// Order of the last data end and DMA transfer complete interrupts (SIM_IrqOrder)
+#define SIM_IRQ_NONE                  0x00 // Neither delivered since the DMA buffer was set
+#define SIM_IRQ_TC_FIRST              0x01 // DMA transfer complete first
+#define SIM_IRQ_DATAEND_FIRST         0x02 // SDIO data end first
+
+
+// Number of times each command (0..63) was received by the card, ACMDs count at 64 + index
+extern uint32_t SIM_CmdCount[128];
+
+
+// Function prototypes
+void SIM_Init(uint8_t type, uint32_t blocks);
+void SIM_Inject(uint32_t errors);
+uint8_t *SIM_Image(void);
+uint8_t SIM_CardState(void);
+uint8_t SIM_IrqOrder(void);
+
+uint32_t SIM_Read(uint32_t reg);
+void SIM_Write(uint32_t reg, uint32_t value);
+void SIM_Step(void);
+
+void SIM_DMA_Enable(uint8_t enable);
+void SIM_DMA_Buffer(uint32_t *pBuf, uint32_t length);
+void SIM_DMA_IRQ(uint8_t enable);
+uint32_t SIM_DMA_Flags(void);
+void SIM_DMA_Clear(void);
+
+#endif // __SDSIM_H
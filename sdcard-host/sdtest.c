@@ -0,0 +1,424 @@
+/*
+	Host test of the SD card driver
+	Runs the shared SD protocol core (sdcard.c of stm32l4-sdio or stm32l151rdt6-dev)
+	against the register level simulator (sdsim.c): card initialization of all card
+	types, bus width and High-Speed switch, polled, DMA, interrupt driven (both orders
+	of the data end and DMA interrupts), scatter-gather and stream transfers, erase and
+	the error paths (CRC, DMA, STOP_TRANSMISSION timeout).
+
+	Build from this directory:
+	  cc -O2 -Wall -DHOSTVER -I. -I../stm32l4-sdio/src -o sdtest sdtest.c sdsim.c ../stm32l4-sdio/src/sdcard.c
+
+	Usage: sdtest [-v]
+	  -v  print every check
+	Returns 0 if all checks passed.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sdcard.h"
+
+
+#define CARD_BLOCKS		8192		// capacity of the simulated cards (4MB)
+
+#define CHECK(cond)		check((cond),#cond,__LINE__)
+
+static int verbose;
+static int checks;
+static int fails;
+
+static uint32_t wbuf[32 * 128];
+static uint32_t rbuf[32 * 128];
+
+static int cb_count;
+static SDResult cb_result;
+
+
+static void check(int ok, const char *what, int line) {
+	checks++;
+	if (!ok) fails++;
+	if (!ok || verbose) printf("  %s line %d: %s\n",ok ? "ok  " : "FAIL",line,what);
+}
+
+static void xfer_done(SDResult result) {
+	cb_count++;
+	cb_result = result;
+}
+
+// Fill the buffer with a pattern depending on the seed
+static void fill(uint32_t *pBuf, uint32_t blocks, uint32_t seed) {
+	uint32_t i;
+
+	for (i = 0; i < blocks * 128; i++) pBuf[i] = (seed << 24) ^ (i * 2654435761U);
+}
+
+// Compare the buffer with the blocks on the card
+static int on_card(uint32_t block, const uint32_t *pBuf, uint32_t blocks) {
+	return !memcmp(SIM_Image() + block * 512,pBuf,blocks * 512);
+}
+
+// Card address of the block for the current card type
+static uint32_t addr(uint32_t block) {
+	return block * 512;
+}
+
+// Insert a card and initialize it up to the 4-bit bus
+static SDResult card_up(uint8_t type) {
+	SDResult res;
+
+	SIM_Init(type,CARD_BLOCKS);
+	SD_GPIO_Init();
+	SD_SDIO_Init();
+	res = SD_Init();
+	if (res != SDR_Success) return res;
+	SD_GetCardInfo();
+
+	return SD_SetBusWidth(SD_BUS_4BIT);
+}
+
+static void test_init(void) {
+	printf("init\n");
+
+	CHECK(card_up(SIM_CARD_SDHC) == SDR_Success);
+	CHECK(SDCard.Type == SDCT_SDHC);
+	CHECK(SDCard.RCA != 0);
+	CHECK(SDCard.BlockSize == 512);
+	CHECK((SDCard.SCR[0] & 0x0F) == 2);
+	CHECK(SDCard.PNM[0] == 'S');
+	CHECK(SDCard.BusClock == SD_SDIOCLK / 2);
+	CHECK(SIM_CardState() == SD_STATE_TRAN);
+
+	CHECK(card_up(SIM_CARD_SDSC) == SDR_Success);
+	CHECK(SDCard.Type == SDCT_SDSC_V2);
+	CHECK(SDCard.BlockCount == CARD_BLOCKS);
+
+	CHECK(card_up(SIM_CARD_SDV1) == SDR_Success);
+	CHECK(SDCard.Type == SDCT_SDSC_V1);
+	CHECK(SD_HighSpeed() == SDR_Unsupported);
+
+	SIM_Init(SIM_CARD_SDHC,CARD_BLOCKS);
+	SIM_Inject(SIM_ERR_NOCARD);
+	SD_SDIO_Init();
+	CHECK(SD_Init() == SDR_Timeout);
+}
+
+static void test_polled(uint8_t type) {
+	printf("polled (%s)\n",type == SIM_CARD_SDHC ? "SDHC" : "SDSC");
+
+	CHECK(card_up(type) == SDR_Success);
+
+	fill(wbuf,1,1);
+	CHECK(SD_WriteBlock(addr(10),wbuf,512) == SDR_Success);
+	CHECK(on_card(10,wbuf,1));
+	CHECK(SD_CardBusy());
+	CHECK(SD_WaitReady() == SDR_Success);
+	CHECK(!SD_CardBusy());
+
+	fill(wbuf,5,2);
+	CHECK(SD_WriteBlock(addr(20),wbuf,5 * 512) == SDR_Success);
+	CHECK(on_card(20,wbuf,5));
+	CHECK(SIM_CmdCount[SD_CMD_WRITE_MULTIPLE_BLOCK] == 1);
+
+	memset(rbuf,0,sizeof(rbuf));
+	CHECK(SD_ReadBlock(addr(20),rbuf,5 * 512) == SDR_Success);
+	CHECK(!memcmp(rbuf,wbuf,5 * 512));
+	CHECK(SD_ReadBlock(addr(10),rbuf,512) == SDR_Success);
+	CHECK(on_card(10,rbuf,1));
+	CHECK(SIM_CmdCount[SD_CMD_STOP_TRANSMISSION] == 2);
+
+	CHECK(SD_ReadBlock(addr(CARD_BLOCKS),rbuf,512) == SDR_AddrOutOfRange);
+	CHECK(SD_ReadBlock(addr(11),rbuf,512) == SDR_Success);
+}
+
+static void test_dma(void) {
+	printf("dma\n");
+
+	CHECK(card_up(SIM_CARD_SDHC) == SDR_Success);
+
+	fill(wbuf,8,3);
+	CHECK(SD_WriteBlock_DMA(addr(100),wbuf,8 * 512) == SDR_Success);
+	CHECK(SD_CheckWrite(8 * 512) == SDR_Success);
+	CHECK(on_card(100,wbuf,8));
+
+	memset(rbuf,0,sizeof(rbuf));
+	CHECK(SD_ReadBlock_DMA(addr(100),rbuf,8 * 512) == SDR_Success);
+	CHECK(SD_CheckRead(8 * 512) == SDR_Success);
+	CHECK(!memcmp(rbuf,wbuf,8 * 512));
+
+	memset(rbuf,0,sizeof(rbuf));
+	CHECK(SD_ReadBlock_DMA(addr(103),rbuf,512) == SDR_Success);
+	CHECK(SD_CheckRead(512) == SDR_Success);
+	CHECK(on_card(103,rbuf,1));
+}
+
+static void test_irq(void) {
+	printf("irq\n");
+
+	CHECK(card_up(SIM_CARD_SDHC) == SDR_Success);
+
+	fill(wbuf,16,4);
+	cb_count = 0;
+	CHECK(SD_WriteBlock_IRQ(addr(120),wbuf,16 * 512,xfer_done) == SDR_Success);
+	CHECK(SD_XferBusy());
+	CHECK(SD_ReadBlock_IRQ(addr(120),rbuf,512,xfer_done) == SDR_Busy);
+	CHECK(SD_XferWait() == SDR_Success);
+	CHECK(cb_count == 1 && cb_result == SDR_Success);
+	CHECK(on_card(120,wbuf,16));
+
+	memset(rbuf,0,sizeof(rbuf));
+	CHECK(SD_ReadBlock_IRQ(addr(120),rbuf,16 * 512,xfer_done) == SDR_Success);
+	CHECK(SD_XferWait() == SDR_Success);
+	CHECK(cb_count == 2 && cb_result == SDR_Success);
+	CHECK(!memcmp(rbuf,wbuf,16 * 512));
+
+	memset(rbuf,0,sizeof(rbuf));
+	CHECK(SD_ReadBlock_IRQ(addr(127),rbuf,512,NULL) == SDR_Success);
+	CHECK(SD_XferWait() == SDR_Success);
+	CHECK(on_card(127,rbuf,1));
+}
+
+// Interrupt driven transfers with both orders of the data end and DMA transfer complete interrupts
+static void test_irq_order(void) {
+	static const uint32_t order[] = { 0, SIM_ORD_DMAFIRST, SIM_ORD_DMALAST };
+	uint32_t blocks;
+	uint32_t i;
+	uint8_t seen[2][3];
+
+	printf("irq order\n");
+
+	CHECK(card_up(SIM_CARD_SDHC) == SDR_Success);
+	memset(seen,0,sizeof(seen));
+	for (i = 0; i < 3; i++) {
+		SIM_Inject(order[i]);
+		for (blocks = 1; blocks <= 8; blocks += 7) {
+			fill(wbuf,blocks,10 + i);
+			cb_count = 0;
+			CHECK(SD_WriteBlock_IRQ(addr(200),wbuf,blocks * 512,xfer_done) == SDR_Success);
+			CHECK(SD_XferWait() == SDR_Success);
+			seen[0][SIM_IrqOrder()] = 1;
+			CHECK(cb_count == 1 && cb_result == SDR_Success);
+			CHECK(on_card(200,wbuf,blocks));
+			CHECK(SIM_CardState() == SD_STATE_TRAN);
+
+			memset(rbuf,0,sizeof(rbuf));
+			CHECK(SD_ReadBlock_IRQ(addr(200),rbuf,blocks * 512,xfer_done) == SDR_Success);
+			CHECK(SD_XferWait() == SDR_Success);
+			seen[1][SIM_IrqOrder()] = 1;
+			CHECK(cb_count == 2 && cb_result == SDR_Success);
+			CHECK(!memcmp(rbuf,wbuf,blocks * 512));
+			CHECK(SIM_CardState() == SD_STATE_TRAN);
+		}
+	}
+	SIM_Inject(0);
+
+	// Both orders happened in both directions
+	CHECK(seen[0][SIM_IRQ_TC_FIRST] && seen[0][SIM_IRQ_DATAEND_FIRST]);
+	CHECK(seen[1][SIM_IRQ_TC_FIRST] && seen[1][SIM_IRQ_DATAEND_FIRST]);
+}
+
+static void test_sg(void) {
+	SD_Segment_TypeDef seg[3];
+	uint32_t cmd18 = SIM_CmdCount[SD_CMD_READ_MULT_BLOCK];
+	uint32_t cmd25 = SIM_CmdCount[SD_CMD_WRITE_MULTIPLE_BLOCK];
+
+	printf("scatter-gather\n");
+
+	// Three buffers, one command
+	fill(wbuf,10,5);
+	seg[0].pBuf = wbuf + 9 * 128;
+	seg[0].blocks = 1;
+	seg[1].pBuf = wbuf;
+	seg[1].blocks = 7;
+	seg[2].pBuf = wbuf + 7 * 128;
+	seg[2].blocks = 2;
+	CHECK(SD_WriteBlock_SG(addr(200),seg,3,xfer_done) == SDR_Success);
+	CHECK(SD_XferWait() == SDR_Success);
+	CHECK(SIM_CmdCount[SD_CMD_WRITE_MULTIPLE_BLOCK] == cmd25 + 1);
+	CHECK(on_card(200,wbuf + 9 * 128,1));
+	CHECK(on_card(201,wbuf,9));
+
+	memset(rbuf,0,sizeof(rbuf));
+	seg[0].pBuf = rbuf;
+	seg[1].pBuf = rbuf + 1 * 128;
+	seg[2].pBuf = rbuf + 8 * 128;
+	CHECK(SD_ReadBlock_SG(addr(200),seg,3,xfer_done) == SDR_Success);
+	CHECK(SD_XferWait() == SDR_Success);
+	CHECK(SIM_CmdCount[SD_CMD_READ_MULT_BLOCK] == cmd18 + 1);
+	CHECK(on_card(200,rbuf,10));
+
+	// Bad segment lists
+	seg[1].blocks = 0;
+	CHECK(SD_ReadBlock_SG(addr(200),seg,3,xfer_done) == SDR_BlockLenError);
+	seg[1].blocks = 512;
+	CHECK(SD_ReadBlock_SG(addr(200),seg,3,xfer_done) == SDR_BlockLenError);
+	CHECK(!SD_XferBusy());
+}
+
+static void test_stream(void) {
+	uint32_t cmd25 = SIM_CmdCount[SD_CMD_WRITE_MULTIPLE_BLOCK];
+	uint32_t acmd23 = SIM_CmdCount[64 + SD_CMD_SET_WR_BLK_ERASE_COUNT];
+
+	printf("stream\n");
+
+	// Three contiguous chunks and a jump: two write commands
+	fill(wbuf,16,6);
+	CHECK(SD_StreamOpen(16) == SDR_Success);
+	CHECK(SD_StreamWrite(addr(300),wbuf,4 * 512) == SDR_Success);
+	CHECK(SD_StreamWrite(addr(304),wbuf + 4 * 128,4 * 512) == SDR_Success);
+	CHECK(SD_StreamWrite(addr(308),wbuf + 8 * 128,4 * 512) == SDR_Success);
+	CHECK(SD_StreamWrite(addr(400),wbuf + 12 * 128,4 * 512) == SDR_Success);
+	CHECK(SD_StreamClose() == SDR_Success);
+	CHECK(!SD_StreamBusy());
+	CHECK(SIM_CmdCount[SD_CMD_WRITE_MULTIPLE_BLOCK] == cmd25 + 2);
+	CHECK(SIM_CmdCount[64 + SD_CMD_SET_WR_BLK_ERASE_COUNT] > acmd23);
+	CHECK(on_card(300,wbuf,12));
+	CHECK(on_card(400,wbuf + 12 * 128,4));
+	CHECK(SD_WaitReady() == SDR_Success);
+}
+
+static void test_erase(void) {
+	printf("erase\n");
+
+	CHECK(card_up(SIM_CARD_SDHC) == SDR_Success);
+
+	fill(wbuf,16,7);
+	CHECK(SD_WriteBlock(addr(500),wbuf,16 * 512) == SDR_Success);
+	memset(rbuf,0,16 * 512);
+	CHECK(SD_Erase(addr(502),12 * 512) == SDR_Success);
+	CHECK(SD_WaitReady() == SDR_Success);
+	CHECK(SIM_CmdCount[SD_CMD_ERASE] == 1);
+	CHECK(on_card(500,wbuf,2));
+	CHECK(on_card(502,rbuf,12));
+	CHECK(on_card(514,wbuf + 14 * 128,2));
+}
+
+static void test_highspeed(void) {
+	printf("high-speed\n");
+
+	CHECK(card_up(SIM_CARD_SDHC) == SDR_Success);
+	CHECK(SD_HighSpeed() == SDR_Success);
+	CHECK(SDCard.HighSpeed);
+	CHECK(SDCard.BusClock == SD_SDIOCLK);
+	fill(wbuf,4,8);
+	CHECK(SD_WriteBlock_DMA(addr(50),wbuf,4 * 512) == SDR_Success);
+	CHECK(SD_CheckWrite(4 * 512) == SDR_Success);
+	CHECK(SD_ReadBlock_DMA(addr(50),rbuf,4 * 512) == SDR_Success);
+	CHECK(SD_CheckRead(4 * 512) == SDR_Success);
+	CHECK(!memcmp(rbuf,wbuf,4 * 512));
+
+	// The card doesn't support the High-Speed function
+	CHECK(card_up(SIM_CARD_SDHC | SIM_CARD_NOHS) == SDR_Success);
+	CHECK(SD_HighSpeed() == SDR_Unsupported);
+	CHECK(!SDCard.HighSpeed);
+	CHECK(SDCard.BusClock == SD_SDIOCLK / 2);
+
+	// The card switches but fails at 48MHz: back to the default speed
+	CHECK(card_up(SIM_CARD_SDHC) == SDR_Success);
+	SIM_Inject(SIM_ERR_HSFAIL);
+	CHECK(SD_HighSpeed() != SDR_Success);
+	CHECK(!SDCard.HighSpeed);
+	CHECK(SDCard.BusClock == SD_SDIOCLK / 2);
+	CHECK(SD_ReadBlock(addr(0),rbuf,2 * 512) == SDR_Success);
+}
+
+static void test_errors(void) {
+	printf("errors\n");
+
+	CHECK(card_up(SIM_CARD_SDHC) == SDR_Success);
+	fill(wbuf,8,9);
+	CHECK(SD_WriteBlock(addr(600),wbuf,8 * 512) == SDR_Success);
+
+	// Data CRC error, the next read succeeds
+	SIM_Inject(SIM_ERR_DCRC);
+	CHECK(SD_ReadBlock(addr(600),rbuf,4 * 512) == SDR_DataCRCFail);
+	CHECK(SD_ReadBlock(addr(600),rbuf,4 * 512) == SDR_Success);
+	CHECK(on_card(600,rbuf,4));
+
+	// DMA transfer error of an interrupt driven transfer
+	SIM_Inject(SIM_ERR_DMA);
+	cb_count = 0;
+	CHECK(SD_ReadBlock_IRQ(addr(600),rbuf,8 * 512,xfer_done) == SDR_Success);
+	CHECK(SD_XferWait() == SDR_DMAError);
+	CHECK(cb_count == 1 && cb_result == SDR_DMAError);
+	CHECK(SIM_CardState() == SD_STATE_TRAN);
+	CHECK(SD_ReadBlock_IRQ(addr(600),rbuf,8 * 512,NULL) == SDR_Success);
+	CHECK(SD_XferWait() == SDR_Success);
+	CHECK(on_card(600,rbuf,8));
+
+	// Data CRC error of interrupt driven transfers, a multiple block transfer is stopped
+	SIM_Inject(SIM_ERR_DCRC);
+	cb_count = 0;
+	CHECK(SD_ReadBlock_IRQ(addr(600),rbuf,8 * 512,xfer_done) == SDR_Success);
+	CHECK(SD_XferWait() == SDR_DataCRCFail);
+	CHECK(cb_count == 1 && cb_result == SDR_DataCRCFail);
+	CHECK(SIM_CardState() == SD_STATE_TRAN);
+	SIM_Inject(SIM_ERR_DCRC);
+	CHECK(SD_ReadBlock_IRQ(addr(600),rbuf,512,xfer_done) == SDR_Success);
+	CHECK(SD_XferWait() == SDR_DataCRCFail);
+	CHECK(cb_count == 2 && cb_result == SDR_DataCRCFail);
+	fill(wbuf,8,11);
+	SIM_Inject(SIM_ERR_DCRC);
+	CHECK(SD_WriteBlock_IRQ(addr(600),wbuf,8 * 512,xfer_done) == SDR_Success);
+	CHECK(SD_XferWait() == SDR_DataCRCFail);
+	CHECK(cb_count == 3 && cb_result == SDR_DataCRCFail);
+	CHECK(SIM_CardState() == SD_STATE_TRAN);
+	CHECK(SD_WriteBlock_IRQ(addr(600),wbuf,8 * 512,xfer_done) == SDR_Success);
+	CHECK(SD_XferWait() == SDR_Success);
+	CHECK(cb_count == 4 && cb_result == SDR_Success);
+	CHECK(on_card(600,wbuf,8));
+
+	// DMA transfer error of an interrupt driven write
+	SIM_Inject(SIM_ERR_DMA);
+	cb_count = 0;
+	CHECK(SD_WriteBlock_IRQ(addr(600),wbuf,8 * 512,xfer_done) == SDR_Success);
+	CHECK(SD_XferWait() == SDR_DMAError);
+	CHECK(cb_count == 1 && cb_result == SDR_DMAError);
+	CHECK(SIM_CardState() == SD_STATE_TRAN);
+
+	// The card doesn't answer the STOP_TRANSMISSION of an interrupt driven transfer,
+	// the transfer ends with the timeout and a second STOP_TRANSMISSION recovers the card
+	SIM_Inject(SIM_ERR_CMD12);
+	cb_count = 0;
+	CHECK(SD_ReadBlock_IRQ(addr(600),rbuf,8 * 512,xfer_done) == SDR_Success);
+	CHECK(SD_XferWait() == SDR_Timeout);
+	CHECK(cb_count == 1 && cb_result == SDR_Timeout);
+	CHECK(!SD_XferBusy());
+	CHECK(SIM_CardState() == SD_STATE_DATA);
+	CHECK(SD_StopTransfer() == SDR_Success);
+	CHECK(SIM_CardState() == SD_STATE_TRAN);
+	memset(rbuf,0,sizeof(rbuf));
+	CHECK(SD_ReadBlock_IRQ(addr(600),rbuf,8 * 512,NULL) == SDR_Success);
+	CHECK(SD_XferWait() == SDR_Success);
+	CHECK(on_card(600,rbuf,8));
+
+	// Without flow control a stalled DMA overruns the FIFO
+	SDIO_WR(CLKCR,SDIO_RD(CLKCR) & ~SD_CLKCR_HWFC_EN);
+	SIM_Inject(SIM_ERR_DMASTALL);
+	CHECK(SD_ReadBlock_DMA(addr(600),rbuf,4 * 512) == SDR_Success);
+	CHECK(SD_CheckRead(4 * 512) == SDR_RXOverrun);
+	SIM_Inject(0);
+	CHECK(SD_ReadBlock_DMA(addr(600),rbuf,4 * 512) == SDR_Success);
+	CHECK(SD_CheckRead(4 * 512) == SDR_Success);
+	CHECK(on_card(600,rbuf,4));
+}
+
+int main(int argc, char *argv[]) {
+	verbose = (argc > 1) && !strcmp(argv[1],"-v");
+
+	test_init();
+	test_polled(SIM_CARD_SDHC);
+	test_polled(SIM_CARD_SDSC);
+	test_dma();
+	test_irq();
+	test_irq_order();
+	test_sg();
+	test_stream();
+	test_erase();
+	test_highspeed();
+	test_errors();
+
+	printf("%d checks, %d failed\n",checks,fails);
+
+	return fails ? 1 : 0;
+}
@@ -7,13 +7,79 @@
 #define _DOSFS_H
 
 #include <stdint.h>
+#ifndef HOSTVER
 #include "sdcard.h"
+#endif
 
 //===================================================================
-// User-supplied functions
+// Sector I/O
+/*
+	Segment of a scatter-gather request: count sectors in a buffer
+*/
+typedef struct _tagSECTORSEG {
+	uint8_t *buffer;			// data buffer (count sectors sized)
+	uint32_t count;				// number of sectors
+} SECTORSEG, *PSECTORSEG;
+
+/*
+	Block device behind a unit (see DFS_AttachDevice)
+	read and write transfer count consecutive sectors starting at sector, and return
+	0 OK, nonzero for any error. count is never larger than maxrun, the number of
+	sectors the device moves with one media command. ctx is passed to all functions
+	as is.
+	readv and writev are optional (NULL if the device has no scatter-gather support):
+	they transfer the consecutive sectors starting at sector from/to a list of segs
+	buffers with one media command, the segments hold at most maxrun sectors together.
+	erase is optional (NULL if the device can't erase): it erases count sectors
+	starting at sector, any count, so that later writes there are faster.
+	Unit 0 is the SD card unless built with HOSTVER.
+*/
+typedef struct _tagBLOCKDEV {
+	uint32_t (*read)(void *ctx, uint8_t *buffer, uint32_t sector, uint32_t count);
+	uint32_t (*write)(void *ctx, uint8_t *buffer, uint32_t sector, uint32_t count);
+	uint32_t maxrun;			// largest count per call (at least 1)
+	void *ctx;					// device specific data
+	uint32_t (*readv)(void *ctx, PSECTORSEG seg, uint32_t segs, uint32_t sector);
+	uint32_t (*writev)(void *ctx, PSECTORSEG seg, uint32_t segs, uint32_t sector);
+	uint32_t (*erase)(void *ctx, uint32_t sector, uint32_t count);
+} BLOCKDEV, *PBLOCKDEV;
+
+/*
+	Attach a block device to a unit, NULL detaches the unit
+	Volumes of the unit must be mounted (DFS_GetVolInfo) again afterwards.
+	Returns 0 OK, DFS_ERRMISC if there is no such unit.
+*/
+uint32_t DFS_AttachDevice(uint8_t unit, PBLOCKDEV dev);
+
+// Transfer sectors through the device of a unit, 0 OK, nonzero for any error
 uint32_t DFS_ReadSector(uint8_t unit, uint8_t *buffer, uint32_t sector, uint32_t count);
 uint32_t DFS_WriteSector(uint8_t unit, uint8_t *buffer, uint32_t sector, uint32_t count);
 
+/*
+	Transfer consecutive sectors starting at sector from/to a list of segs buffers
+	With a scatter-gather device this is one media command as long as the segments
+	don't exceed its maxrun, otherwise the segments go one by one.
+	Returns 0 OK, nonzero for any error.
+*/
+uint32_t DFS_ReadSectorV(uint8_t unit, PSECTORSEG seg, uint32_t segs, uint32_t sector);
+uint32_t DFS_WriteSectorV(uint8_t unit, PSECTORSEG seg, uint32_t segs, uint32_t sector);
+
+/*
+	Erase count sectors starting at sector on the device of a unit, the contents
+	are undefined afterwards
+	Returns 0 OK, nonzero for any error or if the device can't erase.
+*/
+uint32_t DFS_EraseSector(uint8_t unit, uint32_t sector, uint32_t count);
+
+/*
+	Block cache of a unit (see DFS_BLKCACHE)
+	DFS_FlushCache writes the modified sectors to the device, only a write-back cache
+	has some (DFS_Sync does this too). Returns 0 OK, nonzero for any error.
+	DFS_InvalidateCache discards all cached sectors of the unit, modified ones are lost.
+*/
+uint32_t DFS_FlushCache(uint8_t unit);
+void DFS_InvalidateCache(uint8_t unit);
+
 
 //===================================================================
 // Configurable items
@@ -23,8 +89,71 @@ uint32_t DFS_WriteSector(uint8_t unit, uint8_t *buffer, uint32_t sector, uint32_
 
 #define DFS_RTC                 // SDA: If defined use the RTC
 
+#define DFS_MAXRUN      128     // Maximum number of sectors transferred by one
+								// multi-sector request (128 sectors = 64KB)
+
+#define DFS_UNITS       1       // Number of units (block devices, see DFS_AttachDevice)
+
+#define DFS_STATS               // If defined collect I/O statistics in DFS_IOStats
+
+#define DFS_FATCACHE    4       // Number of FAT sectors held in the write-back FAT
+								// cache (0 - no cache, otherwise at least 2).
+								// Each entry costs SECTOR_SIZE + 16 bytes of RAM
+
+#define DFS_FREEMAP     1024    // Size in bytes of the free cluster map (0 - no map).
+								// One bit covers a group of clusters, the group is
+								// as small as the budget allows for the volume size
+
+#define DFS_MIRRORMAP   128     // Size in bytes of the map of FAT sectors whose copy 2
+								// is out of date (0 - no map, both FAT copies are
+								// written together). With the map only copy 1 is
+								// written until DFS_SyncMirror. One bit covers a
+								// group of FAT sectors, the group is as small as
+								// the budget allows for the FAT size. Groups of
+								// one sector (up to 1024 FAT sectors with 128
+								// bytes) keep the mirror pass short
+
+#define DFS_EXTENTS     4       // Number of contiguous cluster runs remembered in
+								// each FILEINFO for fast seeks (0 - no extent map).
+								// Each entry costs 8 bytes of FILEINFO
+
+#define DFS_BLKCACHE    4       // Number of sectors held in the block cache under
+								// DFS_ReadSector/DFS_WriteSector (0 - no cache).
+								// Each entry costs SECTOR_SIZE + 12 bytes of RAM
+
+#define DFS_BLKCACHE_WB 0       // 1 - write-back block cache: single sector writes
+								// stay in RAM until evicted or DFS_FlushCache/DFS_Sync
+								// (the media may then lag behind in any order),
+								// 0 - write-through
+
+#define DFS_READAHEAD   2       // Number of sectors read ahead when single sectors
+								// are read sequentially (0 - no read-ahead, less
+								// than DFS_BLKCACHE)
+
+#define DFS_ERASE       0       // Cluster runs of at least this many sectors freed by
+								// DFS_UnlinkFile or taken by DFS_Preallocate are
+								// erased if the device can do it, later writes
+								// there skip the erase inside the card (0 - no erase)
+
+#define DFS_DIRCACHE    8       // Number of resolved names remembered by the directory
+								// lookup cache (0 - no cache). Each entry costs 36 bytes
+
+#define DFS_BUFFERS     3       // Number of sector buffers in the arena for open files
+								// (0 - no buffers, see DFS_AttachBuffer).
+								// Each buffer costs SECTOR_SIZE + 28 bytes of RAM
+
+#define DFS_DMAALIGN    1       // Alignment of a data buffer which DFS_ReadFile and
+								// DFS_WriteFile pass to the sector driver as is
+								// (1 - any). Whole sectors of a misaligned buffer
+								// are copied through scratch one at a time.
+								// The SPI driver moves bytes, so any buffer will do
+
 
 // End of configurable items
+
+#ifdef HOSTVER
+#undef DFS_RTC					// there is no RTC on the host
+#endif
 //===================================================================
 
 //===================================================================
@@ -42,6 +171,7 @@ uint32_t DFS_WriteSector(uint8_t unit, uint8_t *buffer, uint32_t sector, uint32_
 #define DFS_READ		1			// read-only
 #define DFS_WRITE		2			// write-only
 #define DFS_CREATEDIR   (2+4)       // NTRF: create directory
+#define DFS_NEWFILE     (2+8)       // create a file whose name is known to be unused
 
 //===================================================================
 // Miscellaneous constants
@@ -224,6 +354,25 @@ typedef struct _tagLBR {
 	uint8_t sig_aa;				// 0xaa signature byte
 } LBR, *PLBR;
 
+/*
+	FAT32 FSInfo sector structure
+*/
+typedef struct _tagFSINFO {
+	uint8_t leadsig[4];			// lead signature "RRaA"
+	uint8_t reserved1[480];		// reserved, should be 0
+	uint8_t strucsig[4];		// structure signature "rrAa"
+	uint8_t freecount_0;		// last known free cluster count low byte
+	uint8_t freecount_1;		// (0xffffffff - unknown)
+	uint8_t freecount_2;		//
+	uint8_t freecount_3;		// last known free cluster count high byte
+	uint8_t nextfree_0;			// cluster to start the free cluster search at, low byte
+	uint8_t nextfree_1;			// (0xffffffff - unknown)
+	uint8_t nextfree_2;			//
+	uint8_t nextfree_3;			// cluster to start the free cluster search at, high byte
+	uint8_t reserved2[12];		// reserved, should be 0
+	uint8_t trailsig[4];		// trail signature 0x00,0x00,0x55,0xaa
+} FSINFO, *PFSINFO;
+
 /*
 	Volume information structure (Internal to DOSFS)
 */
@@ -251,10 +400,19 @@ typedef struct _tagVOLINFO {
 	uint16_t sectorsize;        // sector size (in bytes)   // SDA 16.01.2015
 	uint32_t clustersize;       // cluster size (in bytes)  // SDA 16.01.2015
 
+	uint32_t freecount;         // number of free clusters (0xffffffff - unknown yet)
+	uint32_t nextfree;          // cluster to start the free cluster search at
+	uint8_t  fsinfodirty;       // nonzero if freecount/nextfree must go to FSInfo
+#if DFS_MIRRORMAP
+	uint8_t  unclean;           // nonzero if found not cleanly unmounted (FAT16/FAT32)
+	uint8_t  inuse;             // nonzero if the volume is marked as in use on the media
+#endif
+
 	// The fields below are PHYSICAL SECTOR NUMBERS.
 	uint32_t fat1;              // starting sector# of FAT copy 1
 	uint32_t rootdir;           // starting sector# of root directory (FAT12/FAT16) or cluster (FAT32)
 	uint32_t dataarea;          // starting sector# of data area (cluster #2)
+	uint32_t fsinfo;            // sector# of FSInfo sector (FAT32 only, 0 - none)
 } VOLINFO, *PVOLINFO;
 
 /*
@@ -273,6 +431,32 @@ typedef struct _tagDIRINFO {
 	uint8_t flags;				// internal DOSFS flags
 } DIRINFO, *PDIRINFO;
 
+/*
+	Contiguous run of clusters (Internal to DOSFS)
+	The runs in FILEINFO.extent[] follow each other in file order starting from the
+	first cluster of the file, so the file-relative number of the first cluster of a
+	run is the sum of the counts of the runs before it.
+*/
+typedef struct _tagEXTENT {
+	uint32_t cluster;			// first cluster of the run
+	uint32_t count;				// number of clusters in the run
+} EXTENT, *PEXTENT;
+
+/*
+	Sector buffer of an open file (Internal to DOSFS, see DFS_AttachBuffer)
+*/
+typedef struct _tagFILEBUF {
+	struct _tagFILEINFO *owner;	// file this buffer is attached to (NULL - buffer is free)
+	PVOLINFO volinfo;			// volume of the owner
+	uint32_t sector;			// physical sector held in data (0 - none)
+	uint32_t dirty;				// nonzero if data is modified and not yet written
+	uint32_t dirsector;			// directory entry of the owner, written with filelen
+	uint32_t filelen;			// when direntdirty is set (see DFS_Sync)
+	uint8_t diroffset;
+	uint8_t direntdirty;		// nonzero if the directory entry lags behind filelen
+	uint8_t data[SECTOR_SIZE];	// sector contents
+} FILEBUF, *PFILEBUF;
+
 /*
 	File handle structure (Internal to DOSFS)
 */
@@ -286,8 +470,40 @@ typedef struct _tagFILEINFO {
 
 	uint32_t cluster;			// current cluster
 	uint32_t pointer;			// current (BYTE) pointer
+#if DFS_EXTENTS
+	uint8_t extents;			// number of used entries in extent[]
+	EXTENT extent[DFS_EXTENTS];	// known part of the cluster chain (see DFS_Seek)
+#endif
+#if DFS_BUFFERS
+	PFILEBUF buf;				// sector buffer from the arena (see DFS_AttachBuffer)
+#endif
 } FILEINFO, *PFILEINFO;
 
+#ifdef DFS_STATS
+/*
+	I/O statistics (updated by DFS_ReadSector/DFS_WriteSector, the FAT cache and the
+	block cache)
+	The sectors/commands ratio shows how good the multi-sector requests are used.
+*/
+typedef struct _tagIOSTATS {
+	uint32_t rd_cmds;			// read requests issued to the media
+	uint32_t rd_sectors;		// sectors read
+	uint32_t wr_cmds;			// write requests issued to the media
+	uint32_t wr_sectors;		// sectors written
+	uint32_t fat_hits;			// FAT sector lookups served by the FAT cache
+	uint32_t fat_misses;		// FAT sector lookups which had to read the media
+	uint32_t fat_writebacks;	// dirty FAT sectors written back (see DFS_WriteFAT)
+	uint32_t blk_hits;			// single sector reads served by the block cache
+	uint32_t blk_misses;		// single sector reads which had to read the media
+	uint32_t blk_prefetched;	// sectors read ahead into the block cache
+	uint32_t blk_prefetch_hits;	// read ahead sectors asked for later
+	uint32_t er_cmds;			// erase requests issued to the media
+	uint32_t er_sectors;		// sectors erased
+} DFS_IOSTATS, *PDFS_IOSTATS;
+
+extern DFS_IOSTATS DFS_IOStats;
+#endif
+
 /*
 	Get starting sector# of specified partition on drive #unit
 	NOTE: This code ASSUMES an MBR on the disk.
@@ -304,6 +520,12 @@ uint32_t DFS_GetPtnStart(uint8_t unit, uint8_t *scratchsector, uint8_t pnum, uin
 	You must provide the unit and starting sector of the filesystem, and
 	a pointer to a sector buffer for scratch
 	Attempts to read BPB and glean information about the FS from that.
+	On FAT32 the free cluster count and next free cluster hint are taken from the
+	FSInfo sector if it is valid.
+	With DFS_MIRRORMAP volinfo->unclean tells whether the volume was left with FAT
+	changes after the last DFS_CloseFile (FAT copy 2 is then rebuilt by the next
+	DFS_SyncMirror), and the volume takes over the mirror map from the one mounted
+	before.
 	Returns 0 OK, nonzero for any error.
 */
 uint32_t DFS_GetVolInfo(uint8_t unit, uint8_t *scratchsector, uint32_t startsector, PVOLINFO volinfo);
@@ -343,12 +565,27 @@ uint32_t DFS_OpenDir(PVOLINFO volinfo, uint8_t *dirname, PDIRINFO dirinfo);
 */
 uint32_t DFS_GetNext(PVOLINFO volinfo, PDIRINFO dirinfo, PDIRENT dirent);
 
+/*
+	Find the highest number used by the file names in a directory which match a
+	pattern, in a single pass over the directory. pattern is a file name such as
+	"LOG?????.TXT" where each '?' stands for a decimal digit. *num receives the
+	highest number found (0 if no name matches). You also need to provide a pointer
+	to a sector-sized scratch buffer.
+	Returns 0 OK, nonzero for any error.
+*/
+uint32_t DFS_GetMaxNum(PVOLINFO volinfo, uint8_t *dirname, uint8_t *pattern, uint8_t *scratch, uint32_t *num);
+
 /*
 	Open a file for reading or writing. You supply populated VOLINFO, a path to the file,
 	mode (DFS_READ or DFS_WRITE) and an empty fileinfo structure. You also need to
 	provide a pointer to a sector-sized scratch buffer.
 	Returns various DFS_* error states. If the result is DFS_OK, fileinfo can be used
 	to access the file from this point on.
+	DFS_NEWFILE works like DFS_WRITE but skips the search for an existing file of that
+	name, so the caller must be sure that the name is unused (see DFS_GetMaxNum).
+	With DFS_DIRCACHE enabled recently resolved names and the end of the last
+	searched directory are remembered, so opening a known file or creating a new
+	one usually needs no directory walk.
 */
 uint32_t DFS_OpenFile(PVOLINFO volinfo, uint8_t *path, uint8_t mode, uint8_t *scratch, PFILEINFO fileinfo);
 
@@ -366,19 +603,79 @@ uint32_t DFS_ReadFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, uin
 	You must supply a prepopulated FILEINFO as provided by DFS_OpenFile, and a
 	pointer to a SECTOR_SIZE scratch buffer.
 	This function updates the successcount field with the number of bytes actually written.
+	Whole sectors go from buffer to the media directly, as multi-sector requests
+	where the cluster chain allows it (see DFS_DMAALIGN). For a file with a buffer
+	(see DFS_AttachBuffer) the file length in the directory entry is brought up to
+	date only by DFS_Sync, DFS_DetachBuffer or DFS_CloseFile, otherwise by every call.
 */
 uint32_t DFS_WriteFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, uint32_t *successcount, uint32_t len);
 
+/*
+	Preallocate space for a file opened for writing
+	Reserves a contiguous run of clusters so that the chain can hold filelen + bytes
+	bytes; the following writes inside that space need no FAT updates. The file length
+	is not changed, the unused part is released by DFS_CloseFile. With DFS_ERASE the
+	new run is erased.
+	Requires a SECTOR_SIZE scratch buffer.
+	Returns 0 OK, DFS_ERRMISC if there is no contiguous free space that long or for
+	any other error.
+*/
+uint32_t DFS_Preallocate(PFILEINFO fileinfo, uint8_t *scratch, uint32_t bytes);
+
+/*
+	Close a file
+	For a file opened for writing releases the clusters beyond the file length,
+	syncs the volume (see DFS_SyncMirror) and, with DFS_MIRRORMAP, marks it clean
+	with the clean shutdown bit in FAT entry 1 (FAT16/FAT32). The first FAT change
+	after that marks the volume as in use again, so a session which ends without
+	closing its files (e.g. power loss) is detected by DFS_GetVolInfo (see
+	volinfo->unclean). A file buffer is written back and returned to
+	the arena (see DFS_DetachBuffer). Files opened for reading without a buffer
+	need no closing.
+	Requires a SECTOR_SIZE scratch buffer.
+	Returns 0 OK, nonzero for any error.
+*/
+uint32_t DFS_CloseFile(PFILEINFO fileinfo, uint8_t *scratch);
+
+/*
+	Give an open file its own sector buffer from the arena of DFS_BUFFERS buffers
+	Partial sector reads and writes of the file then go through this buffer instead
+	of the scratch sector, and small writes to the same sector are collected in it:
+	the sector is written once it is complete, when the file moves to another
+	sector, or by DFS_Sync/DFS_DetachBuffer/DFS_CloseFile. Several files written in
+	turns thus don't reread each other's sectors. The directory entry of the file
+	is updated at these points too rather than by each DFS_WriteFile.
+	The buffer stays attached until DFS_DetachBuffer or DFS_CloseFile (or until
+	the FILEINFO is reused by DFS_OpenFile), a FILEINFO with a buffer must not be
+	discarded without one of them.
+	Returns 0 OK, DFS_ERRMISC if no buffer is free.
+*/
+uint32_t DFS_AttachBuffer(PFILEINFO fileinfo);
+
+/*
+	Write back the file buffer (if modified) and the file length to the directory
+	entry, and return the buffer to the arena
+	Returns 0 OK, nonzero for any error (the buffer stays attached then).
+*/
+uint32_t DFS_DetachBuffer(PFILEINFO fileinfo);
+
 /*
 	Seek file pointer to a given position
 	This function does not return status - refer to the fileinfo->pointer value
 	to see where the pointer wound up.
 	Requires a SECTOR_SIZE scratch buffer
+	With DFS_EXTENTS enabled the part of the cluster chain already walked by the
+	seek/read/write functions is remembered as contiguous runs, a seek into that
+	part costs no FAT access. Once the map is full the rest of the chain is walked
+	in the FAT, starting from the end of the mapped part.
 */
 void DFS_Seek(PFILEINFO fileinfo, uint32_t offset, uint8_t *scratch);
 
 /*
 	Delete a file
+	With DFS_ERASE the freed clusters are erased and the next allocation starts at
+	the first of them, so a file written next (e.g. log rotation) lands on erased
+	space.
 	scratch must point to a sector-sized buffer
 */
 uint32_t DFS_UnlinkFile(PVOLINFO volinfo, uint8_t *path, uint8_t *scratch);
@@ -389,9 +686,43 @@ uint32_t DFS_UnlinkFile(PVOLINFO volinfo, uint8_t *path, uint8_t *scratch);
 	pointer to a SECTOR_SIZE scratch buffer.
 	cfree - pointer to the variable for number of free clusters
 	Returns 0 OK, nonzero for any error.
+	Only the first call after DFS_GetVolInfo scans the FAT (unless FSInfo provided
+	the count), after that the count is maintained by DFS_SetFAT.
 */
 uint32_t DFS_GetFree(PVOLINFO volinfo, uint8_t *scratch, uint32_t *cfree);
 
+/*
+	Write back all modified FAT sectors of the volume held in the FAT cache
+	With DFS_FATCACHE enabled DFS_SetFAT only modifies the cached copy of a FAT
+	sector, so the file allocation chains reach the media when a sector is evicted
+	from the cache or when this function is called. Call it whenever the on-disk
+	state must be consistent (e.g. after writing a file and before power off).
+	Returns 0 OK, nonzero for any error.
+*/
+uint32_t DFS_FlushFAT(PVOLINFO volinfo);
+
+/*
+	Write all pending volume data to the media: the modified file buffers and the
+	directory entries of their files (see DFS_AttachBuffer), the modified FAT
+	sectors (see DFS_FlushFAT) and, on FAT32, the free cluster count and next free
+	cluster hint in the FSInfo sector.
+	With DFS_MIRRORMAP the FAT goes to copy 1 only, see DFS_SyncMirror.
+	scratch must point to a sector-sized buffer
+	Returns 0 OK, nonzero for any error.
+*/
+uint32_t DFS_Sync(PVOLINFO volinfo, uint8_t *scratch);
+
+/*
+	Sync the volume (see DFS_Sync), then copy the FAT sectors changed since the last
+	call from FAT copy 1 to copy 2 in one pass
+	Call it every now and then while writing, the longer the interval the more FAT
+	writes of copy 2 are saved. DFS_CloseFile calls it too.
+	Without DFS_MIRRORMAP this is just DFS_Sync.
+	scratch must point to a sector-sized buffer
+	Returns 0 OK, nonzero for any error.
+*/
+uint32_t DFS_SyncMirror(PVOLINFO volinfo, uint8_t *scratch);
+
 // If we are building a host-emulation version, include host support
 #ifdef HOSTVER
 #include "hostemu.h"
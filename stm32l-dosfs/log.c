@@ -20,23 +20,11 @@ uint32_t pstart;                            // Partition start sector
 FILEINFO log_file;                          // Current log file handler
 uint8_t log_data[LOG_DATA_BUF_SIZE];        // Buffer for data to write
 uint32_t log_data_pos;                      // Position in data buffer
+uint32_t log_last_num;                      // Highest log file number on the card
+bool _log_last_num;                         // TRUE if log_last_num is known
+uint32_t log_syncs;                         // LOG_FileSync() calls since the FAT mirror was updated
 
 
-uint32_t fn_atoi(char *filename) {
-	uint8_t ch;
-	uint32_t result = 0;
-
-	ch = *filename++;
-	while (ch >= '0' && ch <= '9') {
-		result += ch - '0';
-		result *= 10;
-		ch = *filename++;
-	}
-	result /= 10;
-
-	return result;
-}
-
 void fn_itoa(uint32_t num, char *filename) {
 	uint8_t i = 7;
 
@@ -54,6 +42,7 @@ LOG_Result LOG_Init(void) {
 	uint32_t result;
 
 	_logging = FALSE;
+	_log_last_num = FALSE;
 
 	pstart = DFS_GetPtnStart(0,sector,0,NULL,NULL,NULL);
 	if (pstart == DFS_ERRMISC) return LOG_NOPARTITION; // Partition not found
@@ -79,43 +68,40 @@ LOG_Result LOG_Init(void) {
 // return: LOG_XXX value (LOG_OK if file created)
 // note: pNum changed only if new log file created
 uint32_t LOG_NewFile(uint32_t *pNum) {
-	DIRENT dir_entry; // Directory entry
 	char filename[12]; // Buffer for directory entry
 	uint8_t path[64]; // Full file path
-	uint32_t log_num = 0;
+	uint32_t log_num;
 	uint32_t i;
 
-	i = DFS_OpenDir(&vol_info,(uint8_t *)LOG_DIR_LOGS,&dir_info);
-	if (i == DFS_NOTFOUND) {
-		// Unable to open logs directory, try to create it
-		// In fact, this should not be because the directory had to be created in LOG_Init()
-		i = DFS_OpenFile(&vol_info,(uint8_t *)LOG_DIR_LOGS,DFS_CREATEDIR,sector,&log_file);
-		if (i == DFS_OK) {
-			// Open created directory
-			i = DFS_OpenDir(&vol_info,(uint8_t *)LOG_DIR_LOGS,&dir_info);
-		}
-	}
-	if (i != DFS_OK) return LOG_ERROR;
-
-	// Enumerate *.LOG files and determine highest number
-	while (!DFS_GetNext(&vol_info,&dir_info,&dir_entry)) {
-		if (dir_entry.name[0] && !(dir_entry.attr & ATTR_DIRECTORY)) {
-			DFS_DirToCanonical((uint8_t *)filename,dir_entry.name);
-			if (!memcmp(&filename[0],&LOG_FILENAME_TEMPLATE[0],3) &&
-					!memcmp(&filename[8],&LOG_FILENAME_TEMPLATE[8],4)) {
-				i = fn_atoi(&filename[3]);
-				if (i > log_num) log_num = i;
-			}
+	// Find the highest log number, the directory is scanned only once after LOG_Init()
+	if (!_log_last_num) {
+		i = DFS_OpenDir(&vol_info,(uint8_t *)LOG_DIR_LOGS,&dir_info);
+		if (i == DFS_NOTFOUND) {
+			// Unable to open logs directory, try to create it
+			// In fact, this should not be because the directory had to be created in LOG_Init()
+			i = DFS_OpenFile(&vol_info,(uint8_t *)LOG_DIR_LOGS,DFS_CREATEDIR,sector,&log_file);
 		}
+		if (i == DFS_OK)
+			i = DFS_GetMaxNum(&vol_info,(uint8_t *)LOG_DIR_LOGS,(uint8_t *)LOG_FILENAME_PATTERN,sector,&log_last_num);
+		if (i != DFS_OK) return LOG_ERROR;
+		_log_last_num = TRUE;
 	}
 
 	// Create .LOG file with next number
-	log_num++;
+	// (the name is known to be unused, so DOSFS doesn't have to search for it)
+	log_num = log_last_num + 1;
 	fn_itoa(log_num,filename);
 	strcpy((char *)path,"LOGS/");
 	strcat((char *)path,filename);
-	i = DFS_OpenFile(&vol_info,(uint8_t *)path,DFS_WRITE,sector,&log_file);
+	i = DFS_OpenFile(&vol_info,(uint8_t *)path,DFS_NEWFILE,sector,&log_file);
 	if (i != DFS_OK) return LOG_CREATEERROR;
+	log_last_num = log_num;
+
+	// Keep the partial sector left by LOG_FileSync() in a buffer of the log file,
+	// so appending to it doesn't read it back (without a free buffer this just
+	// goes through the sector buffer)
+	DFS_AttachBuffer(&log_file);
+	if (DFS_Sync(&vol_info,sector) != DFS_OK) return LOG_CREATEERROR;
 
 	// Clear data buffer
 	memset(log_data,0,sizeof(log_data));
@@ -127,9 +113,10 @@ uint32_t LOG_NewFile(uint32_t *pNum) {
 	return LOG_OK;
 }
 
-// Write data buffer to SD card
+// Write data buffer to the log file
 // return: number of bytes written
-uint32_t LOG_FileSync(void) {
+// note: the FAT changes stay in the DOSFS FAT cache
+static uint32_t LOG_WriteBuffer(void) {
 	uint32_t cache = 0;
 
 	// TODO: check for DFS_WriteFile() error
@@ -139,20 +126,43 @@ uint32_t LOG_FileSync(void) {
 	return cache;
 }
 
+// Write data buffer to SD card
+// return: LOG_Result (LOG_SYNCERROR if the FAT, FSInfo or the file length could not be written)
+// note: also writes back the FAT sectors modified since the last sync and FSInfo
+LOG_Result LOG_FileSync(void) {
+	uint32_t result;
+
+	LOG_WriteBuffer();
+	// The second FAT copy is brought up to date only every LOG_MIRROR_SYNCS calls,
+	// in between the FAT changes go to the first copy only
+	if (++log_syncs >= LOG_MIRROR_SYNCS) {
+		result = DFS_SyncMirror(&vol_info,sector);
+		log_syncs = 0;
+	} else result = DFS_Sync(&vol_info,sector);
+
+	return (result == DFS_OK) ? LOG_OK : LOG_SYNCERROR;
+}
+
 // Write binary data to data buffer
 // input:
 //   buf - pointer to the buffer with binary data
 //   len - length of the buffer
-// return: number of bytes copied into data buffer
+// return: number of bytes copied into data buffer or written to the file (0 on write error)
+// note: a block of at least LOG_DATA_BUF_SIZE bytes is not copied, it goes to DOSFS
+//       right after the collected data, the file buffer takes the partial sectors
 uint32_t LOG_WriteBin(uint8_t *buf, uint32_t len) {
 	uint32_t part_len;
 
-    if (log_data_pos + len >= LOG_DATA_BUF_SIZE) {
+	if (len >= LOG_DATA_BUF_SIZE) {
+		LOG_WriteBuffer(); // FIXME: check for error here
+		if (DFS_WriteFile(&log_file,sector,buf,&part_len,len) != DFS_OK) part_len = 0;
+		len = part_len;
+	} else if (log_data_pos + len >= LOG_DATA_BUF_SIZE) {
     	// Copy part of data into data buffer and write it to SD card
 		part_len = LOG_DATA_BUF_SIZE - log_data_pos;
 		memcpy(&log_data[log_data_pos],buf,part_len);
 		log_data_pos += part_len;
-		LOG_FileSync(); // FIXME: check for error here
+		LOG_WriteBuffer(); // FIXME: check for error here
 		// Copy rest of data into data buffer
 		len -= part_len;
 		memcpy(&log_data[log_data_pos],&buf[part_len],len);
@@ -13,6 +13,8 @@
 #define SPI1_MISO_PIN_SRC  GPIO_PinSource4
 #define SPI1_MOSI_PIN_SRC  GPIO_PinSource5
 #define SPI1_GPIO_PORT     GPIOB
+#define SPI1_DMA_RX_CH     DMA1_Channel2 // SPI1_RX DMA request
+#define SPI1_DMA_TX_CH     DMA1_Channel3 // SPI1_TX DMA request
 
 // SPI2
 #define SPI2_PORT          SPI2
@@ -24,6 +26,8 @@
 #define SPI2_MISO_PIN_SRC  GPIO_PinSource14
 #define SPI2_MOSI_PIN_SRC  GPIO_PinSource15
 #define SPI2_GPIO_PORT     GPIOB
+#define SPI2_DMA_RX_CH     DMA1_Channel4 // SPI2_RX DMA request
+#define SPI2_DMA_TX_CH     DMA1_Channel5 // SPI2_TX DMA request
 
 
 #define SPI_BR_2           ((uint16_t)0x0000)    // SPI baud rate prescaler 2
@@ -35,9 +39,16 @@
 #define SPI_BR_128         ((uint16_t)0x0030)    // SPI baud rate prescaler 128
 #define SPI_BR_256         ((uint16_t)0x0038)    // SPI baud rate prescaler 256
 
+// SPI DMA TX/RX mask
+#define SPI_DMA_TX         ((uint8_t)0x01)
+#define SPI_DMA_RX         ((uint8_t)0x02)
+
 
 void SPIx_Init(SPI_TypeDef *SPI);
 void SPIx_SetSpeed(SPI_TypeDef *SPI, uint16_t prescaler);
 uint8_t SPIx_SendRecv(SPI_TypeDef *SPI, uint8_t data);
+void SPIx_Configure_DMA_TX(SPI_TypeDef *SPI, const uint8_t *pBuf, uint16_t length);
+void SPIx_Configure_DMA_RX(SPI_TypeDef *SPI, uint8_t *pBuf, uint16_t length);
+void SPIx_SetDMA(SPI_TypeDef *SPI, uint8_t SPI_DMA_DIR, FunctionalState NewState);
 
 #endif // __SPIx_H
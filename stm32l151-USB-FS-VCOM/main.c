@@ -20,6 +20,7 @@
 
 
 uint32_t i = 0;
+uint32_t ms = 0;
 
 
 int main(void) {
@@ -37,9 +38,19 @@ int main(void) {
 	USB_Init();
 
     while(1) {
-    	Delay_ms(1000);
-    	VCP_SendStr("VCP: ");
-    	VCP_SendInt(i++);
-    	VCP_SendChar('\n');
+    	Delay_ms(1);
+
+    	// Send received data back (just for fun)
+    	if (VCOM_RX_Len) {
+    		VCP_SendBuf(VCOM_RX_BUF,VCOM_RX_Len);
+    		VCOM_RX_Len = 0;
+    	}
+
+    	if (++ms == 1000) {
+    		ms = 0;
+    		VCP_SendStr("VCP: ");
+    		VCP_SendInt(i++);
+    		VCP_SendChar('\n');
+    	}
     }
 }
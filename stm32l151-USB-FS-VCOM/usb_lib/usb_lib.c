@@ -1,4 +1,5 @@
 #include "usb_lib.h"
+#include "usb_pma.h"
 
 
 // Private variables
@@ -161,19 +162,7 @@ void CTR_HP(void) {
 * Return         : None	.
 *******************************************************************************/
 void UserToPMABufferCopy(uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes) {
-	uint32_t n = (wNBytes + 1) >> 1;   /* n = (wNBytes + 1) / 2 */
-	uint32_t i, temp1, temp2;
-	uint16_t *pdwVal;
-
-	pdwVal = (uint16_t *)(wPMABufAddr * 2 + PMAAddr);
-	for (i = n; i != 0; i--) {
-		temp1 = (uint16_t)*pbUsrBuf;
-		pbUsrBuf++;
-		temp2 = temp1 | (uint16_t)*pbUsrBuf << 8;
-		*pdwVal++ = temp2;
-		pdwVal++;
-		pbUsrBuf++;
-	}
+	PMA_Write((uint32_t *)(wPMABufAddr * 2 + PMAAddr),pbUsrBuf,wNBytes);
 }
 
 /*******************************************************************************
@@ -186,15 +175,7 @@ void UserToPMABufferCopy(uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNByt
 * Return         : None.
 *******************************************************************************/
 void PMAToUserBufferCopy(uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes) {
-	uint32_t n = (wNBytes + 1) >> 1;
-	uint32_t i;
-	uint32_t *pdwVal;
-
-	pdwVal = (uint32_t *)(wPMABufAddr * 2 + PMAAddr);
-	for (i = n; i != 0; i--) {
-		*(uint16_t*)pbUsrBuf++ = *pdwVal++;
-		pbUsrBuf++;
-	}
+	PMA_Read((uint32_t *)(wPMABufAddr * 2 + PMAAddr),pbUsrBuf,wNBytes);
 }
 
 /*******************************************************************************
@@ -0,0 +1,39 @@
+// Define to prevent recursive inclusion
+#ifndef __USB_PMA_H
+#define __USB_PMA_H
+
+
+// Copy routines of the USB packet memory area (PMA) of the STM32L1 USB peripheral
+// This file and usb_pma.c are identical in every project with the USB device peripheral,
+// usb-pma-host runs them on the host against a model of the PMA.
+//
+// The PMA is 512 bytes of 16-bit memory: every halfword takes the low half of a 32-bit word
+// of the address space (PMA offset N is at USB_PMAADDR + N * 2). The PMA is written by
+// halfwords, a word read returns the halfword in the low 16 bits.
+#ifdef HOSTVER
+#include "pmasim.h"
+#else
+#include <stdint.h>
+
+// Access to the PMA
+#define PMA_WR(pPMA,value)            (*(volatile uint16_t *)(pPMA) = (uint16_t)(value))
+#define PMA_RD(pPMA)                  (*(volatile uint32_t *)(pPMA))
+
+// Access to the user buffer
+#define BUF_RD8(pBuf)                 (*(const uint8_t *)(pBuf))
+#define BUF_RD16(pBuf)                (*(const uint16_t *)(pBuf))
+#define BUF_RD32(pBuf)                (*(const uint32_t *)(pBuf))
+#define BUF_WR8(pBuf,value)           (*(uint8_t *)(pBuf) = (uint8_t)(value))
+#define BUF_WR16(pBuf,value)          (*(uint16_t *)(pBuf) = (uint16_t)(value))
+#define BUF_WR32(pBuf,value)          (*(uint32_t *)(pBuf) = (uint32_t)(value))
+
+// Offset of the user buffer from a word boundary
+#define BUF_ALIGN(pBuf)               ((uint32_t)(pBuf) & 0x03)
+#endif // HOSTVER
+
+
+// Function prototypes
+void PMA_Write(uint32_t *pPMA, const uint8_t *pBuf, uint32_t length);
+void PMA_Read(uint32_t *pPMA, uint8_t *pBuf, uint32_t length);
+
+#endif // __USB_PMA_H
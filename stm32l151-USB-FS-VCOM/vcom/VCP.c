@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "hw_config.h"
 #include "VCP.h"
 
@@ -7,27 +9,25 @@
 //   pBuf - pointer to the buffer
 //   len - length of the buffer
 void VCP_SendBuf(uint8_t *pBuf, uint32_t len) {
-	while (len--) VCP_SendChar(*pBuf++);
+	VCP_TX_Write(pBuf,len);
 }
 
 // Send string to VCP
 // input:
 //   str - pointer to the null-terminated string
 void VCP_SendStr(char *str) {
-	while (*str) VCP_SendChar(*str++);
+	VCP_TX_Write((uint8_t *)str,strlen(str));
 }
 
 // Send signed integer value as text to VCP
 // input
 //   num - integer value to send
 void VCP_SendInt(int32_t num) {
-	char str[10]; // 10 chars max for INT32_MAX
-	int i = 0;
+	char str[11]; // 10 chars max for INT32_MAX plus sign
+	uint32_t value = (num < 0) ? -(uint32_t)num : num;
+	int i = sizeof(str);
 
-	if (num < 0) {
-		VCP_SendChar('-');
-		num *= -1;
-	}
-	do str[i++] = num % 10 + '0'; while ((num /= 10) > 0);
-	while (i) VCP_SendChar(str[--i]);
+	do str[--i] = value % 10 + '0'; while ((value /= 10) > 0);
+	if (num < 0) str[--i] = '-';
+	VCP_TX_Write((uint8_t *)&str[i],sizeof(str) - i);
 }
@@ -25,6 +25,8 @@
   ******************************************************************************
   */
 
+#include <string.h>
+
 #include "usb_istr.h"
 #include "usb_lib.h"
 #include "usb_prop.h"
@@ -33,10 +35,21 @@
 #include "usb_pwr.h"
 
 
+// The USB send buffer is a single producer/single consumer ring: the main code
+// puts data at the head, the USB interrupt sends it from the tail. Both indices
+// are free running (the buffer position is index & (USB_TX_BUF_SIZE - 1)) and
+// each side writes only its own one, so no locks and no disabled interrupts
 uint8_t  USB_TX_BUF[USB_TX_BUF_SIZE]; // Data buffer for USB send
-uint32_t USB_TX_ptr_in  = 0; // Head byte in USB buffer
-uint32_t USB_TX_ptr_out = 0; // Tail byte in USB buffer
-uint32_t USB_TX_len     = 0; // Amount of data in USB buffer
+static __IO uint32_t USB_TX_head = 0; // Bytes put in the buffer (written by the producer)
+static __IO uint32_t USB_TX_resv = 0; // Bytes put plus the bytes being copied now (written by the producer)
+static __IO uint32_t USB_TX_tail = 0; // Bytes taken from the buffer (written by the USB interrupt)
+static uint8_t USB_TX_busy = 0; // IN packet is in the endpoint buffer, wait for EP1_IN_Callback
+static uint8_t USB_TX_zlp  = 0; // Last packet was a full one, the transfer must be terminated
+static uint8_t USB_TX_policy = VCP_TX_POLICY; // What to do with data that doesn't fit
+__IO uint32_t VCP_TX_Lost = 0; // Bytes dropped or overwritten before being sent
+
+// Data memory barrier, the compiler must not move memory accesses across it either
+#define VCP_DMB()             __ASM volatile ("dmb" ::: "memory")
 
 
 static void IntToUnicode(uint32_t value, uint8_t *pbuf, uint8_t len);
@@ -173,46 +186,168 @@ static void IntToUnicode(uint32_t value, uint8_t *pbuf, uint8_t len) {
 	}
 }
 
+// Put an IN packet from the USB buffer to the endpoint
+// input:
+//   full - only a full packet can be sent, otherwise send what is in the buffer
+//          or a zero length packet to end the transfer
+// note: called from the USB interrupt only
+static void VCP_TX_Packet(uint8_t full) {
+	static uint8_t packet[VIRTUAL_COM_PORT_DATA_SIZE]; // Packet wrapped around the buffer end
+	uint32_t tail;
+	uint32_t len;
+	uint32_t pos;
+	uint32_t part;
+
+	if (USB_TX_busy) return;
+
+	// The bytes the producer is overwriting right now are lost (VCP_TX_OVERWRITE)
+	tail = USB_TX_tail;
+	if ((int32_t)(USB_TX_resv - USB_TX_BUF_SIZE - tail) > 0) tail = USB_TX_resv - USB_TX_BUF_SIZE;
+	len = USB_TX_head - tail;
+	VCP_DMB();
+
+	if (len >= VIRTUAL_COM_PORT_DATA_SIZE) {
+		len = VIRTUAL_COM_PORT_DATA_SIZE;
+	} else if (full || (!len && !USB_TX_zlp)) return;
+
+	// The whole packet goes to the PMA now, so the tail moves past it at once
+	pos  = tail & (USB_TX_BUF_SIZE - 1);
+	part = USB_TX_BUF_SIZE - pos;
+	if (part >= len) {
+		UserToPMABufferCopy(&USB_TX_BUF[pos],ENDP1_TXADDR,len);
+	} else {
+		memcpy(packet,&USB_TX_BUF[pos],part);
+		memcpy(&packet[part],USB_TX_BUF,len - part);
+		UserToPMABufferCopy(packet,ENDP1_TXADDR,len);
+	}
+	USB_TX_tail = tail + len;
+	USB_TX_zlp  = (len == VIRTUAL_COM_PORT_DATA_SIZE);
+	USB_TX_busy = 1;
+
+	SetEPTxCount(ENDP1,len);
+	SetEPTxValid(ENDP1);
+}
+
 // Send data from buffer to USB
-// author: MCD Application Team
+// Called every few frames: sends a packet with whatever is in the buffer, the
+// full packets in between are sent by VCP_TX_Complete as soon as the previous
+// one is gone
 void Handle_USBAsynchXfer(void) {
-	uint16_t tx_ptr; // Pointer to first byte in USB buffer
-	uint16_t tx_len; // Amount of data to be transfered
+	VCP_TX_Packet(0);
+}
+
+// IN packet sent, continue with the next one if a full packet is waiting
+// note: called from EP1_IN_Callback
+void VCP_TX_Complete(void) {
+	USB_TX_busy = 0;
+	VCP_TX_Packet(1);
+}
 
-	if (USB_TX_ptr_out == USB_TX_BUF_SIZE) USB_TX_ptr_out = 0;
-	if (USB_TX_ptr_out == USB_TX_ptr_in) return; // Nothing to send
+// Forget the packet in the endpoint buffer after the USB reset
+// note: the data in the USB buffer is kept and sent after the configuration
+void VCP_TX_Reset(void) {
+	USB_TX_busy = 0;
+	USB_TX_zlp  = 0;
+}
 
-	if (USB_TX_ptr_out > USB_TX_ptr_in) {
-		// rollback
-		USB_TX_len = USB_TX_BUF_SIZE - USB_TX_ptr_out;
+// Select what VCP_TX_Write does with the data that doesn't fit into the USB buffer
+// input:
+//   policy - one of VCP_TX_BLOCK, VCP_TX_DROP, VCP_TX_OVERWRITE
+void VCP_TX_SetPolicy(uint8_t policy) {
+	USB_TX_policy = policy;
+}
+
+// Copy data to the USB buffer at the head and publish it
+// input:
+//   pBuf - pointer to the data
+//   len - number of bytes, at most USB_TX_BUF_SIZE
+static void VCP_TX_Put(const uint8_t *pBuf, uint32_t len) {
+	uint32_t head = USB_TX_head;
+	uint32_t pos  = head & (USB_TX_BUF_SIZE - 1);
+	uint32_t part = USB_TX_BUF_SIZE - pos;
+
+	// Announce the bytes to be overwritten before touching them
+	USB_TX_resv = head + len;
+	VCP_DMB();
+	if (part >= len) {
+		memcpy(&USB_TX_BUF[pos],pBuf,len);
 	} else {
-		USB_TX_len = USB_TX_ptr_in - USB_TX_ptr_out;
+		memcpy(&USB_TX_BUF[pos],pBuf,part);
+		memcpy(USB_TX_BUF,pBuf + part,len - part);
 	}
+	VCP_DMB();
+	USB_TX_head = head + len;
+}
 
-	if (USB_TX_len > VIRTUAL_COM_PORT_DATA_SIZE) {
-		tx_ptr = USB_TX_ptr_out;
-		tx_len = VIRTUAL_COM_PORT_DATA_SIZE;
-		USB_TX_ptr_out += VIRTUAL_COM_PORT_DATA_SIZE;
-		USB_TX_len -= VIRTUAL_COM_PORT_DATA_SIZE;
-	} else {
-		tx_ptr = USB_TX_ptr_out;
-		tx_len = USB_TX_len;
-		USB_TX_ptr_out += USB_TX_len;
-		USB_TX_len = 0;
+// Put data into the USB buffer
+// input:
+//   pBuf - pointer to the data
+//   len - number of bytes
+// return: number of bytes queued, the rest is counted in VCP_TX_Lost
+// note: the only producer of the USB buffer, call it from the main code only
+//       (VCP_TX_BLOCK waits for the USB interrupt)
+uint32_t VCP_TX_Write(const uint8_t *pBuf, uint32_t len) {
+	static uint8_t  stalled = 0; // Blocking write timed out, drop until the host reads again
+	static uint32_t stalled_tail;
+	uint32_t done = 0;
+	uint32_t tail;
+	uint32_t used;
+	uint32_t part;
+	uint32_t wait_tail = 0;
+	uint16_t wait_frame = 0;
+	uint8_t  waiting = 0;
+
+	if (USB_TX_policy == VCP_TX_OVERWRITE) {
+		// Only the last USB_TX_BUF_SIZE bytes can survive
+		if (len > USB_TX_BUF_SIZE) {
+			VCP_TX_Lost += len - USB_TX_BUF_SIZE;
+			pBuf += len - USB_TX_BUF_SIZE;
+			done  = len - USB_TX_BUF_SIZE;
+			len   = USB_TX_BUF_SIZE;
+		}
+		used = USB_TX_head - USB_TX_tail;
+		if (used > USB_TX_BUF_SIZE) used = USB_TX_BUF_SIZE;
+		if (used + len > USB_TX_BUF_SIZE) VCP_TX_Lost += used + len - USB_TX_BUF_SIZE;
+		VCP_TX_Put(pBuf,len);
+
+		return done + len;
 	}
 
-	UserToPMABufferCopy(&USB_TX_BUF[tx_ptr],ENDP1_TXADDR,tx_len);
-	SetEPTxCount(ENDP1,tx_len);
-	SetEPTxValid(ENDP1);
+	if (stalled && (USB_TX_tail != stalled_tail)) stalled = 0;
+	while (len) {
+		tail = USB_TX_tail;
+		used = USB_TX_head - tail;
+		part = (used < USB_TX_BUF_SIZE) ? USB_TX_BUF_SIZE - used : 0;
+		if (part > len) part = len;
+		if (part) {
+			VCP_TX_Put(pBuf,part);
+			pBuf += part;
+			done += part;
+			len  -= part;
+		} else if (USB_TX_policy == VCP_TX_DROP || bDeviceState != CONFIGURED || stalled) {
+			// Nobody will free the buffer while the device is not configured
+			VCP_TX_Lost += len;
+			break;
+		} else if (!waiting || (tail != wait_tail)) {
+			// The host took some data, wait for the next packet
+			waiting = 1;
+			wait_tail = tail;
+			wait_frame = *FNR & FNR_FN;
+		} else if (((*FNR - wait_frame) & FNR_FN) >= VCP_TX_TIMEOUT) {
+			// The host doesn't read (the port is not open), don't hang the caller
+			stalled = 1;
+			stalled_tail = tail;
+			VCP_TX_Lost += len;
+			break;
+		}
+	}
+
+	return done;
 }
 
 // Send single byte to VCOM
 // input:
 //   data - byte to send
 void VCP_SendChar(uint8_t data) {
-	// Put byte into data buffer
-	USB_TX_BUF[USB_TX_ptr_in++] = data;
-
-	// To avoid buffer overflow
-	if (USB_TX_ptr_in >= USB_TX_BUF_SIZE) USB_TX_ptr_in = 0;
+	VCP_TX_Write(&data,1);
 }
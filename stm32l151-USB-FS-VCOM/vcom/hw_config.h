@@ -40,13 +40,22 @@
 
 
 // Exported defines
-#define USB_TX_BUF_SIZE       2048        // Size of USB data buffer (to send data to USB)
+#define USB_TX_BUF_SIZE       2048        // Size of USB data buffer (to send data to USB), must be a power of 2
 #define USB_EXTI_LINE         1 << 18     // USB EXTI line
 
+// What VCP_TX_Write does with the data that doesn't fit into the USB buffer
+#define VCP_TX_BLOCK          0           // Wait for the USB to send it (dropped while the device is not configured)
+#define VCP_TX_DROP           1           // Drop the new data
+#define VCP_TX_OVERWRITE      2           // Drop the oldest data not sent yet
+#define VCP_TX_POLICY         VCP_TX_DROP // Policy after the reset
+#define VCP_TX_TIMEOUT        100         // VCP_TX_BLOCK drops the data when the host takes nothing for this many frames (< 2048)
+
 
 // External variables
-extern uint8_t  USB_TX_Buf[USB_TX_BUF_SIZE]; // Data buffer for USB send
-extern uint32_t USB_TX_Len; // Count of bytes in USB buffer
+extern uint8_t  USB_TX_BUF[USB_TX_BUF_SIZE]; // Data buffer for USB send
+extern __IO uint32_t VCP_TX_Lost; // Bytes dropped or overwritten before being sent
+extern uint8_t  VCOM_RX_BUF[]; // Receive buffer for virtual COM port
+extern __IO uint16_t VCOM_RX_Len; // Bytes in the receive buffer, 0 when it's free
 
 
 // Functions prototypes
@@ -58,6 +67,10 @@ void Leave_LowPowerMode(void);
 void USB_Cable_Config(FunctionalState NewState);
 void Handle_USBAsynchXfer (void);
 void Get_SerialNum(void);
+void VCP_TX_Complete(void);
+void VCP_TX_Reset(void);
+void VCP_TX_SetPolicy(uint8_t policy);
+uint32_t VCP_TX_Write(const uint8_t *pBuf, uint32_t len);
 void VCP_SendChar(uint8_t data);
 
 #endif  // __HW_CONFIG_H
@@ -38,6 +38,7 @@
 
 // Receive buffer for virtual COM port
 uint8_t VCOM_RX_BUF[VIRTUAL_COM_PORT_DATA_SIZE];
+__IO uint16_t VCOM_RX_Len = 0; // Bytes in the receive buffer, the main code zeroes it when done
 
 
 /*******************************************************************************
@@ -48,7 +49,7 @@ uint8_t VCOM_RX_BUF[VIRTUAL_COM_PORT_DATA_SIZE];
 * Return         : None.
 *******************************************************************************/
 void EP1_IN_Callback (void) {
-	Handle_USBAsynchXfer();
+	VCP_TX_Complete();
 }
 
 /*******************************************************************************
@@ -59,20 +60,12 @@ void EP1_IN_Callback (void) {
 * Return         : None.
 *******************************************************************************/
 void EP3_OUT_Callback(void) {
-	uint16_t USB_Rx_Cntr;
-	uint8_t *ptr = VCOM_RX_BUF;
-
 	// Get the received data buffer and update the counter
-	USB_Rx_Cntr = USB_SIL_Read(EP3_OUT,VCOM_RX_BUF);
-
-	// USB data will be immediately processed, this allow next USB traffic
-	// being NAKed till the end of the USART Xfer
-
-	// Send received data back (just for fun)
-	while (USB_Rx_Cntr--) VCP_SendChar(*ptr++);
+	VCOM_RX_Len = USB_SIL_Read(EP3_OUT,VCOM_RX_BUF);
 
-	// Enable the receive of data on EP3
-	SetEPRxValid(ENDP3);
+	// The main code takes the data, the next USB traffic is NAKed till then
+	// (SOF_Callback enables the endpoint again), an empty packet is consumed here
+	if (!VCOM_RX_Len) SetEPRxValid(ENDP3);
 }
 
 /*******************************************************************************
@@ -86,6 +79,8 @@ void SOF_Callback(void) {
 	static uint32_t FrameCount = 0;
 
 	if(bDeviceState == CONFIGURED) {
+		// Receive buffer is free again
+		if (!VCOM_RX_Len && GetEPRxStatus(ENDP3) == EP_RX_NAK) SetEPRxValid(ENDP3);
 		if (FrameCount++ == VCOMPORT_IN_FRAME_INTERVAL) {
 			// Reset the frame counter
 			FrameCount = 0;
@@ -148,6 +148,7 @@ void Virtual_Com_Port_Reset(void) {
 	SetEPTxAddr(ENDP1,ENDP1_TXADDR);
 	SetEPTxStatus(ENDP1,EP_TX_NAK);
 	SetEPRxStatus(ENDP1,EP_RX_DIS);
+	VCP_TX_Reset();
 
 	// Initialize Endpoint 2
 	SetEPType(ENDP2,EP_INTERRUPT);
@@ -115,6 +115,682 @@ uint32_t DFS_GetPtnStart(uint8_t unit, uint8_t *scratchsector, uint8_t pnum, uin
 	return result;
 }
 
+#if DFS_MIRRORMAP
+/*
+	Map of the FAT sectors whose copy 2 is behind copy 1
+	Each bit covers a group of (1 << DFS_MirrorShift) FAT sectors, 1 - the copy 2
+	of some sector in the group may be out of date. DFS_WriteFAT sets the bits,
+	DFS_SyncMirror copies the groups and clears them. The map belongs to the volume
+	most recently mounted by DFS_GetVolInfo, any other volume gets both FAT copies
+	written at once.
+*/
+static uint8_t DFS_MirrorMap[DFS_MIRRORMAP];
+static PVOLINFO DFS_MirrorVol;
+static uint8_t DFS_MirrorShift;
+
+#define DFS_MIRROR_TEST(group)     (DFS_MirrorMap[(group) >> 3] &   (1 << ((group) & 7)))
+#define DFS_MIRROR_SET(group)      (DFS_MirrorMap[(group) >> 3] |=  (1 << ((group) & 7)))
+#define DFS_MIRROR_CLEAR(group)    (DFS_MirrorMap[(group) >> 3] &= ~(1 << ((group) & 7)))
+
+/*
+	Take the mirror map over for a volume
+	The group size is the smallest power of two which makes the map of the whole
+	FAT fit in DFS_MIRRORMAP bytes. If stale is nonzero, copy 2 can't be trusted
+	anywhere and the whole FAT is marked.
+*/
+static void DFS_MirrorInit(PVOLINFO volinfo, uint32_t stale)
+{
+	DFS_MirrorShift = 0;
+	while (((volinfo->secperfat - 1) >> DFS_MirrorShift) >= DFS_MIRRORMAP * 8)
+		DFS_MirrorShift++;
+	memset(DFS_MirrorMap, stale ? 0xff : 0, DFS_MIRRORMAP);
+	DFS_MirrorVol = volinfo;
+}
+
+/*
+	Clean shutdown bit of FAT entry 1 (set - the volume is clean), 0 for FAT12
+	which has no such bit
+*/
+static uint32_t DFS_CleanBit(PVOLINFO volinfo)
+{
+	if (volinfo->filesystem == FAT16)
+		return 0x00008000;
+	if (volinfo->filesystem == FAT32)
+		return 0x08000000;
+	return 0;
+}
+#endif // DFS_MIRRORMAP
+
+/*
+	Write consecutive FAT sectors (physical sector number of the first one in FAT
+	copy 1) from a list of buffers to copy 1 and mirror them into copy 2. With
+	DFS_MIRRORMAP copy 2 is left for DFS_SyncMirror.
+	Returns 0 OK, nonzero for any error.
+*/
+static uint32_t DFS_WriteFATRun(PVOLINFO volinfo, PSECTORSEG seg, uint32_t segs, uint32_t sector)
+{
+	if (DFS_WriteSectorV(volinfo->unit, seg, segs, sector))
+		return DFS_ERRMISC;
+
+#if DFS_MIRRORMAP
+	if (DFS_MirrorVol == volinfo) {
+		uint32_t i, count = 0;
+
+		for (i = 0; i < segs; i++)
+			count += seg[i].count;
+		for (i = 0; i < count; i++)
+			DFS_MIRROR_SET((sector + i - volinfo->fat1) >> DFS_MirrorShift);
+		return DFS_OK;
+	}
+#endif
+
+	// mirror the FAT into copy 2
+	return DFS_WriteSectorV(volinfo->unit, seg, segs, sector + volinfo->secperfat);
+}
+
+/*
+	Write a FAT sector (physical sector number in FAT copy 1) to both FAT copies,
+	see DFS_WriteFATRun
+	Returns 0 OK, nonzero for any error.
+*/
+static uint32_t DFS_WriteFAT(PVOLINFO volinfo, uint8_t *data, uint32_t sector)
+{
+	SECTORSEG seg;
+
+	seg.buffer = data;
+	seg.count = 1;
+
+	return DFS_WriteFATRun(volinfo, &seg, 1, sector);
+}
+
+#if DFS_FATCACHE
+#if DFS_FATCACHE < 2
+#error "DFS_FATCACHE must be 0 or at least 2 (a FAT12 entry may span two sectors)"
+#endif
+
+/*
+	Write-back FAT sector cache
+	DFS_GetFAT/DFS_SetFAT work on the cached copies of the FAT sectors. A modified
+	sector is written (to both FAT copies) only when it is evicted from the cache or
+	by DFS_FlushFAT(), so linking a chain of clusters costs one FAT write per dirty
+	sector instead of a read and two writes per cluster.
+	The least recently used entry is replaced on a miss.
+*/
+typedef struct _tagFATCACHE {
+	PVOLINFO volinfo;			// volume this sector belongs to (NULL - entry is unused)
+	uint32_t sector;			// physical sector number (in FAT copy 1)
+	uint32_t stamp;				// time of last access, for LRU replacement
+	uint32_t dirty;				// nonzero if the sector is modified and not yet written
+	uint8_t data[SECTOR_SIZE];	// sector contents
+} FATCACHE, *PFATCACHE;
+
+static FATCACHE DFS_FATCache[DFS_FATCACHE];
+static uint32_t DFS_FATCacheStamp;
+
+/*
+	Write a dirty FAT cache entry back to the media
+	Returns 0 OK, nonzero for any error (the entry remains dirty).
+*/
+static uint32_t DFS_FATCacheWriteBack(PFATCACHE fc)
+{
+	uint32_t result;
+
+	result = DFS_WriteFAT(fc->volinfo, fc->data, fc->sector);
+	if (DFS_OK == result)
+		fc->dirty = 0;
+#ifdef DFS_STATS
+	DFS_IOStats.fat_writebacks++;
+#endif
+
+	return result;
+}
+
+/*
+	Look up a FAT sector in the cache, reading it from the media on a miss
+	Returns pointer to the cache entry, or NULL for any error.
+*/
+static PFATCACHE DFS_FATCacheGet(PVOLINFO volinfo, uint32_t sector)
+{
+	PFATCACHE fc, victim = DFS_FATCache;
+
+	for (fc = DFS_FATCache; fc < DFS_FATCache + DFS_FATCACHE; fc++) {
+		if (fc->volinfo == volinfo && fc->sector == sector) {
+#ifdef DFS_STATS
+			DFS_IOStats.fat_hits++;
+#endif
+			fc->stamp = ++DFS_FATCacheStamp;
+			return fc;
+		}
+		// Prefer an unused entry, otherwise the least recently used one
+		if (!fc->volinfo)
+			victim = fc;
+		else if (victim->volinfo && fc->stamp < victim->stamp)
+			victim = fc;
+	}
+
+#ifdef DFS_STATS
+	DFS_IOStats.fat_misses++;
+#endif
+	if (victim->volinfo && victim->dirty && DFS_FATCacheWriteBack(victim))
+		return NULL;
+
+	if (DFS_ReadSector(volinfo->unit, victim->data, sector, 1)) {
+		// avoid anyone assuming that this entry is still valid, which
+		// might cause disk corruption
+		victim->volinfo = NULL;
+		return NULL;
+	}
+	victim->volinfo = volinfo;
+	victim->sector = sector;
+	victim->dirty = 0;
+	victim->stamp = ++DFS_FATCacheStamp;
+
+	return victim;
+}
+#endif // DFS_FATCACHE
+
+/*
+	Write the length (and the last write time) of a file into its directory entry
+	scratch must point to a sector-sized buffer
+	Returns 0 OK, nonzero for any error.
+*/
+static uint32_t DFS_UpdateDirEnt(PVOLINFO volinfo, uint8_t *scratch, uint32_t dirsector, uint8_t diroffset, uint32_t filelen)
+{
+	if (DFS_ReadSector(volinfo->unit, scratch, dirsector, 1)) return DFS_ERRMISC;
+	((PDIRENT) scratch)[diroffset].filesize_0 =  filelen & 0x000000ff;
+	((PDIRENT) scratch)[diroffset].filesize_1 = (filelen & 0x0000ff00) >> 8;
+	((PDIRENT) scratch)[diroffset].filesize_2 = (filelen & 0x00ff0000) >> 16;
+	((PDIRENT) scratch)[diroffset].filesize_3 = (filelen & 0xff000000) >> 24;
+
+#ifdef DFS_RTC
+	// SDA 21.08.14: use current RTC date/time for file last write date/time
+
+//	RTC_TimeTypeDef RTC_Time;
+//	RTC_DateTypeDef RTC_Date;
+
+//	RTC_GetDateTime(&RTC_Time,&RTC_Date);
+
+	// RTC_Time and RTC_Date structures are populated every second by RTC_WKUP IRQ handler
+
+	// Last write date/time
+	((PDIRENT) scratch)[diroffset].wrttime = DFS_FATTime(&RTC_Time);
+	((PDIRENT) scratch)[diroffset].wrtdate = DFS_FATDate(&RTC_Date);
+#endif
+
+	if (DFS_WriteSector(volinfo->unit, scratch, dirsector, 1)) return DFS_ERRMISC;
+	return DFS_OK;
+}
+
+#if DFS_BUFFERS
+/*
+	File buffer arena
+	A file with a buffer attached keeps its current partial sector there, so its
+	small reads and writes neither go to the media every time nor disturb the
+	caller's scratch sector. A modified buffer is written when its sector is
+	complete, when the file moves on to another sector, and by DFS_Sync or
+	DFS_DetachBuffer.
+*/
+static FILEBUF DFS_FileBufs[DFS_BUFFERS];
+
+/*
+	Buffer attached to an open file, NULL if there is none
+	(a buffer taken back by DFS_GetVolInfo no longer names the file as its owner)
+*/
+static PFILEBUF DFS_FileBuf(PFILEINFO fileinfo)
+{
+	if (fileinfo->buf && fileinfo->buf->owner == fileinfo)
+		return fileinfo->buf;
+
+	return NULL;
+}
+
+/*
+	Write a file buffer to the media if it is modified
+	Returns 0 OK, nonzero for any error (the buffer remains dirty).
+*/
+static uint32_t DFS_FileBufWriteBack(PFILEBUF fb)
+{
+	if (fb->dirty) {
+		if (DFS_WriteSector(fb->volinfo->unit, fb->data, fb->sector, 1))
+			return DFS_ERRMISC;
+		fb->dirty = 0;
+	}
+
+	return DFS_OK;
+}
+
+/*
+	Make a file buffer hold the specified sector, writing back the sector it held
+	so far. The sector is read from the media only if load is nonzero, otherwise
+	it starts out zeroed (no file data in it yet).
+	Returns 0 OK, nonzero for any error.
+*/
+static uint32_t DFS_FileBufLoad(PFILEBUF fb, uint32_t sector, uint32_t load)
+{
+	if (fb->sector == sector)
+		return DFS_OK;
+
+	if (DFS_FileBufWriteBack(fb))
+		return DFS_ERRMISC;
+
+	fb->sector = 0;
+	if (load) {
+		if (DFS_ReadSector(fb->volinfo->unit, fb->data, sector, 1))
+			return DFS_ERRMISC;
+	}
+	else
+		memset(fb->data, 0, SECTOR_SIZE);
+	fb->sector = sector;
+
+	return DFS_OK;
+}
+
+/*
+	Write a file buffer and the directory entry of its file to the media and
+	return the buffer to the arena. The buffer serves as scratch for the
+	directory sector.
+	Returns 0 OK, nonzero for any error (the buffer stays attached).
+*/
+static uint32_t DFS_FileBufRelease(PFILEBUF fb)
+{
+	if (DFS_FileBufWriteBack(fb))
+		return DFS_ERRMISC;
+
+	if (fb->direntdirty) {
+		fb->sector = 0;
+		if (DFS_UpdateDirEnt(fb->volinfo, fb->data, fb->dirsector, fb->diroffset, fb->filelen))
+			return DFS_ERRMISC;
+		fb->direntdirty = 0;
+	}
+	fb->owner = NULL;
+
+	return DFS_OK;
+}
+#endif // DFS_BUFFERS
+
+/*
+	Give an open file its own sector buffer from the arena
+	Returns 0 OK, DFS_ERRMISC if no buffer is free.
+*/
+uint32_t DFS_AttachBuffer(PFILEINFO fileinfo)
+{
+#if DFS_BUFFERS
+	PFILEBUF fb, found = NULL;
+
+	// Attaching twice just empties the buffer
+	if (DFS_DetachBuffer(fileinfo))
+		return DFS_ERRMISC;
+
+	for (fb = DFS_FileBufs; fb < DFS_FileBufs + DFS_BUFFERS && !found; fb++)
+		if (!fb->owner)
+			found = fb;
+	if (!found)
+		return DFS_ERRMISC;
+
+	found->owner = fileinfo;
+	found->volinfo = fileinfo->volinfo;
+	found->sector = 0;
+	found->dirty = 0;
+	found->dirsector = fileinfo->dirsector;
+	found->diroffset = fileinfo->diroffset;
+	found->direntdirty = 0;
+	fileinfo->buf = found;
+
+	return DFS_OK;
+#else
+	return DFS_ERRMISC;
+#endif
+}
+
+/*
+	Write back the buffer of a file and return it to the arena
+	Returns 0 OK, nonzero for any error.
+*/
+uint32_t DFS_DetachBuffer(PFILEINFO fileinfo)
+{
+#if DFS_BUFFERS
+	PFILEBUF fb = DFS_FileBuf(fileinfo);
+
+	if (fb && DFS_FileBufRelease(fb))
+		return DFS_ERRMISC;
+	fileinfo->buf = NULL;
+#endif
+
+	return DFS_OK;
+}
+
+/*
+	Write back all modified FAT sectors of the volume held in the FAT cache
+	Dirty sectors with consecutive numbers are written by one request (per FAT
+	copy) straight from their cache entries.
+	Returns 0 OK, nonzero for any error.
+*/
+uint32_t DFS_FlushFAT(PVOLINFO volinfo)
+{
+	uint32_t result = DFS_OK;
+#if DFS_FATCACHE
+	PFATCACHE fc;
+	PFATCACHE run[DFS_FATCACHE];
+	SECTORSEG seg[DFS_FATCACHE];
+	uint32_t i, n;
+
+	while (result == DFS_OK) {
+		// The lowest dirty sector starts a run
+		run[0] = NULL;
+		for (fc = DFS_FATCache; fc < DFS_FATCache + DFS_FATCACHE; fc++)
+			if (fc->volinfo == volinfo && fc->dirty && (!run[0] || fc->sector < run[0]->sector))
+				run[0] = fc;
+		if (!run[0])
+			break;
+
+		// and the dirty sectors right behind it join
+		for (n = 1; n < DFS_FATCACHE; n++) {
+			run[n] = NULL;
+			for (fc = DFS_FATCache; fc < DFS_FATCache + DFS_FATCACHE; fc++)
+				if (fc->volinfo == volinfo && fc->dirty && fc->sector == run[n - 1]->sector + 1)
+					run[n] = fc;
+			if (!run[n])
+				break;
+		}
+
+		for (i = 0; i < n; i++) {
+			seg[i].buffer = run[i]->data;
+			seg[i].count = 1;
+		}
+		// entries which could not be written remain dirty
+		result = DFS_WriteFATRun(volinfo, seg, n, run[0]->sector);
+		if (DFS_OK == result)
+			for (i = 0; i < n; i++)
+				run[i]->dirty = 0;
+#ifdef DFS_STATS
+		DFS_IOStats.fat_writebacks += n;
+#endif
+	}
+#endif
+
+	return result;
+}
+
+/*
+	Write all pending volume data to the media: the modified file buffers, the
+	modified FAT sectors and, on FAT32, the free cluster count and next free
+	cluster hint in FSInfo
+	scratch must point to a sector-sized buffer
+	Returns 0 OK, nonzero for any error.
+*/
+uint32_t DFS_Sync(PVOLINFO volinfo, uint8_t *scratch)
+{
+	PFSINFO fsi = (PFSINFO) scratch;
+#if DFS_BUFFERS
+	PFILEBUF fb;
+
+	// File data first, the FAT must never point to clusters with stale contents
+	for (fb = DFS_FileBufs; fb < DFS_FileBufs + DFS_BUFFERS; fb++) {
+		if (!fb->owner || fb->volinfo != volinfo)
+			continue;
+		if (DFS_FileBufWriteBack(fb))
+			return DFS_ERRMISC;
+		if (fb->direntdirty) {
+			if (DFS_UpdateDirEnt(volinfo, scratch, fb->dirsector, fb->diroffset, fb->filelen))
+				return DFS_ERRMISC;
+			fb->direntdirty = 0;
+		}
+	}
+#endif
+
+	if (DFS_FlushFAT(volinfo))
+		return DFS_ERRMISC;
+
+	if (volinfo->fsinfo && volinfo->fsinfodirty) {
+		// All other fields of FSInfo are constant, so build the sector from scratch
+		// rather than read it first
+		memset(scratch, 0, SECTOR_SIZE);
+		memcpy(fsi->leadsig, "RRaA", 4);
+		memcpy(fsi->strucsig, "rrAa", 4);
+		fsi->freecount_0 = volinfo->freecount & 0xff;
+		fsi->freecount_1 = (volinfo->freecount & 0xff00) >> 8;
+		fsi->freecount_2 = (volinfo->freecount & 0xff0000) >> 16;
+		fsi->freecount_3 = (volinfo->freecount & 0xff000000) >> 24;
+		fsi->nextfree_0 = volinfo->nextfree & 0xff;
+		fsi->nextfree_1 = (volinfo->nextfree & 0xff00) >> 8;
+		fsi->nextfree_2 = (volinfo->nextfree & 0xff0000) >> 16;
+		fsi->nextfree_3 = (volinfo->nextfree & 0xff000000) >> 24;
+		fsi->trailsig[2] = 0x55;
+		fsi->trailsig[3] = 0xaa;
+		if (DFS_WriteSector(volinfo->unit, scratch, volinfo->fsinfo, 1))
+			return DFS_ERRMISC;
+		volinfo->fsinfodirty = 0;
+	}
+
+	// A write-back block cache may still hold some of the sectors written above
+	if (DFS_FlushCache(volinfo->unit))
+		return DFS_ERRMISC;
+
+	return DFS_OK;
+}
+
+#if DFS_FREEMAP
+/*
+	Free cluster map
+	Each bit covers a group of (1 << DFS_FreeMapShift) clusters: 1 - the group may
+	contain free clusters, 0 - all clusters of the group are in use. The map starts
+	with all groups marked as "may be free" and is refined lazily: DFS_GetFreeFAT
+	clears the groups it has found full, DFS_GetFree rebuilds the whole map while
+	counting and DFS_SetFAT marks the group of every released cluster.
+	The map belongs to the volume most recently mounted by DFS_GetVolInfo.
+*/
+static uint8_t DFS_FreeMap[DFS_FREEMAP];
+static PVOLINFO DFS_FreeMapVol;
+static uint8_t DFS_FreeMapShift;
+
+#define DFS_FREEMAP_GROUP(cluster) (((cluster) - 2) >> DFS_FreeMapShift)
+#define DFS_FREEMAP_TEST(group)    (DFS_FreeMap[(group) >> 3] &   (1 << ((group) & 7)))
+#define DFS_FREEMAP_SET(group)     (DFS_FreeMap[(group) >> 3] |=  (1 << ((group) & 7)))
+#define DFS_FREEMAP_CLEAR(group)   (DFS_FreeMap[(group) >> 3] &= ~(1 << ((group) & 7)))
+
+/*
+	Take the free cluster map over for a volume
+	The group size is the smallest power of two which makes the map of the whole
+	volume fit in DFS_FREEMAP bytes.
+*/
+static void DFS_FreeMapInit(PVOLINFO volinfo)
+{
+	DFS_FreeMapShift = 0;
+	while (((volinfo->numclusters - 1) >> DFS_FreeMapShift) >= DFS_FREEMAP * 8)
+		DFS_FreeMapShift++;
+	memset(DFS_FreeMap, 0xff, DFS_FREEMAP);
+	DFS_FreeMapVol = volinfo;
+}
+#endif // DFS_FREEMAP
+
+/*
+	Account a change of the FAT entry for the specified cluster in the free cluster
+	count and the free cluster map
+*/
+static void DFS_FreeUpdate(PVOLINFO volinfo, uint32_t cluster, uint32_t old_contents, uint32_t new_contents)
+{
+	if (volinfo->freecount != 0xffffffff) {
+		if (!old_contents && new_contents) {
+			volinfo->freecount--;
+			volinfo->fsinfodirty = 1;
+		}
+		else if (old_contents && !new_contents) {
+			volinfo->freecount++;
+			volinfo->fsinfodirty = 1;
+		}
+	}
+#if DFS_FREEMAP
+	if (!new_contents && DFS_FreeMapVol == volinfo)
+		DFS_FREEMAP_SET(DFS_FREEMAP_GROUP(cluster));
+#endif
+}
+
+/*
+	Physical sector number of the current sector of an open directory
+*/
+static uint32_t DFS_DirSector(PVOLINFO volinfo, PDIRINFO di)
+{
+	if (di->currentcluster == 0)
+		return volinfo->rootdir + di->currentsector;
+	else
+		return volinfo->dataarea + ((di->currentcluster - 2) * volinfo->secperclus) + di->currentsector;
+}
+
+/*
+	Start cluster of the file or directory described by a directory entry
+*/
+static uint32_t DFS_StartCluster(PVOLINFO volinfo, PDIRENT de)
+{
+	if (volinfo->filesystem == FAT32) {
+		return (uint32_t) de->startclus_l_l |
+		  ((uint32_t) de->startclus_l_h) <<  8 |
+		  ((uint32_t) de->startclus_h_l) << 16 |
+		  ((uint32_t) de->startclus_h_h) << 24;
+	}
+	else {
+		return (uint32_t) de->startclus_l_l |
+		  ((uint32_t) de->startclus_l_h) << 8;
+	}
+}
+
+#if DFS_DIRCACHE
+/*
+	Directory lookup cache
+	Remembers where recently resolved names live, so DFS_OpenDir and DFS_OpenFile
+	don't have to walk the parent directory with DFS_GetNext every time. Only names
+	which exist are cached, an entry is dropped when its file is unlinked.
+	The least recently used entry is replaced when the cache is full.
+	DFS_DirEnd remembers the end of one directory (the first never used entry, with
+	no deleted entries in front of it), so DFS_GetFreeDirEnt can place a new entry
+	there without searching the directory for a free slot.
+*/
+typedef struct _tagDIRCACHE {
+	PVOLINFO volinfo;			// volume this entry belongs to (NULL - entry is unused)
+	uint32_t parent;			// start cluster of the directory holding the name
+	uint32_t cluster;			// start cluster of the file or directory
+	uint32_t dirsector;			// physical sector containing the directory entry
+	uint32_t stamp;				// time of last access, for LRU replacement
+	uint8_t diroffset;			// # of the directory entry within dirsector
+	uint8_t attr;				// attributes of the entry
+	uint8_t name[11];			// name in directory entry form
+} DIRCACHE, *PDIRCACHE;
+
+typedef struct _tagDIREND {
+	PVOLINFO volinfo;			// volume (NULL - end of directory is unknown)
+	uint32_t parent;			// start cluster of the directory
+	uint32_t cluster;			// position of the end, same meaning as in DIRINFO
+	uint32_t sector;
+	uint32_t entry;
+} DIREND;
+
+static DIRCACHE DFS_DirCache[DFS_DIRCACHE];
+static uint32_t DFS_DirCacheStamp;
+static DIREND DFS_DirEnd;
+
+/*
+	Look up a name (in directory entry form) in the directory starting at cluster parent
+	Returns pointer to the cache entry, or NULL if the name is not cached.
+*/
+static PDIRCACHE DFS_DirCacheFind(PVOLINFO volinfo, uint32_t parent, uint8_t *name)
+{
+	PDIRCACHE dc;
+
+	for (dc = DFS_DirCache; dc < DFS_DirCache + DFS_DIRCACHE; dc++) {
+		if (dc->volinfo == volinfo && dc->parent == parent && !memcmp(dc->name, name, 11)) {
+			dc->stamp = ++DFS_DirCacheStamp;
+			return dc;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+	Remember the directory entry just returned by DFS_GetNext, parent is the start
+	cluster of the directory being enumerated
+*/
+static void DFS_DirCacheAdd(PVOLINFO volinfo, uint32_t parent, PDIRINFO di, PDIRENT de)
+{
+	PDIRCACHE dc, victim = DFS_DirCache;
+
+	for (dc = DFS_DirCache; dc < DFS_DirCache + DFS_DIRCACHE; dc++) {
+		if (dc->volinfo == volinfo && dc->parent == parent && !memcmp(dc->name, de->name, 11)) {
+			victim = dc;
+			break;
+		}
+		// Prefer an unused entry, otherwise the least recently used one
+		if (!dc->volinfo)
+			victim = dc;
+		else if (victim->volinfo && dc->stamp < victim->stamp)
+			victim = dc;
+	}
+
+	victim->volinfo = volinfo;
+	victim->parent = parent;
+	victim->cluster = DFS_StartCluster(volinfo, de);
+	victim->dirsector = DFS_DirSector(volinfo, di);
+	victim->diroffset = di->currententry - 1;
+	victim->attr = de->attr;
+	memcpy(victim->name, de->name, 11);
+	victim->stamp = ++DFS_DirCacheStamp;
+}
+
+/*
+	Forget the cached name stored in the directory entry dirsector/diroffset, or all
+	names of the volume if dirsector is 0. The known end of directory is forgotten
+	too, the deleted entry is a free slot which should be reused first.
+*/
+static void DFS_DirCacheDrop(PVOLINFO volinfo, uint32_t dirsector, uint8_t diroffset)
+{
+	PDIRCACHE dc;
+
+	for (dc = DFS_DirCache; dc < DFS_DirCache + DFS_DIRCACHE; dc++) {
+		if (dc->volinfo == volinfo && (!dirsector || (dc->dirsector == dirsector && dc->diroffset == diroffset)))
+			dc->volinfo = NULL;
+	}
+	if (DFS_DirEnd.volinfo == volinfo)
+		DFS_DirEnd.volinfo = NULL;
+}
+
+/*
+	Remember the position di points to as the end of the directory starting at
+	cluster parent. The position may be just past the end of a sector; if it is past
+	the end of the cluster (or of the FAT12/16 root directory) it is not remembered,
+	as the next cluster of the directory may not even exist.
+*/
+static void DFS_DirEndSet(PVOLINFO volinfo, uint32_t parent, PDIRINFO di)
+{
+	DFS_DirEnd.volinfo = NULL;
+	DFS_DirEnd.cluster = di->currentcluster;
+	DFS_DirEnd.sector = di->currentsector;
+	DFS_DirEnd.entry = di->currententry;
+	if (DFS_DirEnd.entry >= SECTOR_SIZE / sizeof(DIRENT)) {
+		DFS_DirEnd.entry = 0;
+		DFS_DirEnd.sector++;
+	}
+	if (di->currentcluster == 0) {
+		if (DFS_DirEnd.sector * (SECTOR_SIZE / sizeof(DIRENT)) >= volinfo->rootentries)
+			return;
+	}
+	else if (DFS_DirEnd.sector >= volinfo->secperclus)
+		return;
+
+	DFS_DirEnd.parent = parent;
+	DFS_DirEnd.volinfo = volinfo;
+}
+
+/*
+	Called when a directory search ended with DFS_EOF: remembers the end of the
+	directory, unless deleted entries were seen on the way (holes is nonzero) or
+	the search ran off the end of the cluster chain
+*/
+static void DFS_DirEndFound(PVOLINFO volinfo, uint32_t parent, PDIRINFO di, uint32_t holes)
+{
+	if (!holes && di->currententry < SECTOR_SIZE / sizeof(DIRENT) &&
+	    !((PDIRENT) di->scratch)[di->currententry].name[0])
+		DFS_DirEndSet(volinfo, parent, di);
+}
+#endif // DFS_DIRCACHE
 
 /*
 	Retrieve volume info from BPB and store it in a VOLINFO structure
@@ -122,10 +798,35 @@ uint32_t DFS_GetPtnStart(uint8_t unit, uint8_t *scratchsector, uint8_t pnum, uin
 	a pointer to a sector buffer for scratch
 	Attempts to read BPB and glean information about the FS from that.
 	Returns 0 OK, nonzero for any error.
+	Any FAT sectors, directory entries and file buffers cached for this VOLINFO
+	and the block cache of the unit are discarded (the media may have been
+	changed), call DFS_Sync() first to keep the pending updates.
 */
 uint32_t DFS_GetVolInfo(uint8_t unit, uint8_t *scratchsector, uint32_t startsector, PVOLINFO volinfo)
 {
 	PLBR lbr = (PLBR) scratchsector;
+	PFSINFO fsi = (PFSINFO) scratchsector;
+	uint32_t temp;
+#if DFS_FATCACHE || DFS_BUFFERS
+	uint32_t i;
+#endif
+
+#if DFS_FATCACHE
+	for (i = 0; i < DFS_FATCACHE; i++)
+		if (DFS_FATCache[i].volinfo == volinfo)
+			DFS_FATCache[i].volinfo = NULL;
+#endif
+#if DFS_DIRCACHE
+	DFS_DirCacheDrop(volinfo, 0, 0);
+#endif
+#if DFS_BUFFERS
+	for (i = 0; i < DFS_BUFFERS; i++)
+		if (DFS_FileBufs[i].owner && DFS_FileBufs[i].volinfo == volinfo)
+			DFS_FileBufs[i].owner = NULL;
+#endif
+
+	DFS_InvalidateCache(unit);
+
 	volinfo->unit = unit;
 	volinfo->startsector = startsector;
 
@@ -211,6 +912,63 @@ uint32_t DFS_GetVolInfo(uint8_t unit, uint8_t *scratchsector, uint32_t startsect
 	volinfo->sectorsize = (lbr->bpb.bytepersec_h << 8) | (lbr->bpb.bytepersec_l);
 	volinfo->clustersize = volinfo->sectorsize * volinfo->secperclus;
 
+	// Free space is unknown until counted by DFS_GetFree, unless the FAT32 FSInfo
+	// sector tells it. FSInfo values out of range are ignored.
+	volinfo->freecount = 0xffffffff;
+	volinfo->nextfree = 2;
+	volinfo->fsinfodirty = 0;
+	volinfo->fsinfo = 0;
+	if (volinfo->filesystem == FAT32) {
+		volinfo->fsinfo = (uint16_t) lbr->ebpb.ebpb32.fsinfo_l |
+		  (((uint16_t) lbr->ebpb.ebpb32.fsinfo_h) << 8);
+		if (volinfo->fsinfo && volinfo->fsinfo < volinfo->reservedsecs) {
+			volinfo->fsinfo += startsector;
+			if (!DFS_ReadSector(unit,scratchsector,volinfo->fsinfo,1) &&
+					!memcmp(fsi->leadsig,"RRaA",4) && !memcmp(fsi->strucsig,"rrAa",4)) {
+				temp = (uint32_t) fsi->freecount_0 |
+				  (((uint32_t) fsi->freecount_1) << 8) |
+				  (((uint32_t) fsi->freecount_2) << 16) |
+				  (((uint32_t) fsi->freecount_3) << 24);
+				if (temp <= volinfo->numclusters)
+					volinfo->freecount = temp;
+				temp = (uint32_t) fsi->nextfree_0 |
+				  (((uint32_t) fsi->nextfree_1) << 8) |
+				  (((uint32_t) fsi->nextfree_2) << 16) |
+				  (((uint32_t) fsi->nextfree_3) << 24);
+				if (temp >= 2 && temp < volinfo->numclusters + 2)
+					volinfo->nextfree = temp;
+			}
+			else
+				volinfo->fsinfo = 0;	// never overwrite something which is not FSInfo
+		}
+		else
+			volinfo->fsinfo = 0;
+	}
+#if DFS_FREEMAP
+	DFS_FreeMapInit(volinfo);
+#endif
+#if DFS_MIRRORMAP
+	// A cleared clean shutdown bit means the last session on the volume changed the
+	// FAT after its last DFS_CloseFile, so FAT copy 2 is stale in unknown places.
+	// The next DFS_SyncMirror copies all of copy 1 then.
+	volinfo->unclean = 0;
+	if (DFS_CleanBit(volinfo)) {
+		if (DFS_ReadSector(unit, scratchsector, volinfo->fat1, 1))
+			return DFS_ERRMISC;
+		// FAT entry 1 is at byte 2 (FAT16) or 4 (FAT32) of the first FAT sector
+		if (volinfo->filesystem == FAT16)
+			temp = (uint32_t) scratchsector[2] | (((uint32_t) scratchsector[3]) << 8);
+		else
+			temp = (uint32_t) scratchsector[4] |
+			  (((uint32_t) scratchsector[5]) << 8) |
+			  (((uint32_t) scratchsector[6]) << 16) |
+			  (((uint32_t) scratchsector[7]) << 24);
+		volinfo->unclean = !(temp & DFS_CleanBit(volinfo));
+	}
+	volinfo->inuse = volinfo->unclean;
+	DFS_MirrorInit(volinfo, volinfo->unclean);
+#endif
+
 	return DFS_OK;
 }
 
@@ -221,10 +979,15 @@ uint32_t DFS_GetVolInfo(uint8_t unit, uint8_t *scratchsector, uint32_t startsect
 	FAT entry.
 	scratchcache should point to a UINT32. This variable caches the physical sector number
 	last read into the scratch buffer for performance enhancement reasons.
+	With DFS_FATCACHE enabled the FAT sectors come from the FAT cache, scratch and
+	scratchcache are left untouched.
 */
 uint32_t DFS_GetFAT(PVOLINFO volinfo, uint8_t *scratch, uint32_t *scratchcache, uint32_t cluster)
 {
 	uint32_t offset, sector, result;
+#if DFS_FATCACHE
+	PFATCACHE fc;
+#endif
 
 	if (volinfo->filesystem == FAT12) {
 		offset = cluster + (cluster / 2);
@@ -242,6 +1005,12 @@ uint32_t DFS_GetFAT(PVOLINFO volinfo, uint8_t *scratch, uint32_t *scratchcache,
 	// of the FAT. Calculate the physical sector containing this FAT entry.
 	sector = ldiv(offset, SECTOR_SIZE).quot + volinfo->fat1;
 
+#if DFS_FATCACHE
+	fc = DFS_FATCacheGet(volinfo, sector);
+	if (!fc)
+		return 0x0ffffff7;	// FAT32 bad cluster
+	scratch = fc->data;
+#else
 	// If this is not the same sector we last read, then read it into RAM
 	if (sector != *scratchcache) {
 		if(DFS_ReadSector(volinfo->unit, scratch, sector, 1)) {
@@ -252,6 +1021,7 @@ uint32_t DFS_GetFAT(PVOLINFO volinfo, uint8_t *scratch, uint32_t *scratchcache,
 		}
 		*scratchcache = sector;
 	}
+#endif
 
 	// At this point, we "merely" need to extract the relevant entry.
 	// This is easy for FAT16 and FAT32, but a royal PITA for FAT12 as a single entry
@@ -266,6 +1036,12 @@ uint32_t DFS_GetFAT(PVOLINFO volinfo, uint8_t *scratch, uint32_t *scratchcache,
 		if (offset == SECTOR_SIZE - 1) {
 			result = (uint32_t) scratch[offset];
 			sector++;
+#if DFS_FATCACHE
+			fc = DFS_FATCacheGet(volinfo, sector);
+			if (!fc)
+				return 0x0ffffff7;	// FAT32 bad cluster
+			scratch = fc->data;
+#else
 			if(DFS_ReadSector(volinfo->unit, scratch, sector, 1)) {
 				// avoid anyone assuming that this cache value is still valid, which
 				// might cause disk corruption
@@ -273,6 +1049,7 @@ uint32_t DFS_GetFAT(PVOLINFO volinfo, uint8_t *scratch, uint32_t *scratchcache,
 				return 0x0ffffff7;	// FAT32 bad cluster	
 			}
 			*scratchcache = sector;
+#endif
 			// Thanks to Claudio Leonel for pointing out this missing line.
 			result |= ((uint32_t) scratch[0]) << 8;
 		}
@@ -316,10 +1093,33 @@ uint32_t DFS_GetFAT(PVOLINFO volinfo, uint8_t *scratch, uint32_t *scratchcache,
 	If you are operating DOSFS over flash, you are strongly advised to implement a writeback
 	cache in your physical I/O driver. This will speed up your code significantly and will
 	also conserve power and flash write life.
+
+	With DFS_FATCACHE enabled the entry is modified in the FAT cache only (scratch and
+	scratchcache are left untouched), the sector reaches the media when it is evicted
+	from the cache or by DFS_FlushFAT().
 */
 uint32_t DFS_SetFAT(PVOLINFO volinfo, uint8_t *scratch, uint32_t *scratchcache, uint32_t cluster, uint32_t new_contents)
 {
-	uint32_t offset, sector, result;
+	uint32_t offset, sector, old_contents = 0;
+#if DFS_FATCACHE
+	PFATCACHE fc;
+#else
+	uint32_t result;
+#endif
+
+#if DFS_MIRRORMAP
+	// The first FAT change of a session marks the volume as in use on the media,
+	// DFS_CloseFile marks it clean again
+	if (!volinfo->inuse && DFS_MirrorVol == volinfo && DFS_CleanBit(volinfo)) {
+		volinfo->inuse = 1;
+		offset = DFS_GetFAT(volinfo, scratch, scratchcache, 1);
+		if (offset == 0x0ffffff7 ||
+		    DFS_SetFAT(volinfo, scratch, scratchcache, 1, offset & ~DFS_CleanBit(volinfo))) {
+			volinfo->inuse = 0;
+			return DFS_ERRMISC;
+		}
+	}
+#endif
 
 	if (volinfo->filesystem == FAT12) {
 		offset = cluster + (cluster / 2);
@@ -336,10 +1136,66 @@ uint32_t DFS_SetFAT(PVOLINFO volinfo, uint8_t *scratch, uint32_t *scratchcache,
 	else
 		return DFS_ERRMISC;	
 
+	// The free cluster count needs to know whether this entry was free before
+	if (volinfo->freecount != 0xffffffff)
+		old_contents = DFS_GetFAT(volinfo, scratch, scratchcache, cluster);
+
 	// at this point, offset is the BYTE offset of the desired sector from the start
 	// of the FAT. Calculate the physical sector containing this FAT entry.
 	sector = ldiv(offset, SECTOR_SIZE).quot + volinfo->fat1;
 
+#if DFS_FATCACHE
+	fc = DFS_FATCacheGet(volinfo, sector);
+	if (!fc)
+		return DFS_ERRMISC;
+	fc->dirty = 1;
+	scratch = fc->data;
+	offset = ldiv(offset, SECTOR_SIZE).rem;
+
+	if (volinfo->filesystem == FAT12) {
+		// If this is an odd cluster, pre-shift the desired new contents 4 bits to
+		// make the calculations below simpler
+		if (cluster & 1)
+			new_contents = new_contents << 4;
+
+		// Odd cluster: High 12 bits being set
+		if (cluster & 1)
+			scratch[offset] = (scratch[offset] & 0x0f) | (new_contents & 0xf0);
+		// Even cluster: Low 12 bits being set
+		else
+			scratch[offset] = new_contents & 0x00ff;
+
+		// Special case for sector boundary: the high byte lives in the next sector
+		if (offset == SECTOR_SIZE - 1) {
+			fc = DFS_FATCacheGet(volinfo, sector + 1);
+			if (!fc)
+				return DFS_ERRMISC;
+			fc->dirty = 1;
+			scratch = fc->data;
+			offset = 0;
+		} else
+			offset++;
+
+		if (cluster & 1)
+			scratch[offset] = new_contents >> 8;
+		else
+			scratch[offset] = (scratch[offset] & 0xf0) | ((new_contents >> 8) & 0x0f);
+	}
+	else if (volinfo->filesystem == FAT16) {
+		scratch[offset] = (new_contents & 0xff);
+		scratch[offset+1] = (new_contents & 0xff00) >> 8;
+	}
+	else {
+		// Per Microsoft's guidelines the upper 4 bits of the FAT32 cluster value are preserved
+		scratch[offset] = (new_contents & 0xff);
+		scratch[offset+1] = (new_contents & 0xff00) >> 8;
+		scratch[offset+2] = (new_contents & 0xff0000) >> 16;
+		scratch[offset+3] = (scratch[offset+3] & 0xf0) | ((new_contents & 0x0f000000) >> 24);
+	}
+	DFS_FreeUpdate(volinfo, cluster, old_contents, new_contents);
+
+	return DFS_OK;
+#else
 	// If this is not the same sector we last read, then read it into RAM
 	if (sector != *scratchcache) {
 		if (DFS_ReadSector(volinfo->unit, scratch, sector, 1)) {
@@ -375,10 +1231,7 @@ uint32_t DFS_SetFAT(PVOLINFO volinfo, uint8_t *scratch, uint32_t *scratchcache,
 				scratch[offset] = new_contents & 0x00ff;
 			}
 
-			result = DFS_WriteSector(volinfo->unit, scratch, *scratchcache, 1);
-			// mirror the FAT into copy 2
-			if (DFS_OK == result)
-				result = DFS_WriteSector(volinfo->unit, scratch, (*scratchcache)+volinfo->secperfat, 1);
+			result = DFS_WriteFAT(volinfo, scratch, *scratchcache);
 
 			// If we wrote that sector OK, then read in the subsequent sector
 			// and poke the first byte with the remainder of this FAT entry.
@@ -395,10 +1248,7 @@ uint32_t DFS_SetFAT(PVOLINFO volinfo, uint8_t *scratch, uint32_t *scratchcache,
 					else {
 						scratch[0] = (scratch[0] & 0xf0) | ((new_contents >> 8) & 0x0f); // 06.08.14 SDA: FAT12 fix
 					}
-					result = DFS_WriteSector(volinfo->unit, scratch, *scratchcache, 1);
-					// mirror the FAT into copy 2
-					if (DFS_OK == result)
-						result = DFS_WriteSector(volinfo->unit, scratch, (*scratchcache)+volinfo->secperfat, 1);
+					result = DFS_WriteFAT(volinfo, scratch, *scratchcache);
 				}
 				else {
 					// avoid anyone assuming that this cache value is still valid, which
@@ -422,19 +1272,13 @@ uint32_t DFS_SetFAT(PVOLINFO volinfo, uint8_t *scratch, uint32_t *scratchcache,
 				scratch[offset+1] = (scratch[offset+1] & 0xf0) | ((new_contents >> 8) & 0x0f);
 			}
 
-	        result = DFS_WriteSector(volinfo->unit, scratch, *scratchcache, 1);
-			// mirror the FAT into copy 2
-			if (DFS_OK == result)
-				result = DFS_WriteSector(volinfo->unit, scratch, (*scratchcache)+volinfo->secperfat, 1);
+	        result = DFS_WriteFAT(volinfo, scratch, *scratchcache);
 		}
 	}
 	else if (volinfo->filesystem == FAT16) {
 		scratch[offset] = (new_contents & 0xff);
 		scratch[offset+1] = (new_contents & 0xff00) >> 8;
-		result = DFS_WriteSector(volinfo->unit, scratch, *scratchcache, 1);
-		// mirror the FAT into copy 2
-		if (DFS_OK == result)
-			result = DFS_WriteSector(volinfo->unit, scratch, (*scratchcache)+volinfo->secperfat, 1);
+		result = DFS_WriteFAT(volinfo, scratch, *scratchcache);
 	}
 	else if (volinfo->filesystem == FAT32) {
 		scratch[offset] = (new_contents & 0xff);
@@ -444,15 +1288,16 @@ uint32_t DFS_SetFAT(PVOLINFO volinfo, uint8_t *scratch, uint32_t *scratchcache,
 		// Note well from the above: Per Microsoft's guidelines we preserve the upper
 		// 4 bits of the FAT32 cluster value. It's unclear what these bits will be used
 		// for; in every example I've encountered they are always zero.
-		result = DFS_WriteSector(volinfo->unit, scratch, *scratchcache, 1);
-		// mirror the FAT into copy 2
-		if (DFS_OK == result)
-			result = DFS_WriteSector(volinfo->unit, scratch, (*scratchcache)+volinfo->secperfat, 1);
+		result = DFS_WriteFAT(volinfo, scratch, *scratchcache);
 	}
 	else
 		result = DFS_ERRMISC;
 
+	if (DFS_OK == result)
+		DFS_FreeUpdate(volinfo, cluster, old_contents, new_contents);
+
 	return result;
+#endif // DFS_FATCACHE
 }
 
 /*
@@ -520,24 +1365,178 @@ uint8_t *DFS_DirToCanonical(uint8_t *dest, uint8_t *src)
 	Returns a FAT32 BAD_CLUSTER value for any error, otherwise the contents of the desired
 	FAT entry.
 	Returns FAT32 bad_sector (0x0ffffff7) if there is no free cluster available
+	The search starts at the next free cluster hint and wraps around at the end of the
+	volume, groups of clusters known to be in use are skipped using the free cluster map.
 */
 uint32_t DFS_GetFreeFAT(PVOLINFO volinfo, uint8_t *scratch)
 {
 	uint32_t i, result = 0xffffffff, scratchcache = 0;
-	
-	// Search starts at cluster 2, which is the first usable cluster
+	uint32_t remain, step;
+#if DFS_FREEMAP
+	uint32_t group = 0, groupend = 0, full = 0;
+#endif
+
+	// Valid clusters are 2..numclusters+1
 	// NOTE: This search can't terminate at a bad cluster, because there might
 	// legitimately be bad clusters on the disk.
-	for (i=2; i < volinfo->numclusters; i++) {
-		result = DFS_GetFAT(volinfo, scratch, &scratchcache, i);
-		if (!result) {
-			return i;
+	i = volinfo->nextfree;
+	if (i < 2 || i >= volinfo->numclusters + 2)
+		i = 2;
+	remain = volinfo->numclusters;
+	while (remain) {
+		step = 1;
+#if DFS_FREEMAP
+		if (DFS_FreeMapVol == volinfo) {
+			group = DFS_FREEMAP_GROUP(i);
+			groupend = ((group + 1) << DFS_FreeMapShift) + 2;
+			if (groupend > volinfo->numclusters + 2)
+				groupend = volinfo->numclusters + 2;
+			// Only a group scanned from its first cluster can be proven full
+			if (i == (group << DFS_FreeMapShift) + 2)
+				full = 1;
+			if (!DFS_FREEMAP_TEST(group))
+				step = groupend - i;
 		}
+		if (step == 1) {
+#endif
+			result = DFS_GetFAT(volinfo, scratch, &scratchcache, i);
+			if (!result) {
+				if (volinfo->nextfree != i) {
+					volinfo->nextfree = i;
+					volinfo->fsinfodirty = 1;
+				}
+				return i;
+			}
+#if DFS_FREEMAP
+			if (DFS_FreeMapVol == volinfo && full && i + 1 == groupend)
+				DFS_FREEMAP_CLEAR(group);
+		}
+#endif
+		if (step > remain)
+			step = remain;
+		remain -= step;
+		i += step;
+		if (i >= volinfo->numclusters + 2)
+			i = 2;
 	}
 	return 0x0ffffff7;		// Can't find a free cluster
 }
 
 
+/*
+	Return nonzero if the FAT entry contents end a cluster chain walk: end of chain,
+	bad cluster (also returned by DFS_GetFAT on error) or a free/reserved entry
+*/
+static uint32_t DFS_IsEOC(PVOLINFO volinfo, uint32_t contents)
+{
+	if (contents < 2)
+		return 1;
+	if (volinfo->filesystem == FAT12)
+		return contents >= 0x00000ff7;
+	if (volinfo->filesystem == FAT16)
+		return contents >= 0x0000fff7;
+	return contents >= 0x0ffffff7;
+}
+
+#if DFS_EXTENTS
+/*
+	Find the cluster with file-relative number index in the extent map of a file
+	Returns 0 if that part of the cluster chain is not mapped.
+*/
+static uint32_t DFS_ExtentFind(PFILEINFO fileinfo, uint32_t index)
+{
+	PEXTENT ext;
+
+	for (ext = fileinfo->extent; ext < fileinfo->extent + fileinfo->extents; ext++) {
+		if (index < ext->count)
+			return ext->cluster + index;
+		index -= ext->count;
+	}
+
+	return 0;
+}
+
+/*
+	Return the number of clusters at the start of a file covered by its extent map
+*/
+static uint32_t DFS_ExtentMapped(PFILEINFO fileinfo)
+{
+	uint32_t i, mapped = 0;
+
+	for (i = 0; i < fileinfo->extents; i++)
+		mapped += fileinfo->extent[i].count;
+
+	return mapped;
+}
+
+/*
+	Record in the extent map of a file that its cluster number index is cluster
+	Only a cluster which directly follows the mapped part of the chain is recorded.
+	Once all entries are used the rest of the chain stays unmapped.
+*/
+static void DFS_ExtentAdd(PFILEINFO fileinfo, uint32_t index, uint32_t cluster)
+{
+	PEXTENT ext = fileinfo->extent + fileinfo->extents;
+
+	if (index != DFS_ExtentMapped(fileinfo))
+		return;
+
+	// Extend the last run if the cluster is physically contiguous with it
+	if (fileinfo->extents && cluster == ext[-1].cluster + ext[-1].count) {
+		ext[-1].count++;
+		return;
+	}
+
+	if (fileinfo->extents < DFS_EXTENTS) {
+		ext->cluster = cluster;
+		ext->count = 1;
+		fileinfo->extents++;
+	}
+}
+
+/*
+	Cut the extent map of a file down to its first count clusters
+*/
+static void DFS_ExtentTrim(PFILEINFO fileinfo, uint32_t count)
+{
+	uint32_t i;
+
+	for (i = 0; i < fileinfo->extents && count; i++) {
+		if (count <= fileinfo->extent[i].count) {
+			fileinfo->extent[i].count = count;
+			fileinfo->extents = i + 1;
+			return;
+		}
+		count -= fileinfo->extent[i].count;
+	}
+	fileinfo->extents = i;
+}
+#endif // DFS_EXTENTS
+
+/*
+	Fetch the cluster which follows the cluster with file-relative number index in
+	the chain of a file. This is DFS_GetFAT on the current cluster of the file,
+	except that the extent map is used (and filled) when DFS_EXTENTS is enabled.
+*/
+static uint32_t DFS_NextCluster(PFILEINFO fileinfo, uint8_t *scratch, uint32_t *scratchcache, uint32_t index, uint32_t cluster)
+{
+#if DFS_EXTENTS
+	uint32_t result;
+
+	result = DFS_ExtentFind(fileinfo, index + 1);
+	if (result)
+		return result;
+
+	result = DFS_GetFAT(fileinfo->volinfo, scratch, scratchcache, cluster);
+	if (result >= 2 && result < fileinfo->volinfo->numclusters + 2)
+		DFS_ExtentAdd(fileinfo, index + 1, result);
+
+	return result;
+#else
+	return DFS_GetFAT(fileinfo->volinfo, scratch, scratchcache, cluster);
+#endif
+}
+
 /*
 	Open a directory for enumeration by DFS_GetNextDirEnt
 	You must supply a populated VOLINFO (see DFS_GetVolInfo)
@@ -575,27 +1574,17 @@ uint32_t DFS_OpenDir(PVOLINFO volinfo, uint8_t *dirname, PDIRINFO dirinfo)
 	else {
 		uint8_t tmpfn[12];
 		uint8_t *ptr = dirname;
-		uint32_t result = 0; // SDA 21.08.14: fix compiler warning
+		uint32_t result;
 		DIRENT de;
+#if DFS_DIRCACHE
+		PDIRCACHE dc;
+		uint32_t parent;
+#endif
 
-		if (volinfo->filesystem == FAT32) {
+		if (volinfo->filesystem == FAT32)
 			dirinfo->currentcluster = volinfo->rootdir;
-			dirinfo->currentsector  = 0;
-			dirinfo->currententry   = 0;
-
-			// read first sector of directory
-			if (DFS_ReadSector(volinfo->unit, dirinfo->scratch, volinfo->dataarea + ((volinfo->rootdir - 2) * volinfo->secperclus), 1))
-				return DFS_ERRMISC;
-		}
-		else {
+		else
 			dirinfo->currentcluster = 0;
-			dirinfo->currentsector  = 0;
-			dirinfo->currententry   = 0;
-
-			// read first sector of directory
-			if (DFS_ReadSector(volinfo->unit, dirinfo->scratch, volinfo->rootdir, 1))
-				return DFS_ERRMISC;
-		}
 
 		// skip leading path separators
 		while (*ptr == DIR_SEPARATOR && *ptr)
@@ -604,34 +1593,42 @@ uint32_t DFS_OpenDir(PVOLINFO volinfo, uint8_t *dirname, PDIRINFO dirinfo)
 		// Scan the path from left to right, finding the start cluster of each entry
 		// Observe that this code is inelegant, but obviates the need for recursion.
 		while (*ptr) {
-			result = 0; // bugfix
-
 			DFS_CanonicalToDir(tmpfn, ptr);
-			de.name[0] = 0;
-
-			do {
-				result = DFS_GetNext(volinfo, dirinfo, &de);
-			} while (!result && memcmp(de.name, tmpfn, 11));
-
-			if (!memcmp(de.name, tmpfn, 11) && ((de.attr & ATTR_DIRECTORY) == ATTR_DIRECTORY)) {
-				if (volinfo->filesystem == FAT32) {
-					dirinfo->currentcluster = (uint32_t) de.startclus_l_l |
-					  ((uint32_t) de.startclus_l_h) <<  8 |
-					  ((uint32_t) de.startclus_h_l) << 16 |
-					  ((uint32_t) de.startclus_h_h) << 24;
-				}
-				else {
-					dirinfo->currentcluster = (uint32_t) de.startclus_l_l |
-					  ((uint32_t) de.startclus_l_h) << 8;
-				}
-				dirinfo->currentsector = 0;
-				dirinfo->currententry = 0;
-
-				if (DFS_ReadSector(volinfo->unit, dirinfo->scratch, volinfo->dataarea + ((dirinfo->currentcluster - 2) * volinfo->secperclus), 1))
+			dirinfo->currentsector = 0;
+			dirinfo->currententry = 0;
+
+#if DFS_DIRCACHE
+			// A recently resolved component needs no directory search at all
+			dc = DFS_DirCacheFind(volinfo, dirinfo->currentcluster, tmpfn);
+			if (dc) {
+				if (!(dc->attr & ATTR_DIRECTORY))
+					return DFS_NOTFOUND;
+				dirinfo->currentcluster = dc->cluster;
+			}
+			else
+#endif
+			{
+#if DFS_DIRCACHE
+				parent = dirinfo->currentcluster;
+#endif
+				// read first sector of directory
+				if (DFS_ReadSector(volinfo->unit, dirinfo->scratch, DFS_DirSector(volinfo, dirinfo), 1))
 					return DFS_ERRMISC;
+
+				do {
+					result = DFS_GetNext(volinfo, dirinfo, &de);
+				} while (!result && memcmp(de.name, tmpfn, 11));
+
+				// BUGFIX: Check result for failure instead of
+				// dirinfo->currentcluster. dirinfo->currentcluster will be
+				// non-zero for searches in subdirectories - Dave Hein 11/9/11
+				if (result || !(de.attr & ATTR_DIRECTORY))
+					return DFS_NOTFOUND;
+#if DFS_DIRCACHE
+				DFS_DirCacheAdd(volinfo, parent, dirinfo, &de);
+#endif
+				dirinfo->currentcluster = DFS_StartCluster(volinfo, &de);
 			}
-			else if (!memcmp(de.name, tmpfn, 11) && !(de.attr & ATTR_DIRECTORY))
-				return DFS_NOTFOUND;
 
 			// seek to next item in list
 			while (*ptr != DIR_SEPARATOR && *ptr)
@@ -640,11 +1637,12 @@ uint32_t DFS_OpenDir(PVOLINFO volinfo, uint8_t *dirname, PDIRINFO dirinfo)
 				ptr++;
 		}
 
-		// BUGFIX: Check result for failure instead of
-		// dirinfo->currentcluster. dirinfo->currentcluster will be
-		// non-zero for searches in subdirectories - Dave Hein 11/9/11
-//		if (!dirinfo->currentcluster) return DFS_NOTFOUND;
-		if (result) return DFS_NOTFOUND;
+		dirinfo->currentsector = 0;
+		dirinfo->currententry = 0;
+
+		// read first sector of directory
+		if (DFS_ReadSector(volinfo->unit, dirinfo->scratch, DFS_DirSector(volinfo, dirinfo), 1))
+			return DFS_ERRMISC;
 	}
 	return DFS_OK;
 }
@@ -661,7 +1659,8 @@ uint32_t DFS_OpenDir(PVOLINFO volinfo, uint8_t *dirname, PDIRINFO dirinfo)
 */
 uint32_t DFS_GetNext(PVOLINFO volinfo, PDIRINFO dirinfo, PDIRENT dirent)
 {
-	uint32_t tempint;	// required by DFS_GetFAT
+	uint32_t tempint;
+	uint32_t cache = 0;	// required by DFS_GetFAT
 
 	// Do we need to read the next sector of the directory?
 	if (dirinfo->currententry >= SECTOR_SIZE / sizeof(DIRENT)) {
@@ -685,10 +1684,13 @@ uint32_t DFS_GetNext(PVOLINFO volinfo, PDIRINFO dirinfo, PDIRENT dirent)
 		// Normal handling
 		else {
 			if (dirinfo->currentsector >= volinfo->secperclus) {
-				dirinfo->currentsector = 0;
-				if ((dirinfo->currentcluster >= 0x00000ff7 && volinfo->filesystem == FAT12) ||
-				    (dirinfo->currentcluster >= 0x0000fff7 && volinfo->filesystem == FAT16) ||
-				    (dirinfo->currentcluster >= 0x0ffffff7 && volinfo->filesystem == FAT32)) {
+				// Check the link before following it. At the end of the chain the
+				// position stays past the last entry of the directory, so the last
+				// cluster is still current when DFS_GetFreeDirEnt extends the chain.
+				tempint = DFS_GetFAT(volinfo, dirinfo->scratch, &cache, dirinfo->currentcluster);
+				if (DFS_IsEOC(volinfo, tempint)) {
+					dirinfo->currentsector--;
+					dirinfo->currententry = SECTOR_SIZE / sizeof(DIRENT);
 				  
 				  	// We are at the end of the directory chain. If this is a normal
 				  	// find operation, we should indicate that there is nothing more
@@ -701,7 +1703,8 @@ uint32_t DFS_GetNext(PVOLINFO volinfo, PDIRINFO dirinfo, PDIRENT dirent)
 					else
 						return DFS_ALLOCNEW;
 				}
-				dirinfo->currentcluster = DFS_GetFAT(volinfo, dirinfo->scratch, &tempint, dirinfo->currentcluster);
+				dirinfo->currentsector = 0;
+				dirinfo->currentcluster = tempint;
 			}
 			if (DFS_ReadSector(volinfo->unit, dirinfo->scratch, volinfo->dataarea + ((dirinfo->currentcluster - 2) * volinfo->secperclus) + dirinfo->currentsector, 1))
 				return DFS_ERRMISC;
@@ -736,6 +1739,66 @@ uint32_t DFS_GetNext(PVOLINFO volinfo, PDIRINFO dirinfo, PDIRENT dirent)
 	return DFS_OK;
 }
 
+/*
+	Find the highest number used by the file names in a directory which match a
+	pattern ('?' stands for a decimal digit), in a single pass over the directory
+	Returns 0 OK, nonzero for any error.
+*/
+uint32_t DFS_GetMaxNum(PVOLINFO volinfo, uint8_t *dirname, uint8_t *pattern, uint8_t *scratch, uint32_t *num)
+{
+	uint8_t tmpfn[12];
+	DIRINFO di;
+	DIRENT de;
+	uint32_t result, value, i;
+#if DFS_DIRCACHE
+	uint32_t dircluster, holes = 0;
+#endif
+
+	*num = 0;
+	DFS_CanonicalToDir(tmpfn, pattern);
+
+	di.scratch = scratch;
+	if (DFS_OpenDir(volinfo, dirname, &di))
+		return DFS_NOTFOUND;
+#if DFS_DIRCACHE
+	dircluster = di.currentcluster;
+#endif
+
+	while (!(result = DFS_GetNext(volinfo, &di, &de))) {
+		if (!de.name[0]) {
+#if DFS_DIRCACHE
+			if (((PDIRENT) scratch)[di.currententry - 1].name[0] == 0xe5)
+				holes = 1;
+#endif
+			continue;
+		}
+		if (de.attr & (ATTR_DIRECTORY | ATTR_VOLUME_ID))
+			continue;
+
+		value = 0;
+		for (i = 0; i < 11; i++) {
+			if (tmpfn[i] == '?') {
+				if (de.name[i] < '0' || de.name[i] > '9')
+					break;
+				value = value * 10 + de.name[i] - '0';
+			}
+			else if (de.name[i] != tmpfn[i])
+				break;
+		}
+		if (i == 11 && value > *num)
+			*num = value;
+	}
+	if (result != DFS_EOF)
+		return DFS_ERRMISC;
+
+#if DFS_DIRCACHE
+	// The whole directory has been read, a new name can go straight to its end
+	DFS_DirEndFound(volinfo, dircluster, &di, holes);
+#endif
+
+	return DFS_OK;
+}
+
 /*
 	INTERNAL
 	Find a free directory entry in the directory specified by path
@@ -753,6 +1816,26 @@ uint32_t DFS_GetFreeDirEnt(PVOLINFO volinfo, uint8_t *path, PDIRINFO di, PDIRENT
 	if (DFS_OpenDir(volinfo, path, di))
 		return DFS_NOTFOUND;
 
+#if DFS_DIRCACHE
+	// Go straight to the end of the directory if we know where it is
+	if (DFS_DirEnd.volinfo == volinfo && DFS_DirEnd.parent == di->currentcluster) {
+		di->currentcluster = DFS_DirEnd.cluster;
+		di->currentsector = DFS_DirEnd.sector;
+		if (DFS_ReadSector(volinfo->unit, di->scratch, DFS_DirSector(volinfo, di), 1))
+			return DFS_ERRMISC;
+		if (!((PDIRENT) di->scratch)[DFS_DirEnd.entry].name[0]) {
+			di->currententry = DFS_DirEnd.entry + 1;
+			memcpy(de, &(((PDIRENT) di->scratch)[DFS_DirEnd.entry]), sizeof(DIRENT));
+			return DFS_OK;
+		}
+
+		// Not what we expected, search the directory from the start
+		DFS_DirEnd.volinfo = NULL;
+		if (DFS_OpenDir(volinfo, path, di))
+			return DFS_NOTFOUND;
+	}
+#endif
+
 	// Set "search for empty" flag so DFS_GetNext knows what we're doing
 	di->flags |= DFS_DI_BLANKENT;
 
@@ -799,6 +1882,10 @@ uint32_t DFS_GetFreeDirEnt(PVOLINFO volinfo, uint8_t *path, PDIRINFO di, PDIRENT
 				default: return DFS_ERRMISC;
 			}
 			DFS_SetFAT(volinfo, di->scratch, &i, di->currentcluster, tempclus);
+
+			// The first entry of the new cluster is ours
+			memset(de, 0, sizeof(DIRENT));
+			return DFS_OK;
 		}
 	} while (!tempclus);
 
@@ -821,7 +1908,21 @@ uint32_t DFS_OpenFile(PVOLINFO volinfo, uint8_t *path, uint8_t mode, uint8_t *sc
 	DIRINFO di;
 	DIRENT de;
 	uint32_t temp;
+	uint32_t found = 0;
     uint32_t dircluster; // NTRF
+#if DFS_DIRCACHE
+	PDIRCACHE dc;
+	uint32_t holes = 0;
+	uint8_t endslot;
+#endif
+#if DFS_BUFFERS
+	PFILEBUF fb;
+
+	// A buffer still attached to this FILEINFO belongs to the file opened with it before
+	for (fb = DFS_FileBufs; fb < DFS_FileBufs + DFS_BUFFERS; fb++)
+		if (fb->owner == fileinfo && DFS_FileBufRelease(fb))
+			return DFS_ERRMISC;
+#endif
 
 	// larwe 2006-09-16 +1 zero out file structure
 	memset(fileinfo, 0, sizeof(FILEINFO));
@@ -860,48 +1961,81 @@ uint32_t DFS_OpenFile(PVOLINFO volinfo, uint8_t *path, uint8_t mode, uint8_t *sc
 	// At this point, if our path was MYDIR/MYDIR2/FILE.EXT, filename = "FILE    EXT" and
 	// tmppath = "MYDIR/MYDIR2".
 	di.scratch = scratch;
-    //dircluster = di.currentcluster; // NTRF (start cluster for parent directory entry)
 
     if (DFS_OpenDir(volinfo, tmppath, &di))
 		return DFS_NOTFOUND;
+    dircluster = di.currentcluster; // SDA (start cluster for parent directory entry)
 
-	while (!DFS_GetNext(volinfo, &di, &de)) {
+#if DFS_DIRCACHE
+	// A cached name only has to be checked against its directory sector
+	dc = DFS_DirCacheFind(volinfo, dircluster, filename);
+	if (dc) {
+		if (DFS_ReadSector(volinfo->unit, scratch, dc->dirsector, 1))
+			return DFS_ERRMISC;
+		memcpy(&de, &(((PDIRENT) scratch)[dc->diroffset]), sizeof(DIRENT));
 		if (!memcmp(de.name, filename, 11)) {
-			// You can't use this function call to open a directory.
-            //NTRF: allows to create directories
-            if (( de.attr & ATTR_DIRECTORY ) && ( mode != DFS_CREATEDIR ))
-                return DFS_NOTFOUND;
+			fileinfo->dirsector = dc->dirsector;
+			fileinfo->diroffset = dc->diroffset;
+			found = 1;
+		}
+		else {
+			// stale entry, forget it and search the directory
+			DFS_DirCacheDrop(volinfo, dc->dirsector, dc->diroffset);
+			if (DFS_OpenDir(volinfo, tmppath, &di))
+				return DFS_NOTFOUND;
+		}
+	}
+#endif
 
-			fileinfo->volinfo = volinfo;
-			fileinfo->pointer = 0;
-			// The reason we store this extra info about the file is so that we can
-			// speedily update the file size, modification date, etc. on a file that is
-			// opened for writing.
-			if (di.currentcluster == 0)
-				fileinfo->dirsector = volinfo->rootdir + di.currentsector;
-			else
-				fileinfo->dirsector = volinfo->dataarea + ((di.currentcluster - 2) * volinfo->secperclus) + di.currentsector;
-			fileinfo->diroffset = di.currententry - 1;
-			if (volinfo->filesystem == FAT32) {
-				fileinfo->cluster = (uint32_t) de.startclus_l_l |
-				  ((uint32_t) de.startclus_l_h) <<  8 |
-				  ((uint32_t) de.startclus_h_l) << 16 |
-				  ((uint32_t) de.startclus_h_h) << 24;
-			}
-			else {
-				fileinfo->cluster = (uint32_t) de.startclus_l_l |
-				  ((uint32_t) de.startclus_l_h) << 8;
+	if (!found && mode != DFS_NEWFILE) {
+		while (!(temp = DFS_GetNext(volinfo, &di, &de))) {
+			if (!memcmp(de.name, filename, 11)) {
+				// The reason we store this extra info about the file is so that we can
+				// speedily update the file size, modification date, etc. on a file that is
+				// opened for writing.
+				fileinfo->dirsector = DFS_DirSector(volinfo, &di);
+				fileinfo->diroffset = di.currententry - 1;
+#if DFS_DIRCACHE
+				DFS_DirCacheAdd(volinfo, dircluster, &di, &de);
+#endif
+				found = 1;
+				break;
 			}
-			fileinfo->firstcluster = fileinfo->cluster;
-			fileinfo->filelen = (uint32_t) de.filesize_0 |
-			  ((uint32_t) de.filesize_1) <<  8 |
-			  ((uint32_t) de.filesize_2) << 16 |
-			  ((uint32_t) de.filesize_3) << 24;
-
-			return DFS_OK;
+#if DFS_DIRCACHE
+			if (!de.name[0] && ((PDIRENT) scratch)[di.currententry - 1].name[0] == 0xe5)
+				holes = 1;
+#endif
 		}
+#if DFS_DIRCACHE
+		// The whole directory has been read, a new entry can go straight to its end
+		if (temp == DFS_EOF)
+			DFS_DirEndFound(volinfo, dircluster, &di, holes);
+#endif
+	}
+
+	if (found) {
+		// You can't use this function call to open a directory.
+		//NTRF: allows to create directories
+		if (( de.attr & ATTR_DIRECTORY ) && ( mode != DFS_CREATEDIR ))
+			return DFS_NOTFOUND;
+
+		fileinfo->volinfo = volinfo;
+		fileinfo->pointer = 0;
+		fileinfo->cluster = DFS_StartCluster(volinfo, &de);
+		fileinfo->firstcluster = fileinfo->cluster;
+		fileinfo->filelen = (uint32_t) de.filesize_0 |
+		  ((uint32_t) de.filesize_1) <<  8 |
+		  ((uint32_t) de.filesize_2) << 16 |
+		  ((uint32_t) de.filesize_3) << 24;
+#if DFS_EXTENTS
+		// an empty file may have no cluster at all
+		fileinfo->extents = 0;
+		if (fileinfo->firstcluster >= 2)
+			DFS_ExtentAdd(fileinfo, 0, fileinfo->firstcluster);
+#endif
+
+		return DFS_OK;
 	}
-    dircluster = di.currentcluster; // SDA (start cluster for parent directory entry)
 
 	// At this point, we KNOW the file does not exist. If the file was opened
 	// with write access, we can create it.
@@ -966,23 +2100,33 @@ uint32_t DFS_OpenFile(PVOLINFO volinfo, uint8_t *path, uint8_t mode, uint8_t *sc
 		// The reason we store this extra info about the file is so that we can
 		// speedily update the file size, modification date, etc. on a file that is
 		// opened for writing.
-		if (di.currentcluster == 0)
-			fileinfo->dirsector = volinfo->rootdir + di.currentsector;
-		else
-			fileinfo->dirsector = volinfo->dataarea + ((di.currentcluster - 2) * volinfo->secperclus) + di.currentsector;
+		fileinfo->dirsector = DFS_DirSector(volinfo, &di);
 		fileinfo->diroffset = di.currententry - 1;
 		fileinfo->cluster = cluster;
 		fileinfo->firstcluster = cluster;
 		fileinfo->filelen = 0;
+#if DFS_EXTENTS
+		fileinfo->extents = 0;
+		DFS_ExtentAdd(fileinfo, 0, cluster);
+#endif
 		
 		// write the directory entry
 		// note that we no longer have the sector containing the directory entry,
 		// tragically, so we have to re-read it
 		if (DFS_ReadSector(volinfo->unit, scratch, fileinfo->dirsector, 1))
 			return DFS_ERRMISC;
+#if DFS_DIRCACHE
+		endslot = !((PDIRENT) scratch)[di.currententry-1].name[0];
+#endif
 		memcpy(&(((PDIRENT) scratch)[di.currententry-1]), &de, sizeof(DIRENT));
 
 		if (DFS_WriteSector(volinfo->unit, scratch, fileinfo->dirsector, 1)) return DFS_ERRMISC;
+#if DFS_DIRCACHE
+		DFS_DirCacheAdd(volinfo, dircluster, &di, &de);
+		// the entry following a never used one is the new end of the directory
+		if (endslot)
+			DFS_DirEndSet(volinfo, dircluster, &di);
+#endif
 
 		// Mark newly allocated cluster as end of chain			
 		switch(volinfo->filesystem) {
@@ -1044,6 +2188,13 @@ uint32_t DFS_ReadFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, uin
 	uint32_t result = DFS_OK;
 	uint32_t sector;
 	uint32_t bytesread;
+	uint8_t *sbuf = scratch;	// sector buffer for partial sectors
+#if DFS_BUFFERS
+	PFILEBUF fb = DFS_FileBuf(fileinfo);
+
+	if (fb)
+		sbuf = fb->data;
+#endif
 
 	// Don't try to read past EOF
 	if (len > fileinfo->filelen - fileinfo->pointer)
@@ -1064,7 +2215,12 @@ uint32_t DFS_ReadFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, uin
 		if (div(fileinfo->pointer, SECTOR_SIZE).rem) {
 			uint16_t tempreadsize;
 
-			// We always have to go through scratch in this case
+			// We always have to go through scratch (or the file buffer) in this case
+#if DFS_BUFFERS
+			if (fb)
+				result = DFS_FileBufLoad(fb, sector, 1);
+			else
+#endif
 			result = DFS_ReadSector(fileinfo->volinfo->unit, scratch, sector, 1);
 
 			// This is the number of bytes that we actually care about in the sector
@@ -1075,7 +2231,7 @@ uint32_t DFS_ReadFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, uin
 			// point, all passes through the read loop will be aligned on a sector
 			// boundary, which allows us to go through the optimal path 2A below.
 		   	if (remain >= tempreadsize) {
-				memcpy(buffer, scratch + (SECTOR_SIZE - tempreadsize), tempreadsize);
+				memcpy(buffer, sbuf + (SECTOR_SIZE - tempreadsize), tempreadsize);
 				bytesread = tempreadsize;
 				buffer += tempreadsize;
 				fileinfo->pointer += tempreadsize;
@@ -1083,7 +2239,7 @@ uint32_t DFS_ReadFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, uin
 			}
 			// Case 1B - This read concludes the file read operation
 			else {
-				memcpy(buffer, scratch + (SECTOR_SIZE - tempreadsize), remain);
+				memcpy(buffer, sbuf + (SECTOR_SIZE - tempreadsize), remain);
 
 				buffer += remain;
 				fileinfo->pointer += remain;
@@ -1094,23 +2250,62 @@ uint32_t DFS_ReadFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, uin
 		// Case 2 - File pointer is on sector boundary
 		else {
 			// Case 2A - We have at least one more full sector to read and don't have
-			// to go through the scratch buffer. You could insert optimizations here to
-			// read multiple sectors at a time, if you were thus inclined (note that
-			// the maximum multi-read you could perform is a single cluster, so it would
-			// be advantageous to have code similar to case 1A above that would round the
-			// pointer to a cluster boundary the first pass through, so all subsequent
-			// [large] read requests would be able to go a cluster at a time).
+			// to go through the scratch buffer. Read all full sectors up to the end of
+			// the current cluster with one multi-sector request, and if the following
+			// clusters of the chain are physically contiguous, extend that request
+			// over them as well.
 			if (remain >= SECTOR_SIZE) {
-				result = DFS_ReadSector(fileinfo->volinfo->unit, buffer, sector, 1);
-				remain -= SECTOR_SIZE;
-				buffer += SECTOR_SIZE;
-				fileinfo->pointer += SECTOR_SIZE;
-				bytesread = SECTOR_SIZE;
+				uint32_t count;     // sectors to read by one request
+				uint32_t maxcount;  // full sectors left to read
+				uint32_t nextclus;
+				uint32_t index;     // file-relative number of the current cluster
+				uint32_t fatcache = 0;
+
+				index = div(fileinfo->pointer, fileinfo->volinfo->secperclus * SECTOR_SIZE).quot;
+				maxcount = remain / SECTOR_SIZE;
+				// A misaligned buffer can't be handed to the driver, it gets one sector
+				// at a time through scratch
+				if ((uintptr_t) buffer & (DFS_DMAALIGN - 1))
+					maxcount = 1;
+				count = fileinfo->volinfo->secperclus - (sector - fileinfo->volinfo->dataarea -
+						((fileinfo->cluster - 2) * fileinfo->volinfo->secperclus));
+				if (count > maxcount) count = maxcount;
+
+				// Extend the run over the contiguous clusters
+				while (count < maxcount && count + fileinfo->volinfo->secperclus <= DFS_MAXRUN) {
+					nextclus = DFS_NextCluster(fileinfo, scratch, &fatcache, index, fileinfo->cluster);
+					if (nextclus != fileinfo->cluster + 1) break;
+					fileinfo->cluster = nextclus;
+					index++;
+					count += fileinfo->volinfo->secperclus;
+				}
+				if (count > maxcount) count = maxcount;
+
+#if DFS_BUFFERS
+				// The media must be up to date with the file buffer
+				if (fb && fb->dirty && fb->sector >= sector && fb->sector < sector + count)
+					result = DFS_FileBufWriteBack(fb);
+#endif
+				if (!result && ((uintptr_t) buffer & (DFS_DMAALIGN - 1))) {
+					result = DFS_ReadSector(fileinfo->volinfo->unit, scratch, sector, 1);
+					memcpy(buffer, scratch, SECTOR_SIZE);
+				}
+				else if (!result)
+					result = DFS_ReadSector(fileinfo->volinfo->unit, buffer, sector, count);
+				bytesread = count * SECTOR_SIZE;
+				remain -= bytesread;
+				buffer += bytesread;
+				fileinfo->pointer += bytesread;
 			}
 			// Case 2B - We are only reading a partial sector
 			else {
+#if DFS_BUFFERS
+				if (fb)
+					result = DFS_FileBufLoad(fb, sector, 1);
+				else
+#endif
 				result = DFS_ReadSector(fileinfo->volinfo->unit, scratch, sector, 1);
-				memcpy(buffer, scratch, remain);
+				memcpy(buffer, sbuf, remain);
 				buffer += remain;
 				fileinfo->pointer += remain;
 				bytesread = remain;
@@ -1121,8 +2316,9 @@ uint32_t DFS_ReadFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, uin
 		*successcount += bytesread;
 
 		// check to see if we stepped over a cluster boundary
-		if (div(fileinfo->pointer - bytesread, fileinfo->volinfo->secperclus * SECTOR_SIZE).quot !=
-		  div(fileinfo->pointer, fileinfo->volinfo->secperclus * SECTOR_SIZE).quot) {
+		// (a multi-sector read leaves fileinfo->cluster at the last cluster it touched,
+		// so the pointer landing on a cluster boundary is the only case to handle here)
+		if (!div(fileinfo->pointer, fileinfo->volinfo->secperclus * SECTOR_SIZE).rem) {
 			// An act of minor evil - we use bytesread as a scratch integer, knowing that
 			// its value is not used after updating *successcount above
 			bytesread = 0;
@@ -1131,7 +2327,8 @@ uint32_t DFS_ReadFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, uin
 			    ((fileinfo->volinfo->filesystem == FAT32) && (fileinfo->cluster >= 0x0ffffff8)))
 				result = DFS_EOF;
 			else
-				fileinfo->cluster = DFS_GetFAT(fileinfo->volinfo, scratch, &bytesread, fileinfo->cluster);
+				fileinfo->cluster = DFS_NextCluster(fileinfo, scratch, &bytesread,
+				  div(fileinfo->pointer, fileinfo->volinfo->secperclus * SECTOR_SIZE).quot - 1, fileinfo->cluster);
 		}
 	}
 	
@@ -1146,8 +2343,9 @@ uint32_t DFS_ReadFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, uin
 */
 void DFS_Seek(PFILEINFO fileinfo, uint32_t offset, uint8_t *scratch)
 {
-	uint32_t tempint;
-	uint16_t endcluster=0;  //canny/reza 5/7 fixed
+	uint32_t tempint = 0;	// required by DFS_GetFAT
+	uint32_t endcluster;	// file-relative number of the cluster containing offset
+	uint32_t clustersize = fileinfo->volinfo->secperclus * SECTOR_SIZE;
 
 	// larwe 9/16/06 bugfix split case 0a/0b and changed fallthrough handling
 	// Case 0a - Return immediately for degenerate case
@@ -1168,48 +2366,88 @@ void DFS_Seek(PFILEINFO fileinfo, uint32_t offset, uint8_t *scratch)
 		fileinfo->pointer = 0;
 		return;		// larwe 9/16/06 +1 bugfix
 	}
-	// Case 2 - Seeking backwards. Need to reset and seek forwards
-	else if (offset < fileinfo->pointer) {
-		fileinfo->cluster = fileinfo->firstcluster;
-		fileinfo->pointer = 0;
-		// NOTE NO RETURN HERE!
-	}
 
-	// Case 3 - Seeking forwards
-	// Note _intentional_ fallthrough from Case 2 above
+	endcluster = div(offset, clustersize).quot;
 
-	// Case 3a - Seek size does not cross cluster boundary - 
-	// very simple case
-	// larwe 9/16/06 changed .rem to .quot in both div calls, bugfix
-	if (div(fileinfo->pointer, fileinfo->volinfo->secperclus * SECTOR_SIZE).quot ==
-	  div(fileinfo->pointer + offset, fileinfo->volinfo->secperclus * SECTOR_SIZE).quot) {
+	// Case 2 - Seek within the current cluster, in either direction - very simple case
+	if (div(fileinfo->pointer, clustersize).quot == endcluster) {
 		fileinfo->pointer = offset;
+		return;
 	}
-	// Case 3b - Seeking across cluster boundary(ies)
-	else {
-		// round file pointer down to cluster boundary
-		fileinfo->pointer = div(fileinfo->pointer, fileinfo->volinfo->secperclus * SECTOR_SIZE).quot *
-		  fileinfo->volinfo->secperclus * SECTOR_SIZE;
-
-		// seek by clusters
-		// larwe 9/30/06 bugfix changed .rem to .quot in both div calls
-        // canny/reza 5/7  added endcluster related code
-        endcluster = div(fileinfo->pointer + offset, fileinfo->volinfo->secperclus * SECTOR_SIZE).quot;
-        while (div(fileinfo->pointer, fileinfo->volinfo->secperclus * SECTOR_SIZE).quot !=endcluster) {
-			fileinfo->cluster = DFS_GetFAT(fileinfo->volinfo, scratch, &tempint, fileinfo->cluster);
-			// Abort if there was an error
-			if (fileinfo->cluster == 0x0ffffff7) {
-				fileinfo->pointer = 0;
-				fileinfo->cluster = fileinfo->firstcluster;
-				return;
-			}
-			fileinfo->pointer += SECTOR_SIZE * fileinfo->volinfo->secperclus;
-		}
 
-		// since we know the cluster is right, we have no more work to do
+#if DFS_EXTENTS
+	// Case 3 - The target cluster is in the extent map, no FAT access needed
+	tempint = DFS_ExtentFind(fileinfo, endcluster);
+	if (tempint) {
+		fileinfo->cluster = tempint;
 		fileinfo->pointer = offset;
+		return;
+	}
+
+	// Otherwise the target is beyond the mapped part of the chain: start walking
+	// from the last mapped cluster, unless the current position is closer
+	if (fileinfo->extents) {
+		PEXTENT ext = fileinfo->extent + fileinfo->extents - 1;
+
+		tempint = DFS_ExtentMapped(fileinfo) - 1;
+		if (div(fileinfo->pointer, clustersize).quot > endcluster ||
+		    div(fileinfo->pointer, clustersize).quot < tempint) {
+			fileinfo->cluster = ext->cluster + ext->count - 1;
+			fileinfo->pointer = tempint * clustersize;
+		}
+	}
+	tempint = 0;
+#endif
+
+	// Case 4 - Seeking backwards. Need to reset and seek forwards
+	if (offset < fileinfo->pointer) {
+		fileinfo->cluster = fileinfo->firstcluster;
+		fileinfo->pointer = 0;
+		// NOTE NO RETURN HERE!
+	}
+
+	// Case 5 - Seeking forwards across cluster boundary(ies)
+	// Note _intentional_ fallthrough from Case 4 above
+	// round file pointer down to cluster boundary
+	fileinfo->pointer = div(fileinfo->pointer, clustersize).quot * clustersize;
+
+	// seek by clusters
+	// larwe 9/30/06 bugfix changed .rem to .quot in both div calls
+	// canny/reza 5/7  added endcluster related code
+	while (div(fileinfo->pointer, clustersize).quot != endcluster) {
+		fileinfo->cluster = DFS_NextCluster(fileinfo, scratch, &tempint,
+		  div(fileinfo->pointer, clustersize).quot, fileinfo->cluster);
+		// Abort if there was an error
+		if (fileinfo->cluster == 0x0ffffff7) {
+			fileinfo->pointer = 0;
+			fileinfo->cluster = fileinfo->firstcluster;
+			return;
+		}
+		fileinfo->pointer += clustersize;
 	}
+
+	// since we know the cluster is right, we have no more work to do
+	fileinfo->pointer = offset;
+}
+
+#if DFS_ERASE
+/*
+	Erase a run of free clusters if it is at least DFS_ERASE sectors long
+	Erasing is only a hint for the media, errors are ignored.
+	Returns nonzero if the run was erased.
+*/
+static uint32_t DFS_EraseClusters(PVOLINFO volinfo, uint32_t cluster, uint32_t count)
+{
+	if (cluster < 2 || count * volinfo->secperclus < DFS_ERASE)
+		return 0;
+
+	if (DFS_EraseSector(volinfo->unit, volinfo->dataarea + (cluster - 2) * volinfo->secperclus,
+	    count * volinfo->secperclus))
+		return 0;
+
+	return 1;
 }
+#endif
 
 /*
 	Delete a file
@@ -1221,6 +2459,9 @@ uint32_t DFS_UnlinkFile(PVOLINFO volinfo, uint8_t *path, uint8_t *scratch)
 	FILEINFO fi;
 	uint32_t cache = 0;
 	uint32_t tempclus;
+#if DFS_ERASE
+	uint32_t run = 0, runlen = 0, erased = 0;
+#endif
 
 	// DFS_OpenFile gives us all the information we need to delete it
 	if (DFS_OK != DFS_OpenFile(volinfo, path, DFS_READ, scratch, &fi))
@@ -1232,6 +2473,9 @@ uint32_t DFS_UnlinkFile(PVOLINFO volinfo, uint8_t *path, uint8_t *scratch)
 	((PDIRENT) scratch)[fi.diroffset].name[0] = 0xe5;
 	if (DFS_WriteSector(volinfo->unit, scratch, fi.dirsector, 1))
 		return DFS_ERRMISC;
+#if DFS_DIRCACHE
+	DFS_DirCacheDrop(volinfo, fi.dirsector, fi.diroffset);
+#endif
 
 	// Now follow the cluster chain to free the file space
 	while (!((volinfo->filesystem == FAT12 && fi.firstcluster >= 0x00000ff7) ||
@@ -1242,7 +2486,27 @@ uint32_t DFS_UnlinkFile(PVOLINFO volinfo, uint8_t *path, uint8_t *scratch)
 		fi.firstcluster = DFS_GetFAT(volinfo, scratch, &cache, fi.firstcluster);
 		DFS_SetFAT(volinfo, scratch, &cache, tempclus, 0);
 
+#if DFS_ERASE
+		// Erase the freed clusters in physically contiguous runs
+		if (runlen && tempclus == run + runlen) {
+			runlen++;
+		} else {
+			if (DFS_EraseClusters(volinfo, run, runlen) && !erased)
+				erased = run;
+			run = tempclus;
+			runlen = 1;
+		}
+#endif
 	}
+#if DFS_ERASE
+	if (DFS_EraseClusters(volinfo, run, runlen) && !erased)
+		erased = run;
+	if (erased) {
+		// The next file goes to the erased space
+		volinfo->nextfree = erased;
+		volinfo->fsinfodirty = 1;
+	}
+#endif
 	return DFS_OK;
 }
 
@@ -1259,6 +2523,10 @@ uint32_t DFS_WriteFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, ui
 	uint32_t result = DFS_OK;
 	uint32_t sector;
 	uint32_t byteswritten;
+#if DFS_BUFFERS
+	PFILEBUF fb = DFS_FileBuf(fileinfo);
+	uint32_t pending = 0;	// completed sector in the file buffer waits for the next run
+#endif
 
 	// Don't allow writes to a file that's open as readonly
 	if (!(fileinfo->mode & DFS_WRITE))
@@ -1275,6 +2543,43 @@ uint32_t DFS_WriteFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, ui
 		  ((fileinfo->cluster - 2) * fileinfo->volinfo->secperclus) +
 		  div(div(fileinfo->pointer,fileinfo->volinfo->secperclus * SECTOR_SIZE).rem, SECTOR_SIZE).quot;
 
+#if DFS_BUFFERS
+		// Partial sector and the file has a buffer - collect the bytes there
+		if (fb && (div(fileinfo->pointer, SECTOR_SIZE).rem || remain < SECTOR_SIZE)) {
+			uint16_t tempsize;
+
+			// This is the number of bytes in the sector in front of the pointer
+			tempsize = div(fileinfo->pointer, SECTOR_SIZE).rem;
+
+			byteswritten = SECTOR_SIZE - tempsize;
+			if (byteswritten > remain)
+				byteswritten = remain;
+
+			// The sector needs to be read only if it already holds file data
+			result = DFS_FileBufLoad(fb, sector, fileinfo->pointer - tempsize < fileinfo->filelen);
+			if (!result) {
+				memcpy(fb->data + tempsize, buffer, byteswritten);
+				fb->dirty = 1;
+				// Nothing more is going to be collected in a completed sector. If full
+				// sectors from an aligned buffer follow, it is written together with them.
+				if (tempsize + byteswritten == SECTOR_SIZE) {
+					if (remain - byteswritten >= SECTOR_SIZE &&
+					  !((uintptr_t) (buffer + byteswritten) & (DFS_DMAALIGN - 1)))
+						pending = 1;
+					else
+						result = DFS_FileBufWriteBack(fb);
+				}
+			}
+
+			buffer += byteswritten;
+			fileinfo->pointer += byteswritten;
+			if (fileinfo->filelen < fileinfo->pointer) {
+				fileinfo->filelen = fileinfo->pointer;
+			}
+			remain -= byteswritten;
+		}
+		else
+#endif
 		// Case 1 - File pointer is not on a sector boundary
 		if (div(fileinfo->pointer, SECTOR_SIZE).rem) {
 			uint16_t tempsize;
@@ -1321,18 +2626,87 @@ uint32_t DFS_WriteFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, ui
 		// Case 2 - File pointer is on sector boundary
 		else {
 			// Case 2A - We have at least one more full sector to write and don't have
-			// to go through the scratch buffer. You could insert optimizations here to
-			// write multiple sectors at a time, if you were thus inclined. Refer to
-			// similar notes in DFS_ReadFile.
+			// to go through the scratch buffer. As in DFS_ReadFile, all full sectors up
+			// to the end of the current cluster, and on over the following clusters of
+			// the chain while they are physically contiguous (e.g. preallocated), are
+			// written by one multi-sector request.
 			if (remain >= SECTOR_SIZE) {
-				result = DFS_WriteSector(fileinfo->volinfo->unit, buffer, sector, 1);
-				remain -= SECTOR_SIZE;
-				buffer += SECTOR_SIZE;
-				fileinfo->pointer += SECTOR_SIZE;
+				uint32_t count;     // sectors to write by one request
+				uint32_t maxcount;  // full sectors left to write
+				uint32_t nextclus;
+				uint32_t index;     // file-relative number of the current cluster
+				uint32_t fatcache = 0;
+				uint32_t head = 0;  // sectors from the file buffer in front of the run
+
+#if DFS_BUFFERS
+				// The completed sector in the file buffer leads the run if it is the
+				// physically preceding one, otherwise it goes by itself
+				if (pending) {
+					pending = 0;
+					if (fb->sector + 1 == sector)
+						head = 1;
+					else
+						result = DFS_FileBufWriteBack(fb);
+				}
+#endif
+
+				index = div(fileinfo->pointer, fileinfo->volinfo->secperclus * SECTOR_SIZE).quot;
+				maxcount = remain / SECTOR_SIZE;
+				// A misaligned buffer can't be handed to the driver, it gets one sector
+				// at a time through scratch
+				if ((uintptr_t) buffer & (DFS_DMAALIGN - 1))
+					maxcount = 1;
+				count = fileinfo->volinfo->secperclus - (sector - fileinfo->volinfo->dataarea -
+						((fileinfo->cluster - 2) * fileinfo->volinfo->secperclus));
+				if (count > maxcount) count = maxcount;
+
+				// Extend the run over the contiguous clusters
+				while (count < maxcount && head + count + fileinfo->volinfo->secperclus <= DFS_MAXRUN) {
+					nextclus = DFS_NextCluster(fileinfo, scratch, &fatcache, index, fileinfo->cluster);
+					if (nextclus != fileinfo->cluster + 1) break;
+					fileinfo->cluster = nextclus;
+					index++;
+					count += fileinfo->volinfo->secperclus;
+				}
+				if (count > maxcount) count = maxcount;
+
+				if (result) {
+					// the file buffer could not be written
+				}
+				else if ((uintptr_t) buffer & (DFS_DMAALIGN - 1)) {
+					memcpy(scratch, buffer, SECTOR_SIZE);
+					result = DFS_WriteSector(fileinfo->volinfo->unit, scratch, sector, 1);
+				}
+#if DFS_BUFFERS
+				else if (head) {
+					SECTORSEG seg[2];
+
+					// file buffer and caller's data without copying them together
+					seg[0].buffer = fb->data;
+					seg[0].count = 1;
+					seg[1].buffer = buffer;
+					seg[1].count = count;
+					result = DFS_WriteSectorV(fileinfo->volinfo->unit, seg, 2, fb->sector);
+					if (!result)
+						fb->dirty = 0;
+				}
+#endif
+				else
+					result = DFS_WriteSector(fileinfo->volinfo->unit, buffer, sector, count);
+#if DFS_BUFFERS
+				// the sectors have been replaced as a whole
+				if (fb && fb->sector >= sector && fb->sector < sector + count) {
+					fb->sector = 0;
+					fb->dirty = 0;
+				}
+#endif
+				byteswritten = count * SECTOR_SIZE;
+				remain -= byteswritten;
+				buffer += byteswritten;
+				fileinfo->pointer += byteswritten;
 				if (fileinfo->filelen < fileinfo->pointer) {
 					fileinfo->filelen = fileinfo->pointer;
 				}
-				byteswritten = SECTOR_SIZE;
 			}
 			// Case 2B - We are only writing a partial sector and potentially need to
 			// go through the scratch buffer.
@@ -1364,9 +2738,11 @@ uint32_t DFS_WriteFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, ui
 		*successcount += byteswritten;
 
 		// check to see if we stepped over a cluster boundary
-		if (div(fileinfo->pointer - byteswritten, fileinfo->volinfo->secperclus * SECTOR_SIZE).quot !=
-		  div(fileinfo->pointer, fileinfo->volinfo->secperclus * SECTOR_SIZE).quot) {
+		// (a multi-sector write leaves fileinfo->cluster at the last cluster it touched,
+		// so the pointer landing on a cluster boundary is the only case to handle here)
+		if (!div(fileinfo->pointer, fileinfo->volinfo->secperclus * SECTOR_SIZE).rem) {
 		  	uint32_t lastcluster;
+			uint32_t index;
 
 		  	// We've transgressed into another cluster. If we were already at EOF,
 		  	// we need to allocate a new cluster.
@@ -1374,8 +2750,10 @@ uint32_t DFS_WriteFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, ui
 			// that its value is not used after updating *successcount above
 			byteswritten = 0;
 
+			// file-relative number of the cluster we've just left
+			index = div(fileinfo->pointer, fileinfo->volinfo->secperclus * SECTOR_SIZE).quot - 1;
 			lastcluster = fileinfo->cluster;
-			fileinfo->cluster = DFS_GetFAT(fileinfo->volinfo, scratch, &byteswritten, fileinfo->cluster);
+			fileinfo->cluster = DFS_NextCluster(fileinfo, scratch, &byteswritten, index, fileinfo->cluster);
 			
 			// Allocate a new cluster?
 			if (((fileinfo->volinfo->filesystem == FAT12) && (fileinfo->cluster >= 0x00000ff8)) ||
@@ -1391,6 +2769,9 @@ uint32_t DFS_WriteFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, ui
 				// Link new cluster onto file
 				DFS_SetFAT(fileinfo->volinfo, scratch, &byteswritten, lastcluster, tempclus);
 				fileinfo->cluster = tempclus;
+#if DFS_EXTENTS
+				DFS_ExtentAdd(fileinfo, index + 1, tempclus);
+#endif
 
 				// Mark newly allocated cluster as end of chain			
 				switch(fileinfo->volinfo->filesystem) {
@@ -1407,130 +2788,1051 @@ uint32_t DFS_WriteFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, ui
 		}
 	}
 	
+#if DFS_BUFFERS
+	// A file with a buffer has its directory entry updated by DFS_Sync or when the
+	// buffer is detached
+	if (fb) {
+		fb->filelen = fileinfo->filelen;
+		fb->direntdirty = 1;
+		return result;
+	}
+#endif
+
 	// Update directory entry
-	if (DFS_ReadSector(fileinfo->volinfo->unit, scratch, fileinfo->dirsector, 1)) return DFS_ERRMISC;
-	((PDIRENT) scratch)[fileinfo->diroffset].filesize_0 =  fileinfo->filelen & 0x000000ff;
-	((PDIRENT) scratch)[fileinfo->diroffset].filesize_1 = (fileinfo->filelen & 0x0000ff00) >> 8;
-	((PDIRENT) scratch)[fileinfo->diroffset].filesize_2 = (fileinfo->filelen & 0x00ff0000) >> 16;
-	((PDIRENT) scratch)[fileinfo->diroffset].filesize_3 = (fileinfo->filelen & 0xff000000) >> 24;
+	if (DFS_UpdateDirEnt(fileinfo->volinfo, scratch, fileinfo->dirsector, fileinfo->diroffset, fileinfo->filelen))
+		return DFS_ERRMISC;
+	return result;
+}
 
-#ifdef DFS_RTC
-	// SDA 21.08.14: use current RTC date/time for file last write date/time
 
-//	RTC_TimeTypeDef RTC_Time;
-//	RTC_DateTypeDef RTC_Date;
+/*
+	Find a run of count free clusters, starting the search at cluster start
+	You must provide a scratch buffer for one sector (SECTOR_SIZE) and a populated VOLINFO
+	Returns the first cluster of the run, or FAT32 bad_sector (0x0ffffff7) if there is
+	no such run
+*/
+static uint32_t DFS_GetFreeRun(PVOLINFO volinfo, uint8_t *scratch, uint32_t start, uint32_t count)
+{
+	uint32_t i, n, run = 0, scratchcache = 0;
+
+	if (start < 2 || start >= volinfo->numclusters + 2)
+		start = 2;
+	i = start;
+	// numclusters + count steps check every possible run once, including
+	// the ones which start before the starting cluster
+	for (n = volinfo->numclusters + count; n; n--) {
+		if (i >= volinfo->numclusters + 2) {
+			// a run can't wrap around the end of the volume
+			i = 2;
+			run = 0;
+		}
+		if (DFS_GetFAT(volinfo, scratch, &scratchcache, i))
+			run = 0;
+		else if (++run == count)
+			return i + 1 - count;
+		i++;
+	}
 
-//	RTC_GetDateTime(&RTC_Time,&RTC_Date);
+	return 0x0ffffff7;
+}
 
-	// RTC_Time and RTC_Date structures are populated every second by RTC_WKUP IRQ handler
+/*
+	Preallocate space for a file
+	Makes sure the cluster chain of the file can hold filelen + bytes bytes, so that
+	the following writes up to that size touch only data sectors and the directory
+	entry. The missing clusters are taken as one contiguous run, preferably directly
+	after the last cluster of the file, and linked into the chain in one pass.
+	The file length is not changed; the unused part of the chain is released by
+	DFS_CloseFile.
+	You must supply a prepopulated FILEINFO as provided by DFS_OpenFile, and a
+	pointer to a SECTOR_SIZE scratch buffer.
+	Returns 0 OK, DFS_ERRMISC if there is no free run long enough (nothing is
+	allocated then) or for any other error.
+*/
+uint32_t DFS_Preallocate(PFILEINFO fileinfo, uint8_t *scratch, uint32_t bytes)
+{
+	PVOLINFO volinfo = fileinfo->volinfo;
+	uint32_t clustersize = volinfo->secperclus * SECTOR_SIZE;
+	uint32_t cluster, next, index, need, run, i;
+	uint32_t cache = 0;
 
-	// Last write date/time
-	((PDIRENT) scratch)[fileinfo->diroffset].wrttime = DFS_FATTime(&RTC_Time);
-	((PDIRENT) scratch)[fileinfo->diroffset].wrtdate = DFS_FATDate(&RTC_Date);
+	if (!(fileinfo->mode & DFS_WRITE) || fileinfo->firstcluster < 2)
+		return DFS_ERRMISC;
+
+	// number of clusters the chain must have
+	need = div(fileinfo->filelen + bytes + clustersize - 1, clustersize).quot;
+
+	// find the last cluster of the chain
+	cluster = fileinfo->firstcluster;
+	index = 0;
+	for (;;) {
+		next = DFS_NextCluster(fileinfo, scratch, &cache, index, cluster);
+		if (next == 0x0ffffff7)
+			return DFS_ERRMISC;
+		if (DFS_IsEOC(volinfo, next))
+			break;
+		cluster = next;
+		index++;
+	}
+	if (index + 1 >= need)
+		return DFS_OK;
+	need -= index + 1;
+
+	run = DFS_GetFreeRun(volinfo, scratch, cluster + 1, need);
+	if (run == 0x0ffffff7)
+		return DFS_ERRMISC;
+
+	// Build the chain of the run first and link it to the file last, so an
+	// interrupted preallocation leaves lost clusters rather than a broken file
+	cache = 0;
+	for (i = 0; i < need; i++) {
+		if (DFS_SetFAT(volinfo, scratch, &cache, run + i, (i == need - 1) ? 0x0ffffff8 : run + i + 1))
+			return DFS_ERRMISC;
+	}
+	if (DFS_SetFAT(volinfo, scratch, &cache, cluster, run))
+		return DFS_ERRMISC;
+
+	volinfo->nextfree = run + need;
+	volinfo->fsinfodirty = 1;
+
+#if DFS_ERASE
+	DFS_EraseClusters(volinfo, run, need);
+#endif
+
+	// The file pointer may sit at the very end of the old chain
+	if (div(fileinfo->pointer, clustersize).quot == index + 1)
+		fileinfo->cluster = run;
+
+#if DFS_EXTENTS
+	for (i = 0; i < need; i++)
+		DFS_ExtentAdd(fileinfo, index + 1 + i, run + i);
+#endif
+
+	return DFS_OK;
+}
+
+/*
+	Close a file
+	For a file opened for writing the clusters of the chain beyond the file length
+	(e.g. left over from DFS_Preallocate) are released and the volume is synced
+	(see DFS_Sync). Like DFS_WriteFile does, the chain keeps the cluster following
+	a file length which ends on a cluster boundary.
+	The file buffer, if any, is written back and returned to the arena first.
+	You must supply a prepopulated FILEINFO as provided by DFS_OpenFile, and a
+	pointer to a SECTOR_SIZE scratch buffer.
+	Returns 0 OK, nonzero for any error.
+*/
+uint32_t DFS_CloseFile(PFILEINFO fileinfo, uint8_t *scratch)
+{
+	PVOLINFO volinfo = fileinfo->volinfo;
+	uint32_t cluster, next, index, keep;
+	uint32_t cache = 0;
+
+	if (DFS_DetachBuffer(fileinfo))
+		return DFS_ERRMISC;
+
+	// Nothing to do for read-only files; directories have no file length
+	if (!(fileinfo->mode & DFS_WRITE) || fileinfo->mode == DFS_CREATEDIR || fileinfo->firstcluster < 2)
+		return DFS_OK;
+
+	keep = div(fileinfo->filelen, volinfo->secperclus * SECTOR_SIZE).quot + 1;
+
+	// walk to the last cluster to keep
+	cluster = fileinfo->firstcluster;
+	for (index = 0; index < keep - 1; index++) {
+		cluster = DFS_NextCluster(fileinfo, scratch, &cache, index, cluster);
+		if (DFS_IsEOC(volinfo, cluster))
+			break;
+	}
+
+	if (index == keep - 1) {
+		next = DFS_GetFAT(volinfo, scratch, &cache, cluster);
+		if (!DFS_IsEOC(volinfo, next)) {
+			// Cut the chain and release the tail. The tail is where the next
+			// allocation should go, so it can continue contiguously.
+			if (DFS_SetFAT(volinfo, scratch, &cache, cluster, 0x0ffffff8))
+				return DFS_ERRMISC;
+			volinfo->nextfree = next;
+			volinfo->fsinfodirty = 1;
+			while (!DFS_IsEOC(volinfo, next)) {
+				cluster = next;
+				next = DFS_GetFAT(volinfo, scratch, &cache, cluster);
+				if (DFS_SetFAT(volinfo, scratch, &cache, cluster, 0))
+					return DFS_ERRMISC;
+			}
+		}
+#if DFS_EXTENTS
+		DFS_ExtentTrim(fileinfo, keep);
+#endif
+	}
+
+#if DFS_MIRRORMAP
+	// Mark the volume clean, this goes to both FAT copies with the mirror pass below
+	if (DFS_MirrorVol == volinfo && volinfo->inuse) {
+		next = DFS_GetFAT(volinfo, scratch, &cache, 1);
+		if (next == 0x0ffffff7 ||
+		    DFS_SetFAT(volinfo, scratch, &cache, 1, next | DFS_CleanBit(volinfo)))
+			return DFS_ERRMISC;
+	}
+#endif
+
+	if (DFS_SyncMirror(volinfo, scratch))
+		return DFS_ERRMISC;
+
+#if DFS_MIRRORMAP
+	// the next FAT change marks the volume as in use again
+	volinfo->inuse = 0;
+#endif
+
+	return DFS_OK;
+}
+
+/*
+	Sync the volume (see DFS_Sync) and bring FAT copy 2 up to date with copy 1
+	scratch must point to a sector-sized buffer
+	Returns 0 OK, nonzero for any error.
+*/
+uint32_t DFS_SyncMirror(PVOLINFO volinfo, uint8_t *scratch)
+{
+#if DFS_MIRRORMAP
+	uint32_t group, sector, end;
+#endif
+
+	if (DFS_Sync(volinfo, scratch))
+		return DFS_ERRMISC;
+
+#if DFS_MIRRORMAP
+	if (DFS_MirrorVol != volinfo)
+		return DFS_OK;
+
+	for (group = 0; group < DFS_MIRRORMAP * 8; group++) {
+		if (!DFS_MIRROR_TEST(group))
+			continue;
+		end = (group + 1) << DFS_MirrorShift;
+		if (end > volinfo->secperfat)
+			end = volinfo->secperfat;
+		for (sector = group << DFS_MirrorShift; sector < end; sector++) {
+			if (DFS_ReadSector(volinfo->unit, scratch, volinfo->fat1 + sector, 1) ||
+			    DFS_WriteSector(volinfo->unit, scratch, volinfo->fat1 + volinfo->secperfat + sector, 1))
+				return DFS_ERRMISC;
+		}
+		DFS_MIRROR_CLEAR(group);
+	}
+	if (DFS_FlushCache(volinfo->unit))
+		return DFS_ERRMISC;
 #endif
 
-	if (DFS_WriteSector(fileinfo->volinfo->unit, scratch, fileinfo->dirsector, 1)) return DFS_ERRMISC;
-	return result;
+	return DFS_OK;
 }
 
-
 /*
 	Get number of free clusters
 	you must supply a prepopulated VOLUMEINFO as provided by DFS_GetVolInfo, and a
 	pointer to a SECTOR_SIZE scratch buffer.
 	cfree - pointer to the variable for number of free clusters
 	Returns 0 OK, nonzero for any error.
-	Note: on big volumes with large number of clusters this procedure will be really slow
+	Note: on big volumes with large number of clusters the first call will be really slow,
+	after that the count is kept up to date by DFS_SetFAT (FAT32 volumes usually get it
+	from the FSInfo sector, so there is no scan at all)
+	The scan also rebuilds the free cluster map.
 */
 uint32_t DFS_GetFree(PVOLINFO volinfo, uint8_t *scratch, uint32_t *cfree) {
 	uint32_t cluster;
 	uint32_t sector;
 	uint32_t free_clusters = 0; // counter
 	uint32_t fat_val;
-	uint32_t tempint; // required by DFS_GetFAT
+	uint32_t tempint = 0; // required by DFS_GetFAT
 	uint32_t spos = 0; // offset in sector
 	uint32_t *fval32;
 	uint16_t *fval16;
 
+	if (volinfo->freecount != 0xffffffff) {
+		*cfree = volinfo->freecount;
+		return 0;
+	}
+
+	// For FAT16/FAT32 will read FAT sectors directly, so the FAT cache
+	// must be written back first
+	if (DFS_FlushFAT(volinfo)) return 0x0ffffff7;
+
+#if DFS_FREEMAP
+	if (DFS_FreeMapVol == volinfo)
+		memset(DFS_FreeMap, 0, DFS_FREEMAP);
+#endif
+
+	fat_val = 0;
 	if (volinfo->filesystem == FAT12) {
 		// Compute number free clusters for FAT12
 		cluster = 2;
 		do {
 			fat_val = DFS_GetFAT(volinfo,scratch,&tempint,cluster);
-			if (fat_val == 0x0ffffff7) return fat_val;
-			if (!fat_val) free_clusters++;
-		} while (++cluster < volinfo->numclusters);
+			if (fat_val == 0x0ffffff7) break;
+			if (!fat_val) {
+				free_clusters++;
+				DFS_FreeUpdate(volinfo,cluster,1,0);
+			}
+		} while (++cluster < volinfo->numclusters + 2);
 	} else {
-		// For FAT16/FAT32 will read FAT sectors directly
-		cluster = volinfo->numclusters;
+		cluster = 0; // entries 0 and 1 are reserved, they are read but not counted
 		sector  = volinfo->fat1; // FAT table first sector
-		do {
+		while (cluster < volinfo->numclusters + 2) {
 			if (!spos) {
 				spos = volinfo->sectorsize;
-				tempint = DFS_ReadSector(0,scratch,sector++,spos);
-				if (tempint) return 0x0ffffff7;
+				tempint = DFS_ReadSector(volinfo->unit,scratch,sector++,1);
+				if (tempint) {
+					fat_val = 0x0ffffff7;
+					break;
+				}
 				fval32 = (uint32_t *)scratch;
 				fval16 = (uint16_t *)scratch;
 			}
 			if (volinfo->filesystem == FAT16) {
-				if (!*fval16) free_clusters++;
+				if (!*fval16 && cluster >= 2) {
+					free_clusters++;
+					DFS_FreeUpdate(volinfo,cluster,1,0);
+				}
 				fval16++;
 				spos -= 2;
 			} else {
-				if (!(*fval32 & 0x0fffffff)) free_clusters++;
+				if (!(*fval32 & 0x0fffffff) && cluster >= 2) {
+					free_clusters++;
+					DFS_FreeUpdate(volinfo,cluster,1,0);
+				}
 				fval32++;
 				spos -= 4;
 			}
-		} while (--cluster);
-		free_clusters += 2;
+			cluster++;
+		}
+	}
+
+	if (fat_val == 0x0ffffff7) {
+#if DFS_FREEMAP
+		// The map is incomplete, forget what has been learned
+		if (DFS_FreeMapVol == volinfo)
+			memset(DFS_FreeMap, 0xff, DFS_FREEMAP);
+#endif
+		return fat_val;
 	}
+
+	volinfo->freecount = free_clusters;
+	volinfo->fsinfodirty = 1;
 	*cfree = free_clusters;
 
 	return 0;
 }
 
 
-// Read sector from the SD card
+#ifdef DFS_STATS
+// I/O statistics
+DFS_IOSTATS DFS_IOStats;
+#endif
+
+
+#ifndef HOSTVER
+// Read sectors from the SD card
 // input:
-//   unit - device number (ignored)
-//   buffer - pointer to the data buffer (one sector sized)
+//   ctx - device context (unused)
+//   buffer - pointer to the data buffer (count sectors sized)
 //   sector - sector address
-//   count - number of sectors to read (ignored, one sector always)
+//   count - number of sectors to read (at most DFS_MAXRUN)
 // return: 0 OK, nonzero for any error
-uint32_t DFS_ReadSector(uint8_t unit, uint8_t *buffer, uint32_t sector, uint32_t count) {
-	SDResult Status = SDR_Success;
+// note: multiple sectors are read by one multiple block command (CMD18)
+static uint32_t DFS_SDRead(void *ctx, uint8_t *buffer, uint32_t sector, uint32_t count) {
+	SDResult Status;
 
 	// Polling read
-//    Status = SD_ReadBlock(sector << 9,(uint32_t *)buffer,SECTOR_SIZE);
+//	Status = SD_ReadBlock(sector << 9,(uint32_t *)buffer,count * SECTOR_SIZE);
 
 	// DMA read
-	Status = SD_ReadBlock_DMA(sector << 9,(uint32_t *)buffer,SECTOR_SIZE);
+	Status = SD_ReadBlock_DMA(sector << 9,(uint32_t *)buffer,count * SECTOR_SIZE);
 	if (Status == SDR_Success) {
-		Status = SD_CheckRead(SECTOR_SIZE);
+		Status = SD_CheckRead(count * SECTOR_SIZE);
 	}
 
-    return (Status == SDR_Success) ? 0 : 1;
+	return (Status == SDR_Success) ? 0 : 1;
 }
 
 
-// Write sector to the SD card
+// Write sectors to the SD card
 // input:
-//   unit - device number (ignored)
-//   buffer - pointer to the data buffer (one sector sized)
+//   ctx - device context (unused)
+//   buffer - pointer to the data buffer (count sectors sized)
 //   sector - sector address
-//   count - number of sectors to read (ignored, one sector always)
+//   count - number of sectors to write (at most DFS_MAXRUN)
 // return: 0 OK, nonzero for any error
-uint32_t DFS_WriteSector(uint8_t unit, uint8_t *buffer, uint32_t sector, uint32_t count) {
-	SDResult Status = SDR_Success;
+// note: multiple sectors are written by one multiple block command (CMD25)
+static uint32_t DFS_SDWrite(void *ctx, uint8_t *buffer, uint32_t sector, uint32_t count) {
+	SDResult Status;
 
 	// Polling write
-//    Status = SD_WriteBlock(sector << 9,(uint32_t *)buffer,SECTOR_SIZE);
+//	Status = SD_WriteBlock(sector << 9,(uint32_t *)buffer,count * SECTOR_SIZE);
 
 	// DMA write
-	Status = SD_WriteBlock_DMA(sector << 9,(uint32_t *)buffer,SECTOR_SIZE);
+	Status = SD_WriteBlock_DMA(sector << 9,(uint32_t *)buffer,count * SECTOR_SIZE);
 	if (Status == SDR_Success) {
-		Status = SD_CheckWrite(SECTOR_SIZE);
+		Status = SD_CheckWrite(count * SECTOR_SIZE);
 	}
 
 	return (Status == SDR_Success) ? 0 : 1;
 }
+
+// Erase sectors on the SD card
+// input:
+//   ctx - device context (unused)
+//   sector - address of the first sector
+//   count - number of sectors to erase
+// return: 0 OK, nonzero for any error
+// note: the card erases in the background, the next command waits for it
+static uint32_t DFS_SDErase(void *ctx, uint32_t sector, uint32_t count) {
+	return (SD_Erase(sector << 9,count * SECTOR_SIZE) == SDR_Success) ? 0 : 1;
+}
+
+#if DFS_SDIO_SG
+// Segments per SDIO scatter-gather command
+#define DFS_SDSEGS      8
+
+// Transfer sectors from/to a list of buffers with scatter-gather SDIO commands
+// input:
+//   seg - pointer to the array of segments
+//   segs - number of segments
+//   sector - address of the first sector
+//   write - nonzero to write to the card
+// return: 0 OK, nonzero for any error
+// note: up to DFS_SDSEGS segments go with one command
+static uint32_t DFS_SDTransferV(PSECTORSEG seg, uint32_t segs, uint32_t sector, uint32_t write) {
+	SD_Segment_TypeDef sd_seg[DFS_SDSEGS];
+	SDResult Status;
+	uint32_t count;
+	uint32_t n;
+
+	while (segs) {
+		count = 0;
+		for (n = 0; n < segs && n < DFS_SDSEGS; n++) {
+			sd_seg[n].pBuf = (uint32_t *)seg[n].buffer;
+			sd_seg[n].blocks = seg[n].count;
+			count += seg[n].count;
+		}
+
+		if (write) {
+			Status = SD_WriteBlock_SG(sector << 9,sd_seg,n,NULL);
+		} else {
+			Status = SD_ReadBlock_SG(sector << 9,sd_seg,n,NULL);
+		}
+		if (Status == SDR_Success) {
+			Status = SD_XferWait();
+		}
+		if (Status != SDR_Success) return 1;
+
+		seg    += n;
+		segs   -= n;
+		sector += count;
+	}
+
+	return 0;
+}
+
+// Read sectors from the SD card into a list of buffers
+static uint32_t DFS_SDReadV(void *ctx, PSECTORSEG seg, uint32_t segs, uint32_t sector) {
+	return DFS_SDTransferV(seg,segs,sector,0);
+}
+
+// Write sectors from a list of buffers to the SD card
+static uint32_t DFS_SDWriteV(void *ctx, PSECTORSEG seg, uint32_t segs, uint32_t sector) {
+	return DFS_SDTransferV(seg,segs,sector,1);
+}
+
+// SD card on SDIO, the device of unit 0
+static BLOCKDEV DFS_SDCard = { DFS_SDRead, DFS_SDWrite, DFS_MAXRUN, NULL, DFS_SDReadV, DFS_SDWriteV, DFS_SDErase };
+#else
+// SD card on SDIO, the device of unit 0
+static BLOCKDEV DFS_SDCard = { DFS_SDRead, DFS_SDWrite, DFS_MAXRUN, NULL, NULL, NULL, DFS_SDErase };
+#endif // DFS_SDIO_SG
+#endif // HOSTVER
+
+// Block devices of the units (see DFS_AttachDevice)
+static PBLOCKDEV DFS_Devices[DFS_UNITS] = {
+#ifndef HOSTVER
+	&DFS_SDCard
+#else
+	NULL
+#endif
+};
+
+// Read sectors from a block device
+// input:
+//   dev - the device (NULL fails)
+//   buffer - pointer to the data buffer (count sectors sized)
+//   sector - sector address
+//   count - number of sectors to read
+// return: 0 OK, nonzero for any error
+// note: requests longer than the maxrun of the device are split into several calls,
+//       each of them is accounted as one media command in DFS_IOStats
+static uint32_t DFS_DevRead(PBLOCKDEV dev, uint8_t *buffer, uint32_t sector, uint32_t count) {
+	uint32_t len;
+
+	if (!dev)
+		return 1;
+
+	while (count) {
+		len = (count > dev->maxrun) ? dev->maxrun : count;
+		if (dev->read(dev->ctx, buffer, sector, len))
+			return 1;
+
+#ifdef DFS_STATS
+		DFS_IOStats.rd_cmds++;
+		DFS_IOStats.rd_sectors += len;
+#endif
+
+		buffer += len * SECTOR_SIZE;
+		sector += len;
+		count  -= len;
+	}
+
+	return 0;
+}
+
+// Write sectors to a block device
+// input:
+//   dev - the device (NULL fails)
+//   buffer - pointer to the data buffer (count sectors sized)
+//   sector - sector address
+//   count - number of sectors to write
+// return: 0 OK, nonzero for any error
+// note: requests longer than the maxrun of the device are split into several calls,
+//       each of them is accounted as one media command in DFS_IOStats
+static uint32_t DFS_DevWrite(PBLOCKDEV dev, uint8_t *buffer, uint32_t sector, uint32_t count) {
+	uint32_t len;
+
+	if (!dev)
+		return 1;
+
+	while (count) {
+		len = (count > dev->maxrun) ? dev->maxrun : count;
+		if (dev->write(dev->ctx, buffer, sector, len))
+			return 1;
+
+#ifdef DFS_STATS
+		DFS_IOStats.wr_cmds++;
+		DFS_IOStats.wr_sectors += len;
+#endif
+
+		buffer += len * SECTOR_SIZE;
+		sector += len;
+		count  -= len;
+	}
+
+	return 0;
+}
+
+// Read consecutive sectors into a list of buffers from a block device
+// input:
+//   dev - the device (NULL fails)
+//   seg - pointer to the array of segments (buffer and number of sectors)
+//   segs - number of segments
+//   sector - address of the first sector
+// return: 0 OK, nonzero for any error
+// note: one media command if the device supports scatter-gather and the segments
+//       fit into its maxrun, otherwise every segment goes through DFS_DevRead
+static uint32_t DFS_DevReadV(PBLOCKDEV dev, PSECTORSEG seg, uint32_t segs, uint32_t sector) {
+	uint32_t count = 0;
+	uint32_t i;
+
+	if (!dev)
+		return 1;
+
+	for (i = 0; i < segs; i++)
+		count += seg[i].count;
+
+	if (dev->readv && count <= dev->maxrun) {
+		if (dev->readv(dev->ctx, seg, segs, sector))
+			return 1;
+
+#ifdef DFS_STATS
+		DFS_IOStats.rd_cmds++;
+		DFS_IOStats.rd_sectors += count;
+#endif
+
+		return 0;
+	}
+
+	for (i = 0; i < segs; i++) {
+		if (DFS_DevRead(dev, seg[i].buffer, sector, seg[i].count))
+			return 1;
+		sector += seg[i].count;
+	}
+
+	return 0;
+}
+
+// Write consecutive sectors from a list of buffers to a block device
+// input:
+//   dev - the device (NULL fails)
+//   seg - pointer to the array of segments (buffer and number of sectors)
+//   segs - number of segments
+//   sector - address of the first sector
+// return: 0 OK, nonzero for any error
+// note: one media command if the device supports scatter-gather and the segments
+//       fit into its maxrun, otherwise every segment goes through DFS_DevWrite
+static uint32_t DFS_DevWriteV(PBLOCKDEV dev, PSECTORSEG seg, uint32_t segs, uint32_t sector) {
+	uint32_t count = 0;
+	uint32_t i;
+
+	if (!dev)
+		return 1;
+
+	for (i = 0; i < segs; i++)
+		count += seg[i].count;
+
+	if (dev->writev && count <= dev->maxrun) {
+		if (dev->writev(dev->ctx, seg, segs, sector))
+			return 1;
+
+#ifdef DFS_STATS
+		DFS_IOStats.wr_cmds++;
+		DFS_IOStats.wr_sectors += count;
+#endif
+
+		return 0;
+	}
+
+	for (i = 0; i < segs; i++) {
+		if (DFS_DevWrite(dev, seg[i].buffer, sector, seg[i].count))
+			return 1;
+		sector += seg[i].count;
+	}
+
+	return 0;
+}
+
+#if DFS_BLKCACHE
+#if DFS_READAHEAD >= DFS_BLKCACHE
+#error "DFS_READAHEAD must be less than DFS_BLKCACHE"
+#endif
+
+/*
+	Block cache
+	Holds recently used sectors of the units between DFS_ReadSector/DFS_WriteSector
+	and the devices, so the directory and FAT sectors read over and over again (path
+	lookups, directory scans, FAT walks) come from RAM. Single sector reads go
+	through the cache, longer reads go straight to the device and only pick up the
+	modified cached sectors. A single sector miss in the third or later of reads
+	following each other on the unit (sequential access) also fetches up to
+	DFS_READAHEAD following sectors, with one multi-sector command into neighbouring
+	entries. Two reads in a row are not enough, a read of an unaligned sector-sized
+	piece of a file does that.
+	Writes keep the cached copies up to date. With DFS_BLKCACHE_WB a single sector
+	write stays in the cache until its entry is evicted or DFS_FlushCache, otherwise
+	every write goes to the device at once.
+	The least recently used entries are replaced on a miss.
+*/
+typedef struct _tagBLKCACHE {
+	uint32_t sector;			// sector number
+	uint32_t stamp;				// time of last access, for LRU replacement
+	uint8_t unit;				// unit of the sector
+	uint8_t valid;				// nonzero if the entry holds a sector
+	uint8_t dirty;				// nonzero if the sector is modified and not yet written
+	uint8_t ahead;				// nonzero if read ahead and not asked for yet
+} BLKCACHE, *PBLKCACHE;
+
+static BLKCACHE DFS_BlkCache[DFS_BLKCACHE];
+// Sector contents, in one (word aligned) array so that neighbouring entries take
+// a multi-sector read
+static uint32_t DFS_BlkData[DFS_BLKCACHE][SECTOR_SIZE / 4];
+static uint32_t DFS_BlkStamp;
+static uint32_t DFS_BlkNext[DFS_UNITS];	// sector behind the last read of the unit
+static uint8_t DFS_BlkSeq[DFS_UNITS];	// number of reads in a row behind the previous one
+
+#define DFS_BLKDATA(bc)	((uint8_t *) DFS_BlkData[(bc) - DFS_BlkCache])
+
+/*
+	Find a sector in the block cache
+	Returns pointer to the entry, or NULL if the sector is not cached.
+*/
+static PBLKCACHE DFS_BlkFind(uint8_t unit, uint32_t sector)
+{
+	PBLKCACHE bc;
+
+	for (bc = DFS_BlkCache; bc < DFS_BlkCache + DFS_BLKCACHE; bc++)
+		if (bc->valid && bc->unit == unit && bc->sector == sector)
+			return bc;
+
+	return NULL;
+}
+
+/*
+	Free count neighbouring entries of the block cache: the run whose most recently
+	used entry is the oldest. Dirty entries are written back first.
+	Returns pointer to the first entry, or NULL for any error.
+*/
+static PBLKCACHE DFS_BlkAlloc(uint32_t count)
+{
+	PBLKCACHE bc, run = DFS_BlkCache;
+	uint32_t i, newest, best = 0xffffffff;
+
+	for (bc = DFS_BlkCache; bc + count <= DFS_BlkCache + DFS_BLKCACHE; bc++) {
+		newest = 0;
+		for (i = 0; i < count; i++)
+			if (bc[i].valid && bc[i].stamp > newest)
+				newest = bc[i].stamp;
+		if (newest < best) {
+			best = newest;
+			run = bc;
+		}
+	}
+
+	for (bc = run; bc < run + count; bc++) {
+		if (bc->valid && bc->dirty) {
+			if (DFS_DevWrite(DFS_Devices[bc->unit], DFS_BLKDATA(bc), bc->sector, 1))
+				return NULL;
+			bc->dirty = 0;
+		}
+		bc->valid = 0;
+	}
+
+	return run;
+}
+
+/*
+	Track the sequential reads of a unit
+	Reading the last sector again (the next piece of it) doesn't break the sequence.
+*/
+static void DFS_BlkSequence(uint8_t unit, uint32_t sector, uint32_t count)
+{
+	if (count == 1 && sector + 1 == DFS_BlkNext[unit])
+		return;
+	if (sector != DFS_BlkNext[unit])
+		DFS_BlkSeq[unit] = 0;
+	else if (DFS_BlkSeq[unit] < 255)
+		DFS_BlkSeq[unit]++;
+	DFS_BlkNext[unit] = sector + count;
+}
+
+/*
+	Read one sector through the block cache
+	Returns 0 OK, nonzero for any error.
+*/
+static uint32_t DFS_BlkRead(uint8_t unit, PBLOCKDEV dev, uint8_t *buffer, uint32_t sector)
+{
+	PBLKCACHE bc = DFS_BlkFind(unit, sector);
+	uint32_t count = 1;
+	uint32_t i;
+
+	DFS_BlkSequence(unit, sector, 1);
+	if (bc) {
+#ifdef DFS_STATS
+		DFS_IOStats.blk_hits++;
+		if (bc->ahead)
+			DFS_IOStats.blk_prefetch_hits++;
+#endif
+		bc->ahead = 0;
+	} else {
+#ifdef DFS_STATS
+		DFS_IOStats.blk_misses++;
+#endif
+#if DFS_READAHEAD
+		// Sequential access: read ahead the following sectors up to the first cached one
+		if (DFS_BlkSeq[unit] >= 2)
+			while (count <= DFS_READAHEAD && count < dev->maxrun && !DFS_BlkFind(unit, sector + count))
+				count++;
+#endif
+		bc = DFS_BlkAlloc(count);
+		if (!bc)
+			return 1;
+		if (DFS_DevRead(dev, DFS_BLKDATA(bc), sector, count)) {
+			// Perhaps the read ahead went beyond the end of the media
+			count = 1;
+			if (DFS_DevRead(dev, DFS_BLKDATA(bc), sector, 1))
+				return 1;
+		}
+		for (i = 0; i < count; i++) {
+			bc[i].unit = unit;
+			bc[i].sector = sector + i;
+			bc[i].valid = 1;
+			bc[i].dirty = 0;
+			bc[i].ahead = (i != 0);
+			bc[i].stamp = ++DFS_BlkStamp;
+		}
+#ifdef DFS_STATS
+		DFS_IOStats.blk_prefetched += count - 1;
+#endif
+	}
+
+	bc->stamp = ++DFS_BlkStamp;
+	memcpy(buffer, DFS_BLKDATA(bc), SECTOR_SIZE);
+
+	return 0;
+}
+
+/*
+	Bring the cached copies of count sectors up to date after a write to the device,
+	buffer NULL drops them (the write failed, the contents on the media are unknown)
+*/
+static void DFS_BlkUpdate(uint8_t unit, uint8_t *buffer, uint32_t sector, uint32_t count)
+{
+	PBLKCACHE bc;
+
+	for (bc = DFS_BlkCache; bc < DFS_BlkCache + DFS_BLKCACHE; bc++) {
+		if (!bc->valid || bc->unit != unit || bc->sector - sector >= count)
+			continue;
+		if (buffer) {
+			memcpy(DFS_BLKDATA(bc), buffer + (bc->sector - sector) * SECTOR_SIZE, SECTOR_SIZE);
+			bc->dirty = 0;
+		} else {
+			bc->valid = 0;
+		}
+	}
+}
+
+/*
+	Finish a read of count sectors which went past the cache: copy the modified
+	cached sectors over the data from the device
+*/
+static void DFS_BlkReadDone(uint8_t unit, uint8_t *buffer, uint32_t sector, uint32_t count)
+{
+#if DFS_BLKCACHE_WB
+	PBLKCACHE bc;
+
+	for (bc = DFS_BlkCache; bc < DFS_BlkCache + DFS_BLKCACHE; bc++)
+		if (bc->valid && bc->dirty && bc->unit == unit && bc->sector - sector < count)
+			memcpy(buffer + (bc->sector - sector) * SECTOR_SIZE, DFS_BLKDATA(bc), SECTOR_SIZE);
+#endif
+
+	DFS_BlkSequence(unit, sector, count);
+}
+
+#if DFS_BLKCACHE_WB
+/*
+	Write one sector into the block cache
+	Returns 0 OK, nonzero for any error.
+*/
+static uint32_t DFS_BlkStore(uint8_t unit, uint8_t *buffer, uint32_t sector)
+{
+	PBLKCACHE bc = DFS_BlkFind(unit, sector);
+
+	if (!bc) {
+		bc = DFS_BlkAlloc(1);
+		if (!bc)
+			return 1;
+		bc->unit = unit;
+		bc->sector = sector;
+		bc->valid = 1;
+	}
+	memcpy(DFS_BLKDATA(bc), buffer, SECTOR_SIZE);
+	bc->dirty = 1;
+	bc->ahead = 0;
+	bc->stamp = ++DFS_BlkStamp;
+
+	return 0;
+}
+#endif // DFS_BLKCACHE_WB
+#endif // DFS_BLKCACHE
+
+/*
+	Write the modified sectors of the block cache of a unit to its device
+	Runs of consecutive sectors go with one scatter-gather request.
+	Returns 0 OK, nonzero for any error.
+*/
+uint32_t DFS_FlushCache(uint8_t unit)
+{
+#if DFS_BLKCACHE && DFS_BLKCACHE_WB
+	PBLOCKDEV dev = (unit < DFS_UNITS) ? DFS_Devices[unit] : NULL;
+	PBLKCACHE run[DFS_BLKCACHE];
+	SECTORSEG seg[DFS_BLKCACHE];
+	PBLKCACHE bc;
+	uint32_t n, i;
+
+	for (;;) {
+		// The lowest modified sector and the modified ones right behind it
+		run[0] = NULL;
+		for (bc = DFS_BlkCache; bc < DFS_BlkCache + DFS_BLKCACHE; bc++)
+			if (bc->valid && bc->dirty && bc->unit == unit && (!run[0] || bc->sector < run[0]->sector))
+				run[0] = bc;
+		if (!run[0])
+			break;
+		if (!dev)
+			return 1;
+		for (n = 1; n < DFS_BLKCACHE && n < dev->maxrun; n++) {
+			bc = DFS_BlkFind(unit, run[0]->sector + n);
+			if (!bc || !bc->dirty)
+				break;
+			run[n] = bc;
+		}
+
+		for (i = 0; i < n; i++) {
+			seg[i].buffer = DFS_BLKDATA(run[i]);
+			seg[i].count = 1;
+		}
+		if (DFS_DevWriteV(dev, seg, n, run[0]->sector))
+			return 1;
+		for (i = 0; i < n; i++)
+			run[i]->dirty = 0;
+	}
+#endif
+
+	return 0;
+}
+
+/*
+	Discard the block cache of a unit, modified sectors are lost
+*/
+void DFS_InvalidateCache(uint8_t unit)
+{
+#if DFS_BLKCACHE
+	uint32_t i;
+
+	for (i = 0; i < DFS_BLKCACHE; i++)
+		if (DFS_BlkCache[i].unit == unit)
+			DFS_BlkCache[i].valid = 0;
+	if (unit < DFS_UNITS) {
+		DFS_BlkNext[unit] = 0xffffffff;
+		DFS_BlkSeq[unit] = 0;
+	}
+#endif
+}
+
+/*
+	Erase sectors on the device of a unit
+	The cached copies of the sectors are dropped.
+	Returns 0 OK, nonzero for any error or if the device can't erase.
+*/
+uint32_t DFS_EraseSector(uint8_t unit, uint32_t sector, uint32_t count)
+{
+	PBLOCKDEV dev = (unit < DFS_UNITS) ? DFS_Devices[unit] : NULL;
+
+	if (!dev || !dev->erase)
+		return 1;
+
+#if DFS_BLKCACHE
+	DFS_BlkUpdate(unit, NULL, sector, count);
+#endif
+	if (dev->erase(dev->ctx, sector, count))
+		return 1;
+
+#ifdef DFS_STATS
+	DFS_IOStats.er_cmds++;
+	DFS_IOStats.er_sectors += count;
+#endif
+
+	return 0;
+}
+
+/*
+	Attach a block device to a unit, NULL detaches the unit
+	The modified sectors in the block cache go to the old device first.
+	Returns 0 OK, DFS_ERRMISC if there is no such unit.
+*/
+uint32_t DFS_AttachDevice(uint8_t unit, PBLOCKDEV dev)
+{
+	if (unit >= DFS_UNITS)
+		return DFS_ERRMISC;
+
+	DFS_FlushCache(unit);
+	DFS_InvalidateCache(unit);
+	DFS_Devices[unit] = dev;
+
+	return DFS_OK;
+}
+
+// Read sectors from the device of a unit
+// input:
+//   unit - device number
+//   buffer - pointer to the data buffer (count sectors sized)
+//   sector - sector address
+//   count - number of sectors to read
+// return: 0 OK, nonzero for any error
+// note: a single sector goes through the block cache, see DFS_DevRead for longer reads
+uint32_t DFS_ReadSector(uint8_t unit, uint8_t *buffer, uint32_t sector, uint32_t count) {
+	PBLOCKDEV dev = (unit < DFS_UNITS) ? DFS_Devices[unit] : NULL;
+
+#if DFS_BLKCACHE
+	if (dev && count == 1)
+		return DFS_BlkRead(unit, dev, buffer, sector);
+	if (DFS_DevRead(dev, buffer, sector, count))
+		return 1;
+	DFS_BlkReadDone(unit, buffer, sector, count);
+
+	return 0;
+#else
+	return DFS_DevRead(dev, buffer, sector, count);
+#endif
+}
+
+// Write sectors to the device of a unit
+// input:
+//   unit - device number
+//   buffer - pointer to the data buffer (count sectors sized)
+//   sector - sector address
+//   count - number of sectors to write
+// return: 0 OK, nonzero for any error
+// note: with DFS_BLKCACHE_WB a single sector stays in the block cache, see
+//       DFS_DevWrite for the rest
+uint32_t DFS_WriteSector(uint8_t unit, uint8_t *buffer, uint32_t sector, uint32_t count) {
+	PBLOCKDEV dev = (unit < DFS_UNITS) ? DFS_Devices[unit] : NULL;
+	uint32_t result;
+
+#if DFS_BLKCACHE && DFS_BLKCACHE_WB
+	if (dev && count == 1)
+		return DFS_BlkStore(unit, buffer, sector);
+#endif
+	result = DFS_DevWrite(dev, buffer, sector, count);
+#if DFS_BLKCACHE
+	DFS_BlkUpdate(unit, result ? NULL : buffer, sector, count);
+#endif
+
+	return result;
+}
+
+// Read consecutive sectors into a list of buffers from the device of a unit
+// input:
+//   unit - device number
+//   seg - pointer to the array of segments (buffer and number of sectors)
+//   segs - number of segments
+//   sector - address of the first sector
+// return: 0 OK, nonzero for any error
+// note: the request goes past the block cache, see DFS_DevReadV
+uint32_t DFS_ReadSectorV(uint8_t unit, PSECTORSEG seg, uint32_t segs, uint32_t sector) {
+	PBLOCKDEV dev = (unit < DFS_UNITS) ? DFS_Devices[unit] : NULL;
+#if DFS_BLKCACHE
+	uint32_t i;
+#endif
+
+	if (DFS_DevReadV(dev, seg, segs, sector))
+		return 1;
+
+#if DFS_BLKCACHE
+	for (i = 0; i < segs; i++) {
+		DFS_BlkReadDone(unit, seg[i].buffer, sector, seg[i].count);
+		sector += seg[i].count;
+	}
+#endif
+
+	return 0;
+}
+
+// Write consecutive sectors from a list of buffers to the device of a unit
+// input:
+//   unit - device number
+//   seg - pointer to the array of segments (buffer and number of sectors)
+//   segs - number of segments
+//   sector - address of the first sector
+// return: 0 OK, nonzero for any error
+// note: the request goes past the block cache (the cached copies are updated),
+//       see DFS_DevWriteV
+uint32_t DFS_WriteSectorV(uint8_t unit, PSECTORSEG seg, uint32_t segs, uint32_t sector) {
+	PBLOCKDEV dev = (unit < DFS_UNITS) ? DFS_Devices[unit] : NULL;
+	uint32_t result;
+#if DFS_BLKCACHE
+	uint32_t i;
+#endif
+
+	result = DFS_DevWriteV(dev, seg, segs, sector);
+
+#if DFS_BLKCACHE
+	for (i = 0; i < segs; i++) {
+		DFS_BlkUpdate(unit, result ? NULL : seg[i].buffer, sector, seg[i].count);
+		sector += seg[i].count;
+	}
+#endif
+
+	return result;
+}
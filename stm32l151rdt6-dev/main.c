@@ -17,7 +17,7 @@
 #include "tsl2581.h"
 #include "beeper.h"
 #include "delay.h"
-#include "sdcard-sdio.h"
+#include "sdcard.h"
 #include "log.h"
 #include "spi.h"
 #include "nRF24.h"
@@ -574,26 +574,6 @@ void DMA1_Channel3_IRQHandler(void) {
 	ST7541_CS_H();
 }
 
-// SDIO IRQ handler
-void SDIO_IRQHandler(void) {
-	printf("\r\n###> IRQ SDIO [%X] CNT=%u\r\n",SDIO->STA,SDIO->FIFOCNT);
-
-	// Clear SDIO interrupt bit
-//	SDIO->ICR = 0x00FFFFFF;
-	SDIO->ICR = SDIO_ICR_TXUNDERRC;
-}
-
-// DMA2 channel4 IRQ handler (SDIO DMA)
-void DMA2_Channel4_IRQHandler(void) {
-	uint32_t cntr;
-
-	cntr = SDIO_DMA_CH->CNDTR;
-	printf("\r\n###> IRQ DMA2 [%X] [%u]\r\n",DMA2->ISR,cntr);
-
-	// Clear DMA interrupt bits
-	DMA2->IFCR = DMA_IFCR_CGIF4 | DMA_IFCR_CHTIF4 | DMA_IFCR_CTCIF4 | DMA_IFCR_CTEIF4;
-}
-
 // Compute interquartile mean from array of values
 uint32_t InterquartileMean(uint16_t *array, uint32_t numOfSamples) {
 	uint32_t sum = 0;
@@ -1432,14 +1412,19 @@ int main(void) {
 	// Enable the DMA2 peripheral clock
 	RCC->AHBENR |= RCC_AHBENR_DMA2EN;
 
-	// Enable the DMA2 channel4 interrupt
-//	NVIC_EnableIRQ(DMA2_Channel4_IRQn);
-
-	// Enable the SDIO interrupt
-//	NVIC_EnableIRQ(SDIO_IRQn);
+	// Enable the SDIO DMA channel and SDIO interrupts (asynchronous transfers)
+	// Both handlers share the transfer state, so they must have the same priority
+	NVICInit.NVIC_IRQChannel = SDIO_DMA_IRQN;
+	NVICInit.NVIC_IRQChannelPreemptionPriority = 1;
+	NVICInit.NVIC_IRQChannelSubPriority = 0;
+	NVICInit.NVIC_IRQChannelCmd = ENABLE;
+	NVIC_Init(&NVICInit);
+	NVICInit.NVIC_IRQChannel = SDIO_IRQn;
+	NVIC_Init(&NVICInit);
 
 	if (_SD_connected) {
-		SD_SDIO_GPIO_Init();
+		SD_GPIO_Init();
+		SD_SDIO_Init();
 		j = SD_Init();
 		printf("SD_Init: %X\r\n",j);
 	} else j = SDR_NoResponse;
@@ -0,0 +1,141 @@
+#include <stm32l1xx_rcc.h>
+#include <stm32l1xx_gpio.h>
+
+#include "sdcard.h"
+
+
+// Initialize the SDIO GPIO lines
+void SD_GPIO_Init(void) {
+	GPIO_InitTypeDef PORT;
+
+	// Enable SDIO corresponding GPIO peripherals
+	RCC->AHBENR |= SDIO_GPIO_PERIPH;
+
+	PORT.GPIO_Mode = GPIO_Mode_AF; // Alternative function mode
+	PORT.GPIO_Speed = GPIO_Speed_40MHz; // High speed
+	PORT.GPIO_OType = GPIO_OType_PP; // Output push-pull
+	PORT.GPIO_PuPd = GPIO_PuPd_UP; // Pull-up
+
+	// SDIO_CMD (PD2)
+	PORT.GPIO_Pin = GPIO_Pin_2;
+	GPIO_Init(GPIOD,&PORT);
+
+	// SDIO_D0 (PC8), SDIO_CK (PC12)
+	PORT.GPIO_Pin = GPIO_Pin_8 | GPIO_Pin_12;
+	GPIO_Init(GPIOC,&PORT);
+
+#if (SDIO_USE_4BIT)
+	// SDIO_D1 (PC9), SDIO_D2 (PC10), SDIO_D3 (PC11)
+	PORT.GPIO_Pin = GPIO_Pin_9 | GPIO_Pin_10 | GPIO_Pin_11;
+	GPIO_Init(GPIOC,&PORT);
+#endif // SDIO_USE_4BIT
+
+	// Enable pin alternate functions
+	GPIO_PinAFConfig(GPIOD,GPIO_PinSource2,SDIO_GPIO_AF);
+	GPIO_PinAFConfig(GPIOC,GPIO_PinSource8,SDIO_GPIO_AF);
+	GPIO_PinAFConfig(GPIOC,GPIO_PinSource12,SDIO_GPIO_AF);
+#if (SDIO_USE_4BIT)
+	GPIO_PinAFConfig(GPIOC,GPIO_PinSource9,SDIO_GPIO_AF);
+	GPIO_PinAFConfig(GPIOC,GPIO_PinSource10,SDIO_GPIO_AF);
+	GPIO_PinAFConfig(GPIOC,GPIO_PinSource11,SDIO_GPIO_AF);
+#endif // SDIO_USE_4BIT
+}
+
+// De-initialize the SDIO GPIO lines to its default state
+void SD_GPIO_DeInit(void) {
+	GPIO_InitTypeDef PORT;
+
+	PORT.GPIO_Mode = GPIO_Mode_AN; // Analog mode
+	PORT.GPIO_Speed = GPIO_Speed_400KHz; // Low speed
+	PORT.GPIO_OType = GPIO_OType_PP; // Output push-pull
+	PORT.GPIO_PuPd = GPIO_PuPd_NOPULL; // No pull
+
+	// SDIO_CMD (PD2)
+	PORT.GPIO_Pin = GPIO_Pin_2;
+	GPIO_Init(GPIOD,&PORT);
+
+	// SDIO_D0..SDIO_D3 (PC8..PC11), SDIO_CK (PC12)
+	PORT.GPIO_Pin = GPIO_Pin_8 | GPIO_Pin_9 | GPIO_Pin_10 | GPIO_Pin_11 | GPIO_Pin_12;
+	GPIO_Init(GPIOC,&PORT);
+}
+
+// Configure the SDIO peripheral
+void SD_SDIO_Init(void) {
+	// Enable the SDIO peripheral
+	RCC->APB2ENR |= RCC_APB2ENR_SDIOEN;
+
+	// Configure SDIO peripheral clock
+	// HW flow control disabled, Rising edge of SDIOCLK, 1-bit bus, Power saving enabled, SDIOCLK bypass disabled
+	SDIO->CLKCR = SD_BUS_1BIT | SD_CLK_DIV_INIT | SD_CLKCR_CLKEN | SD_CLKCR_PWRSAV; // 400kHz speed, clock enabled
+
+	// Disable SDIO clock
+	SDIO->POWER = SD_PWR_OFF;
+}
+
+// De-initialize the SDIO peripheral
+void SD_SDIO_DeInit(void) {
+	// Disable SDIO clock
+	SDIO->POWER = SD_PWR_OFF;
+
+	// Disable the SDIO peripheral
+	RCC->APB2ENR &= ~RCC_APB2ENR_SDIOEN;
+}
+
+// Initialize the DMA channel for SDIO peripheral (DMA2 Channel4)
+// input:
+//   pBuf - pointer to memory buffer
+//   length - memory buffer size in bytes (must be a multiple of 4, since SDIO operates 32-bit words)
+//   direction - DMA channel direction, one of SDIO_DMA_DIR_xx values
+// note: the DMA2 peripheral clock must be already enabled, the channel stays disabled
+void SD_Configure_DMA(uint32_t *pBuf, uint32_t length, uint8_t direction) {
+	uint32_t reg;
+
+	// Clear DMA configuration bits
+	reg = SDIO_DMA_CH->CCR & ((uint32_t)~(DMA_CCR4_MEM2MEM | DMA_CCR4_PL | DMA_CCR4_MSIZE | \
+			DMA_CCR4_PSIZE | DMA_CCR4_MINC | DMA_CCR4_PINC | DMA_CCR4_CIRC | DMA_CCR4_DIR | DMA_CCR4_EN));
+	SDIO_DMA_CH->CCR = reg; // Disable DMA channel in case if it enabled
+
+	// Address of the peripheral data register
+	SDIO_DMA_CH->CPAR = (uint32_t)(&(SDIO->FIFO));
+
+	// Address of the memory buffer
+	SDIO_DMA_CH->CMAR = (uint32_t)pBuf;
+
+	// Buffer length
+	SDIO_DMA_CH->CNDTR = length >> 2; // SDIO operates with 32-bit words
+
+	// Clear DMA2 interrupt flags
+	DMA2->IFCR = (DMA_IFCR_CGIF4 | DMA_IFCR_CHTIF4 | DMA_IFCR_CTCIF4 | DMA_IFCR_CTEIF4);
+
+	// DMA: no circular mode, 32-bit transfer, memory increment, very high channel priority
+	reg |= (DMA_CCR4_MINC | DMA_CCR4_PL | DMA_CCR4_MSIZE_1 | DMA_CCR4_PSIZE_1);
+	if (direction != SDIO_DMA_DIR_RX) reg |= DMA_CCR4_DIR; // DMA will read from memory
+
+	SDIO_DMA_CH->CCR = reg;
+}
+
+// Enable the DPSM for a DMA data transfer to the card
+// input:
+//   dctrl - value for the DCTRL register
+// note: DTIMER, DLEN and the DMA channel must be already configured
+void SD_EnableWriteDPSM(uint32_t dctrl) {
+#ifndef STM32L1XX_HD
+	SDIO->DCTRL = dctrl;
+#else
+	// STM32L151RD: when the SDIO_CK clock is 24MHz, the incomprehensible error pops right after enabling
+	// the data transfer with DMA. Disabling the SDIO_CK clock output, enabling the DPSM and then enabling
+	// SDIO_CK output is workaround for this issue.
+
+	// Disable SDIO_CK clock output
+	SDIO_CLKCR_CLKEN_BB = 0;
+
+	// Enable the data transfer
+	SDIO->DCTRL = dctrl;
+
+	// Wait until the SDIO FIFO buffer is half full
+	while (SDIO->STA & SDIO_STA_TXFIFOHE);
+
+	// Enable the SDIO_CK clock output
+	SDIO_CLKCR_CLKEN_BB = 1;
+#endif
+}
@@ -0,0 +1,90 @@
+// Define to prevent recursive inclusion
+#ifndef __SDCARD_HW_H
+#define __SDCARD_HW_H
+
+
+// Target layer of the SD card driver: STM32L151RD, SDIO, DMA2 channel 4
+// (see sdcard.h for what the driver expects from this file)
+
+
+#include <stm32l1xx.h>
+
+
+// Enable usage of SDIO 4-bit bus
+//   0 - use 1-bit bus
+//   1 - use 4-bit bus
+#define SDIO_USE_4BIT                 1
+
+// Enable usage of DMA transfers
+//   0 - no DMA-related code
+//   1 - use DMA-related code
+#define SDIO_USE_DMA                  1
+
+// Enable usage of interrupt driven DMA transfers (requires SDIO_USE_DMA)
+//   0 - no IRQ-related code
+//   1 - SD_ReadBlock_IRQ()/SD_WriteBlock_IRQ() with completion callback, the SDIO
+//       and SDIO DMA channel IRQ handlers are provided by the driver
+#define SDIO_USE_IRQ                  1
+
+// Enable usage of the High-Speed mode (50MHz)
+//   0 - the bus clock stays at SD_CLK_DIV_TRAN
+//   1 - SD_HighSpeed() switches the card to High-Speed mode and the bus clock to SDIOCLK
+// The SDIO of the STM32L1 has no margin for 48MHz with its pins at 40MHz speed
+#define SDIO_USE_HIGHSPEED            0
+
+
+// SDIO kernel clock (PLLVCO / 2)
+#define SD_SDIOCLK                    ((uint32_t)48000000U)
+
+// SDIO clocks for initialization and data transfer
+#define SD_CLK_DIV_INIT               (SD_CLK_DIV_400K) // SDIO initialization frequency (400kHz)
+//#define SD_CLK_DIV_TRAN               (SD_CLK_DIV_400K) // SDIO data transfer 400kHz
+//#define SD_CLK_DIV_TRAN               (SD_CLK_DIV_1M)   // SDIO data transfer 1MHz
+//#define SD_CLK_DIV_TRAN               (SD_CLK_DIV_8M)   // SDIO data transfer 8MHz
+//#define SD_CLK_DIV_TRAN               (SD_CLK_DIV_9M6)  // SDIO data transfer 9.6MHz
+//#define SD_CLK_DIV_TRAN               (SD_CLK_DIV_12M)  // SDIO data transfer 12MHz
+//#define SD_CLK_DIV_TRAN               (SD_CLK_DIV_16M)  // SDIO data transfer 16MHz
+#define SD_CLK_DIV_TRAN               (SD_CLK_DIV_24M) // SDIO data transfer 24MHz
+
+// Access to the SDIO registers
+#define SDIO_RD(reg)                  (SDIO->reg)
+#define SDIO_WR(reg,value)            (SDIO->reg = (value))
+
+// Nothing to do while waiting for an interrupt
+#define SDIO_IDLE()
+
+
+// SDIO HAL
+#define SDIO_GPIO_PERIPH              (RCC_AHBPeriph_GPIOC | RCC_AHBPeriph_GPIOD)
+#define SDIO_GPIO_AF                  GPIO_AF_SDIO
+#define SDIO_DMA_CH                   DMA2_Channel4
+#define SDIO_DMA_IRQN                 DMA2_Channel4_IRQn
+#define SDIO_DMA_IRQHandler           DMA2_Channel4_IRQHandler
+
+// SDIO DMA channel direction
+#define SDIO_DMA_DIR_RX               0x00 // SDIO -> MEMORY
+#define SDIO_DMA_DIR_TX               0x01 // MEMORY -> SDIO
+
+// SDIO DMA channel control
+#define SDIO_DMA_ENABLE()             (SDIO_DMA_CH->CCR |= DMA_CCR4_EN)
+#define SDIO_DMA_DISABLE()            (SDIO_DMA_CH->CCR &= ~DMA_CCR4_EN)
+#define SDIO_DMA_BUFFER(pBuf,length)  do { SDIO_DMA_CH->CMAR = (uint32_t)(pBuf); SDIO_DMA_CH->CNDTR = (length) >> 2; } while (0)
+#define SDIO_DMA_IRQ_ON()             (SDIO_DMA_CH->CCR |= DMA_CCR4_TCIE | DMA_CCR4_TEIE)
+#define SDIO_DMA_IRQ_OFF()            (SDIO_DMA_CH->CCR &= ~(DMA_CCR4_TCIE | DMA_CCR4_TEIE))
+#define SDIO_DMA_TC()                 (DMA2->ISR & DMA_ISR_TCIF4)
+#define SDIO_DMA_TE()                 (DMA2->ISR & DMA_ISR_TEIF4)
+#define SDIO_DMA_CLEAR()              (DMA2->IFCR = DMA_IFCR_CGIF4 | DMA_IFCR_CHTIF4 | DMA_IFCR_CTCIF4 | DMA_IFCR_CTEIF4)
+
+// Enable the DPSM for a DMA transfer to the card
+#define SDIO_DMA_TX_START(dctrl)      SD_EnableWriteDPSM(dctrl)
+
+// Alias word address of bits of the SDIO CLKCR register
+#define SDIO_CLKCR_OFFSET             (SDIO_BASE - PERIPH_BASE + 0x04)
+#define SDIO_CLKCR_CLKEN_BN           8 // CLKEN
+#define SDIO_CLKCR_CLKEN_BB           *(__IO uint32_t *)((PERIPH_BB_BASE + (SDIO_CLKCR_OFFSET * 32) + (SDIO_CLKCR_CLKEN_BN * 4)))
+
+
+// Function prototypes
+void SD_EnableWriteDPSM(uint32_t dctrl);
+
+#endif // __SDCARD_HW_H
@@ -0,0 +1,405 @@
+// Define to prevent recursive inclusion
+#ifndef __SDCARD_H
+#define __SDCARD_H
+
+
+// SD card driver for the SDIO peripheral (STM32L1) and the SDMMC peripheral (STM32L4)
+// The SD protocol is the same code for all targets, this file and sdcard.c are identical in
+// every project. All that depends on the MCU and the board is in the target layer:
+// sdcard-hw.h/sdcard-hw.c of the project, or the register level simulator of sdcard-host
+// when built with HOSTVER defined.
+//
+// The target layer provides:
+//   SDIO_USE_4BIT, SDIO_USE_DMA, SDIO_USE_IRQ, SDIO_USE_HIGHSPEED - driver options
+//   SD_SDIOCLK - SDIO kernel clock (Hz), SD_CLK_DIV_INIT, SD_CLK_DIV_TRAN - bus clock dividers
+//   SDIO_RD(reg), SDIO_WR(reg,value) - access to a register of the peripheral (POWER, CLKCR, ...)
+//   SDIO_IRQHandler - name of the SDIO interrupt vector
+//   SDIO_IDLE() - called by the loops waiting for an interrupt
+//   SD_GPIO_Init(), SD_GPIO_DeInit(), SD_SDIO_Init(), SD_SDIO_DeInit() - pins and peripheral
+// and with SDIO_USE_DMA:
+//   SDIO_DMA_DIR_RX, SDIO_DMA_DIR_TX - directions of the DMA channel
+//   SD_Configure_DMA(pBuf,length,direction) - set up the channel and clear its flags, the channel stays disabled
+//   SDIO_DMA_ENABLE(), SDIO_DMA_DISABLE() - enable or disable the channel
+//   SDIO_DMA_BUFFER(pBuf,length) - set another buffer to the disabled channel
+//   SDIO_DMA_IRQ_ON(), SDIO_DMA_IRQ_OFF() - transfer complete and transfer error interrupts of the channel
+//   SDIO_DMA_TC(), SDIO_DMA_TE() - transfer complete and transfer error flags, SDIO_DMA_CLEAR() clears them
+//   SDIO_DMA_TX_START(dctrl) - enable the DPSM for a DMA transfer to the card with the given DCTRL value
+//   SDIO_DMA_IRQHandler - name of the DMA channel interrupt vector
+#ifdef HOSTVER
+#include "sdsim.h"
+#else
+#include "sdcard-hw.h"
+#endif
+
+
+// Bits of the SDIO registers (same layout in the STM32L1 SDIO and the STM32L4 SDMMC)
+
+// POWER register
+#define SD_PWR_OFF                    ((uint32_t)0x00000000U) // Power off: the clock to card is stopped
+#define SD_PWR_ON                     ((uint32_t)0x00000003U) // Power on: the card is clocked
+
+// CLKCR register
+#define SD_CLKCR_CLKDIV               ((uint32_t)0x000000FFU) // Clock divide factor
+#define SD_CLKCR_CLKEN                ((uint32_t)0x00000100U) // Clock enable
+#define SD_CLKCR_PWRSAV               ((uint32_t)0x00000200U) // Power saving: clock only while the bus is active
+#define SD_CLKCR_BYPASS               ((uint32_t)0x00000400U) // Clock divider bypass
+#define SD_CLKCR_WIDBUS               ((uint32_t)0x00001800U) // Wide bus mode
+#define SD_CLKCR_HWFC_EN              ((uint32_t)0x00004000U) // Hardware flow control
+
+// CMD register
+#define SD_CMD_CPSMEN                 ((uint32_t)0x00000400U) // Command path state machine enable
+
+// DCTRL register
+#define SD_DCTRL_DTEN                 ((uint32_t)0x00000001U) // Data transfer enable (DPSM)
+#define SD_DCTRL_DTDIR                ((uint32_t)0x00000002U) // Direction: from card to controller
+#define SD_DCTRL_DMAEN                ((uint32_t)0x00000008U) // DMA enable
+
+// STA register, the ICR and MASK registers have the same layout for the static flags
+#define SD_STA_CCRCFAIL               ((uint32_t)0x00000001U) // Command response received (CRC check failed)
+#define SD_STA_DCRCFAIL               ((uint32_t)0x00000002U) // Data block sent/received (CRC check failed)
+#define SD_STA_CTIMEOUT               ((uint32_t)0x00000004U) // Command response timeout
+#define SD_STA_DTIMEOUT               ((uint32_t)0x00000008U) // Data timeout
+#define SD_STA_TXUNDERR               ((uint32_t)0x00000010U) // Transmit FIFO underrun
+#define SD_STA_RXOVERR                ((uint32_t)0x00000020U) // Receive FIFO overrun
+#define SD_STA_CMDREND                ((uint32_t)0x00000040U) // Command response received (CRC check passed)
+#define SD_STA_CMDSENT                ((uint32_t)0x00000080U) // Command sent (no response required)
+#define SD_STA_DATAEND                ((uint32_t)0x00000100U) // Data end (data counter is zero)
+#define SD_STA_STBITERR               ((uint32_t)0x00000200U) // Start bit not detected on all data signals (STM32L1 only)
+#define SD_STA_DBCKEND                ((uint32_t)0x00000400U) // Data block sent/received (CRC check passed)
+#define SD_STA_TXACT                  ((uint32_t)0x00001000U) // Data transmit in progress
+#define SD_STA_TXFIFOHE               ((uint32_t)0x00004000U) // Transmit FIFO half empty
+#define SD_STA_RXFIFOHF               ((uint32_t)0x00008000U) // Receive FIFO half full
+#define SD_STA_RXDAVL                 ((uint32_t)0x00200000U) // Data available in receive FIFO
+
+// SDIO clock divider
+#define SD_CLK_DIV_400K               ((uint32_t)0x00000076U) // SDIO clock 400kHz  (48MHz / (0x76 + 2) = 400kHz)
+#define SD_CLK_DIV_1M                 ((uint32_t)0x0000002EU) // SDIO clock 1MHz    (48MHz / (0x2e + 2) = 1MHz)
+#define SD_CLK_DIV_2M                 ((uint32_t)0x00000016U) // SDIO clock 2MHz    (48MHz / (0x16 + 2) = 2MHz)
+#define SD_CLK_DIV_4M                 ((uint32_t)0x0000000AU) // SDIO clock 4MHz    (48MHz / (0x0a + 2) = 4MHz)
+#define SD_CLK_DIV_6M85               ((uint32_t)0x00000005U) // SDIO clock 6.85MHz (48MHz / (0x05 + 2) = 6.85MHz)
+#define SD_CLK_DIV_8M                 ((uint32_t)0x00000004U) // SDIO clock 8MHz    (48MHz / (0x04 + 2) = 8MHz)
+#define SD_CLK_DIV_9M6                ((uint32_t)0x00000003U) // SDIO clock 9.6MHz  (48MHz / (0x03 + 2) = 9.6MHz)
+#define SD_CLK_DIV_12M                ((uint32_t)0x00000002U) // SDIO clock 12MHz   (48MHz / (0x02 + 2) = 12MHz)
+#define SD_CLK_DIV_16M                ((uint32_t)0x00000001U) // SDIO clock 16MHz   (48MHz / (0x01 + 2) = 16MHz)
+#define SD_CLK_DIV_24M                ((uint32_t)0x00000000U) // SDIO clock 24MHz   (48MHz / (0x00 + 2) = 24MHz)
+#define SD_CLK_DIV_48M                (SD_CLKCR_BYPASS)       // SDIO clock 48MHz   (divider bypassed, High-Speed mode only)
+
+// SDIO CMD response type
+#define SD_RESP_NONE                  ((uint32_t)0x00000000U) // No response
+#define SD_RESP_SHORT                 ((uint32_t)0x00000040U) // Short response
+#define SD_RESP_LONG                  ((uint32_t)0x000000C0U) // Long response
+
+// SD commands  index
+#define SD_CMD_GO_IDLE_STATE          ((uint8_t)0)
+#define SD_CMD_SEND_OP_COND           ((uint8_t)1)  // MMC only
+#define SD_CMD_ALL_SEND_CID           ((uint8_t)2)  // Not supported in SPI mode
+#define SD_CMD_SEND_REL_ADDR          ((uint8_t)3)  // Not supported in SPI mode
+#define SD_CMD_SWITCH_FUNC            ((uint8_t)6)  // SD v1.10+ only
+#define SD_CMD_SEL_DESEL_CARD         ((uint8_t)7)  // Not supported in SPI mode
+#define SD_CMD_HS_SEND_EXT_CSD        ((uint8_t)8)
+#define SD_CMD_SEND_CSD               ((uint8_t)9)
+#define SD_CMD_SEND_CID               ((uint8_t)10)
+#define SD_CMD_READ_DAT_UNTIL_STOP    ((uint8_t)11) // Not supported in SPI mode
+#define SD_CMD_STOP_TRANSMISSION      ((uint8_t)12)
+#define SD_CMD_SEND_STATUS            ((uint8_t)13)
+#define SD_CMD_GO_INACTIVE_STATE      ((uint8_t)15) // Not supported in SPI mode
+#define SD_CMD_SET_BLOCKLEN           ((uint8_t)16)
+#define SD_CMD_READ_SINGLE_BLOCK      ((uint8_t)17)
+#define SD_CMD_READ_MULT_BLOCK        ((uint8_t)18)
+#define SD_CMD_WRITE_DAT_UNTIL_STOP   ((uint8_t)20) // Not supported in SPI mode
+#define SD_CMD_WRITE_BLOCK            ((uint8_t)24)
+#define SD_CMD_WRITE_MULTIPLE_BLOCK   ((uint8_t)25)
+#define SD_CMD_PROG_CSD               ((uint8_t)27)
+#define SD_CMD_SET_WRITE_PROT         ((uint8_t)28) // Not supported in SPI mode
+#define SD_CMD_CLR_WRITE_PROT         ((uint8_t)29) // Not supported in SPI mode
+#define SD_CMD_SEND_WRITE_PROT        ((uint8_t)30) // Not supported in SPI mode
+#define SD_CMD_ERASE_WR_BLK_START     ((uint8_t)32)
+#define SD_CMD_ERASE_WR_BLK_END       ((uint8_t)33)
+#define SD_CMD_ERASE                  ((uint8_t)38)
+#define SD_CMD_LOCK_UNLOCK            ((uint8_t)42)
+#define SD_CMD_APP_CMD                ((uint8_t)55)
+#define SD_CMD_READ_OCR               ((uint8_t)58) // Read OCR register
+#define SD_CMD_CRC_ON_OFF             ((uint8_t)59) // On/Off CRC check by SD Card (in SPI mode)
+
+// Following commands are SD Card Specific commands.
+// SD_CMD_APP_CMD should be sent before sending these commands.
+#define SD_CMD_SET_BUS_WIDTH          ((uint8_t)6)  // ACMD6
+#define SD_CMD_SET_WR_BLK_ERASE_COUNT ((uint8_t)23) // ACMD23
+#define SD_CMD_SD_SEND_OP_COND        ((uint8_t)41) // ACMD41
+#define SD_CMD_SET_CLR_CARD_DETECT    ((uint8_t)42) // ACMD42
+#define SD_CMD_SEND_SCR               ((uint8_t)51) // ACMD51
+
+// Pattern for R6 response
+#define SD_CHECK_PATTERN              ((uint32_t)0x000001AAU)
+
+// R6 response error bits
+#define SD_R6_GENERAL_UNKNOWN_ERROR   ((uint32_t)0x00002000U)
+#define SD_R6_ILLEGAL_CMD             ((uint32_t)0x00004000U)
+#define SD_R6_COM_CRC_FAILED          ((uint32_t)0x00008000U)
+
+// Argument for ACMD41 to select voltage window
+#define SD_OCR_VOLTAGE                ((uint32_t)0x80100000U)
+
+// Mask for errors in card status value
+#define SD_OCR_ALL_ERRORS             ((uint32_t)0xFDFFE008U) // All possible error bits
+#define SD_OCR_OUT_OF_RANGE           ((uint32_t)0x80000000U) // The command's argument was out of allowed range
+#define SD_OCR_ADDRESS_ERROR          ((uint32_t)0x40000000U) // A misaligned address used in the command
+#define SD_OCR_BLOCK_LEN_ERROR        ((uint32_t)0x20000000U) // The transfer block length is not allowed for this card
+#define SD_OCR_ERASE_SEQ_ERROR        ((uint32_t)0x10000000U) // An error in the sequence of erase commands occurred
+#define SD_OCR_ERASE_PARAM            ((uint32_t)0x08000000U) // An invalid selection of write-blocks for erase occurred
+#define SD_OCR_WP_VIOLATION           ((uint32_t)0x04000000U) // Attempt to write to a protected block or to the write protected card
+#define SD_OCR_LOCK_UNLOCK_FAILED     ((uint32_t)0x01000000U) // Sequence or password error in lock/unlock card command
+#define SD_OCR_COM_CRC_ERROR          ((uint32_t)0x00800000U) // The CRC check of the previous command failed
+#define SD_OCR_ILLEGAL_COMMAND        ((uint32_t)0x00400000U) // Command not legal for the card state
+#define SD_OCR_CARD_ECC_FAILED        ((uint32_t)0x00200000U) // Card internal ECC was applied but failed to correct the data
+#define SD_OCR_CC_ERROR               ((uint32_t)0x00100000U) // Internal card controller error
+#define SD_OCR_ERROR                  ((uint32_t)0x00080000U) // A general or an unknown error occurred during the operation
+#define SD_OCR_STREAM_R_UNDERRUN      ((uint32_t)0x00040000U) // The card could not sustain data transfer in stream read operation
+#define SD_OCR_STREAM_W_OVERRUN       ((uint32_t)0x00020000U) // The card could not sustain data programming in stream mode
+#define SD_OCR_CSD_OVERWRITE          ((uint32_t)0x00010000U) // CSD overwrite error
+#define SD_OCR_WP_ERASE_SKIP          ((uint32_t)0x00008000U) // Only partial address space was erased
+#define SD_OCR_CARD_ECC_DISABLED      ((uint32_t)0x00004000U) // The command has been executed without using the internal ECC
+#define SD_OCR_ERASE_RESET            ((uint32_t)0x00002000U) // An erase sequence was cleared before executing
+#define SD_OCR_AKE_SEQ_ERROR          ((uint32_t)0x00000008U) // Error in the sequence of the authentication process
+
+// Card state (OCR[12:9] bits CURRENT_STATE)
+#define SD_STATE_IDLE                 ((uint8_t)0x00) // Idle
+#define SD_STATE_READY                ((uint8_t)0x01) // Ready
+#define SD_STATE_IDENT                ((uint8_t)0x02) // Identification
+#define SD_STATE_STBY                 ((uint8_t)0x03) // Stand-by
+#define SD_STATE_TRAN                 ((uint8_t)0x04) // Transfer
+#define SD_STATE_DATA                 ((uint8_t)0x05) // Sending data
+#define SD_STATE_RCV                  ((uint8_t)0x06) // Receive data
+#define SD_STATE_PRG                  ((uint8_t)0x07) // Programming
+#define SD_STATE_DIS                  ((uint8_t)0x08) // Disconnect
+#define SD_STATE_ERROR                ((uint8_t)0xFF) // Error or unknown state
+
+// Mask for ACMD41
+#define SD_STD_CAPACITY               ((uint32_t)0x00000000U)
+#define SD_HIGH_CAPACITY              ((uint32_t)0x40000000U)
+
+// Timeout for CMD0 or CMD8
+#define SD_CMD_TIMEOUT                ((uint32_t)0x00010000U)
+
+// SDIO timeout for data transfer ((48MHz / CLKDIV / 1000) * timeout_ms)
+// In High-Speed mode the bus runs at full SDIOCLK, the timeouts must be long enough for that
+#if (SDIO_USE_HIGHSPEED)
+#define SD_DATA_R_TIMEOUT             ((uint32_t)((SD_SDIOCLK / 1000U) * 100U)) // Data read timeout is 100ms
+#define SD_DATA_W_TIMEOUT             ((uint32_t)((SD_SDIOCLK / 1000U) * 250U)) // Date write timeout is 250ms
+#else
+#define SD_DATA_R_TIMEOUT             ((uint32_t)((SD_SDIOCLK / (SD_CLK_DIV_TRAN + 2U) / 1000U) * 100U)) // Data read timeout is 100ms
+#define SD_DATA_W_TIMEOUT             ((uint32_t)((SD_SDIOCLK / (SD_CLK_DIV_TRAN + 2U) / 1000U) * 250U)) // Date write timeout is 250ms
+#endif
+
+// Bits of the SWITCH_FUNC (CMD6) argument
+#define SD_SWITCH_CHECK               ((uint32_t)0x00FFFFF0U) // Check function, function group 1 is in the low nibble
+#define SD_SWITCH_SET                 ((uint32_t)0x80FFFFF0U) // Switch function, function group 1 is in the low nibble
+#define SD_SWITCH_DEFAULT             ((uint32_t)0x00000000U) // Function group 1: default speed
+#define SD_SWITCH_HIGHSPEED           ((uint32_t)0x00000001U) // Function group 1: High-Speed
+
+// Erase command class in the CCC field of the CSD (class 5)
+#define SD_CCC_ERASE                  ((uint16_t)0x0020U)
+
+// Trials count for ACMD41
+#define SD_ACMD41_TRIALS              ((uint32_t)0x0000FFFF)
+
+// Bitmap to clear the SDIO command flags
+#define SD_ICR_CMD                    (SD_STA_CCRCFAIL | SD_STA_CTIMEOUT | SD_STA_CMDREND | SD_STA_CMDSENT)
+
+// Bitmap to clear the SDIO data flags
+#define SD_ICR_DATA                   (SD_STA_RXOVERR | SD_STA_DCRCFAIL | SD_STA_DTIMEOUT | SD_STA_DBCKEND | SD_STA_STBITERR)
+
+// Bitmap to clear the SDIO static flags (command and data)
+#define SD_ICR_STATIC                 (SD_STA_CCRCFAIL | SD_STA_DCRCFAIL | SD_STA_CTIMEOUT | \
+                                       SD_STA_DTIMEOUT | SD_STA_TXUNDERR | SD_STA_RXOVERR  | \
+                                       SD_STA_CMDREND  | SD_STA_CMDSENT  | SD_STA_DATAEND  | \
+                                       SD_STA_DBCKEND)
+
+// SDIO bus width
+#define SD_BUS_1BIT                   ((uint32_t)0x00000000U) // 1-bit wide bus (SDIO_D0 used)
+#define SD_BUS_4BIT                   ((uint32_t)0x00000800U) // 4-bit wide bus (SDIO_D[3:0] used)
+#define SD_BUS_8BIT                   ((uint32_t)0x00001000U) // 8-bit wide bus (SDIO_D[7:0] used)
+
+// SDIO transfer flags
+#define SD_XFER_COMMON_FLAGS          (SD_STA_DTIMEOUT | SD_STA_DCRCFAIL | SD_STA_STBITERR)
+
+// SDIO flags for single block receive
+#define SD_RX_SB_FLAGS                (SD_XFER_COMMON_FLAGS | SD_STA_DBCKEND | SD_STA_RXOVERR)
+
+// SDIO flags for multiple block receive
+#define SD_RX_MB_FLAGS                (SD_XFER_COMMON_FLAGS | SD_STA_DATAEND | SD_STA_RXOVERR)
+
+// SDIO flags for single block transmit
+#define SD_TX_SB_FLAGS                (SD_XFER_COMMON_FLAGS | SD_STA_DBCKEND | SD_STA_TXUNDERR)
+
+// SDIO flags for multiple block transmit
+#define SD_TX_MB_FLAGS                (SD_XFER_COMMON_FLAGS | SD_STA_DATAEND | SD_STA_TXUNDERR)
+
+// SDIO transfer error flags
+#define SD_XFER_ERROR_FLAGS           (SD_XFER_COMMON_FLAGS | SD_STA_TXUNDERR | SD_STA_RXOVERR)
+
+// SDIO interrupts for the data phase of an asynchronous transfer
+#define SD_MASK_DATA                  (SD_STA_DATAEND | SD_STA_DCRCFAIL | SD_STA_DTIMEOUT | SD_STA_TXUNDERR | SD_STA_RXOVERR)
+
+// SDIO interrupts for the response of a command
+#define SD_MASK_CMD                   (SD_STA_CMDREND | SD_STA_CCRCFAIL | SD_STA_CTIMEOUT)
+
+// RCA for the MMC card
+#define SD_MMC_RCA                    ((uint16_t)0x0001)
+
+
+// Card type
+enum {
+	SDCT_UNKNOWN = 0x00,
+	SDCT_SDSC_V1 = 0x01,  // Standard capacity SD card v1.0
+	SDCT_SDSC_V2 = 0x02,  // Standard capacity SD card v2.0
+	SDCT_MMC     = 0x03,  // MMC
+	SDCT_SDHC    = 0x04   // High capacity SD card (SDHC or SDXC)
+};
+
+// State of an asynchronous transfer
+enum {
+	SD_XFER_IDLE = 0x00,  // No transfer in progress
+	SD_XFER_DATA = 0x01,  // Data transfer in progress
+	SD_XFER_STOP = 0x02   // Waiting for the STOP_TRANSMISSION response
+};
+
+// SD functions result
+typedef enum {
+	SDR_Success             = 0x00,
+	SDR_Timeout             = 0x01,  // Timeout
+	SDR_CRCError            = 0x02,  // Response for command received but CRC check failed
+	SDR_ReadError           = 0x03,  // Read block error (response for CMD17)
+	SDR_WriteError          = 0x04,  // Write block error (response for CMD24)
+	SDR_WriteErrorInternal  = 0x05,  // Write block error due to internal card error
+	SDR_Unsupported         = 0x06,  // Unsupported card found
+	SDR_BadResponse         = 0x07,
+	SDR_SetBlockSizeFailed  = 0x08,  // Set block size command failed (response for CMD16)
+	SDR_UnknownCard         = 0x09,
+	SDR_NoResponse          = 0x0a,
+	SDR_AddrOutOfRange      = 0x0b,  // Address out of range
+	SDR_WriteCRCError       = 0x0c,  // Data write rejected due to a CRC error
+	SDR_InvalidVoltage      = 0x0d,  // Unsupported voltage range
+	SDR_DataTimeout         = 0x0e,  // Data block transfer timeout
+	SDR_DataCRCFail         = 0x0f,  // Data block transfer CRC failed
+	SDR_RXOverrun           = 0x10,  // Receive FIFO overrun
+	SDR_TXUnderrun          = 0x11,  // Transmit FIFO underrun
+	SDR_StartBitError       = 0x12,  // Start bit not detected on all data signals
+	SDR_AddrMisaligned      = 0x13,  // A misaligned address which did not match the block length was used in the command
+	SDR_BlockLenError       = 0x14,  // The transfer block length is not allowed for this card
+	SDR_EraseSeqError       = 0x15,  // An error in the sequence of erase commands occurred
+	SDR_EraseParam          = 0x16,  // An invalid selection of write-blocks for erase occurred
+	SDR_WPViolation         = 0x17,  // Attempt to write to a protected block or to the write protected card
+	SDR_LockUnlockFailed    = 0x18,  // Error in lock/unlock command
+	SDR_ComCRCError         = 0x19,  // The CRC check of the previous command failed
+	SDR_IllegalCommand      = 0x1a,  // Command is not legal for the the current card state
+	SDR_CardECCFailed       = 0x1b,  // Card internal ECC was applied but failed to correct the data
+	SDR_CCError             = 0x1c,  // Internal card controller error
+	SDR_GeneralError        = 0x1d,  // A general or an unknown error occurred during the operation
+	SDR_StreamUnderrun      = 0x1e,  // The card could not sustain data transfer in stream read operation
+	SDR_StreamOverrun       = 0x1f,  // The card could not sustain data programming in stream mode
+	SDR_CSDOverwrite        = 0x20,  // CSD overwrite error
+	SDR_WPEraseSkip         = 0x21,  // Only partial address space was erased
+	SDR_ECCDisabled         = 0x22,  // The command has been executed without using the internal ECC
+	SDR_EraseReset          = 0x23,  // An erase sequence was cleared before executing
+	SDR_AKESeqError         = 0x24,  // Error in the sequence of the authentication process
+	SDR_Busy                = 0x25,  // An asynchronous transfer is in progress
+	SDR_DMAError            = 0x26,  // DMA transfer error
+	SDR_UnknownError        = 0xFF   // Unknown error
+} SDResult;
+
+// SD card description
+typedef struct {
+	uint8_t     Type;            // Card type (detected by SD_Init())
+	uint32_t    Capacity;        // Card capacity (MBytes for SDHC/SDXC, bytes otherwise)
+	uint32_t    BlockCount;      // SD card blocks count
+	uint32_t    BlockSize;       // SD card block size (bytes), determined in SD_ReadCSD()
+	uint32_t    MaxBusClkFreq;   // Maximum card bus frequency (MHz)
+	uint32_t    BusClock;        // Current bus clock (Hz), set by SD_SetBusClock()
+	uint8_t     HighSpeed;       // Nonzero when the card is in High-Speed mode
+	uint8_t     CSDVer;          // SD card CSD register version
+	uint16_t    RCA;             // SD card RCA address (only for SDIO)
+	uint8_t     MID;             // SD card manufacturer ID
+	uint8_t     PRV;             // SD card product revision (two BCD digits: '6.2' will be 01100010b)
+	uint16_t    OID;             // SD card OEM/Application ID
+	uint8_t     PNM[5];          // SD card product name (5-character ASCII string)
+	uint16_t    MDT;             // SD card manufacturing date
+	uint32_t    PSN;             // SD card serial number
+	// The registers are read word by word, keep them word aligned
+	uint8_t     CSD[16];         // SD card CSD register (card structure data)
+	uint8_t     CID[16];         // SD card CID register (card identification number)
+	uint8_t     SCR[8];          // SD card SCR register (SD card configuration)
+} SDCard_TypeDef;
+
+// Completion callback of an asynchronous transfer, called from the IRQ handler
+// with the result of the transfer
+typedef void (*SD_XferCallback_TypeDef)(SDResult result);
+
+// Segment of a scatter-gather transfer
+typedef struct {
+	uint32_t *pBuf;              // Data buffer (must be word aligned)
+	uint32_t  blocks;            // Number of 512-byte blocks in the buffer (1..511)
+} SD_Segment_TypeDef;
+
+
+// Exported variables
+
+// SD card parameters
+extern SDCard_TypeDef SDCard;
+
+
+// Public functions and macros
+
+#ifndef __GNUC__
+// Change an endianess of unsigned long integer (uint32_t)
+#define SWAP_UINT32(x) (((x) >> 24) | (((x) & 0x00FF0000) >> 8) | (((x) & 0x0000FF00) << 8) | ((x) << 24))
+#endif
+
+
+// Function prototypes
+void SD_GPIO_Init(void);
+void SD_GPIO_DeInit(void);
+void SD_SDIO_Init(void);
+void SD_SDIO_DeInit(void);
+
+SDResult SD_SetBlockSize(uint32_t block_size);
+SDResult SD_Init(void);
+SDResult SD_SetBusWidth(uint32_t BW);
+void SD_SetBusClock(uint32_t clk_div);
+void SD_GetCardInfo(void);
+#if (SDIO_USE_HIGHSPEED)
+SDResult SD_HighSpeed(void);
+#endif // SDIO_USE_HIGHSPEED
+
+SDResult SD_StopTransfer(void);
+SDResult SD_GetCardState(uint8_t *pState);
+SDResult SD_WaitReady(void);
+uint8_t SD_CardBusy(void);
+SDResult SD_Erase(uint32_t addr, uint32_t length);
+
+SDResult SD_ReadBlock(uint32_t addr, uint32_t *pBuf, uint32_t length);
+SDResult SD_WriteBlock(uint32_t addr, uint32_t *pBuf, uint32_t length);
+
+#if (SDIO_USE_DMA)
+void SD_Configure_DMA(uint32_t *pBuf, uint32_t length, uint8_t direction);
+SDResult SD_ReadBlock_DMA(uint32_t addr, uint32_t *pBuf, uint32_t length);
+SDResult SD_WriteBlock_DMA(uint32_t addr, uint32_t *pBuf, uint32_t length);
+SDResult SD_CheckRead(uint32_t length);
+SDResult SD_CheckWrite(uint32_t length);
+#if (SDIO_USE_IRQ)
+SDResult SD_ReadBlock_IRQ(uint32_t addr, uint32_t *pBuf, uint32_t length, SD_XferCallback_TypeDef callback);
+SDResult SD_WriteBlock_IRQ(uint32_t addr, uint32_t *pBuf, uint32_t length, SD_XferCallback_TypeDef callback);
+SDResult SD_ReadBlock_SG(uint32_t addr, const SD_Segment_TypeDef *pSeg, uint32_t count, SD_XferCallback_TypeDef callback);
+SDResult SD_WriteBlock_SG(uint32_t addr, const SD_Segment_TypeDef *pSeg, uint32_t count, SD_XferCallback_TypeDef callback);
+uint8_t SD_XferBusy(void);
+SDResult SD_XferWait(void);
+void SDIO_IRQHandler(void);
+void SDIO_DMA_IRQHandler(void);
+#endif // SDIO_USE_IRQ
+SDResult SD_StreamOpen(uint32_t erase_blocks);
+SDResult SD_StreamWrite(uint32_t addr, uint32_t *pBuf, uint32_t length);
+uint8_t SD_StreamBusy(void);
+SDResult SD_StreamClose(void);
+#endif // SDIO_USE_DMA
+
+#endif // __SDCARD_H
@@ -0,0 +1,198 @@
+#include "usb_pma.h"
+
+
+// A halfword aligned buffer is moved by words, every word is two PMA halfwords.
+// A buffer at an odd address is moved by words too: each PMA halfword takes the
+// byte left from the previous word and the first byte of the next one.
+// The loops are unrolled by 16 bytes (a 64-byte packet is four iterations).
+
+
+// Copy data from the user buffer to the PMA
+// input:
+//   pPMA - pointer to the PMA (address of the halfword in the APB1 address space)
+//   pBuf - pointer to the user buffer (any alignment)
+//   length - number of bytes to copy
+// note: an odd length writes the last byte into the low half of a PMA halfword
+void PMA_Write(uint32_t *pPMA, const uint8_t *pBuf, uint32_t length) {
+	uint32_t w;
+	uint32_t carry;
+
+	if (!(BUF_ALIGN(pBuf) & 0x01)) {
+		// Halfword aligned buffer
+		if ((BUF_ALIGN(pBuf) == 0x02) && (length >= 2)) {
+			PMA_WR(pPMA++,BUF_RD16(pBuf));
+			pBuf += 2;
+			length -= 2;
+		}
+		while (length >= 16) {
+			w = BUF_RD32(pBuf);
+			PMA_WR(pPMA,w);
+			PMA_WR(pPMA + 1,w >> 16);
+			w = BUF_RD32(pBuf + 4);
+			PMA_WR(pPMA + 2,w);
+			PMA_WR(pPMA + 3,w >> 16);
+			w = BUF_RD32(pBuf + 8);
+			PMA_WR(pPMA + 4,w);
+			PMA_WR(pPMA + 5,w >> 16);
+			w = BUF_RD32(pBuf + 12);
+			PMA_WR(pPMA + 6,w);
+			PMA_WR(pPMA + 7,w >> 16);
+			pPMA += 8;
+			pBuf += 16;
+			length -= 16;
+		}
+		while (length >= 4) {
+			w = BUF_RD32(pBuf);
+			PMA_WR(pPMA,w);
+			PMA_WR(pPMA + 1,w >> 16);
+			pPMA += 2;
+			pBuf += 4;
+			length -= 4;
+		}
+		if (length >= 2) {
+			PMA_WR(pPMA++,BUF_RD16(pBuf));
+			pBuf += 2;
+			length -= 2;
+		}
+		if (length) PMA_WR(pPMA,BUF_RD8(pBuf));
+	} else if (length) {
+		// Odd buffer address: the first byte waits for the next one
+		carry = BUF_RD8(pBuf);
+		pBuf++;
+		length--;
+		if ((BUF_ALIGN(pBuf) == 0x02) && (length >= 2)) {
+			w = BUF_RD16(pBuf);
+			PMA_WR(pPMA++,carry | (w << 8));
+			carry = w >> 8;
+			pBuf += 2;
+			length -= 2;
+		}
+		while (length >= 16) {
+			w = BUF_RD32(pBuf);
+			PMA_WR(pPMA,carry | (w << 8));
+			PMA_WR(pPMA + 1,w >> 8);
+			carry = w >> 24;
+			w = BUF_RD32(pBuf + 4);
+			PMA_WR(pPMA + 2,carry | (w << 8));
+			PMA_WR(pPMA + 3,w >> 8);
+			carry = w >> 24;
+			w = BUF_RD32(pBuf + 8);
+			PMA_WR(pPMA + 4,carry | (w << 8));
+			PMA_WR(pPMA + 5,w >> 8);
+			carry = w >> 24;
+			w = BUF_RD32(pBuf + 12);
+			PMA_WR(pPMA + 6,carry | (w << 8));
+			PMA_WR(pPMA + 7,w >> 8);
+			carry = w >> 24;
+			pPMA += 8;
+			pBuf += 16;
+			length -= 16;
+		}
+		while (length >= 4) {
+			w = BUF_RD32(pBuf);
+			PMA_WR(pPMA,carry | (w << 8));
+			PMA_WR(pPMA + 1,w >> 8);
+			carry = w >> 24;
+			pPMA += 2;
+			pBuf += 4;
+			length -= 4;
+		}
+		if (length >= 2) {
+			w = BUF_RD16(pBuf);
+			PMA_WR(pPMA++,carry | (w << 8));
+			carry = w >> 8;
+			pBuf += 2;
+			length -= 2;
+		}
+		// The last halfword: the byte left and the last byte of the buffer, if any
+		PMA_WR(pPMA,length ? carry | (BUF_RD8(pBuf) << 8) : carry);
+	}
+}
+
+// Copy data from the PMA to the user buffer
+// input:
+//   pPMA - pointer to the PMA (address of the halfword in the APB1 address space)
+//   pBuf - pointer to the user buffer (any alignment)
+//   length - number of bytes to copy
+// note: exactly length bytes are stored, an odd length doesn't write past the end of the buffer
+void PMA_Read(uint32_t *pPMA, uint8_t *pBuf, uint32_t length) {
+	uint32_t h;
+	uint32_t carry;
+
+	if (!(BUF_ALIGN(pBuf) & 0x01)) {
+		// Halfword aligned buffer
+		if ((BUF_ALIGN(pBuf) == 0x02) && (length >= 2)) {
+			BUF_WR16(pBuf,PMA_RD(pPMA++));
+			pBuf += 2;
+			length -= 2;
+		}
+		while (length >= 16) {
+			BUF_WR32(pBuf,     (PMA_RD(pPMA)     & 0xFFFF) | (PMA_RD(pPMA + 1) << 16));
+			BUF_WR32(pBuf + 4, (PMA_RD(pPMA + 2) & 0xFFFF) | (PMA_RD(pPMA + 3) << 16));
+			BUF_WR32(pBuf + 8, (PMA_RD(pPMA + 4) & 0xFFFF) | (PMA_RD(pPMA + 5) << 16));
+			BUF_WR32(pBuf + 12,(PMA_RD(pPMA + 6) & 0xFFFF) | (PMA_RD(pPMA + 7) << 16));
+			pPMA += 8;
+			pBuf += 16;
+			length -= 16;
+		}
+		while (length >= 4) {
+			BUF_WR32(pBuf,(PMA_RD(pPMA) & 0xFFFF) | (PMA_RD(pPMA + 1) << 16));
+			pPMA += 2;
+			pBuf += 4;
+			length -= 4;
+		}
+		if (length >= 2) {
+			BUF_WR16(pBuf,PMA_RD(pPMA++));
+			pBuf += 2;
+			length -= 2;
+		}
+		if (length) BUF_WR8(pBuf,PMA_RD(pPMA));
+	} else if (length) {
+		// Odd buffer address: the first byte alone, the second one waits for the next store
+		h = PMA_RD(pPMA++);
+		BUF_WR8(pBuf,h);
+		carry = (h >> 8) & 0xFF;
+		pBuf++;
+		length--;
+		if ((BUF_ALIGN(pBuf) == 0x02) && (length >= 2)) {
+			h = PMA_RD(pPMA++);
+			BUF_WR16(pBuf,carry | (h << 8));
+			carry = (h >> 8) & 0xFF;
+			pBuf += 2;
+			length -= 2;
+		}
+		while (length >= 16) {
+			h = PMA_RD(pPMA + 1);
+			BUF_WR32(pBuf,carry | ((PMA_RD(pPMA) & 0xFFFF) << 8) | (h << 24));
+			carry = (h >> 8) & 0xFF;
+			h = PMA_RD(pPMA + 3);
+			BUF_WR32(pBuf + 4,carry | ((PMA_RD(pPMA + 2) & 0xFFFF) << 8) | (h << 24));
+			carry = (h >> 8) & 0xFF;
+			h = PMA_RD(pPMA + 5);
+			BUF_WR32(pBuf + 8,carry | ((PMA_RD(pPMA + 4) & 0xFFFF) << 8) | (h << 24));
+			carry = (h >> 8) & 0xFF;
+			h = PMA_RD(pPMA + 7);
+			BUF_WR32(pBuf + 12,carry | ((PMA_RD(pPMA + 6) & 0xFFFF) << 8) | (h << 24));
+			carry = (h >> 8) & 0xFF;
+			pPMA += 8;
+			pBuf += 16;
+			length -= 16;
+		}
+		while (length >= 4) {
+			h = PMA_RD(pPMA + 1);
+			BUF_WR32(pBuf,carry | ((PMA_RD(pPMA) & 0xFFFF) << 8) | (h << 24));
+			carry = (h >> 8) & 0xFF;
+			pPMA += 2;
+			pBuf += 4;
+			length -= 4;
+		}
+		if (length >= 2) {
+			h = PMA_RD(pPMA++);
+			BUF_WR16(pBuf,carry | (h << 8));
+			carry = (h >> 8) & 0xFF;
+			pBuf += 2;
+			length -= 2;
+		}
+		if (length) BUF_WR8(pBuf,carry);
+	}
+}
@@ -5,6 +5,9 @@
 //#define buf_size (512U * 64) // 32KB
 #define buf_size (512U * 128) // 64KB
 
+// Size of the card area used by the sequential write tests (must be a power of 2)
+#define STREAM_AREA (16U << 20) // 16MB
+
 #if 0
 // Place buffers in SRAM2 region
 static uint8_t __attribute__((section(".sram2"))) sd_buf[buf_size] __attribute__((aligned(4)));
@@ -184,6 +187,56 @@ uint8_t CRC8_CCITT(uint8_t *pBuf, uint32_t length) {
 	return (uint8_t)(crc >> 8);
 }
 
+// Time source for the benchmark
+static uint32_t BENCH_Ticks(void) {
+	return DWT->CYCCNT;
+}
+
+// Benchmark backends: polled and DMA transfers of the SD card driver
+static uint32_t BENCH_ReadPoll(void *ctx, uint8_t *buffer, uint32_t block, uint32_t count) {
+	return SD_ReadBlock(block << 9,(uint32_t *)buffer,count << 9);
+}
+
+static uint32_t BENCH_WritePoll(void *ctx, uint8_t *buffer, uint32_t block, uint32_t count) {
+	return SD_WriteBlock(block << 9,(uint32_t *)buffer,count << 9);
+}
+
+static uint32_t BENCH_ReadDMA(void *ctx, uint8_t *buffer, uint32_t block, uint32_t count) {
+	SDResult result;
+
+	result = SD_ReadBlock_DMA(block << 9,(uint32_t *)buffer,count << 9);
+	if (result == SDR_Success) result = SD_CheckRead(count << 9);
+
+	return result;
+}
+
+static uint32_t BENCH_WriteDMA(void *ctx, uint8_t *buffer, uint32_t block, uint32_t count) {
+	SDResult result;
+
+	result = SD_WriteBlock_DMA(block << 9,(uint32_t *)buffer,count << 9);
+	if (result == SDR_Success) result = SD_CheckWrite(count << 9);
+
+	return result;
+}
+
+// The erase runs in the background, wait for the card to finish it
+static uint32_t BENCH_Erase(void *ctx, uint32_t block, uint32_t count) {
+	SDResult result;
+
+	result = SD_Erase(block << 9,count << 9);
+	if (result == SDR_Success) result = SD_WaitReady();
+
+	return result;
+}
+
+// Both backends work on the card area of the sequential write tests
+static const BENCH_Dev_TypeDef BENCH_DevPoll = {
+		"POLL", BENCH_ReadPoll, BENCH_WritePoll, BENCH_Erase, NULL, 0x4000000 >> 9, STREAM_AREA >> 9
+};
+static const BENCH_Dev_TypeDef BENCH_DevDMA = {
+		"DMA", BENCH_ReadDMA, BENCH_WriteDMA, BENCH_Erase, NULL, 0x4000000 >> 9, STREAM_AREA >> 9
+};
+
 
 int main(void) {
 	// Initialize the MCU clock system
@@ -249,6 +302,15 @@ int main(void) {
 	// Enable DMA2 peripheral (for SDIO)
 	RCC->AHB1ENR |= RCC_AHB1ENR_DMA2EN;
 
+#if (SDIO_USE_DMA && SDIO_USE_IRQ)
+	// Enable the SDIO DMA channel and SDMMC1 IRQs (asynchronous transfers)
+	// Both handlers share the transfer state, so they must have the same priority
+	NVIC_SetPriority(SDIO_DMA_IRQN,1);
+	NVIC_SetPriority(SDMMC1_IRQn,1);
+	NVIC_EnableIRQ(SDIO_DMA_IRQN);
+	NVIC_EnableIRQ(SDMMC1_IRQn);
+#endif
+
 	// Try to initialize the SD card
 	j = SD_Init();
 	printf("SDCard init: %02X\r\n",j);
@@ -301,28 +363,23 @@ int main(void) {
 	}
 #endif // SDIO_USE_4BIT
 
+#if (SDIO_USE_HIGHSPEED)
+	// Try to switch to High-speed mode, the card stays at default speed if it fails
+	j = SD_HighSpeed();
+	printf("High-Speed: %02X\r\n",j);
+#endif // SDIO_USE_HIGHSPEED
+
 	printf("Bus: ");
 	switch (SDMMC1->CLKCR & SDMMC_CLKCR_WIDBUS) {
 		case SD_BUS_4BIT: printf("4-bit"); break;
 		case SD_BUS_8BIT: printf("8-bit"); break;
 		default:          printf("1-bit"); break;
 	}
-	printf(", div=%u -> %.3uMHz\r\n",
-			SDMMC1->CLKCR & 0xFF,
-			48000000 / ((SDMMC1->CLKCR & 0xFF) + 2) / 1000
+	printf(", %s, %.3uMHz\r\n",
+			SDCard.HighSpeed ? "high speed" : "default speed",
+			SDCard.BusClock / 1000
 		);
 
-#if 0
-	// Try to switch to High-speed mode
-	i = SD_HighSpeed();
-	// For SDv1,SDv2 and MMC card must set block size (SDHC/SDXC always have fixed size 512bytes)
-	if ((SDCard.Type == SDCT_SDSC_V1) || (SDCard.Type == SDCT_SDSC_V2) || (SDCard.Type == SDCT_MMC)) {
-		i = SD_SetBlockSize(512);
-	}
-	// Enable SDIO clock bypass
-	SDMMC1->CLKCR |= SDMMC_CLKCR_BYPASS;
-#endif
-
 
 	// Initialize test variables
 	sd_count  = 0;
@@ -367,9 +424,6 @@ int main(void) {
 //	USART_SendBufHexPretty(DBG_USART,sd_buf,buf_size,32,'.');
 	printf("ReadBlock: %02X [CRC:%02X]\r\n",j,crc_ref);
 
-	// Configure the SDIO DMA channel to read data from SDIO
-	SD_Configure_DMA((uint32_t *)sd_buf, buf_size, SDIO_DMA_DIR_RX);
-
 	memset(sd_buf,0x11,buf_size);
 	j = SD_ReadBlock_DMA(0x5000000,(uint32_t *)sd_buf,buf_size);
 	if (j == SDR_Success) {
@@ -386,275 +440,40 @@ int main(void) {
 	}
 
 
-#if 0
-	// Perform read tests
-
-	printf("Single block read POLL: ");
-	sd_count  = 0;
-	sd_error  = 0;
-	sd_crc    = 0;
-	sd_amount = 0;
-	tim_flag = 0;
-	TIM17->CR1 |= TIM_CR1_CEN;
-	while (!tim_flag) {
-		j = SD_ReadBlock(0x5000000, (uint32_t *)sd_buf, 512);
-		if (j == SDR_Success) {
-			sd_count++;
-			sd_amount += 512;
-		} else {
-			printf("RB:%02X ", j);
-			sd_error++;
-		}
-	}
-	if (sd_error != 0) {
-		printf("success/errors count: %u/%u\r\n",
-				sd_count,
-				sd_error
-			);
-	} else {
-		printf("%u bytes (%.3u MB), perf: %u blocks/s, %u bytes/s (%.3uMB/s)\r\n",
-				sd_amount,
-				sd_amount >> 10,
-				sd_count / tim_seconds,
-				sd_amount / tim_seconds,
-				(uint32_t)((sd_amount / 1048576.0) * 1000.0) / tim_seconds
-			);
-	}
-
-	printf("Multiple block read POLL: ");
-	sd_count  = 0;
-	sd_error  = 0;
-	sd_crc    = 0;
-	sd_amount = 0;
-	tim_flag = 0;
-	TIM17->CR1 |= TIM_CR1_CEN;
-	while (!tim_flag) {
-		j = SD_ReadBlock(0x5000000, (uint32_t *)sd_buf, buf_size);
-		if (j == SDR_Success) {
-			sd_count++;
-			sd_amount += buf_size;
-		} else {
-			printf("RB:%02X ", j);
-			sd_error++;
-		}
-	}
-	if (sd_error != 0) {
-		printf("success/errors count: %u/%u\r\n",
-				sd_count,
-				sd_error
-			);
-	} else {
-		printf("%u bytes (%.3u MB), perf: %u blocks/s, %u bytes/s (%.3uMB/s)\r\n",
-				sd_amount,
-				sd_amount >> 10,
-				((buf_size >> 9) * sd_count) / tim_seconds,
-				sd_amount / tim_seconds,
-				(uint32_t)((sd_amount / 1048576.0) * 1000.0) / tim_seconds
-			);
-	}
-
-	printf("Single block read DMA: ");
-	sd_count  = 0;
-	sd_error  = 0;
-	sd_crc    = 0;
-	sd_amount = 0;
-	tim_flag = 0;
-	TIM17->CR1 |= TIM_CR1_CEN;
-	while (!tim_flag) {
-		j = SD_ReadBlock_DMA(0x5000000, (uint32_t *)sd_buf, 512);
-		if (j == SDR_Success) {
-			j = SD_CheckRead(512);
-			if (j == SDR_Success) {
-				sd_count++;
-				sd_amount += 512;
-			} else {
-				printf("CR:%02X ", j);
-				sd_error++;
-			}
-		} else {
-			printf("RB:%02X ", j);
-			sd_error++;
-		}
-	}
-	if (sd_error != 0) {
-		printf("success/errors count: %u/%u\r\n",
-				sd_count,
-				sd_error
-			);
-	} else {
-		printf("%u bytes (%.3u MB), perf: %u blocks/s, %u bytes/s (%.3uMB/s)\r\n",
-				sd_amount,
-				sd_amount >> 10,
-				sd_count / tim_seconds,
-				sd_amount / tim_seconds,
-				(uint32_t)((sd_amount / 1048576.0) * 1000.0) / tim_seconds
-			);
-	}
-
-	printf("Multiple block read DMA: ");
-	sd_count  = 0;
-	sd_error  = 0;
-	sd_crc    = 0;
-	sd_amount = 0;
-	tim_flag = 0;
-	TIM17->CR1 |= TIM_CR1_CEN;
-	while (!tim_flag) {
-		j = SD_ReadBlock_DMA(0x5000000, (uint32_t *)sd_buf, buf_size);
-		if (j == SDR_Success) {
-			j = SD_CheckRead(buf_size);
-			if (j == SDR_Success) {
-				sd_count++;
-				sd_amount += buf_size;
-			} else {
-				printf("CR:%02X ", j);
-				sd_error++;
-			}
-		} else {
-			printf("RB:%02X ", j);
-			sd_error++;
-		}
-	}
-	if (sd_error != 0) {
-		printf("success/errors count: %u/%u\r\n",
-				sd_count,
-				sd_error
-			);
-	} else {
-		printf("%u bytes (%.3u MB), perf: %u blocks/s, %u bytes/s (%.3uMB/s)\r\n",
-				sd_amount,
-				sd_amount >> 10,
-				((buf_size >> 9) * sd_count) / tim_seconds,
-				sd_amount / tim_seconds,
-				(uint32_t)((sd_amount / 1048576.0) * 1000.0) / tim_seconds
-			);
-	}
-
-#endif // Read tests
-
-
-/*
+	// Block device benchmark: polled and DMA transfers, sequential and random
+	// addresses, single block, 4KB and 32KB operations, with the latency of every
+	// operation taken from the DWT cycle counter
 	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
-	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
-	sd_addr = 0;
-	for (k = 0; k < 16; k++) {
-		DWT->CYCCNT = 0;
-		j = SD_WriteBlock(sd_addr, (uint32_t *)sd_buf, buf_size);
-		i = DWT->CYCCNT;
-		printf("WB:%02X\t\tDWT:%u\r\n", j, i);
-		sd_addr += buf_size;
-	}
-*/
-
-/*
 	DWT->CYCCNT = 0;
-	j = SD_ReadBlock(0x0, (uint32_t *)sd_buf, buf_size);
-	i = DWT->CYCCNT;
-	printf("RB:%02X  DWT:%u\r\n", j, i);
-*/
-
-/*
-	SD_Configure_DMA((uint32_t *)sd_buf, 32768, SDIO_DMA_DIR_TX);
-	j = SD_WriteBlock_DMA(0x0, (uint32_t *)sd_buf, 32768);
-	if (j == SDR_Success) {
-		j = SD_CheckWrite(buf_size);
-		printf("CW:%02X\r\n", j);
-	}
-*/
-
-
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	BENCH_Init(BENCH_Ticks,SystemCoreClock / 1000000);
+	BENCH_RunAll(&BENCH_DevPoll,BENCH_Tests,BENCH_TESTS,sd_buf,tim_seconds * 1000);
+	BENCH_RunAll(&BENCH_DevDMA,BENCH_Tests,BENCH_TESTS,sd_buf,tim_seconds * 1000);
 
 
 #if 1
 	// Perform write tests
 
-	// Single block
-	printf("Single block write POLL: ");
-	memset(sd_buf, 0xCC, 512);
-	sd_count  = 0;
-	sd_error  = 0;
-	sd_crc    = 0;
-	sd_amount = 0;
-	tim_flag = 0;
-	TIM17->CR1 |= TIM_CR1_CEN;
-	while (!tim_flag) {
-		j = SD_WriteBlock(0x4FF7E00, (uint32_t *)sd_buf, 512);
-		if (j == SDR_Success) {
-			sd_count++;
-			sd_amount += 512;
-		} else {
-			printf("WB:%02X ", j);
-			sd_error++;
-		}
-	}
-	if (sd_error != 0) {
-		printf("success/errors count: %u/%u\r\n",
-				sd_count,
-				sd_error
-			);
-	} else {
-		printf("%u bytes (%.3u MB), perf: %u blocks/s, %u bytes/s (%.3uMB/s)\r\n",
-				sd_amount,
-				sd_amount >> 10,
-				sd_count / tim_seconds,
-				sd_amount / tim_seconds,
-				(uint32_t)((sd_amount / 1048576.0) * 1000.0) / tim_seconds
-			);
-	}
-
-	// Multiple block
-	printf("Multiple block write POLL: ");
-	memset(sd_buf, 0x33, buf_size);
-	sd_count  = 0;
-	sd_error  = 0;
-	sd_crc    = 0;
-	sd_amount = 0;
-	tim_flag = 0;
-	TIM17->CR1 |= TIM_CR1_CEN;
-	while (!tim_flag) {
-		j = SD_WriteBlock(0x4FF8000, (uint32_t *)sd_buf, buf_size);
-		if (j == SDR_Success) {
-			sd_count++;
-			sd_amount += buf_size;
-		} else {
-			printf("WB:%02X ", j);
-			sd_error++;
-		}
-	}
-	if (sd_error != 0) {
-		printf("success/errors count: %u/%u\r\n",
-				sd_count,
-				sd_error
-			);
-	} else {
-		printf("%u bytes (%.3u MB), perf: %u blocks/s, %u bytes/s (%.3uMB/s)\r\n",
-				sd_amount,
-				sd_amount >> 10,
-				((buf_size >> 9) * sd_count) / tim_seconds,
-				sd_amount / tim_seconds,
-				(uint32_t)((sd_amount / 1048576.0) * 1000.0) / tim_seconds
-			);
-	}
-
-/*
-	// Configure the SDIO DMA channel to write data to SDIO
-	SD_Configure_DMA((uint32_t *)sd_buf, buf_size, SDIO_DMA_DIR_TX);
-
-	// Single block with DMA
-	printf("Single block write DMA: ");
-	memset(sd_buf, 0xCC, 512);
+	// Sequential write of half-buffer chunks, the CPU fills one half while the other is written
+	// (the memset stands for the work of a data producer)
+	// Start/check pair for every chunk: each one is a separate WRITE_MULTIPLE_BLOCK command
+	printf("Chunk write DMA: ");
 	sd_count  = 0;
 	sd_error  = 0;
 	sd_crc    = 0;
 	sd_amount = 0;
+	sd_addr   = 0;
 	tim_flag = 0;
 	TIM17->CR1 |= TIM_CR1_CEN;
 	while (!tim_flag) {
-		j = SD_WriteBlock_DMA(0x4FF7E00, (uint32_t *)sd_buf, 512);
+		k = (sd_count & 1) ? (buf_size >> 1) : 0;
+		memset(&sd_buf[k], sd_count, buf_size >> 1);
+		j = SD_WriteBlock_DMA(0x4000000 + sd_addr, (uint32_t *)&sd_buf[k], buf_size >> 1);
 		if (j == SDR_Success) {
-			j = SD_CheckWrite(512);
+			j = SD_CheckWrite(buf_size >> 1);
 			if (j == SDR_Success) {
 				sd_count++;
-				sd_amount += 512;
+				sd_amount += buf_size >> 1;
 			} else {
 				printf("CW:%02X ", j);
 				sd_error++;
@@ -663,6 +482,7 @@ int main(void) {
 			printf("WB:%02X ", j);
 			sd_error++;
 		}
+		sd_addr = (sd_addr + (buf_size >> 1)) & (STREAM_AREA - 1);
 	}
 	if (sd_error != 0) {
 		printf("success/errors count: %u/%u\r\n",
@@ -673,36 +493,40 @@ int main(void) {
 		printf("%u bytes (%.3u MB), perf: %u blocks/s, %u bytes/s (%.3uMB/s)\r\n",
 				sd_amount,
 				sd_amount >> 10,
-				sd_count / tim_seconds,
+				((buf_size >> 10) * sd_count) / tim_seconds,
 				sd_amount / tim_seconds,
 				(uint32_t)((sd_amount / 1048576.0) * 1000.0) / tim_seconds
 			);
 	}
 
-	// Multiple block with DMA
-	printf("Multiple block write DMA: ");
-	memset(sd_buf, 0x33, buf_size);
+	// Same chunks with the streaming writer: one open-ended WRITE_MULTIPLE_BLOCK
+	// with pre-erase, stopped only when the address wraps around
+	printf("Stream write DMA: ");
 	sd_count  = 0;
 	sd_error  = 0;
 	sd_crc    = 0;
 	sd_amount = 0;
+	sd_addr   = 0;
+	SD_StreamOpen(STREAM_AREA >> 9);
 	tim_flag = 0;
 	TIM17->CR1 |= TIM_CR1_CEN;
 	while (!tim_flag) {
-		j = SD_WriteBlock_DMA(0x4FF8000, (uint32_t *)sd_buf, buf_size);
+		k = (sd_count & 1) ? (buf_size >> 1) : 0;
+		memset(&sd_buf[k], sd_count, buf_size >> 1);
+		j = SD_StreamWrite(0x4000000 + sd_addr, (uint32_t *)&sd_buf[k], buf_size >> 1);
 		if (j == SDR_Success) {
-			j = SD_CheckWrite(buf_size);
-			if (j == SDR_Success) {
-				sd_count++;
-				sd_amount += buf_size;
-			} else {
-				printf("CW:%02X ", j);
-				sd_error++;
-			}
+			sd_count++;
+			sd_amount += buf_size >> 1;
 		} else {
-			printf("WB:%02X ", j);
+			printf("SW:%02X ", j);
 			sd_error++;
 		}
+		sd_addr = (sd_addr + (buf_size >> 1)) & (STREAM_AREA - 1);
+	}
+	j = SD_StreamClose();
+	if (j != SDR_Success) {
+		printf("SC:%02X ", j);
+		sd_error++;
 	}
 	if (sd_error != 0) {
 		printf("success/errors count: %u/%u\r\n",
@@ -713,12 +537,11 @@ int main(void) {
 		printf("%u bytes (%.3u MB), perf: %u blocks/s, %u bytes/s (%.3uMB/s)\r\n",
 				sd_amount,
 				sd_amount >> 10,
-				((buf_size >> 9) * sd_count) / tim_seconds,
+				((buf_size >> 10) * sd_count) / tim_seconds,
 				sd_amount / tim_seconds,
 				(uint32_t)((sd_amount / 1048576.0) * 1000.0) / tim_seconds
 			);
 	}
-*/
 
 #endif // Write tests
 
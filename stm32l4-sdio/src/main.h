@@ -20,6 +20,7 @@
 
 //
 #include "sdcard.h"
+#include "sdbench.h"
 
 // Standard libraries
 #include <string.h>
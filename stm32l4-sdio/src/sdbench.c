@@ -0,0 +1,259 @@
+// Block device benchmark
+
+
+#ifdef HOSTVER
+#include <stdio.h>
+#else
+#include "usart.h"
+
+// Reports go to the debug USART
+#define printf(...)                USART_printf(BENCH_USART,__VA_ARGS__)
+#endif // HOSTVER
+#include <string.h>
+
+#include "sdbench.h"
+
+
+// Standard set of tests: single block, 4KB and 32KB transfers, sequential writes
+// to a freshly erased area at the end
+const BENCH_Test_TypeDef BENCH_Tests[BENCH_TESTS] = {
+		{ BENCH_READ  | BENCH_SEQ,     1 },
+		{ BENCH_READ  | BENCH_SEQ,     8 },
+		{ BENCH_READ  | BENCH_SEQ,    64 },
+		{ BENCH_READ  | BENCH_RANDOM,  1 },
+		{ BENCH_READ  | BENCH_RANDOM,  8 },
+		{ BENCH_WRITE | BENCH_SEQ,     1 },
+		{ BENCH_WRITE | BENCH_SEQ,     8 },
+		{ BENCH_WRITE | BENCH_SEQ,    64 },
+		{ BENCH_WRITE | BENCH_RANDOM,  1 },
+		{ BENCH_WRITE | BENCH_RANDOM,  8 },
+		{ BENCH_WRITE | BENCH_SEQ | BENCH_ERASED,  8 },
+		{ BENCH_WRITE | BENCH_SEQ | BENCH_ERASED, 64 }
+};
+
+static uint32_t (*BENCH_Ticks)(void);     // Time source, free running 32-bit counter
+static uint32_t BENCH_TicksPerUs = 1;     // Counter ticks per microsecond
+static uint32_t BENCH_Seed;               // State of the random address generator
+static BENCH_Result_TypeDef BENCH_Result; // Result of the last test of BENCH_RunAll
+
+
+// Repeatable pseudo random numbers, so every run accesses the same blocks
+static uint32_t BENCH_Rand(void) {
+	BENCH_Seed = BENCH_Seed * 1103515245 + 12345;
+
+	return (BENCH_Seed >> 8) & 0xffffff;
+}
+
+// Histogram bucket of the latency value
+// input:
+//   us - latency (us)
+// return: index of the bucket
+static uint32_t BENCH_Bucket(uint32_t us) {
+	uint32_t exp = 31;
+
+	if (us < BENCH_HIST_SUB) return us;
+
+	// Position of the most significant bit (3..31)
+	while (!(us & 0x80000000)) {
+		us <<= 1;
+		exp--;
+	}
+
+	// The 3 bits after the most significant one select the bucket within the power of two
+	return ((exp - 2) * BENCH_HIST_SUB) + ((us >> 28) & (BENCH_HIST_SUB - 1));
+}
+
+// Highest latency value that falls into the bucket
+// input:
+//   idx - index of the bucket
+// return: latency (us)
+static uint32_t BENCH_BucketMax(uint32_t idx) {
+	uint32_t exp;
+
+	if (idx < BENCH_HIST_SUB) return idx;
+
+	exp = (idx / BENCH_HIST_SUB) + 2;
+
+	return (((BENCH_HIST_SUB + (idx % BENCH_HIST_SUB) + 1) << (exp - 3)) - 1);
+}
+
+// Erase the test area
+// input:
+//   dev - block device under test
+//   res - pointer to the result, the erase time is added to it
+// return: zero on success
+static uint32_t BENCH_Erase(const BENCH_Dev_TypeDef *dev, BENCH_Result_TypeDef *res) {
+	uint32_t start;
+	uint32_t result;
+
+	start = BENCH_Ticks();
+	result = dev->erase(dev->ctx,dev->base,dev->blocks);
+	res->erase += (BENCH_Ticks() - start) / BENCH_TicksPerUs;
+
+	return result;
+}
+
+// Initialize the benchmark
+// input:
+//   ticks - function which returns the free running 32-bit time counter
+//   ticks_per_us - counter ticks per microsecond
+// note: on the board this is e.g. the DWT cycle counter, on the host the simulated time
+void BENCH_Init(uint32_t (*ticks)(void), uint32_t ticks_per_us) {
+	BENCH_Ticks = ticks;
+	BENCH_TicksPerUs = ticks_per_us ? ticks_per_us : 1;
+}
+
+// Run one test
+// input:
+//   dev - block device under test
+//   test - the test to run
+//   pBuf - data buffer (test->count blocks)
+//   duration_ms - how long to repeat the operation (ms)
+//   res - pointer to the structure for the result
+// note: the time counts only while the operations are in progress
+// note: with BENCH_ERASED the area is erased before the test and whenever the sequential
+//       addresses wrap around, this time goes to res->erase
+void BENCH_Run(const BENCH_Dev_TypeDef *dev, const BENCH_Test_TypeDef *test, uint8_t *pBuf, uint32_t duration_ms, BENCH_Result_TypeDef *res) {
+	uint32_t (*xfer)(void *ctx, uint8_t *buffer, uint32_t block, uint32_t count);
+	uint32_t slots = dev->blocks / test->count; // Transfer size aligned places in the test area
+	uint32_t slot = 0;
+	uint32_t start;
+	uint32_t us;
+	uint32_t result;
+
+	memset(res,0,sizeof(BENCH_Result_TypeDef));
+	res->min = 0xffffffff;
+	if (!slots) return;
+	if (test->flags & BENCH_ERASED) {
+		if (!dev->erase || BENCH_Erase(dev,res)) {
+			res->errors++;
+			return;
+		}
+	}
+
+	if (test->flags & BENCH_WRITE) {
+		xfer = dev->write;
+		memset(pBuf,0xA5,test->count * BENCH_BLOCK_SIZE);
+	} else {
+		xfer = dev->read;
+	}
+	BENCH_Seed = 1;
+
+	while ((res->time / 1000 < duration_ms) && (res->ops + res->errors < BENCH_MAX_OPS)) {
+		if (test->flags & BENCH_RANDOM) {
+			slot = BENCH_Rand() % slots;
+		}
+
+		start = BENCH_Ticks();
+		result = xfer(dev->ctx,pBuf,dev->base + (slot * test->count),test->count);
+		us = (BENCH_Ticks() - start) / BENCH_TicksPerUs;
+
+		if (result) {
+			res->errors++;
+		} else {
+			res->ops++;
+			res->bytes += test->count * BENCH_BLOCK_SIZE;
+		}
+		res->time += us;
+		if (us < res->min) res->min = us;
+		if (us > res->max) res->max = us;
+		res->hist[BENCH_Bucket(us)]++;
+
+		if (!(test->flags & BENCH_RANDOM) && (++slot == slots)) {
+			slot = 0;
+			if ((test->flags & BENCH_ERASED) && BENCH_Erase(dev,res)) res->errors++;
+		}
+	}
+}
+
+// Latency below which the given part of the operations completed
+// input:
+//   res - pointer to the test result
+//   permille - part of the operations (e.g. 500 for the median, 990 for p99)
+// return: latency (us), the upper end of the histogram bucket limited to the measured maximum
+uint32_t BENCH_Percentile(const BENCH_Result_TypeDef *res, uint32_t permille) {
+	uint32_t total = res->ops + res->errors;
+	uint32_t need;
+	uint32_t sum = 0;
+	uint32_t idx;
+	uint32_t us;
+
+	if (!total) return 0;
+
+	// Number of operations to be covered, rounded up
+	need = (uint32_t)(((uint64_t)total * permille + 999) / 1000);
+	if (!need) need = 1;
+
+	for (idx = 0; idx < BENCH_HIST_SIZE; idx++) {
+		sum += res->hist[idx];
+		if (sum >= need) break;
+	}
+
+	us = BENCH_BucketMax(idx);
+	if (us > res->max) us = res->max;
+	if (us < res->min) us = res->min;
+
+	return us;
+}
+
+// Print the header of the report table
+void BENCH_Header(void) {
+	printf("%-6s %-4s %-6s %6s %7s %9s %8s %8s %8s %8s\r\n",
+			"dev","addr","op","bytes","ops","MB/s","min us","p50 us","p99 us","max us"
+		);
+}
+
+// Print the result of a test
+// input:
+//   dev - block device the test was run on
+//   test - the test
+//   res - the result
+void BENCH_Report(const BENCH_Dev_TypeDef *dev, const BENCH_Test_TypeDef *test, const BENCH_Result_TypeDef *res) {
+	uint32_t speed = 0; // Throughput (thousandths of MB/s)
+
+	if (res->time) speed = (uint32_t)(((uint64_t)res->bytes * 1000000 / res->time) * 1000 / 1048576);
+
+	printf("%-6s %-4s %-6s %6u %7u %5u.%03u %8u %8u %8u %8u",
+			dev->name,
+			(test->flags & BENCH_RANDOM) ? "rand" : "seq",
+			(test->flags & BENCH_WRITE) ? ((test->flags & BENCH_ERASED) ? "ewrite" : "write") : "read",
+			test->count * BENCH_BLOCK_SIZE,
+			res->ops,
+			speed / 1000,
+			speed % 1000,
+			(res->ops + res->errors) ? res->min : 0,
+			BENCH_Percentile(res,500),
+			BENCH_Percentile(res,990),
+			res->max
+		);
+	if (res->errors) printf("  errors: %u",res->errors);
+	if (res->erase) printf("  erase: %u us",res->erase);
+	printf("\r\n");
+}
+
+// Run a set of tests and print the results
+// input:
+//   dev - block device under test
+//   tests - array of tests (e.g. BENCH_Tests)
+//   count - number of tests in the array
+//   pBuf - data buffer (must hold the largest transfer of the tests)
+//   duration_ms - duration of every test (ms)
+// return: total number of failed operations
+// note: the BENCH_ERASED tests are skipped if the device can't erase
+uint32_t BENCH_RunAll(const BENCH_Dev_TypeDef *dev, const BENCH_Test_TypeDef *tests, uint32_t count, uint8_t *pBuf, uint32_t duration_ms) {
+	uint32_t errors = 0;
+
+	BENCH_Header();
+	while (count--) {
+		if ((tests->flags & BENCH_ERASED) && !dev->erase) {
+			tests++;
+			continue;
+		}
+		BENCH_Run(dev,tests,pBuf,duration_ms,&BENCH_Result);
+		BENCH_Report(dev,tests,&BENCH_Result);
+		errors += BENCH_Result.errors;
+		tests++;
+	}
+
+	return errors;
+}
@@ -0,0 +1,84 @@
+#ifndef __SDBENCH_H
+#define __SDBENCH_H
+
+
+#include <stdint.h>
+
+
+// Block device benchmark
+// Runs timed read/write loops against any block device backend (the SD card
+// driver on the board, a simulated card on the host) and reports the throughput
+// together with the latency distribution of the single operations.
+// Build with HOSTVER defined for the host, the reports go to stdout then.
+
+
+// Debug USART port for the reports
+#define BENCH_USART                USART1
+
+// Size of the block (bytes)
+#define BENCH_BLOCK_SIZE           512U
+
+// Limit of operations per test, in case the time source doesn't advance
+#define BENCH_MAX_OPS              100000U
+
+// Latency histogram: values below 8us have own buckets, above that every power
+// of two is split into 8 buckets (about 12% resolution) up to 2^32us
+#define BENCH_HIST_SUB             8U
+#define BENCH_HIST_SIZE            (BENCH_HIST_SUB * 30U)
+
+
+// Test flags
+#define BENCH_READ                 ((uint8_t)0x00) // Read test
+#define BENCH_WRITE                ((uint8_t)0x01) // Write test
+#define BENCH_SEQ                  ((uint8_t)0x00) // Sequential addresses
+#define BENCH_RANDOM               ((uint8_t)0x02) // Random addresses (aligned to the transfer size)
+#define BENCH_ERASED               ((uint8_t)0x04) // Erase the test area first (skipped without erase)
+
+
+// Block device under test
+typedef struct {
+	const char *name;                    // Name shown in the reports
+	// Transfer count blocks starting at the given block, return zero on success
+	uint32_t (*read)(void *ctx, uint8_t *buffer, uint32_t block, uint32_t count);
+	uint32_t (*write)(void *ctx, uint8_t *buffer, uint32_t block, uint32_t count);
+	// Erase count blocks and wait until the card is done, return zero on success (NULL if not supported)
+	uint32_t (*erase)(void *ctx, uint32_t block, uint32_t count);
+	void *ctx;                           // Passed to the read/write/erase functions
+	uint32_t base;                       // First block of the test area
+	uint32_t blocks;                     // Size of the test area in blocks
+} BENCH_Dev_TypeDef;
+
+// Benchmark test
+typedef struct {
+	uint8_t flags;                       // Combination of BENCH_xx flags
+	uint32_t count;                      // Blocks per operation
+} BENCH_Test_TypeDef;
+
+// Result of a test
+typedef struct {
+	uint32_t ops;                        // Successful operations
+	uint32_t errors;                     // Failed operations
+	uint32_t bytes;                      // Bytes transferred by the successful operations
+	uint32_t time;                       // Total time of all operations (us)
+	uint32_t erase;                      // Time spent erasing the test area, not part of the time (us)
+	uint32_t min;                        // Shortest operation (us)
+	uint32_t max;                        // Longest operation (us)
+	uint32_t hist[BENCH_HIST_SIZE];      // Latency histogram
+} BENCH_Result_TypeDef;
+
+
+// Standard set of tests (the buffer must hold BENCH_MAX_COUNT blocks)
+#define BENCH_TESTS                12U
+#define BENCH_MAX_COUNT            64U
+extern const BENCH_Test_TypeDef BENCH_Tests[BENCH_TESTS];
+
+
+// Function prototypes
+void BENCH_Init(uint32_t (*ticks)(void), uint32_t ticks_per_us);
+void BENCH_Run(const BENCH_Dev_TypeDef *dev, const BENCH_Test_TypeDef *test, uint8_t *pBuf, uint32_t duration_ms, BENCH_Result_TypeDef *res);
+uint32_t BENCH_Percentile(const BENCH_Result_TypeDef *res, uint32_t permille);
+void BENCH_Header(void);
+void BENCH_Report(const BENCH_Dev_TypeDef *dev, const BENCH_Test_TypeDef *test, const BENCH_Result_TypeDef *res);
+uint32_t BENCH_RunAll(const BENCH_Dev_TypeDef *dev, const BENCH_Test_TypeDef *tests, uint32_t count, uint8_t *pBuf, uint32_t duration_ms);
+
+#endif // __SDBENCH_H
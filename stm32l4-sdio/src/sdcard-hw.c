@@ -0,0 +1,155 @@
+#include "sdcard.h"
+
+
+#if (SDIO_USE_DMA)
+// Handle for SDIO DMA channel
+DMA_HandleTypeDef SDIO_DMA_CH;
+#endif // SDIO_USE_DMA
+
+
+// Initialize the SDIO GPIO lines
+void SD_GPIO_Init(void) {
+	// Enable the SDIO corresponding GPIO peripherals
+	RCC->AHB2ENR |= SDIO_GPIO_PERIPH;
+
+	// Configure SDIO GPIO pins
+
+	// SDIO_CMD
+	GPIO_set_mode(SDIO_GPIO_CMD_PORT,GPIO_Mode_AF,GPIO_PUPD_PU,SDIO_GPIO_CMD_PIN);
+	GPIO_out_cfg(SDIO_GPIO_CMD_PORT,GPIO_OT_PP,GPIO_SPD_HIGH,SDIO_GPIO_CMD_PIN);
+	GPIO_af_cfg(SDIO_GPIO_CMD_PORT,SDIO_GPIO_CMD_SRC,SDIO_GPIO_AF);
+
+	// SDIO_CK
+	GPIO_set_mode(SDIO_GPIO_CK_PORT,GPIO_Mode_AF,GPIO_PUPD_PU,SDIO_GPIO_CK_PIN);
+	GPIO_out_cfg(SDIO_GPIO_CK_PORT,GPIO_OT_PP,GPIO_SPD_HIGH,SDIO_GPIO_CK_PIN);
+	GPIO_af_cfg(SDIO_GPIO_CK_PORT,SDIO_GPIO_CK_SRC,SDIO_GPIO_AF);
+
+	// SDIO_D0
+	GPIO_set_mode(SDIO_GPIO_D0_PORT,GPIO_Mode_AF,GPIO_PUPD_PU,SDIO_GPIO_D0_PIN);
+	GPIO_out_cfg(SDIO_GPIO_D0_PORT,GPIO_OT_PP,GPIO_SPD_HIGH,SDIO_GPIO_D0_PIN);
+	GPIO_af_cfg(SDIO_GPIO_D0_PORT,SDIO_GPIO_D0_SRC,SDIO_GPIO_AF);
+
+#if (SDIO_USE_4BIT)
+	// SDIO_D1
+	GPIO_set_mode(SDIO_GPIO_D1_PORT,GPIO_Mode_AF,GPIO_PUPD_PU,SDIO_GPIO_D1_PIN);
+	GPIO_out_cfg(SDIO_GPIO_D1_PORT,GPIO_OT_PP,GPIO_SPD_HIGH,SDIO_GPIO_D1_PIN);
+	GPIO_af_cfg(SDIO_GPIO_D1_PORT,SDIO_GPIO_D1_SRC,SDIO_GPIO_AF);
+
+	// SDIO_D2
+	GPIO_set_mode(SDIO_GPIO_D2_PORT,GPIO_Mode_AF,GPIO_PUPD_PU,SDIO_GPIO_D2_PIN);
+	GPIO_out_cfg(SDIO_GPIO_D2_PORT,GPIO_OT_PP,GPIO_SPD_HIGH,SDIO_GPIO_D2_PIN);
+	GPIO_af_cfg(SDIO_GPIO_D2_PORT,SDIO_GPIO_D2_SRC,SDIO_GPIO_AF);
+
+	// SDIO_D3
+	GPIO_set_mode(SDIO_GPIO_D3_PORT,GPIO_Mode_AF,GPIO_PUPD_PU,SDIO_GPIO_D3_PIN);
+	GPIO_out_cfg(SDIO_GPIO_D3_PORT,GPIO_OT_PP,GPIO_SPD_HIGH,SDIO_GPIO_D3_PIN);
+	GPIO_af_cfg(SDIO_GPIO_D3_PORT,SDIO_GPIO_D3_SRC,SDIO_GPIO_AF);
+#endif // SDIO_USE_4BIT
+}
+
+// De-initialize the SDIO GPIO lines to its default state
+void SD_GPIO_DeInit(void) {
+	// SDIO_CMD
+	GPIO_set_mode(SDIO_GPIO_CMD_PORT,GPIO_Mode_AN,GPIO_PUPD_PU,SDIO_GPIO_CMD_PIN);
+	GPIO_out_cfg(SDIO_GPIO_CMD_PORT,GPIO_OT_PP,GPIO_SPD_LOW,SDIO_GPIO_CMD_PIN);
+	GPIO_af_cfg(SDIO_GPIO_CMD_PORT,SDIO_GPIO_CMD_SRC,GPIO_AF0);
+
+	// SDIO_CK
+	GPIO_set_mode(SDIO_GPIO_CK_PORT,GPIO_Mode_AN,GPIO_PUPD_PU,SDIO_GPIO_CK_PIN);
+	GPIO_out_cfg(SDIO_GPIO_CK_PORT,GPIO_OT_PP,GPIO_SPD_LOW,SDIO_GPIO_CK_PIN);
+	GPIO_af_cfg(SDIO_GPIO_CK_PORT,SDIO_GPIO_CK_SRC,GPIO_AF0);
+
+	// SDIO_D0
+	GPIO_set_mode(SDIO_GPIO_D0_PORT,GPIO_Mode_AN,GPIO_PUPD_PU,SDIO_GPIO_D0_PIN);
+	GPIO_out_cfg(SDIO_GPIO_D0_PORT,GPIO_OT_PP,GPIO_SPD_LOW,SDIO_GPIO_D0_PIN);
+	GPIO_af_cfg(SDIO_GPIO_D0_PORT,SDIO_GPIO_D0_SRC,GPIO_AF0);
+
+#if (SDIO_USE_4BIT)
+	// SDIO_D1
+	GPIO_set_mode(SDIO_GPIO_D1_PORT,GPIO_Mode_AN,GPIO_PUPD_PU,SDIO_GPIO_D1_PIN);
+	GPIO_out_cfg(SDIO_GPIO_D1_PORT,GPIO_OT_PP,GPIO_SPD_LOW,SDIO_GPIO_D1_PIN);
+	GPIO_af_cfg(SDIO_GPIO_D1_PORT,SDIO_GPIO_D1_SRC,GPIO_AF0);
+
+	// SDIO_D2
+	GPIO_set_mode(SDIO_GPIO_D2_PORT,GPIO_Mode_AN,GPIO_PUPD_PU,SDIO_GPIO_D2_PIN);
+	GPIO_out_cfg(SDIO_GPIO_D2_PORT,GPIO_OT_PP,GPIO_SPD_LOW,SDIO_GPIO_D2_PIN);
+	GPIO_af_cfg(SDIO_GPIO_D2_PORT,SDIO_GPIO_D2_SRC,GPIO_AF0);
+
+	// SDIO_D3
+	GPIO_set_mode(SDIO_GPIO_D3_PORT,GPIO_Mode_AN,GPIO_PUPD_PU,SDIO_GPIO_D3_PIN);
+	GPIO_out_cfg(SDIO_GPIO_D3_PORT,GPIO_OT_PP,GPIO_SPD_LOW,SDIO_GPIO_D3_PIN);
+	GPIO_af_cfg(SDIO_GPIO_D3_PORT,SDIO_GPIO_D3_SRC,GPIO_AF0);
+#endif // SDIO_USE_4BIT
+}
+
+// Configure the SDIO peripheral
+void SD_SDIO_Init(void) {
+	// Enable the SDIO peripheral
+	RCC->APB2ENR |= RCC_APB2ENR_SDMMC1EN;
+
+	// Reset the SDIO peripheral
+	RCC->APB2RSTR |=  RCC_APB2RSTR_SDMMC1RST;
+	RCC->APB2RSTR &= ~RCC_APB2RSTR_SDMMC1RST;
+
+	// Configure SDIO peripheral clock:
+	//   - rising edge of SDIOCLK
+	//   - bus: 1-bit
+	//   - power saving: enabled
+	//   - SDIOCLK bypass: disabled
+	//   - clock speed: 400kHz (SD_CLK_DIV_INIT)
+	//   - HW flow control: enabled
+	//   - clock: enabled
+	SDMMC1->CLKCR = SD_BUS_1BIT | SD_CLK_DIV_INIT | SD_CLKCR_CLKEN | SD_CLKCR_PWRSAV | SD_CLKCR_HWFC_EN;
+//	SDMMC1->CLKCR = SD_BUS_1BIT | SD_CLK_DIV_INIT | SD_CLKCR_CLKEN | SD_CLKCR_PWRSAV;
+}
+
+// De-initialize the SDIO peripheral
+void SD_SDIO_DeInit(void) {
+	// Disable SDIO clock
+	SDMMC1->POWER = SD_PWR_OFF;
+
+	// Disable the SDIO peripheral
+	RCC->APB2ENR &= ~RCC_APB2ENR_SDMMC1EN;
+}
+
+
+#if (SDIO_USE_DMA)
+
+// Initialize the DMA channel for SDIO peripheral (DMA2 Channel4)
+// input:
+//   pBuf - pointer to the memory buffer
+//   length - size of the memory buffer in bytes (must be a multiple of 4, since the SDIO operates with 32-bit words)
+//   direction - DMA channel direction, one of SDIO_DMA_DIR_xx values
+// note: the DMA peripheral (DMA2) must be already enabled
+void SD_Configure_DMA(uint32_t *pBuf, uint32_t length, uint8_t direction) {
+	// Populate SDIO DMA channel handle
+	SDIO_DMA_CH.Channel  = SDIO_DMA_CHANNEL;
+	SDIO_DMA_CH.Instance = DMA_GetChannelPeripheral(SDIO_DMA_CHANNEL);
+	SDIO_DMA_CH.ChIndex  = DMA_GetChannelIndex(SDIO_DMA_CHANNEL);
+	SDIO_DMA_CH.Request  = SDIO_DMA_REQUEST;
+	SDIO_DMA_CH.State    = DMA_STATE_RESET;
+
+	// DMA channel configuration:
+	//   channel priority: medium
+	//   memory increment: enabled
+	//   peripheral increment: disabled
+	//   circular mode: disabled
+	//   IRQ: disabled
+	//   memory size: 32-bit
+	//   peripheral size: 32-bit
+	//   channel: disabled
+	SDIO_DMA_CH.Channel->CCR  = DMA_CCR_MINC | DMA_PRIORITY_MEDIUM | DMA_MALIGN_32BIT | DMA_PALIGN_32BIT | direction;
+	SDIO_DMA_CH.Channel->CPAR = (uint32_t)(&(SDMMC1->FIFO)); // Address of the SDIO FIFO
+	SDIO_DMA_CH.Channel->CMAR = (uint32_t)pBuf; // Memory address
+
+	// Number of DMA transactions
+	DMA_SetDataLength(SDIO_DMA_CH.Channel,length >> 2);
+
+	// Map DMA request to DMA channel
+	DMA_SetRequest(SDIO_DMA_CH.Instance,SDIO_DMA_CH.Request,SDIO_DMA_CH.ChIndex);
+
+	// Clear SDIO DMA channel interrupt flags
+	DMA_ClearFlags(SDIO_DMA_CH.Instance,SDIO_DMA_CH.ChIndex,DMA_CF_ALL);
+}
+
+#endif // SDIO_USE_DMA
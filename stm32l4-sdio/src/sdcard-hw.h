@@ -0,0 +1,128 @@
+// Define to prevent recursive inclusion
+#ifndef __SDCARD_HW_H
+#define __SDCARD_HW_H
+
+
+// Target layer of the SD card driver: STM32L476, SDMMC1, DMA2 channel 4
+// (see sdcard.h for what the driver expects from this file)
+
+
+#include <stm32l4xx.h>
+#include "gpio.h"
+
+
+// Enable usage of SDIO 4-bit bus
+//   0 - use 1-bit bus
+//   1 - use 4-bit bus
+#define SDIO_USE_4BIT                 1
+
+// Enable usage of DMA transfers
+//   0 - no DMA-related code
+//   1 - use DMA-related code
+#define SDIO_USE_DMA                  1
+
+// Enable usage of interrupt driven DMA transfers (requires SDIO_USE_DMA)
+//   0 - no IRQ-related code
+//   1 - SD_ReadBlock_IRQ()/SD_WriteBlock_IRQ() with completion callback, the SDIO
+//       and SDIO DMA channel IRQ handlers are provided by the driver
+#define SDIO_USE_IRQ                  1
+
+// Enable usage of the High-Speed mode (50MHz)
+//   0 - the bus clock stays at SD_CLK_DIV_TRAN
+//   1 - SD_HighSpeed() switches the card to High-Speed mode and the bus clock to SDIOCLK
+//       (divider bypass), if the card fails the read-back check it returns to default speed
+#define SDIO_USE_HIGHSPEED            1
+
+
+// SDIO kernel clock (CLK48)
+#define SD_SDIOCLK                    ((uint32_t)48000000U)
+
+// SDIO clocks for initialization and data transfer
+#define SD_CLK_DIV_INIT               (SD_CLK_DIV_400K) // SDIO initialization frequency (400kHz)
+//#define SD_CLK_DIV_TRAN               (SD_CLK_DIV_400K) // SDIO data transfer 400kHz
+//#define SD_CLK_DIV_TRAN               (SD_CLK_DIV_1M)   // SDIO data transfer 1MHz
+//#define SD_CLK_DIV_TRAN               (SD_CLK_DIV_8M)   // SDIO data transfer 8MHz
+//#define SD_CLK_DIV_TRAN               (SD_CLK_DIV_9M6)  // SDIO data transfer 9.6MHz
+//#define SD_CLK_DIV_TRAN               (SD_CLK_DIV_12M)  // SDIO data transfer 12MHz
+//#define SD_CLK_DIV_TRAN               (SD_CLK_DIV_16M)  // SDIO data transfer 16MHz
+#define SD_CLK_DIV_TRAN               (SD_CLK_DIV_24M) // SDIO data transfer frequency
+
+// Access to the SDIO registers
+#define SDIO_RD(reg)                  (SDMMC1->reg)
+#define SDIO_WR(reg,value)            (SDMMC1->reg = (value))
+
+// SDIO interrupt vector
+#define SDIO_IRQHandler               SDMMC1_IRQHandler
+
+// Nothing to do while waiting for an interrupt
+#define SDIO_IDLE()
+
+
+#if (SDIO_USE_DMA)
+#include "dma.h"
+
+// Handle for SDIO DMA channel
+extern DMA_HandleTypeDef              SDIO_DMA_CH;
+
+// SDIO DMA channel parameters
+#define SDIO_DMA_CHANNEL              DMA2_Channel4 // 4 or 5
+#define SDIO_DMA_REQUEST              DMA_REQUEST_7
+#define SDIO_DMA_IRQN                 DMA2_Channel4_IRQn
+#define SDIO_DMA_IRQHandler           DMA2_Channel4_IRQHandler
+
+// SDIO DMA channel direction
+#define SDIO_DMA_DIR_TX               DMA_DIR_M2P // SDIO write
+#define SDIO_DMA_DIR_RX               DMA_DIR_P2M // SDIO read
+
+// SDIO DMA channel control
+#define SDIO_DMA_ENABLE()             DMA_EnableChannel(SDIO_DMA_CH.Channel)
+#define SDIO_DMA_DISABLE()            DMA_DisableChannel(SDIO_DMA_CH.Channel)
+#define SDIO_DMA_BUFFER(pBuf,length)  do { SDIO_DMA_CH.Channel->CMAR = (uint32_t)(pBuf); DMA_SetDataLength(SDIO_DMA_CH.Channel,(length) >> 2); } while (0)
+#define SDIO_DMA_IRQ_ON()             DMA_EnableIRQ(SDIO_DMA_CH.Channel,DMA_IRQ_TC | DMA_IRQ_TE)
+#define SDIO_DMA_IRQ_OFF()            DMA_DisableIRQ(SDIO_DMA_CH.Channel,DMA_IRQ_TC | DMA_IRQ_TE)
+#define SDIO_DMA_TC()                 DMA_GetFlags(SDIO_DMA_CH.Instance,SDIO_DMA_CH.ChIndex,DMA_FLAG_TC)
+#define SDIO_DMA_TE()                 DMA_GetFlags(SDIO_DMA_CH.Instance,SDIO_DMA_CH.ChIndex,DMA_FLAG_TE)
+#define SDIO_DMA_CLEAR()              DMA_ClearFlags(SDIO_DMA_CH.Instance,SDIO_DMA_CH.ChIndex,DMA_CF_ALL)
+
+// Enable the DPSM for a DMA transfer to the card
+#define SDIO_DMA_TX_START(dctrl)      SDIO_WR(DCTRL,dctrl)
+#endif // SDIO_USE_DMA
+
+// SDIO HAL
+#define SDIO_GPIO_PERIPH              (RCC_AHB2ENR_GPIOCEN | RCC_AHB2ENR_GPIODEN)
+#define SDIO_GPIO_AF                  GPIO_AF12
+
+// SDIO CMD pin (PD2)
+#define SDIO_GPIO_CMD_PORT            GPIOD
+#define SDIO_GPIO_CMD_PIN             GPIO_PIN_2
+#define SDIO_GPIO_CMD_SRC             GPIO_PinSource2
+
+// SDIO CK pin (PC12)
+#define SDIO_GPIO_CK_PORT             GPIOC
+#define SDIO_GPIO_CK_PIN              GPIO_PIN_12
+#define SDIO_GPIO_CK_SRC              GPIO_PinSource12
+
+// SDIO D0 pin (PC8)
+#define SDIO_GPIO_D0_PORT             GPIOC
+#define SDIO_GPIO_D0_PIN              GPIO_PIN_8
+#define SDIO_GPIO_D0_SRC              GPIO_PinSource8
+
+#if (SDIO_USE_4BIT)
+// SDIO D1 pin (PC9)
+#define SDIO_GPIO_D1_PORT             GPIOC
+#define SDIO_GPIO_D1_PIN              GPIO_PIN_9
+#define SDIO_GPIO_D1_SRC              GPIO_PinSource9
+
+// SDIO D2 pin (PC10)
+#define SDIO_GPIO_D2_PORT             GPIOC
+#define SDIO_GPIO_D2_PIN              GPIO_PIN_10
+#define SDIO_GPIO_D2_SRC              GPIO_PinSource10
+
+// SDIO D3 pin (PC11)
+#define SDIO_GPIO_D3_PORT             GPIOC
+#define SDIO_GPIO_D3_PIN              GPIO_PIN_11
+#define SDIO_GPIO_D3_SRC              GPIO_PinSource11
+
+#endif // SDIO_USE_4BIT
+
+#endif // __SDCARD_HW_H
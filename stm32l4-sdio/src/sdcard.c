@@ -1,1338 +1,1755 @@
-#include "sdcard.h"
-#include "delay.h"
-
-
-// SD card parameters
-SDCard_TypeDef SDCard;
-
-
-// Initialize the SDIO GPIO lines
-void SD_GPIO_Init(void) {
-	// Enable the SDIO corresponding GPIO peripherals
-	RCC->AHB2ENR |= SDIO_GPIO_PERIPH;
-
-	// Configure SDIO GPIO pins
-
-	// SDIO_CMD
-	GPIO_set_mode(SDIO_GPIO_CMD_PORT,GPIO_Mode_AF,GPIO_PUPD_PU,SDIO_GPIO_CMD_PIN);
-	GPIO_out_cfg(SDIO_GPIO_CMD_PORT,GPIO_OT_PP,GPIO_SPD_HIGH,SDIO_GPIO_CMD_PIN);
-	GPIO_af_cfg(SDIO_GPIO_CMD_PORT,SDIO_GPIO_CMD_SRC,SDIO_GPIO_AF);
-
-	// SDIO_CK
-	GPIO_set_mode(SDIO_GPIO_CK_PORT,GPIO_Mode_AF,GPIO_PUPD_PU,SDIO_GPIO_CK_PIN);
-	GPIO_out_cfg(SDIO_GPIO_CK_PORT,GPIO_OT_PP,GPIO_SPD_HIGH,SDIO_GPIO_CK_PIN);
-	GPIO_af_cfg(SDIO_GPIO_CK_PORT,SDIO_GPIO_CK_SRC,SDIO_GPIO_AF);
-
-	// SDIO_D0
-	GPIO_set_mode(SDIO_GPIO_D0_PORT,GPIO_Mode_AF,GPIO_PUPD_PU,SDIO_GPIO_D0_PIN);
-	GPIO_out_cfg(SDIO_GPIO_D0_PORT,GPIO_OT_PP,GPIO_SPD_HIGH,SDIO_GPIO_D0_PIN);
-	GPIO_af_cfg(SDIO_GPIO_D0_PORT,SDIO_GPIO_D0_SRC,SDIO_GPIO_AF);
-
-#if (SDIO_USE_4BIT)
-	// SDIO_D1
-	GPIO_set_mode(SDIO_GPIO_D1_PORT,GPIO_Mode_AF,GPIO_PUPD_PU,SDIO_GPIO_D1_PIN);
-	GPIO_out_cfg(SDIO_GPIO_D1_PORT,GPIO_OT_PP,GPIO_SPD_HIGH,SDIO_GPIO_D1_PIN);
-	GPIO_af_cfg(SDIO_GPIO_D1_PORT,SDIO_GPIO_D1_SRC,SDIO_GPIO_AF);
-
-	// SDIO_D2
-	GPIO_set_mode(SDIO_GPIO_D2_PORT,GPIO_Mode_AF,GPIO_PUPD_PU,SDIO_GPIO_D2_PIN);
-	GPIO_out_cfg(SDIO_GPIO_D2_PORT,GPIO_OT_PP,GPIO_SPD_HIGH,SDIO_GPIO_D2_PIN);
-	GPIO_af_cfg(SDIO_GPIO_D2_PORT,SDIO_GPIO_D2_SRC,SDIO_GPIO_AF);
-
-	// SDIO_D3
-	GPIO_set_mode(SDIO_GPIO_D3_PORT,GPIO_Mode_AF,GPIO_PUPD_PU,SDIO_GPIO_D3_PIN);
-	GPIO_out_cfg(SDIO_GPIO_D3_PORT,GPIO_OT_PP,GPIO_SPD_HIGH,SDIO_GPIO_D3_PIN);
-	GPIO_af_cfg(SDIO_GPIO_D3_PORT,SDIO_GPIO_D3_SRC,SDIO_GPIO_AF);
-#endif // SDIO_USE_4BIT
-}
-
-// De-initialize the SDIO GPIO lines to its default state
-void SD_GPIO_DeInit(void) {
-	// SDIO_CMD
-	GPIO_set_mode(SDIO_GPIO_CMD_PORT,GPIO_Mode_AN,GPIO_PUPD_PU,SDIO_GPIO_CMD_PIN);
-	GPIO_out_cfg(SDIO_GPIO_CMD_PORT,GPIO_OT_PP,GPIO_SPD_LOW,SDIO_GPIO_CMD_PIN);
-	GPIO_af_cfg(SDIO_GPIO_CMD_PORT,SDIO_GPIO_CMD_SRC,GPIO_AF0);
-
-	// SDIO_CK
-	GPIO_set_mode(SDIO_GPIO_CK_PORT,GPIO_Mode_AN,GPIO_PUPD_PU,SDIO_GPIO_CK_PIN);
-	GPIO_out_cfg(SDIO_GPIO_CK_PORT,GPIO_OT_PP,GPIO_SPD_LOW,SDIO_GPIO_CK_PIN);
-	GPIO_af_cfg(SDIO_GPIO_CK_PORT,SDIO_GPIO_CK_SRC,GPIO_AF0);
-
-	// SDIO_D0
-	GPIO_set_mode(SDIO_GPIO_D0_PORT,GPIO_Mode_AN,GPIO_PUPD_PU,SDIO_GPIO_D0_PIN);
-	GPIO_out_cfg(SDIO_GPIO_D0_PORT,GPIO_OT_PP,GPIO_SPD_LOW,SDIO_GPIO_D0_PIN);
-	GPIO_af_cfg(SDIO_GPIO_D0_PORT,SDIO_GPIO_D0_SRC,GPIO_AF0);
-
-#if (SDIO_USE_4BIT)
-	// SDIO_D1
-	GPIO_set_mode(SDIO_GPIO_D1_PORT,GPIO_Mode_AN,GPIO_PUPD_PU,SDIO_GPIO_D1_PIN);
-	GPIO_out_cfg(SDIO_GPIO_D1_PORT,GPIO_OT_PP,GPIO_SPD_LOW,SDIO_GPIO_D1_PIN);
-	GPIO_af_cfg(SDIO_GPIO_D1_PORT,SDIO_GPIO_D1_SRC,GPIO_AF0);
-
-	// SDIO_D2
-	GPIO_set_mode(SDIO_GPIO_D2_PORT,GPIO_Mode_AN,GPIO_PUPD_PU,SDIO_GPIO_D2_PIN);
-	GPIO_out_cfg(SDIO_GPIO_D2_PORT,GPIO_OT_PP,GPIO_SPD_LOW,SDIO_GPIO_D2_PIN);
-	GPIO_af_cfg(SDIO_GPIO_D2_PORT,SDIO_GPIO_D2_SRC,GPIO_AF0);
-
-	// SDIO_D3
-	GPIO_set_mode(SDIO_GPIO_D3_PORT,GPIO_Mode_AN,GPIO_PUPD_PU,SDIO_GPIO_D3_PIN);
-	GPIO_out_cfg(SDIO_GPIO_D3_PORT,GPIO_OT_PP,GPIO_SPD_LOW,SDIO_GPIO_D3_PIN);
-	GPIO_af_cfg(SDIO_GPIO_D3_PORT,SDIO_GPIO_D3_SRC,GPIO_AF0);
-#endif // SDIO_USE_4BIT
-}
-
-// Configure the SDIO peripheral
-void SD_SDIO_Init(void) {
-	// Enable the SDIO peripheral
-	RCC->APB2ENR |= RCC_APB2ENR_SDMMC1EN;
-
-	// Reset the SDIO peripheral
-	RCC->APB2RSTR |=  RCC_APB2RSTR_SDMMC1RST;
-	RCC->APB2RSTR &= ~RCC_APB2RSTR_SDMMC1RST;
-
-	// Configure SDIO peripheral clock:
-	//   - rising edge of SDIOCLK
-	//   - bus: 1-bit
-	//   - power saving: enabled
-	//   - SDIOCLK bypass: disabled
-	//   - clock speed: 400kHz (SDMMC_CLK_DIV_INIT)
-	//   - HW flow control: enabled
-	//   - clock: enabled
-	SDMMC1->CLKCR = SD_BUS_1BIT | SD_CLK_DIV_INIT | SDMMC_CLKCR_CLKEN | SDMMC_CLKCR_PWRSAV | SDMMC_CLKCR_HWFC_EN;
-//	SDMMC1->CLKCR = SD_BUS_1BIT | SD_CLK_DIV_INIT | SDMMC_CLKCR_CLKEN | SDMMC_CLKCR_PWRSAV;
-}
-
-// De-initialize the SDIO peripheral
-void SD_SDIO_DeInit(void) {
-	// Disable SDIO clock
-	SDMMC1->POWER = SD_PWR_OFF;
-
-	// Disable the SDIO peripheral
-	RCC->APB2ENR &= ~RCC_APB2ENR_SDMMC1EN;
-}
-
-// Send command to SD card
-// input:
-//   cmd - SD card command
-//   arg - argument for command (32-bit)
-//   resp_type - response type, one of SD_RESP_xx values
-static void SD_Cmd(uint8_t cmd, uint32_t arg, uint32_t resp_type) {
-	// Clear command flags
-	SDMMC1->ICR = SDIO_ICR_CMD;
-
-	// Program an argument for command
-	SDMMC1->ARG = arg;
-
-	// Program command value and response type, enable CPSM
-	SDMMC1->CMD = cmd | resp_type | SDMMC_CMD_CPSMEN;
-}
-
-// Check R1 response
-// input:
-//   cmd - the sent command
-// return: SDResult
-static SDResult SD_GetR1Resp(uint8_t cmd) {
-	volatile uint32_t wait = SD_CMD_TIMEOUT;
-	uint32_t respR1;
-
-	// Wait for response, error or timeout
-	while (!(SDMMC1->STA & (SDMMC_STA_CCRCFAIL | SDMMC_STA_CMDREND | SDMMC_STA_CTIMEOUT)) && --wait);
-
-	// Timeout?
-	if ((SDMMC1->STA & SDMMC_STA_CTIMEOUT) && (wait == 0)) {
-		SDMMC1->ICR = SDMMC_ICR_CTIMEOUTC;
-		return SDR_Timeout;
-	}
-
-	// CRC fail?
-	if (SDMMC1->STA & SDMMC_STA_CCRCFAIL) {
-		SDMMC1->ICR = SDMMC_ICR_CCRCFAILC;
-		return SDR_CRCError;
-	}
-
-	// Illegal command?
-	if (SDMMC1->RESPCMD != cmd) {
-		return SDR_IllegalCommand;
-	}
-
-	// Clear the static SDIO flags
-	SDMMC1->ICR = SDIO_ICR_STATIC;
-
-	// Get a R1 response and analyze it for errors
-	respR1 = SDMMC1->RESP1;
-	if (!(respR1 & SD_OCR_ALL_ERRORS))      return SDR_Success;
-	if (respR1 & SD_OCR_OUT_OF_RANGE)       return SDR_AddrOutOfRange;
-	if (respR1 & SD_OCR_ADDRESS_ERROR)      return SDR_AddrMisaligned;
-	if (respR1 & SD_OCR_BLOCK_LEN_ERROR)    return SDR_BlockLenError;
-	if (respR1 & SD_OCR_ERASE_SEQ_ERROR)    return SDR_EraseSeqError;
-	if (respR1 & SD_OCR_ERASE_PARAM)        return SDR_EraseParam;
-	if (respR1 & SD_OCR_WP_VIOLATION)       return SDR_WPViolation;
-	if (respR1 & SD_OCR_LOCK_UNLOCK_FAILED) return SDR_LockUnlockFailed;
-	if (respR1 & SD_OCR_COM_CRC_ERROR)      return SDR_ComCRCError;
-	if (respR1 & SD_OCR_ILLEGAL_COMMAND)    return SDR_IllegalCommand;
-	if (respR1 & SD_OCR_CARD_ECC_FAILED)    return SDR_CardECCFailed;
-	if (respR1 & SD_OCR_CC_ERROR)           return SDR_CCError;
-	if (respR1 & SD_OCR_ERROR)              return SDR_GeneralError;
-	if (respR1 & SD_OCR_STREAM_R_UNDERRUN)  return SDR_StreamUnderrun;
-	if (respR1 & SD_OCR_STREAM_W_OVERRUN)   return SDR_StreamOverrun;
-	if (respR1 & SD_OCR_CSD_OVERWRITE)      return SDR_CSDOverwrite;
-	if (respR1 & SD_OCR_WP_ERASE_SKIP)      return SDR_WPEraseSkip;
-	if (respR1 & SD_OCR_CARD_ECC_DISABLED)  return SDR_ECCDisabled;
-	if (respR1 & SD_OCR_ERASE_RESET)        return SDR_EraseReset;
-	if (respR1 & SD_OCR_AKE_SEQ_ERROR)      return SDR_AKESeqError;
-
-	return SDR_Success;
-}
-
-// Check R2 response
-// input:
-//   pBuf - pointer to the data buffer to store the R2 response
-// return: SDResult value
-static SDResult SD_GetR2Resp(uint32_t *pBuf) {
-	volatile uint32_t wait = SD_CMD_TIMEOUT;
-
-	// Wait for response, error or timeout
-	while (!(SDMMC1->STA & (SDMMC_STA_CCRCFAIL | SDMMC_STA_CMDREND | SDMMC_STA_CTIMEOUT)) && --wait);
-
-	// Timeout?
-	if ((SDMMC1->STA & SDMMC_STA_CTIMEOUT) && (wait == 0)) {
-		SDMMC1->ICR = SDMMC_ICR_CTIMEOUTC;
-
-		return SDR_Timeout;
-	}
-
-	// CRC fail?
-	if (SDMMC1->STA & SDMMC_STA_CCRCFAIL) {
-		SDMMC1->ICR = SDMMC_ICR_CCRCFAILC;
-		return SDR_CRCError;
-	}
-
-	// Clear the static SDIO flags
-	SDMMC1->ICR = SDIO_ICR_STATIC;
-
-	// SDMMC_RESP[1..4] registers contains the R2 response
-#ifdef __GNUC__
-	// Use GCC built-in intrinsics (fastest, less code) (GCC v4.3 or later)
-	*pBuf++ = __builtin_bswap32(SDMMC1->RESP1);
-	*pBuf++ = __builtin_bswap32(SDMMC1->RESP2);
-	*pBuf++ = __builtin_bswap32(SDMMC1->RESP3);
-	*pBuf   = __builtin_bswap32(SDMMC1->RESP4);
-#else
-	// Use ARM 'REV' instruction (fast, a bit bigger code than GCC intrinsics)
-	*pBuf++ = __REV(SDMMC1->RESP1);
-	*pBuf++ = __REV(SDMMC1->RESP2);
-	*pBuf++ = __REV(SDMMC1->RESP3);
-	*pBuf   = __REV(SDMMC1->RESP4);
-/*
-	// Use SHIFT, AND and OR (slower, biggest code)
-	*pBuf++ = SWAP_UINT32(SDMMC1->RESP1);
-	*pBuf++ = SWAP_UINT32(SDMMC1->RESP2);
-	*pBuf++ = SWAP_UINT32(SDMMC1->RESP3);
-	*pBuf   = SWAP_UINT32(SDMMC1->RESP4);
-*/
-#endif
-
-	return SDR_Success;
-}
-
-// Check R3 response
-// return: SDResult value
-static SDResult SD_GetR3Resp(void) {
-	volatile uint32_t wait = SD_CMD_TIMEOUT;
-
-	// Wait for response, error or timeout
-	while (!(SDMMC1->STA & (SDMMC_STA_CCRCFAIL | SDMMC_STA_CMDREND | SDMMC_STA_CTIMEOUT)) && --wait);
-
-	// Timeout?
-	if ((SDMMC1->STA & SDMMC_STA_CTIMEOUT) && (wait == 0)) {
-		SDMMC1->ICR = SDMMC_ICR_CTIMEOUTC;
-
-		return SDR_Timeout;
-	}
-
-	// Clear the static SDIO flags
-	SDMMC1->ICR = SDIO_ICR_STATIC;
-
-	return SDR_Success;
-}
-
-// Check R6 response (RCA)
-// return: SDResult value
-static SDResult SD_GetR6Resp(uint8_t cmd, uint16_t *pRCA) {
-	volatile uint32_t wait = SD_CMD_TIMEOUT;
-	uint32_t respR6;
-
-	// Wait for response, error or timeout
-	while (!(SDMMC1->STA & (SDMMC_STA_CCRCFAIL | SDMMC_STA_CMDREND | SDMMC_STA_CTIMEOUT)) && --wait);
-
-	// Timeout?
-	if ((SDMMC1->STA & SDMMC_STA_CTIMEOUT) && (wait == 0)) {
-		SDMMC1->ICR = SDMMC_ICR_CTIMEOUTC;
-
-		return SDR_Timeout;
-	}
-
-	// CRC fail?
-	if (SDMMC1->STA & SDMMC_STA_CCRCFAIL) {
-		SDMMC1->ICR = SDMMC_ICR_CCRCFAILC;
-		return SDR_CRCError;
-	}
-
-	// Illegal command?
-	if (SDMMC1->RESPCMD != cmd) {
-		return SDR_IllegalCommand;
-	}
-
-	// Clear the static SDIO flags
-	SDMMC1->ICR = SDIO_ICR_STATIC;
-
-	// Get a R6 response and analyze it for errors
-	respR6 = SDMMC1->RESP1;
-	if (!(respR6 & (SD_R6_ILLEGAL_CMD | SD_R6_GENERAL_UNKNOWN_ERROR | SD_R6_COM_CRC_FAILED))) {
-		*pRCA = (uint16_t)(respR6 >> 16);
-		return SDR_Success;
-	}
-	if (respR6 & SD_R6_GENERAL_UNKNOWN_ERROR) return SDR_UnknownError;
-	if (respR6 & SD_R6_ILLEGAL_CMD)           return SDR_IllegalCommand;
-	if (respR6 & SD_R6_COM_CRC_FAILED)        return SDR_ComCRCError;
-
-	return SDR_Success;
-}
-
-// Check R7 response
-// return: SDResult value
-static SDResult SD_GetR7Resp(void) {
-	volatile uint32_t wait = SD_CMD_TIMEOUT;
-
-	// Wait for response, error or timeout
-	while (!(SDMMC1->STA & (SDMMC_STA_CCRCFAIL | SDMMC_STA_CMDREND | SDMMC_STA_CTIMEOUT)) && --wait);
-
-	// Timeout?
-	if ((SDMMC1->STA & SDMMC_STA_CTIMEOUT) || (wait == 0)) {
-		SDMMC1->ICR = SDMMC_ICR_CTIMEOUTC;
-
-		return SDR_Timeout;
-	}
-
-	// Clear command response received flag
-	if (SDMMC1->STA & SDMMC_STA_CMDREND) {
-		SDMMC1->ICR = SDMMC_ICR_CMDRENDC;
-
-		return SDR_Success;
-	}
-
-	return SDR_NoResponse;
-}
-
-// Retrieve the SD card SCR register value
-// input:
-//   pSCR - pointer to the buffer for SCR register (8 bytes)
-// return: SDResult value
-// note: card must be in transfer mode, not supported by MMC
-static SDResult SD_GetSCR(uint32_t *pSCR) {
-	SDResult cmd_res;
-
-	// Set block size to 8 bytes
-	SD_Cmd(SD_CMD_SET_BLOCKLEN, 8, SD_RESP_SHORT); // CMD16
-	cmd_res = SD_GetR1Resp(SD_CMD_SET_BLOCKLEN);
-	if (cmd_res != SDR_Success) {
-		return cmd_res;
-	}
-
-	// Send leading command for ACMD<n> command
-	SD_Cmd(SD_CMD_APP_CMD, SDCard.RCA << 16, SD_RESP_SHORT); // CMD55
-	cmd_res = SD_GetR1Resp(SD_CMD_APP_CMD);
-	if (cmd_res != SDR_Success) {
-		return cmd_res;
-	}
-
-	// Clear the data flags
-	SDMMC1->ICR = SDIO_ICR_DATA;
-
-	// Configure the SDIO data transfer
-	SDMMC1->DTIMER = SD_DATA_R_TIMEOUT; // Data read timeout
-	SDMMC1->DLEN   = 8; // Data length in bytes
-	// Data transfer:
-	//   - type: block
-	//   - direction: card -> controller
-	//   - size: 2^3 = 8bytes
-	//   - DPSM: enabled
-	SDMMC1->DCTRL  = SDMMC_DCTRL_DTDIR | (3 << 4) | SDMMC_DCTRL_DTEN;
-
-	// Send SEND_SCR command
-	SD_Cmd(SD_CMD_SEND_SCR, 0, SD_RESP_SHORT); // ACMD51
-	cmd_res = SD_GetR1Resp(SD_CMD_SEND_SCR);
-	if (cmd_res != SDR_Success) {
-		return cmd_res;
-	}
-
-	// Receive the SCR register value
-	while (!(SDMMC1->STA & (SDMMC_STA_RXOVERR | SDMMC_STA_DCRCFAIL | SDMMC_STA_DTIMEOUT | SDMMC_STA_DBCKEND | SDMMC_STA_STBITERR))) {
-		// Read word when data available in receive FIFO
-		if (SDMMC1->STA & SDMMC_STA_RXDAVL) *pSCR++ = SDMMC1->FIFO;
-	}
-
-	// Check for errors
-	if (SDMMC1->STA & (SDMMC_STA_DTIMEOUT | SDMMC_STA_DCRCFAIL | SDMMC_STA_RXOVERR | SDMMC_STA_STBITERR)) {
-		if (SDMMC1->STA & SDMMC_STA_DTIMEOUT) cmd_res = SDR_DataTimeout;
-		if (SDMMC1->STA & SDMMC_STA_DCRCFAIL) cmd_res = SDR_DataCRCFail;
-		if (SDMMC1->STA & SDMMC_STA_RXOVERR)  cmd_res = SDR_RXOverrun;
-		if (SDMMC1->STA & SDMMC_STA_STBITERR) cmd_res = SDR_StartBitError;
-	}
-
-	// Clear the static SDIO flags
-	SDMMC1->ICR = SDIO_ICR_STATIC;
-
-	return cmd_res;
-}
-
-// Set block size of the SD card
-// input:
-//   block_size - block length
-// return: SDResult value
-SDResult SD_SetBlockSize(uint32_t block_size) {
-	// Send SET_BLOCKLEN command
-	SD_Cmd(SD_CMD_SET_BLOCKLEN, block_size, SD_RESP_SHORT); // CMD16
-
-	return SD_GetR1Resp(SD_CMD_SET_BLOCKLEN);
-}
-
-// Initialize the SD card
-// return: SDResult value
-// note: SDIO peripheral clock must be on and SDIO GPIO configured
-SDResult SD_Init(void) {
-	volatile uint32_t wait;
-	uint32_t sd_type = SD_STD_CAPACITY; // SD card capacity
-	SDResult cmd_res;
-
-	// Populate SDCard structure with default values
-	SDCard = (SDCard_TypeDef){ 0 };
-	SDCard.Type = SDCT_UNKNOWN;
-
-	// Enable the SDIO clock
-	SDMMC1->POWER = SD_PWR_ON;
-
-	// CMD0
-	wait = SD_CMD_TIMEOUT;
-	SD_Cmd(SD_CMD_GO_IDLE_STATE, 0x00, SD_RESP_NONE);
-	while (!(SDMMC1->STA & (SDMMC_STA_CTIMEOUT | SDMMC_STA_CMDSENT)) && --wait);
-	if ((SDMMC1->STA & SDMMC_STA_CTIMEOUT) || !wait) return SDR_Timeout;
-
-	// CMD8: SEND_IF_COND. Send this command to verify SD card interface operating condition
-	// Argument: - [31:12]: Reserved (shall be set to '0')
-	//           - [11:08]: Supply Voltage (VHS) 0x1 (Range: 2.7-3.6 V)
-	//           - [07:00]: Check Pattern (recommended 0xAA)
-	SD_Cmd(SD_CMD_HS_SEND_EXT_CSD, SD_CHECK_PATTERN, SD_RESP_SHORT); // CMD8
-	cmd_res = SD_GetR7Resp();
-	if (cmd_res == SDR_Success) {
-		// SD v2.0 or later
-
-		// Check echo-back of check pattern
-		if ((SDMMC1->RESP1 & 0x01FF) != (SD_CHECK_PATTERN & 0x01FF)) {
-			return SDR_Unsupported;
-		}
-		sd_type = SD_HIGH_CAPACITY; // SD v2.0 or later
-
-		// Issue ACMD41 command
-		wait = SD_ACMD41_TRIALS;
-		while (--wait) {
-			// Send leading command for ACMD<n> command
-			SD_Cmd(SD_CMD_APP_CMD, 0, SD_RESP_SHORT); // CMD55 with RCA 0
-			cmd_res = SD_GetR1Resp(SD_CMD_APP_CMD);
-			if (cmd_res != SDR_Success) {
-				return cmd_res;
-			}
-			// ACMD41 - initiate initialization process.
-			// Set 3.0-3.3V voltage window (bit 20)
-			// Set HCS bit (30) (Host Capacity Support) to inform card what host support high capacity
-			// Set XPC bit (28) (SDXC Power Control) to use maximum performance (SDXC only)
-			SD_Cmd(SD_CMD_SD_SEND_OP_COND,SD_OCR_VOLTAGE | sd_type,SD_RESP_SHORT);
-			cmd_res = SD_GetR3Resp();
-			if (cmd_res != SDR_Success) {
-				return cmd_res;
-			}
-			if (SDMMC1->RESP1 & (1 << 31)) {
-				// The SD card has finished the power-up sequence
-				break;
-			}
-		}
-		if (wait == 0) {
-			// Unsupported voltage range
-			return SDR_InvalidVoltage;
-		}
-
-		// This is SDHC/SDXC card?
-		SDCard.Type = (SDMMC1->RESP1 & SD_HIGH_CAPACITY) ? SDCT_SDHC : SDCT_SDSC_V2;
-	} else if (cmd_res == SDR_Timeout) {
-		// SD v1.x or MMC
-
-		// Issue CMD55 to reset 'Illegal command' bit of the SD card
-		SD_Cmd(SD_CMD_APP_CMD, 0, SD_RESP_SHORT); // CMD55 with RCA 0
-		SD_GetR1Resp(SD_CMD_APP_CMD);
-
-		// Issue ACMD41 command with zero argument
-		wait = SD_ACMD41_TRIALS;
-		while (--wait) {
-			// Send leading command for ACMD<n> command
-			SD_Cmd(SD_CMD_APP_CMD, 0, SD_RESP_SHORT); // CMD55 with RCA 0
-			cmd_res = SD_GetR1Resp(SD_CMD_APP_CMD);
-			if (cmd_res != SDR_Success) {
-				return cmd_res;
-			}
-
-			// Send ACMD41 - initiate initialization process (bit HCS = 0)
-			SD_Cmd(SD_CMD_SD_SEND_OP_COND, SD_OCR_VOLTAGE, SD_RESP_SHORT); // ACMD41
-			cmd_res = SD_GetR3Resp();
-			if (cmd_res == SDR_Timeout) {
-				// MMC will not respond to this command
-				break;
-			}
-			if (cmd_res != SDR_Success) {
-				return cmd_res;
-			}
-			if (SDMMC1->RESP1 & (1 << 31)) {
-				// The SD card has finished the power-up sequence
-				break;
-			}
-		}
-		if (wait == 0) {
-			// Unknown/Unsupported card type
-			return SDR_UnknownCard;
-		}
-		if (cmd_res != SDR_Timeout) {
-			// SD v1.x
-			SDCard.Type = SDCT_SDSC_V1; // SDv1
-		} else {
-			// MMC or not SD memory card
-
-			////////////////////////////////////////////////////////////////
-			// This part has not been tested due to lack of MMCmicro card //
-			////////////////////////////////////////////////////////////////
-
-			wait = SD_ACMD41_TRIALS;
-			while (--wait) {
-				// Issue CMD1: initiate initialization process.
-				SD_Cmd(SD_CMD_SEND_OP_COND, SD_OCR_VOLTAGE, SD_RESP_SHORT); // CMD1
-				cmd_res = SD_GetR3Resp();
-				if (cmd_res != SDR_Success) {
-					return cmd_res;
-				}
-				if (SDMMC1->RESP1 & (1 << 31)) {
-					// The SD card has finished the power-up sequence
-					break;
-				}
-			}
-			if (wait == 0) return SDR_UnknownCard;
-			SDCard.Type = SDCT_MMC; // MMC
-		}
-	} else {
-		return cmd_res;
-	}
-
-	// Now the CMD2 and CMD3 commands should be issued in cycle until timeout to enumerate all cards on the bus
-	// Since this module suitable to work with single card, issue this commands one time only
-
-	// Send ALL_SEND_CID command
-	SD_Cmd(SD_CMD_ALL_SEND_CID, 0, SD_RESP_LONG); // CMD2
-	cmd_res = SD_GetR2Resp((uint32_t *)SDCard.CID); // The response will be CID/CSD register value
-	if (cmd_res != SDR_Success) {
-		return cmd_res;
-	}
-
-	if (SDCard.Type != SDCT_MMC) {
-		// Send SEND_REL_ADDR command to ask the SD card to publish a new RCA (Relative Card Address)
-		// Once the RCA is received the card state changes to the stand-by state
-		SD_Cmd(SD_CMD_SEND_REL_ADDR, 0, SD_RESP_SHORT); // CMD3
-		cmd_res = SD_GetR6Resp(SD_CMD_SEND_REL_ADDR, (uint16_t *)(&SDCard.RCA));
-		if (cmd_res != SDR_Success) {
-			return cmd_res;
-		}
-	} else {
-		////////////////////////////////////////////////////////////////
-		// This part has not been tested due to lack of MMCmicro card //
-		////////////////////////////////////////////////////////////////
-
-		// For MMC card host should set a RCA value to the card by SET_REL_ADDR command
-		SD_Cmd(SD_CMD_SEND_REL_ADDR, SDIO_MMC_RCA << 16, SD_RESP_SHORT); // CMD3
-		cmd_res = SD_GetR1Resp(SD_CMD_SEND_REL_ADDR);
-		if (cmd_res != SDR_Success) {
-			return cmd_res;
-		}
-		SDCard.RCA = SDIO_MMC_RCA;
-	}
-
-	// Send SEND_CSD command to retrieve CSD register from the card
-	SD_Cmd(SD_CMD_SEND_CSD, SDCard.RCA << 16, SD_RESP_LONG); // CMD9
-	cmd_res = SD_GetR2Resp((uint32_t *)SDCard.CSD);
-	if (cmd_res != SDR_Success) {
-		return cmd_res;
-	}
-
-	// Parse the values of CID and CSD registers
-	SD_GetCardInfo();
-
-	// Now card must be in stand-by mode, from this point it is possible to increase bus speed
-	SD_SetBusClock(SD_CLK_DIV_TRAN);
-
-	// Put the SD card to the transfer mode
-	SD_Cmd(SD_CMD_SEL_DESEL_CARD, SDCard.RCA << 16, SD_RESP_SHORT); // CMD7
-	cmd_res = SD_GetR1Resp(SD_CMD_SEL_DESEL_CARD); // In fact R1b response here
-	if (cmd_res != SDR_Success) {
-		return cmd_res;
-	}
-
-	// Disable the pull-up resistor on CD/DAT3 pin of card
-	// Send leading command for ACMD<n> command
-	SD_Cmd(SD_CMD_APP_CMD, SDCard.RCA << 16, SD_RESP_SHORT); // CMD55
-	cmd_res = SD_GetR1Resp(SD_CMD_APP_CMD);
-	if (cmd_res != SDR_Success) {
-		return cmd_res;
-	}
-	// Send SET_CLR_CARD_DETECT command
-	SD_Cmd(SD_CMD_SET_CLR_CARD_DETECT, 0, SD_RESP_SHORT); // ACMD42
-	cmd_res = SD_GetR1Resp(SD_CMD_SET_CLR_CARD_DETECT);
-	if (cmd_res != SDR_Success) {
-		return cmd_res;
-	}
-
-	// Read the SCR register
-	if (SDCard.Type != SDCT_MMC) {
-		// MMC card doesn't support this feature
-		// Warning: this function set block size to 8 bytes
-		SD_GetSCR((uint32_t *)SDCard.SCR);
-	}
-
-	// For SDv1,SDv2 and MMC card must set block size
-	// The SDHC/SDXC always have fixed block size (512 bytes)
-	if ((SDCard.Type == SDCT_SDSC_V1) || (SDCard.Type == SDCT_SDSC_V2) || (SDCard.Type == SDCT_MMC)) {
-		SD_Cmd(SD_CMD_SET_BLOCKLEN, 512, SD_RESP_SHORT); // CMD16
-		cmd_res = SD_GetR1Resp(SD_CMD_SET_BLOCKLEN);
-		if (cmd_res != SDR_Success) {
-			return SDR_SetBlockSizeFailed;
-		}
-	}
-
-	return SDR_Success;
-}
-
-// Set SDIO bus width
-// input:
-//   BW - bus width (one of SDIO_BUS_xBIT constants)
-// return: SDResult
-// note: card must be in TRAN state and not locked, otherwise it will respond with 'illegal command'
-SDResult SD_SetBusWidth(uint32_t BW) {
-	SDResult cmd_res = SDR_Success;
-	uint32_t clk;
-
-	if (SDCard.Type != SDCT_MMC) {
-		// Send leading command for ACMD<n> command
-		SD_Cmd(SD_CMD_APP_CMD, SDCard.RCA << 16, SD_RESP_SHORT); // CMD55
-		cmd_res = SD_GetR1Resp(SD_CMD_APP_CMD);
-		if (cmd_res != SDR_Success) {
-			return cmd_res;
-		}
-
-		// Send SET_BUS_WIDTH command
-		SD_Cmd(SD_CMD_SET_BUS_WIDTH, (BW == SD_BUS_1BIT) ? 0x00000000 : 0x00000002, SD_RESP_SHORT); // ACMD6
-		cmd_res = SD_GetR1Resp(SD_CMD_SET_BUS_WIDTH);
-		if (cmd_res != SDR_Success) {
-			return cmd_res;
-		}
-	} else {
-		// MMC supports only 8-bit ?
-	}
-
-	// Configure new bus width
-	clk  = SDMMC1->CLKCR;
-	clk &= ~SDMMC_CLKCR_WIDBUS;
-	clk |= (BW & SDMMC_CLKCR_WIDBUS);
-	SDMMC1->CLKCR = clk;
-
-	return cmd_res;
-}
-
-// Set SDIO bus clock
-// input:
-//   clk_div - bus clock divider (0x00..0xff -> bus_clock = SDIOCLK / (clk_div + 2))
-void SD_SetBusClock(uint32_t clk_div) {
-	uint32_t clk;
-
-	clk  = SDMMC1->CLKCR;
-	clk &= ~SDMMC_CLKCR_CLKDIV;
-	clk |= (clk_div & SDMMC_CLKCR_CLKDIV);
-	SDMMC1->CLKCR = clk;
-}
-
-// Parse information about specific card
-// note: CSD/CID register values already must be in the SDCard structure
-void SD_GetCardInfo(void) {
-	uint32_t dev_size;
-	uint32_t dev_size_mul;
-
-	// Parse the CSD register
-	SDCard.CSDVer = SDCard.CSD[0] >> 6; // CSD version
-	if (SDCard.Type != SDCT_MMC) {
-		// SD
-		SDCard.MaxBusClkFreq = SDCard.CSD[3];
-		if (SDCard.CSDVer == 0) {
-			// CSD v1.00 (SDSCv1, SDSCv2)
-			dev_size  = (uint32_t)(SDCard.CSD[6] & 0x03) << 10; // Device size
-			dev_size |= (uint32_t)SDCard.CSD[7] << 2;
-			dev_size |= (SDCard.CSD[8] & 0xc0) >> 6;
-			dev_size_mul  = (SDCard.CSD[ 9] & 0x03) << 1; // Device size multiplier
-			dev_size_mul |= (SDCard.CSD[10] & 0x80) >> 7;
-			SDCard.BlockCount  = (dev_size + 1);
-			SDCard.BlockCount *= (1 << (dev_size_mul + 2));
-			SDCard.BlockSize   =  1 << (SDCard.CSD[5] & 0x0f); // Maximum read data block length
-		} else {
-			// CSD v2.00 (SDHC, SDXC)
-			dev_size  = (SDCard.CSD[7] & 0x3f) << 16;
-			dev_size |=  SDCard.CSD[8] << 8;
-			dev_size |=  SDCard.CSD[9];
-			SDCard.BlockSize = 512;
-			SDCard.BlockCount = dev_size + 1;
-		}
-		SDCard.Capacity = SDCard.BlockCount * SDCard.BlockSize;
-	} else {
-		// MMC
-		SDCard.MaxBusClkFreq = SDCard.CSD[3];
-		dev_size  = (uint32_t)(SDCard.CSD[6] & 0x03) << 8; // C_SIZE
-		dev_size += (uint32_t)SDCard.CSD[7];
-		dev_size <<= 2;
-		dev_size += SDCard.CSD[8] >> 6;
-		SDCard.BlockSize = 1 << (SDCard.CSD[5] & 0x0f); // MMC read block length
-		dev_size_mul = ((SDCard.CSD[9] & 0x03) << 1) + ((SDCard.CSD[10] & 0x80) >> 7);
-		SDCard.BlockCount = (dev_size + 1) * (1 << (dev_size_mul + 2));
-		SDCard.Capacity = SDCard.BlockCount * SDCard.BlockSize;
-	}
-
-	// Parse the CID register
-	if (SDCard.Type != SDCT_MMC) {
-		// SD card
-		SDCard.MID = SDCard.CID[0];
-		SDCard.OID = (SDCard.CID[1] << 8) | SDCard.CID[2];
-		SDCard.PNM[0] = SDCard.CID[3];
-		SDCard.PNM[1] = SDCard.CID[4];
-		SDCard.PNM[2] = SDCard.CID[5];
-		SDCard.PNM[3] = SDCard.CID[6];
-		SDCard.PNM[4] = SDCard.CID[7];
-		SDCard.PRV = SDCard.CID[8];
-		SDCard.PSN = (SDCard.CID[9] << 24) | (SDCard.CID[10] << 16) | (SDCard.CID[11] << 8) | SDCard.CID[12];
-		SDCard.MDT = ((SDCard.CID[13] << 8) | SDCard.CID[14]) & 0x0fff;
-	} else {
-		// MMC
-		SDCard.MID = 0x00;
-		SDCard.OID = 0x0000;
-		SDCard.PNM[0] = '*';
-		SDCard.PNM[1] = 'M';
-		SDCard.PNM[2] = 'M';
-		SDCard.PNM[3] = 'C';
-		SDCard.PNM[4] = '*';
-		SDCard.PRV = 0;
-		SDCard.PSN = 0x00000000;
-		SDCard.MDT = 0x0000;
-	}
-}
-
-SDResult SD_HighSpeed(void) {
-	SDResult cmd_res = SDR_Success;
-	uint8_t CCCR[64];
-	uint32_t *pCCCR = (uint32_t *)CCCR;
-	uint32_t response;
-	uint32_t i;
-	register uint32_t STA;
-
-USART_SendStr(USART1,">>>>> HS: Check HS");
-
-	// Set block size to 64 bytes
-	SD_Cmd(SD_CMD_SET_BLOCKLEN, 64, SD_RESP_SHORT); // CMD16
-	cmd_res = SD_GetR1Resp(SD_CMD_SET_BLOCKLEN);
-	if (cmd_res != SDR_Success) {
-		return cmd_res;
-	}
-
-	// Clear the data flags
-	SDMMC1->ICR = SDIO_ICR_DATA;
-
-	// Data read timeout
-	SDMMC1->DTIMER = SD_DATA_R_TIMEOUT;
-	// Data length in bytes
-	SDMMC1->DLEN   = 64;
-	// Data transfer:
-	//   transfer mode: block
-	//   direction: to card
-	//   DMA: enabled
-	//   block size: 2^6 = 64 bytes
-	//   DPSM: enabled
-	SDMMC1->DCTRL  = SDMMC_DCTRL_DTDIR | (6 << 4) | SDMMC_DCTRL_DTEN;
-
-	// Send SD_CMD_HS_SWITCH command
-//	SD_Cmd(SD_CMD_SET_BUS_WIDTH,0x00000001,SD_RESP_SHORT); // CMD6
-//	SD_Cmd(SD_CMD_SET_BUS_WIDTH,0x80000001,SD_RESP_SHORT); // CMD6
-	SD_Cmd(SD_CMD_SET_BUS_WIDTH,0x80FFFFF1,SD_RESP_SHORT); // CMD6
-	cmd_res = SD_GetR1Resp(SD_CMD_SET_BUS_WIDTH);
-	if (cmd_res != SDR_Success) {
-		return cmd_res;
-	}
-
-	// Read the CCCR register value
-	while (!(SDMMC1->STA & (SDMMC_STA_RXOVERR | SDMMC_STA_DCRCFAIL | SDMMC_STA_DTIMEOUT | SDMMC_STA_DBCKEND | SDMMC_STA_STBITERR))) {
-		// Read word when data available in receive FIFO
-		if (SDMMC1->STA & SDMMC_STA_RXFIFOHF) {
-			*pCCCR++ = SDMMC1->FIFO;
-			*pCCCR++ = SDMMC1->FIFO;
-			*pCCCR++ = SDMMC1->FIFO;
-			*pCCCR++ = SDMMC1->FIFO;
-			*pCCCR++ = SDMMC1->FIFO;
-			*pCCCR++ = SDMMC1->FIFO;
-			*pCCCR++ = SDMMC1->FIFO;
-			*pCCCR++ = SDMMC1->FIFO;
-		}
-	}
-
-	// Check for errors
-	if (STA & SDIO_XFER_ERROR_FLAGS) {
-		if (SDMMC1->STA & SDMMC_STA_DTIMEOUT) cmd_res = SDR_DataTimeout;
-		if (SDMMC1->STA & SDMMC_STA_DCRCFAIL) cmd_res = SDR_DataCRCFail;
-		if (SDMMC1->STA & SDMMC_STA_RXOVERR)  cmd_res = SDR_RXOverrun;
-		if (SDMMC1->STA & SDMMC_STA_STBITERR) cmd_res = SDR_StartBitError;
-	}
-
-	// Read the data remnant from the SDIO FIFO (if any present)
-	while (SDMMC1->STA & SDMMC_STA_RXDAVL) {
-		*pCCCR++ = SDMMC1->FIFO;
-	}
-
-	// Clear the static SDIO flags
-	SDMMC1->ICR = SDIO_ICR_STATIC;
-
-	if (cmd_res == SDR_Success) {
-		for (i = 0; i < 64; i++) {
-			if ((i % 8) == 0) USART_printf(USART1,"\r\n");
-			USART_printf(USART1,"%02u=%02X ",i,CCCR[i]);
-		}
-		USART_printf(USART1,"\r\n");
-		USART_printf(USART1,"SHS: %s\r\n",(CCCR[63 - (400 / 8)] & 0x01) ? "YES" : "NO");
-		USART_printf(USART1,"BSS: %03b\r\n",(CCCR[63 - (400 / 8)] & 0x0E) >> 1);
-	} else {
-		USART_printf(USART1,"GetCCCR error: %02X\r\n",cmd_res);
-	}
-
-USART_SendStr(USART1,"<<<< HS: End of check\r\n");
-
-	return SDR_Success;
-}
-
-// Abort an ongoing data transfer
-// return: SDResult value
-SDResult SD_StopTransfer(void) {
-	// Send STOP_TRANSMISSION command
-	SD_Cmd(SD_CMD_STOP_TRANSMISSION, 0, SD_RESP_SHORT); // CMD12
-
-	return SD_GetR1Resp(SD_CMD_STOP_TRANSMISSION);
-}
-
-// Get current SD card state
-// input:
-//   pState - pointer to the variable for current card state, one of SD_STATE_xx values
-// return: SDResult value
-SDResult SD_GetCardState(uint8_t *pState) {
-	uint8_t cmd_res;
-
-	// Send SEND_STATUS command
-	SD_Cmd(SD_CMD_SEND_STATUS, SDCard.RCA << 16, SD_RESP_SHORT); // CMD13
-	cmd_res = SD_GetR1Resp(SD_CMD_SEND_STATUS);
-	if (cmd_res != SDR_Success) {
-		*pState = SD_STATE_ERROR;
-		return cmd_res;
-	}
-
-	// Find out a card status
-	*pState = (SDMMC1->RESP1 & 0x1e00) >> 9;
-
-	// Check for errors
-	return SDR_Success;
-}
-
-// Read block of data from the SD card
-// input:
-//   addr - address of the block to be read
-//   pBuf - pointer to the buffer that will contain the received data
-//   length - buffer length (must be multiple of 512)
-// return: SDResult value
-SDResult SD_ReadBlock(uint32_t addr, uint32_t *pBuf, uint32_t length) {
-	SDResult cmd_res = SDR_Success;
-	uint32_t blk_count = length >> 9; // Sectors in block
-	register uint32_t STA; // to speed up SDIO flags checking
-	register uint32_t STA_mask; // mask for SDIO flags checking
-
-	// Initialize the data control register
-	SDMMC1->DCTRL = 0;
-
-	// SDSC card uses byte unit address and
-	// SDHC/SDXC cards use block unit address (1 unit = 512 bytes)
-	// For SDHC card addr must be converted to block unit address
-	if (SDCard.Type == SDCT_SDHC) addr >>= 9;
-
-	// Clear the static SDIO flags
-	SDMMC1->ICR = SDIO_ICR_STATIC;
-
-	if (blk_count > 1) {
-		// Prepare bit checking variable for multiple block transfer
-		STA_mask = SDIO_RX_MB_FLAGS;
-		// Send READ_MULT_BLOCK command
-		SD_Cmd(SD_CMD_READ_MULT_BLOCK, addr, SD_RESP_SHORT); // CMD18
-		cmd_res = SD_GetR1Resp(SD_CMD_READ_MULT_BLOCK);
-	} else {
-		// Prepare bit checking variable for single block transfer
-		STA_mask = SDIO_RX_SB_FLAGS;
-		// Send READ_SINGLE_BLOCK command
-		SD_Cmd(SD_CMD_READ_SINGLE_BLOCK, addr, SD_RESP_SHORT); // CMD17
-		cmd_res = SD_GetR1Resp(SD_CMD_READ_SINGLE_BLOCK);
-	}
-	if (cmd_res != SDR_Success) {
-		return cmd_res;
-	}
-
-	// Data read timeout
-	SDMMC1->DTIMER = SD_DATA_R_TIMEOUT;
-	// Data length
-	SDMMC1->DLEN   = length;
-	// Data transfer:
-	//   transfer mode: block
-	//   direction: to card
-	//   DMA: disabled
-	//   block size: 2^9 = 512 bytes
-	//   DPSM: enabled
-	SDMMC1->DCTRL  = SDMMC_DCTRL_DTDIR | (9 << 4) | SDMMC_DCTRL_DTEN;
-
-	// Receive a data block from the SDIO
-	// ----> TIME CRITICAL SECTION BEGIN <----
-	do {
-		STA = SDMMC1->STA;
-		if (STA & SDMMC_STA_RXFIFOHF) {
-			// Receive FIFO half full, there are at least 8 words in it
-			// This code is 80 bytes more than the 'for' loop, but faster
-			*pBuf++ = SDMMC1->FIFO;
-			*pBuf++ = SDMMC1->FIFO;
-			*pBuf++ = SDMMC1->FIFO;
-			*pBuf++ = SDMMC1->FIFO;
-			*pBuf++ = SDMMC1->FIFO;
-			*pBuf++ = SDMMC1->FIFO;
-			*pBuf++ = SDMMC1->FIFO;
-			*pBuf++ = SDMMC1->FIFO;
-		}
-	} while (!(STA & STA_mask));
-	// <---- TIME CRITICAL SECTION END ---->
-
-	// Send stop transmission command in case of multiple block transfer
-	if ((SDCard.Type != SDCT_MMC) && (blk_count > 1)) {
-		cmd_res = SD_StopTransfer();
-	}
-
-	// Check for errors
-	if (STA & SDIO_XFER_ERROR_FLAGS) {
-		if (STA & SDMMC_STA_DTIMEOUT) cmd_res = SDR_DataTimeout;
-		if (STA & SDMMC_STA_DCRCFAIL) cmd_res = SDR_DataCRCFail;
-		if (STA & SDMMC_STA_RXOVERR)  cmd_res = SDR_RXOverrun;
-		if (STA & SDMMC_STA_STBITERR) cmd_res = SDR_StartBitError;
-	}
-
-	// Read the data remnant from RX FIFO (if there is still any data)
-	while (SDMMC1->STA & SDMMC_STA_RXDAVL) {
-		*pBuf++ = SDMMC1->FIFO;
-	}
-
-	// Clear the static SDIO flags
-	SDMMC1->ICR = SDIO_ICR_STATIC;
-
-	return cmd_res;
-}
-
-// Write block of data to the SD card
-// input:
-//   addr - address of the block to be written
-//   pBuf - pointer to the buffer that will contain the received data
-//   length - buffer length (must be multiple of 512)
-// return: SDResult value
-SDResult SD_WriteBlock(uint32_t addr, uint32_t *pBuf, uint32_t length) {
-	SDResult cmd_res = SDR_Success;
-	uint32_t blk_count = length >> 9; // Sectors in block
-	uint32_t STA; // To speed up SDIO flags checking
-	register uint32_t STA_mask; // Mask for SDIO flags checking
-	uint32_t data_sent = 0; // Counter of transferred bytes
-	uint8_t card_state; // Card state
-
-	// Initialize the data control register
-	SDMMC1->DCTRL = 0;
-
-	// SDSC card uses byte unit address and
-	// SDHC/SDXC cards use block unit address (1 unit = 512 bytes)
-	// For SDHC card addr must be converted to block unit address
-	if (SDCard.Type == SDCT_SDHC) addr >>= 9;
-
-	if (blk_count > 1) {
-		// Prepare bit checking variable for multiple block transfer
-		STA_mask = SDIO_TX_MB_FLAGS;
-		// Send WRITE_MULTIPLE_BLOCK command
-		SD_Cmd(SD_CMD_WRITE_MULTIPLE_BLOCK, addr, SD_RESP_SHORT); // CMD25
-		cmd_res = SD_GetR1Resp(SD_CMD_WRITE_MULTIPLE_BLOCK);
-	} else {
-		// Prepare bit checking variable for single block transfer
-		STA_mask = SDIO_TX_SB_FLAGS;
-		// Send WRITE_BLOCK command
-		SD_Cmd(SD_CMD_WRITE_BLOCK, addr, SD_RESP_SHORT); // CMD24
-		cmd_res = SD_GetR1Resp(SD_CMD_WRITE_BLOCK);
-	}
-	if (cmd_res != SDR_Success) {
-		return cmd_res;
-	}
-
-	// Clear the static SDIO flags
-	SDMMC1->ICR = SDIO_ICR_STATIC;
-
-	// Data write timeout
-	SDMMC1->DTIMER = SD_DATA_W_TIMEOUT;
-	// Data length
-	SDMMC1->DLEN = length;
-	// Data transfer:
-	//   transfer mode: block
-	//   direction: to card
-	//   DMA: disabled
-	//   block size: 2^9 = 512 bytes
-	//   DPSM: enabled
-	SDMMC1->DCTRL = (9 << 4) | SDMMC_DCTRL_DTEN;
-
-	// Transfer data block to the SDIO
-	// ----> TIME CRITICAL SECTION BEGIN <----
-	if (!(length & 0x1F)) {
-		// The block length is multiple of 32, simplified transfer procedure can be used
-		do {
-			if ((SDMMC1->STA & SDMMC_STA_TXFIFOHE) && (data_sent < length)) {
-				// The TX FIFO is half empty, at least 8 words can be written
-				SDMMC1->FIFO = *pBuf++;
-				SDMMC1->FIFO = *pBuf++;
-				SDMMC1->FIFO = *pBuf++;
-				SDMMC1->FIFO = *pBuf++;
-				SDMMC1->FIFO = *pBuf++;
-				SDMMC1->FIFO = *pBuf++;
-				SDMMC1->FIFO = *pBuf++;
-				SDMMC1->FIFO = *pBuf++;
-				data_sent += 32;
-			}
-		} while (!(SDMMC1->STA & STA_mask));
-	} else {
-		// Since the block length is not a multiple of 32, it is necessary to apply additional calculations
-		do {
-			if ((SDMMC1->STA & SDMMC_STA_TXFIFOHE) && (data_sent < length)) {
-				// TX FIFO half empty, at least 8 words can be written
-				uint32_t data_left = length - data_sent;
-				if (data_left < 32) {
-					// Write last portion of data to the TX FIFO
-					data_left = ((data_left & 0x03) == 0) ? (data_left >> 2) : ((data_left >> 2) + 1);
-					data_sent += data_left << 2;
-					while (data_left--) {
-						SDMMC1->FIFO = *pBuf++;
-					}
-				} else {
-					// Write 8 words to the TX FIFO
-					SDMMC1->FIFO = *pBuf++;
-					SDMMC1->FIFO = *pBuf++;
-					SDMMC1->FIFO = *pBuf++;
-					SDMMC1->FIFO = *pBuf++;
-					SDMMC1->FIFO = *pBuf++;
-					SDMMC1->FIFO = *pBuf++;
-					SDMMC1->FIFO = *pBuf++;
-					SDMMC1->FIFO = *pBuf++;
-					data_sent += 32;
-				}
-			}
-		} while (!(SDMMC1->STA & STA_mask));
-	}
-	// <---- TIME CRITICAL SECTION END ---->
-
-	// Save STA register value for further analysis
-	STA = SDMMC1->STA;
-
-	// Send stop transmission command in case of multiple block transfer
-	if ((SDCard.Type != SDCT_MMC) && (blk_count > 1)) {
-		cmd_res = SD_StopTransfer();
-	}
-
-	// Check for errors
-	if (STA & SDIO_XFER_ERROR_FLAGS) {
-		if (STA & SDMMC_STA_DTIMEOUT) cmd_res = SDR_DataTimeout;
-		if (STA & SDMMC_STA_DCRCFAIL) cmd_res = SDR_DataCRCFail;
-		if (STA & SDMMC_STA_TXUNDERR) cmd_res = SDR_TXUnderrun;
-		if (STA & SDMMC_STA_STBITERR) cmd_res = SDR_StartBitError;
-	}
-
-	// Wait while the card is in programming state
-	do {
-		if (SD_GetCardState(&card_state) != SDR_Success) {
-			break;
-		}
-	} while ((card_state == SD_STATE_PRG) || (card_state == SD_STATE_RCV));
-
-	// Clear the static SDIO flags
-	SDMMC1->ICR = SDIO_ICR_STATIC;
-
-	return cmd_res;
-}
-
-#if (SDIO_USE_DMA)
-
-// Initialize the DMA channel for SDIO peripheral (DMA2 Channel4)
-// input:
-//   pBuf - pointer to the memory buffer
-//   length - size of the memory buffer in bytes (must be a multiple of 4, since the SDIO operates with 32-bit words)
-//   direction - DMA channel direction, one of SDIO_DMA_DIR_xx values
-// note: the DMA peripheral (DMA2) must be already enabled
-void SD_Configure_DMA(uint32_t *pBuf, uint32_t length, uint8_t direction) {
-	// Populate SDIO DMA channel handle
-	SDIO_DMA_CH.Channel  = SDIO_DMA_CHANNEL;
-	SDIO_DMA_CH.Instance = DMA_GetChannelPeripheral(SDIO_DMA_CHANNEL);
-	SDIO_DMA_CH.ChIndex  = DMA_GetChannelIndex(SDIO_DMA_CHANNEL);
-	SDIO_DMA_CH.Request  = SDIO_DMA_REQUEST;
-	SDIO_DMA_CH.State    = DMA_STATE_RESET;
-
-	// DMA channel configuration:
-	//   channel priority: medium
-	//   memory increment: enabled
-	//   peripheral increment: disabled
-	//   circular mode: disabled
-	//   IRQ: disabled
-	//   memory size: 32-bit
-	//   peripheral size: 32-bit
-	//   channel: disabled
-	SDIO_DMA_CH.Channel->CCR  = DMA_CCR_MINC | DMA_PRIORITY_MEDIUM | DMA_MALIGN_32BIT | DMA_PALIGN_32BIT | direction;
-	SDIO_DMA_CH.Channel->CPAR = (uint32_t)(&(SDMMC1->FIFO)); // Address of the SDIO FIFO
-	SDIO_DMA_CH.Channel->CMAR = (uint32_t)pBuf; // Memory address
-
-	// Number of DMA transactions
-	DMA_SetDataLength(SDIO_DMA_CH.Channel,length >> 2);
-
-	// Map DMA request to DMA channel
-	DMA_SetRequest(SDIO_DMA_CH.Instance,SDIO_DMA_CH.Request,SDIO_DMA_CH.ChIndex);
-
-	// Clear SDIO DMA channel interrupt flags
-	DMA_ClearFlags(SDIO_DMA_CH.Instance,SDIO_DMA_CH.ChIndex,DMA_CF_ALL);
-}
-
-// Start reading of data block from the SD card with DMA transfer
-// input:
-//   addr - address of the block to be read
-//   pBuf - pointer to the buffer that will contain the received data
-//   length - buffer length (must be multiple of 512)
-// return: SDResult value
-SDResult SD_ReadBlock_DMA(uint32_t addr, uint32_t *pBuf, uint32_t length) {
-	SDResult cmd_res = SDR_Success;
-	uint32_t blk_count = length >> 9;
-
-	// Initialize the data control register
-	SDMMC1->DCTRL = 0;
-
-	// Clear the static SDIO flags
-	SDMMC1->ICR = SDIO_ICR_STATIC;
-
-	// Configure number of transactions and enable the SDIO DMA channel
-	DMA_SetDataLength(SDIO_DMA_CH.Channel, length >> 2);
-	DMA_EnableChannel(SDIO_DMA_CH.Channel);
-
-	// SDSC card uses byte unit address and
-	// SDHC/SDXC cards use block unit address (1 unit = 512 bytes)
-	// For SDHC card addr must be converted to block unit address
-	if (SDCard.Type == SDCT_SDHC) addr >>= 9;
-
-	if (blk_count > 1) {
-		// Send READ_MULT_BLOCK command
-		SD_Cmd(SD_CMD_READ_MULT_BLOCK, addr, SD_RESP_SHORT); // CMD18
-		cmd_res = SD_GetR1Resp(SD_CMD_READ_MULT_BLOCK);
-	} else {
-		// Send READ_SINGLE_BLOCK command
-		SD_Cmd(SD_CMD_READ_SINGLE_BLOCK, addr, SD_RESP_SHORT); // CMD17
-		cmd_res = SD_GetR1Resp(SD_CMD_READ_SINGLE_BLOCK);
-	}
-	if (cmd_res == SDR_Success) {
-		// Data read timeout
-		SDMMC1->DTIMER = SD_DATA_R_TIMEOUT;
-		// Data length
-		SDMMC1->DLEN   = length;
-		// Data transfer:
-		//   transfer mode: block
-		//   direction: from card
-		//   DMA: enabled
-		//   block size: 2^9 = 512 bytes
-		//   DPSM: enabled
-		SDMMC1->DCTRL = SDMMC_DCTRL_DMAEN | SDMMC_DCTRL_DTDIR | (9 << 4) | SDMMC_DCTRL_DTEN;
-	}
-
-	return cmd_res;
-}
-
-// Start writing block of data to the SD card with DMA transfer
-// input:
-//   addr - address of the block to be written
-//   pBuf - pointer to the buffer that will contain the received data
-//   length - buffer length (must be multiple of 512)
-// return: SDResult value
-SDResult SD_WriteBlock_DMA(uint32_t addr, uint32_t *pBuf, uint32_t length) {
-	SDResult cmd_res = SDR_Success;
-	uint32_t blk_count = length >> 9;
-
-	// Initialize the data control register
-	SDMMC1->DCTRL = 0;
-
-	// Clear the static SDIO flags
-	SDMMC1->ICR = SDIO_ICR_STATIC;
-
-	// Configure number of transactions and enable the SDIO DMA channel
-	DMA_SetDataLength(SDIO_DMA_CH.Channel,length >> 2);
-	DMA_EnableChannel(SDIO_DMA_CH.Channel);
-
-	// SDSC card uses byte unit address and
-	// SDHC/SDXC cards use block unit address (1 unit = 512 bytes)
-	// For SDHC card addr must be converted to block unit address
-	if (SDCard.Type == SDCT_SDHC) addr >>= 9;
-
-	if (blk_count > 1) {
-		// Send WRITE_MULTIPLE_BLOCK command
-		SD_Cmd(SD_CMD_WRITE_MULTIPLE_BLOCK,addr,SD_RESP_SHORT); // CMD25
-		cmd_res = SD_GetR1Resp(SD_CMD_WRITE_MULTIPLE_BLOCK);
-	} else {
-		// Send WRITE_BLOCK command
-		SD_Cmd(SD_CMD_WRITE_BLOCK,addr,SD_RESP_SHORT); // CMD24
-		cmd_res = SD_GetR1Resp(SD_CMD_WRITE_BLOCK);
-	}
-	if (cmd_res == SDR_Success) {
-		// Data write timeout
-		SDMMC1->DTIMER = SD_DATA_W_TIMEOUT;
-		// Data length
-		SDMMC1->DLEN   = length;
-		// Data transfer:
-		//   transfer mode: block
-		//   direction: to card
-		//   DMA: enabled
-		//   block size: 2^9 = 512 bytes
-		//   DPSM: enabled
-		SDMMC1->DCTRL = SDMMC_DCTRL_DMAEN | (9 << 4) | SDMMC_DCTRL_DTEN;
-	}
-
-	return cmd_res;
-}
-
-// This function waits until the SDIO DMA data read transfer is finished
-// It must be called after SD_ReadBlock_DMA() function to ensure that all
-// data sent by the SD card is already transfered by the DMA and send STOP
-// command in case of multiple block transfer
-// input:
-//   length - buffer length (must be a multiple of 512)
-// return: SDResult value
-// note: length passed here to determine if it was multiple block transfer
-SDResult SD_CheckRead(uint32_t length) {
-	SDResult cmd_res = SDR_Success;
-	uint32_t blk_count = length >> 9;
-	volatile uint32_t wait = SD_DATA_R_TIMEOUT;
-	uint32_t STA;
-
-	// Wait for SDIO receive complete or error occurred
-	if (blk_count > 1) {
-		// Multiple block transfer
-		while (!(SDMMC1->STA & SDIO_RX_MB_FLAGS) && --wait);
-	} else {
-		// Single block transfer
-		while (!(SDMMC1->STA & SDIO_RX_SB_FLAGS) && --wait);
-	}
-	STA = SDMMC1->STA;
-
-	// This is a READ operation, SDIO transfer must be completed before DMA transaction,
-	// therefore will be enough to ensure only DMA transfer completed, without TXACT polling?
-
-	// Wait for DMA transfer complete and then disable the DMA channel
-	while (!(DMA_GetFlags(SDIO_DMA_CH.Instance,SDIO_DMA_CH.ChIndex,DMA_FLAG_TC)) && --wait);
-	DMA_DisableChannel(SDIO_DMA_CH.Channel);
-
-	// Send stop transmission command in case of multiple block transfer
-	if ((SDCard.Type != SDCT_MMC) && (blk_count > 1)) {
-		cmd_res = SD_StopTransfer();
-	}
-
-	// Clear the static SDIO flags
-	SDMMC1->ICR = SDIO_ICR_STATIC;
-
-	// Timeout?
-	if (wait == 0) return SDR_Timeout;
-
-	// Error happened?
-	if (STA & SDIO_XFER_ERROR_FLAGS) {
-		if (STA & SDMMC_STA_DTIMEOUT) cmd_res = SDR_DataTimeout;
-		if (STA & SDMMC_STA_DCRCFAIL) cmd_res = SDR_DataCRCFail;
-		if (STA & SDMMC_STA_RXOVERR)  cmd_res = SDR_RXOverrun;
-		if (STA & SDMMC_STA_STBITERR) cmd_res = SDR_StartBitError;
-	}
-
-	return cmd_res;
-}
-
-// This function waits until the SDIO DMA data write transfer is finished
-// It must be called after SD_WriteBlock_DMA() function to ensure that all
-// data is already transfered by the DMA to SD card and send STOP command
-// in case of multiple block transfer
-// input:
-//   length - buffer length (must be a multiple of 512)
-// return: SDResult value
-// note: length passed here to determine if it was multiple block transfer
-SDResult SD_CheckWrite(uint32_t length) {
-	SDResult cmd_res = SDR_Success;
-	uint32_t blk_count = length >> 9;
-	volatile uint32_t wait = SD_DATA_W_TIMEOUT;
-	volatile uint32_t STA;
-	uint8_t card_state;
-
-	// Wait for SDIO receive complete or error occurred
-	if (blk_count > 1) {
-		// Multiple block transfer
-		while (!(SDMMC1->STA & SDIO_TX_MB_FLAGS) && --wait);
-	} else {
-		// Single block transfer
-		while (!(SDMMC1->STA & SDIO_TX_SB_FLAGS) && --wait);
-	}
-
-	// Wait while the SDIO transfer active
-	while ((SDMMC1->STA & SDMMC_STA_TXACT) && --wait);
-	STA = SDMMC1->STA;
-
-	// Disable the DMA channel
-	DMA_DisableChannel(SDIO_DMA_CH.Channel);
-
-	// Send stop transmission command in case of multiple block transfer
-	if ((SDCard.Type != SDCT_MMC) && (blk_count > 1)) {
-		cmd_res = SD_StopTransfer();
-	}
-
-	// Clear the static SDIO flags
-	SDMMC1->ICR = SDIO_ICR_STATIC;
-
-	// Timeout?
-	if (wait == 0) return SDR_Timeout;
-
-	// Error happened?
-	if (STA & SDIO_XFER_ERROR_FLAGS) {
-		if (STA & SDMMC_STA_DTIMEOUT) cmd_res = SDR_DataTimeout;
-		if (STA & SDMMC_STA_DCRCFAIL) cmd_res = SDR_DataCRCFail;
-		if (STA & SDMMC_STA_TXUNDERR) cmd_res = SDR_TXUnderrun;
-		if (STA & SDMMC_STA_STBITERR) cmd_res = SDR_StartBitError;
-	}
-
-	// Wait while the card is in programming state
-	do {
-		if (SD_GetCardState(&card_state) != SDR_Success) break;
-	} while ((card_state == SD_STATE_PRG) || (card_state == SD_STATE_RCV));
-
-	// Clear the static SDIO flags
-	SDMMC1->ICR = SDIO_ICR_STATIC;
-
-	return cmd_res;
-}
-
-#endif // SDIO_USE_DMA
+#include "sdcard.h"
+
+
+// SD card parameters
+SDCard_TypeDef SDCard;
+
+// Nonzero while the card may still program the data of the last write
+static volatile uint8_t SD_Program = 0;
+
+
+// Send command to SD card
+// input:
+//   cmd - SD card command
+//   arg - argument for command (32-bit)
+//   resp_type - response type, one of SD_RESP_xx values
+static void SD_Cmd(uint8_t cmd, uint32_t arg, uint32_t resp_type) {
+	// Clear command flags
+	SDIO_WR(ICR,SD_ICR_CMD);
+
+	// Program an argument for command
+	SDIO_WR(ARG,arg);
+
+	// Program command value and response type, enable CPSM
+	SDIO_WR(CMD,cmd | resp_type | SD_CMD_CPSMEN);
+}
+
+// Wait for the response to the last command
+// return: SDR_Success when the response is received, SDR_CRCError if it failed the
+//         CRC check (always so for R3), SDR_Timeout if the card didn't respond
+static SDResult SD_WaitResp(void) {
+	volatile uint32_t wait = SD_CMD_TIMEOUT;
+	uint32_t STA;
+
+	// Wait for response, error or timeout
+	while (!((STA = SDIO_RD(STA)) & (SD_STA_CCRCFAIL | SD_STA_CMDREND | SD_STA_CTIMEOUT)) && --wait);
+
+	// Timeout?
+	if ((STA & SD_STA_CTIMEOUT) || (wait == 0)) {
+		SDIO_WR(ICR,SD_STA_CTIMEOUT);
+		return SDR_Timeout;
+	}
+
+	// CRC fail?
+	if (STA & SD_STA_CCRCFAIL) {
+		SDIO_WR(ICR,SD_STA_CCRCFAIL);
+		return SDR_CRCError;
+	}
+
+	return SDR_Success;
+}
+
+// Get SDResult code from the card status of a R1 response
+// input:
+//   respR1 - card status (32-bit value)
+// return: SDResult
+static SDResult SD_GetR1Error(uint32_t respR1) {
+	if (!(respR1 & SD_OCR_ALL_ERRORS))      return SDR_Success;
+	if (respR1 & SD_OCR_OUT_OF_RANGE)       return SDR_AddrOutOfRange;
+	if (respR1 & SD_OCR_ADDRESS_ERROR)      return SDR_AddrMisaligned;
+	if (respR1 & SD_OCR_BLOCK_LEN_ERROR)    return SDR_BlockLenError;
+	if (respR1 & SD_OCR_ERASE_SEQ_ERROR)    return SDR_EraseSeqError;
+	if (respR1 & SD_OCR_ERASE_PARAM)        return SDR_EraseParam;
+	if (respR1 & SD_OCR_WP_VIOLATION)       return SDR_WPViolation;
+	if (respR1 & SD_OCR_LOCK_UNLOCK_FAILED) return SDR_LockUnlockFailed;
+	if (respR1 & SD_OCR_COM_CRC_ERROR)      return SDR_ComCRCError;
+	if (respR1 & SD_OCR_ILLEGAL_COMMAND)    return SDR_IllegalCommand;
+	if (respR1 & SD_OCR_CARD_ECC_FAILED)    return SDR_CardECCFailed;
+	if (respR1 & SD_OCR_CC_ERROR)           return SDR_CCError;
+	if (respR1 & SD_OCR_ERROR)              return SDR_GeneralError;
+	if (respR1 & SD_OCR_STREAM_R_UNDERRUN)  return SDR_StreamUnderrun;
+	if (respR1 & SD_OCR_STREAM_W_OVERRUN)   return SDR_StreamOverrun;
+	if (respR1 & SD_OCR_CSD_OVERWRITE)      return SDR_CSDOverwrite;
+	if (respR1 & SD_OCR_WP_ERASE_SKIP)      return SDR_WPEraseSkip;
+	if (respR1 & SD_OCR_CARD_ECC_DISABLED)  return SDR_ECCDisabled;
+	if (respR1 & SD_OCR_ERASE_RESET)        return SDR_EraseReset;
+	if (respR1 & SD_OCR_AKE_SEQ_ERROR)      return SDR_AKESeqError;
+
+	return SDR_Success;
+}
+
+// Get SDResult code from the data path flags
+// input:
+//   STA - value of the SDIO status register
+//   cmd_res - result to return if there is no error
+// return: SDResult
+static SDResult SD_GetXferError(uint32_t STA, SDResult cmd_res) {
+	if (STA & SD_STA_DTIMEOUT) cmd_res = SDR_DataTimeout;
+	if (STA & SD_STA_DCRCFAIL) cmd_res = SDR_DataCRCFail;
+	if (STA & SD_STA_TXUNDERR) cmd_res = SDR_TXUnderrun;
+	if (STA & SD_STA_RXOVERR)  cmd_res = SDR_RXOverrun;
+	if (STA & SD_STA_STBITERR) cmd_res = SDR_StartBitError;
+
+	return cmd_res;
+}
+
+// Check R1 response
+// input:
+//   cmd - the sent command
+// return: SDResult
+static SDResult SD_GetR1Resp(uint8_t cmd) {
+	SDResult cmd_res;
+
+	cmd_res = SD_WaitResp();
+	if (cmd_res != SDR_Success) return cmd_res;
+
+	// Illegal command?
+	if (SDIO_RD(RESPCMD) != cmd) {
+		return SDR_IllegalCommand;
+	}
+
+	// Clear the static SDIO flags
+	SDIO_WR(ICR,SD_ICR_STATIC);
+
+	// Get a R1 response and analyze it for errors
+	return SD_GetR1Error(SDIO_RD(RESP1));
+}
+
+// Check R2 response
+// input:
+//   pBuf - pointer to the data buffer to store the R2 response
+// return: SDResult value
+static SDResult SD_GetR2Resp(uint32_t *pBuf) {
+	SDResult cmd_res;
+
+	cmd_res = SD_WaitResp();
+	if (cmd_res != SDR_Success) return cmd_res;
+
+	// Clear the static SDIO flags
+	SDIO_WR(ICR,SD_ICR_STATIC);
+
+	// SDIO_RESP[1..4] registers contains the R2 response
+#ifdef __GNUC__
+	// Use GCC built-in intrinsics (fastest, less code) (GCC v4.3 or later)
+	*pBuf++ = __builtin_bswap32(SDIO_RD(RESP1));
+	*pBuf++ = __builtin_bswap32(SDIO_RD(RESP2));
+	*pBuf++ = __builtin_bswap32(SDIO_RD(RESP3));
+	*pBuf   = __builtin_bswap32(SDIO_RD(RESP4));
+#else
+	// Use ARM 'REV' instruction (fast, a bit bigger code than GCC intrinsics)
+	*pBuf++ = __REV(SDIO_RD(RESP1));
+	*pBuf++ = __REV(SDIO_RD(RESP2));
+	*pBuf++ = __REV(SDIO_RD(RESP3));
+	*pBuf   = __REV(SDIO_RD(RESP4));
+/*
+	// Use SHIFT, AND and OR (slower, biggest code)
+	*pBuf++ = SWAP_UINT32(SDIO_RD(RESP1));
+	*pBuf++ = SWAP_UINT32(SDIO_RD(RESP2));
+	*pBuf++ = SWAP_UINT32(SDIO_RD(RESP3));
+	*pBuf   = SWAP_UINT32(SDIO_RD(RESP4));
+*/
+#endif
+
+	return SDR_Success;
+}
+
+// Check R3 response
+// return: SDResult value
+// note: R3 has no CRC, the failed CRC check is the normal case here
+static SDResult SD_GetR3Resp(void) {
+	if (SD_WaitResp() == SDR_Timeout) return SDR_Timeout;
+
+	// Clear the static SDIO flags
+	SDIO_WR(ICR,SD_ICR_STATIC);
+
+	return SDR_Success;
+}
+
+// Check R6 response (RCA)
+// return: SDResult value
+static SDResult SD_GetR6Resp(uint8_t cmd, uint16_t *pRCA) {
+	SDResult cmd_res;
+	uint32_t respR6;
+
+	cmd_res = SD_WaitResp();
+	if (cmd_res != SDR_Success) return cmd_res;
+
+	// Illegal command?
+	if (SDIO_RD(RESPCMD) != cmd) {
+		return SDR_IllegalCommand;
+	}
+
+	// Clear the static SDIO flags
+	SDIO_WR(ICR,SD_ICR_STATIC);
+
+	// Get a R6 response and analyze it for errors
+	respR6 = SDIO_RD(RESP1);
+	if (!(respR6 & (SD_R6_ILLEGAL_CMD | SD_R6_GENERAL_UNKNOWN_ERROR | SD_R6_COM_CRC_FAILED))) {
+		*pRCA = (uint16_t)(respR6 >> 16);
+		return SDR_Success;
+	}
+	if (respR6 & SD_R6_GENERAL_UNKNOWN_ERROR) return SDR_UnknownError;
+	if (respR6 & SD_R6_ILLEGAL_CMD)           return SDR_IllegalCommand;
+	if (respR6 & SD_R6_COM_CRC_FAILED)        return SDR_ComCRCError;
+
+	return SDR_Success;
+}
+
+// Check R7 response
+// return: SDResult value
+static SDResult SD_GetR7Resp(void) {
+	SDResult cmd_res;
+
+	cmd_res = SD_WaitResp();
+	if (cmd_res != SDR_Success) return cmd_res;
+
+	// Clear command response received flag
+	SDIO_WR(ICR,SD_STA_CMDREND);
+
+	return SDR_Success;
+}
+
+// Receive a short data block by polling the FIFO
+// input:
+//   pBuf - pointer to the buffer for the data
+//   words - size of the buffer (32-bit words)
+// return: SDResult value
+// note: the DPSM must be already enabled and the command sent
+static SDResult SD_ReadShort(uint32_t *pBuf, uint32_t words) {
+	uint32_t count = 0;
+
+	// Receive the data
+	while (!(SDIO_RD(STA) & (SD_STA_RXOVERR | SD_STA_DCRCFAIL | SD_STA_DTIMEOUT | SD_STA_DBCKEND | SD_STA_STBITERR))) {
+		// Read word when data available in receive FIFO
+		if ((SDIO_RD(STA) & SD_STA_RXDAVL) && (count < words)) pBuf[count++] = SDIO_RD(FIFO);
+	}
+
+	// Read the data remnant from the SDIO FIFO (if any present)
+	while ((SDIO_RD(STA) & SD_STA_RXDAVL) && (count < words)) pBuf[count++] = SDIO_RD(FIFO);
+
+	return SD_GetXferError(SDIO_RD(STA),SDR_Success);
+}
+
+// Retrieve the SD card SCR register value
+// input:
+//   pSCR - pointer to the buffer for SCR register (8 bytes)
+// return: SDResult value
+// note: card must be in transfer mode, not supported by MMC
+static SDResult SD_GetSCR(uint32_t *pSCR) {
+	SDResult cmd_res;
+
+	// Set block size to 8 bytes
+	cmd_res = SD_SetBlockSize(8);
+	if (cmd_res != SDR_Success) {
+		return cmd_res;
+	}
+
+	// Send leading command for ACMD<n> command
+	SD_Cmd(SD_CMD_APP_CMD, SDCard.RCA << 16, SD_RESP_SHORT); // CMD55
+	cmd_res = SD_GetR1Resp(SD_CMD_APP_CMD);
+	if (cmd_res != SDR_Success) {
+		return cmd_res;
+	}
+
+	// Clear the data flags
+	SDIO_WR(ICR,SD_ICR_DATA);
+
+	// Configure the SDIO data transfer
+	SDIO_WR(DTIMER,SD_DATA_R_TIMEOUT); // Data read timeout
+	SDIO_WR(DLEN,8); // Data length in bytes
+	// Data transfer:
+	//   - type: block
+	//   - direction: card -> controller
+	//   - size: 2^3 = 8bytes
+	//   - DPSM: enabled
+	SDIO_WR(DCTRL,SD_DCTRL_DTDIR | (3 << 4) | SD_DCTRL_DTEN);
+
+	// Send SEND_SCR command
+	SD_Cmd(SD_CMD_SEND_SCR, 0, SD_RESP_SHORT); // ACMD51
+	cmd_res = SD_GetR1Resp(SD_CMD_SEND_SCR);
+	if (cmd_res != SDR_Success) {
+		SDIO_WR(DCTRL,0);
+
+		return cmd_res;
+	}
+
+	// Receive the SCR register value
+	cmd_res = SD_ReadShort(pSCR,2);
+
+	// Clear the static SDIO flags
+	SDIO_WR(ICR,SD_ICR_STATIC);
+
+	return cmd_res;
+}
+
+// Set block size of the SD card
+// input:
+//   block_size - block length
+// return: SDResult value
+SDResult SD_SetBlockSize(uint32_t block_size) {
+	// Send SET_BLOCKLEN command
+	SD_Cmd(SD_CMD_SET_BLOCKLEN, block_size, SD_RESP_SHORT); // CMD16
+
+	return SD_GetR1Resp(SD_CMD_SET_BLOCKLEN);
+}
+
+// Initialize the SD card
+// return: SDResult value
+// note: SDIO peripheral clock must be on and SDIO GPIO configured
+SDResult SD_Init(void) {
+	volatile uint32_t wait;
+	uint32_t sd_type = SD_STD_CAPACITY; // SD card capacity
+	SDResult cmd_res;
+
+	// Populate SDCard structure with default values
+	SDCard = (SDCard_TypeDef){ 0 };
+	SDCard.Type = SDCT_UNKNOWN;
+	SDCard.BusClock = SD_SDIOCLK / (SD_CLK_DIV_INIT + 2);
+
+	// Enable the SDIO clock
+	SDIO_WR(POWER,SD_PWR_ON);
+
+	// CMD0
+	wait = SD_CMD_TIMEOUT;
+	SD_Cmd(SD_CMD_GO_IDLE_STATE, 0x00, SD_RESP_NONE);
+	while (!(SDIO_RD(STA) & (SD_STA_CTIMEOUT | SD_STA_CMDSENT)) && --wait);
+	if ((SDIO_RD(STA) & SD_STA_CTIMEOUT) || !wait) return SDR_Timeout;
+
+	// CMD8: SEND_IF_COND. Send this command to verify SD card interface operating condition
+	// Argument: - [31:12]: Reserved (shall be set to '0')
+	//           - [11:08]: Supply Voltage (VHS) 0x1 (Range: 2.7-3.6 V)
+	//           - [07:00]: Check Pattern (recommended 0xAA)
+	SD_Cmd(SD_CMD_HS_SEND_EXT_CSD, SD_CHECK_PATTERN, SD_RESP_SHORT); // CMD8
+	cmd_res = SD_GetR7Resp();
+	if (cmd_res == SDR_Success) {
+		// SD v2.0 or later
+
+		// Check echo-back of check pattern
+		if ((SDIO_RD(RESP1) & 0x01FF) != (SD_CHECK_PATTERN & 0x01FF)) {
+			return SDR_Unsupported;
+		}
+		sd_type = SD_HIGH_CAPACITY; // SD v2.0 or later
+
+		// Issue ACMD41 command
+		wait = SD_ACMD41_TRIALS;
+		while (--wait) {
+			// Send leading command for ACMD<n> command
+			SD_Cmd(SD_CMD_APP_CMD, 0, SD_RESP_SHORT); // CMD55 with RCA 0
+			cmd_res = SD_GetR1Resp(SD_CMD_APP_CMD);
+			if (cmd_res != SDR_Success) {
+				return cmd_res;
+			}
+			// ACMD41 - initiate initialization process.
+			// Set 3.0-3.3V voltage window (bit 20)
+			// Set HCS bit (30) (Host Capacity Support) to inform card what host support high capacity
+			// Set XPC bit (28) (SDXC Power Control) to use maximum performance (SDXC only)
+			SD_Cmd(SD_CMD_SD_SEND_OP_COND,SD_OCR_VOLTAGE | sd_type,SD_RESP_SHORT);
+			cmd_res = SD_GetR3Resp();
+			if (cmd_res != SDR_Success) {
+				return cmd_res;
+			}
+			if (SDIO_RD(RESP1) & (1U << 31)) {
+				// The SD card has finished the power-up sequence
+				break;
+			}
+		}
+		if (wait == 0) {
+			// Unsupported voltage range
+			return SDR_InvalidVoltage;
+		}
+
+		// This is SDHC/SDXC card?
+		SDCard.Type = (SDIO_RD(RESP1) & SD_HIGH_CAPACITY) ? SDCT_SDHC : SDCT_SDSC_V2;
+	} else if (cmd_res == SDR_Timeout) {
+		// SD v1.x or MMC
+
+		// Issue CMD55 to reset 'Illegal command' bit of the SD card
+		SD_Cmd(SD_CMD_APP_CMD, 0, SD_RESP_SHORT); // CMD55 with RCA 0
+		SD_GetR1Resp(SD_CMD_APP_CMD);
+
+		// Issue ACMD41 command with zero argument
+		wait = SD_ACMD41_TRIALS;
+		while (--wait) {
+			// Send leading command for ACMD<n> command
+			SD_Cmd(SD_CMD_APP_CMD, 0, SD_RESP_SHORT); // CMD55 with RCA 0
+			cmd_res = SD_GetR1Resp(SD_CMD_APP_CMD);
+			if (cmd_res == SDR_Timeout) {
+				// MMC doesn't know the APP_CMD
+				break;
+			}
+			if (cmd_res != SDR_Success) {
+				return cmd_res;
+			}
+
+			// Send ACMD41 - initiate initialization process (bit HCS = 0)
+			SD_Cmd(SD_CMD_SD_SEND_OP_COND, SD_OCR_VOLTAGE, SD_RESP_SHORT); // ACMD41
+			cmd_res = SD_GetR3Resp();
+			if (cmd_res == SDR_Timeout) {
+				// MMC will not respond to this command
+				break;
+			}
+			if (cmd_res != SDR_Success) {
+				return cmd_res;
+			}
+			if (SDIO_RD(RESP1) & (1U << 31)) {
+				// The SD card has finished the power-up sequence
+				break;
+			}
+		}
+		if (wait == 0) {
+			// Unknown/Unsupported card type
+			return SDR_UnknownCard;
+		}
+		if (cmd_res != SDR_Timeout) {
+			// SD v1.x
+			SDCard.Type = SDCT_SDSC_V1; // SDv1
+		} else {
+			// MMC or not SD memory card
+
+			////////////////////////////////////////////////////////////////
+			// This part has not been tested due to lack of MMCmicro card //
+			////////////////////////////////////////////////////////////////
+
+			wait = SD_ACMD41_TRIALS;
+			while (--wait) {
+				// Issue CMD1: initiate initialization process.
+				SD_Cmd(SD_CMD_SEND_OP_COND, SD_OCR_VOLTAGE, SD_RESP_SHORT); // CMD1
+				cmd_res = SD_GetR3Resp();
+				if (cmd_res != SDR_Success) {
+					return cmd_res;
+				}
+				if (SDIO_RD(RESP1) & (1U << 31)) {
+					// The SD card has finished the power-up sequence
+					break;
+				}
+			}
+			if (wait == 0) return SDR_UnknownCard;
+			SDCard.Type = SDCT_MMC; // MMC
+		}
+	} else {
+		return cmd_res;
+	}
+
+	// Now the CMD2 and CMD3 commands should be issued in cycle until timeout to enumerate all cards on the bus
+	// Since this module suitable to work with single card, issue this commands one time only
+
+	// Send ALL_SEND_CID command
+	SD_Cmd(SD_CMD_ALL_SEND_CID, 0, SD_RESP_LONG); // CMD2
+	cmd_res = SD_GetR2Resp((uint32_t *)SDCard.CID); // The response will be CID/CSD register value
+	if (cmd_res != SDR_Success) {
+		return cmd_res;
+	}
+
+	if (SDCard.Type != SDCT_MMC) {
+		// Send SEND_REL_ADDR command to ask the SD card to publish a new RCA (Relative Card Address)
+		// Once the RCA is received the card state changes to the stand-by state
+		SD_Cmd(SD_CMD_SEND_REL_ADDR, 0, SD_RESP_SHORT); // CMD3
+		cmd_res = SD_GetR6Resp(SD_CMD_SEND_REL_ADDR, (uint16_t *)(&SDCard.RCA));
+		if (cmd_res != SDR_Success) {
+			return cmd_res;
+		}
+	} else {
+		////////////////////////////////////////////////////////////////
+		// This part has not been tested due to lack of MMCmicro card //
+		////////////////////////////////////////////////////////////////
+
+		// For MMC card host should set a RCA value to the card by SET_REL_ADDR command
+		SD_Cmd(SD_CMD_SEND_REL_ADDR, SD_MMC_RCA << 16, SD_RESP_SHORT); // CMD3
+		cmd_res = SD_GetR1Resp(SD_CMD_SEND_REL_ADDR);
+		if (cmd_res != SDR_Success) {
+			return cmd_res;
+		}
+		SDCard.RCA = SD_MMC_RCA;
+	}
+
+	// Send SEND_CSD command to retrieve CSD register from the card
+	SD_Cmd(SD_CMD_SEND_CSD, SDCard.RCA << 16, SD_RESP_LONG); // CMD9
+	cmd_res = SD_GetR2Resp((uint32_t *)SDCard.CSD);
+	if (cmd_res != SDR_Success) {
+		return cmd_res;
+	}
+
+	// Parse the values of CID and CSD registers
+	SD_GetCardInfo();
+
+	// Now card must be in stand-by mode, from this point it is possible to increase bus speed
+	SD_SetBusClock(SD_CLK_DIV_TRAN);
+
+	// Put the SD card to the transfer mode
+	SD_Cmd(SD_CMD_SEL_DESEL_CARD, SDCard.RCA << 16, SD_RESP_SHORT); // CMD7
+	cmd_res = SD_GetR1Resp(SD_CMD_SEL_DESEL_CARD); // In fact R1b response here
+	if (cmd_res != SDR_Success) {
+		return cmd_res;
+	}
+
+	if (SDCard.Type != SDCT_MMC) {
+		// Disable the pull-up resistor on CD/DAT3 pin of card
+		// Send leading command for ACMD<n> command
+		SD_Cmd(SD_CMD_APP_CMD, SDCard.RCA << 16, SD_RESP_SHORT); // CMD55
+		cmd_res = SD_GetR1Resp(SD_CMD_APP_CMD);
+		if (cmd_res != SDR_Success) {
+			return cmd_res;
+		}
+		// Send SET_CLR_CARD_DETECT command
+		SD_Cmd(SD_CMD_SET_CLR_CARD_DETECT, 0, SD_RESP_SHORT); // ACMD42
+		cmd_res = SD_GetR1Resp(SD_CMD_SET_CLR_CARD_DETECT);
+		if (cmd_res != SDR_Success) {
+			return cmd_res;
+		}
+
+		// Read the SCR register (MMC card doesn't support this feature)
+		// Warning: this function set block size to 8 bytes
+		SD_GetSCR((uint32_t *)SDCard.SCR);
+	}
+
+	// For SDv1,SDv2 and MMC card must set block size
+	// The SDHC/SDXC always have fixed block size (512 bytes), but the SCR read left 8 bytes
+	cmd_res = SD_SetBlockSize(512);
+	if ((cmd_res != SDR_Success) && (SDCard.Type != SDCT_SDHC)) {
+		return SDR_SetBlockSizeFailed;
+	}
+
+	return SDR_Success;
+}
+
+// Set SDIO bus width
+// input:
+//   BW - bus width (one of SD_BUS_xBIT constants)
+// return: SDResult
+// note: card must be in TRAN state and not locked, otherwise it will respond with 'illegal command'
+SDResult SD_SetBusWidth(uint32_t BW) {
+	SDResult cmd_res = SDR_Success;
+	uint32_t clk;
+
+	// Wait for the card to finish programming of the last write
+	cmd_res = SD_WaitReady();
+	if (cmd_res != SDR_Success) return cmd_res;
+
+	if (SDCard.Type != SDCT_MMC) {
+		// Send leading command for ACMD<n> command
+		SD_Cmd(SD_CMD_APP_CMD, SDCard.RCA << 16, SD_RESP_SHORT); // CMD55
+		cmd_res = SD_GetR1Resp(SD_CMD_APP_CMD);
+		if (cmd_res != SDR_Success) {
+			return cmd_res;
+		}
+
+		// Send SET_BUS_WIDTH command
+		SD_Cmd(SD_CMD_SET_BUS_WIDTH, (BW == SD_BUS_1BIT) ? 0x00000000 : 0x00000002, SD_RESP_SHORT); // ACMD6
+		cmd_res = SD_GetR1Resp(SD_CMD_SET_BUS_WIDTH);
+		if (cmd_res != SDR_Success) {
+			return cmd_res;
+		}
+	} else {
+		// MMC supports only 8-bit ?
+	}
+
+	// Configure new bus width
+	clk  = SDIO_RD(CLKCR);
+	clk &= ~SD_CLKCR_WIDBUS;
+	clk |= (BW & SD_CLKCR_WIDBUS);
+	SDIO_WR(CLKCR,clk);
+
+	return cmd_res;
+}
+
+// Set SDIO bus clock
+// input:
+//   clk_div - bus clock divider (0x00..0xff -> bus_clock = SDIOCLK / (clk_div + 2))
+//             or SD_CLK_DIV_48M (bus_clock = SDIOCLK, only for a card in High-Speed mode)
+void SD_SetBusClock(uint32_t clk_div) {
+	uint32_t clk;
+
+	clk  = SDIO_RD(CLKCR);
+	clk &= ~(SD_CLKCR_CLKDIV | SD_CLKCR_BYPASS);
+	clk |= (clk_div & (SD_CLKCR_CLKDIV | SD_CLKCR_BYPASS));
+	SDIO_WR(CLKCR,clk);
+
+	SDCard.BusClock = (clk_div & SD_CLKCR_BYPASS) ? SD_SDIOCLK : SD_SDIOCLK / ((clk_div & SD_CLKCR_CLKDIV) + 2);
+}
+
+// Parse information about specific card
+// note: CSD/CID register values already must be in the SDCard structure
+void SD_GetCardInfo(void) {
+	uint32_t dev_size;
+	uint32_t dev_size_mul;
+
+	// Parse the CSD register
+	SDCard.CSDVer = SDCard.CSD[0] >> 6; // CSD version
+	if (SDCard.Type != SDCT_MMC) {
+		// SD
+		SDCard.MaxBusClkFreq = SDCard.CSD[3];
+		if (SDCard.CSDVer == 0) {
+			// CSD v1.00 (SDSCv1, SDSCv2)
+			dev_size  = (uint32_t)(SDCard.CSD[6] & 0x03) << 10; // Device size
+			dev_size |= (uint32_t)SDCard.CSD[7] << 2;
+			dev_size |= (SDCard.CSD[8] & 0xc0) >> 6;
+			dev_size_mul  = (SDCard.CSD[ 9] & 0x03) << 1; // Device size multiplier
+			dev_size_mul |= (SDCard.CSD[10] & 0x80) >> 7;
+			SDCard.BlockCount  = (dev_size + 1);
+			SDCard.BlockCount *= (1 << (dev_size_mul + 2));
+			SDCard.BlockSize   =  1 << (SDCard.CSD[5] & 0x0f); // Maximum read data block length
+		} else {
+			// CSD v2.00 (SDHC, SDXC)
+			dev_size  = (SDCard.CSD[7] & 0x3f) << 16;
+			dev_size |=  SDCard.CSD[8] << 8;
+			dev_size |=  SDCard.CSD[9];
+			SDCard.BlockSize = 512;
+			SDCard.BlockCount = dev_size + 1;
+		}
+		SDCard.Capacity = SDCard.BlockCount * SDCard.BlockSize;
+	} else {
+		// MMC
+		SDCard.MaxBusClkFreq = SDCard.CSD[3];
+		dev_size  = (uint32_t)(SDCard.CSD[6] & 0x03) << 8; // C_SIZE
+		dev_size += (uint32_t)SDCard.CSD[7];
+		dev_size <<= 2;
+		dev_size += SDCard.CSD[8] >> 6;
+		SDCard.BlockSize = 1 << (SDCard.CSD[5] & 0x0f); // MMC read block length
+		dev_size_mul = ((SDCard.CSD[9] & 0x03) << 1) + ((SDCard.CSD[10] & 0x80) >> 7);
+		SDCard.BlockCount = (dev_size + 1) * (1 << (dev_size_mul + 2));
+		SDCard.Capacity = SDCard.BlockCount * SDCard.BlockSize;
+	}
+
+	// Parse the CID register
+	if (SDCard.Type != SDCT_MMC) {
+		// SD card
+		SDCard.MID = SDCard.CID[0];
+		SDCard.OID = (SDCard.CID[1] << 8) | SDCard.CID[2];
+		SDCard.PNM[0] = SDCard.CID[3];
+		SDCard.PNM[1] = SDCard.CID[4];
+		SDCard.PNM[2] = SDCard.CID[5];
+		SDCard.PNM[3] = SDCard.CID[6];
+		SDCard.PNM[4] = SDCard.CID[7];
+		SDCard.PRV = SDCard.CID[8];
+		SDCard.PSN = ((uint32_t)SDCard.CID[9] << 24) | (SDCard.CID[10] << 16) | (SDCard.CID[11] << 8) | SDCard.CID[12];
+		SDCard.MDT = ((SDCard.CID[13] << 8) | SDCard.CID[14]) & 0x0fff;
+	} else {
+		// MMC
+		SDCard.MID = 0x00;
+		SDCard.OID = 0x0000;
+		SDCard.PNM[0] = '*';
+		SDCard.PNM[1] = 'M';
+		SDCard.PNM[2] = 'M';
+		SDCard.PNM[3] = 'C';
+		SDCard.PNM[4] = '*';
+		SDCard.PRV = 0;
+		SDCard.PSN = 0x00000000;
+		SDCard.MDT = 0x0000;
+	}
+}
+
+#if (SDIO_USE_HIGHSPEED)
+
+// Send the SWITCH_FUNC command and receive the 512-bit switch function status
+// input:
+//   arg - command argument (SD_SWITCH_xx values)
+//   pStatus - pointer to the buffer for the status (64 bytes, in order of transmission)
+// return: SDResult value
+// note: card must be in transfer mode
+static SDResult SD_SwitchFunc(uint32_t arg, uint32_t *pStatus) {
+	SDResult cmd_res;
+
+	// Clear the data flags
+	SDIO_WR(ICR,SD_ICR_DATA);
+
+	// Configure the SDIO data transfer
+	SDIO_WR(DTIMER,SD_DATA_R_TIMEOUT); // Data read timeout
+	SDIO_WR(DLEN,64); // Data length in bytes
+	// Data transfer:
+	//   - type: block
+	//   - direction: card -> controller
+	//   - size: 2^6 = 64bytes
+	//   - DPSM: enabled
+	SDIO_WR(DCTRL,SD_DCTRL_DTDIR | (6 << 4) | SD_DCTRL_DTEN);
+
+	// Send SWITCH_FUNC command
+	SD_Cmd(SD_CMD_SWITCH_FUNC, arg, SD_RESP_SHORT); // CMD6
+	cmd_res = SD_GetR1Resp(SD_CMD_SWITCH_FUNC);
+	if (cmd_res != SDR_Success) {
+		SDIO_WR(DCTRL,0);
+
+		return cmd_res;
+	}
+
+	// Receive the status
+	cmd_res = SD_ReadShort(pStatus,16);
+
+	// Clear the static SDIO flags
+	SDIO_WR(ICR,SD_ICR_STATIC);
+
+	return cmd_res;
+}
+
+// Read the first block of the card and compute a checksum of it
+// input:
+//   pBuf - pointer to the buffer for the block (512 bytes)
+//   pSum - pointer to the variable for the checksum
+// return: SDResult value
+static SDResult SD_ReadCheckBlock(uint32_t *pBuf, uint32_t *pSum) {
+	SDResult cmd_res;
+	uint32_t i;
+
+	cmd_res = SD_ReadBlock(0, pBuf, 512);
+	if (cmd_res == SDR_Success) {
+		*pSum = 0;
+		for (i = 0; i < 128; i++) *pSum = ((*pSum << 1) | (*pSum >> 31)) ^ pBuf[i];
+	}
+
+	return cmd_res;
+}
+
+// Switch the card to High-Speed mode and the bus clock to 48MHz
+// The card must report support of High-Speed in function group 1 (SD v1.10+ card with
+// the switch command class). After the switch, the first block is read again and compared
+// with the one read at default speed, on CRC error, timeout or mismatch the card and the
+// bus go back to default speed.
+// return: SDResult value, SDR_Success when the card is in High-Speed mode,
+//         SDR_Unsupported if the card doesn't support it, otherwise the cause of the fallback
+// note: card must be in transfer mode and the bus width already configured,
+//       the negotiated clock is in SDCard.BusClock and SDCard.HighSpeed
+SDResult SD_HighSpeed(void) {
+	SDResult cmd_res;
+	uint32_t status[16]; // Switch function status
+	uint8_t *pStatus = (uint8_t *)status;
+	uint32_t block[128]; // Block for the read-back check
+	uint32_t sum_ref;
+	uint32_t sum;
+
+	SDCard.HighSpeed = 0;
+
+	// MMC has another switch command, SD v1.01 doesn't have CMD6,
+	// bit 10 of the CCC field in the CSD register is the switch command class
+	if ((SDCard.Type == SDCT_MMC) || !(SDCard.SCR[0] & 0x0f) || !(SDCard.CSD[4] & 0x40)) {
+		return SDR_Unsupported;
+	}
+
+	// Reference read at default speed
+	cmd_res = SD_ReadCheckBlock(block, &sum_ref);
+	if (cmd_res != SDR_Success) return cmd_res;
+
+	// Check function: is High-Speed supported (bit 401) and can it be selected (bits 379:376)
+	cmd_res = SD_SwitchFunc(SD_SWITCH_CHECK | SD_SWITCH_HIGHSPEED, status);
+	if (cmd_res != SDR_Success) return cmd_res;
+	if (!(pStatus[13] & 0x02) || ((pStatus[16] & 0x0f) != SD_SWITCH_HIGHSPEED)) {
+		return SDR_Unsupported;
+	}
+
+	// Switch function
+	cmd_res = SD_SwitchFunc(SD_SWITCH_SET | SD_SWITCH_HIGHSPEED, status);
+	if (cmd_res != SDR_Success) return cmd_res;
+	if ((pStatus[16] & 0x0f) != SD_SWITCH_HIGHSPEED) return SDR_Unsupported;
+
+	// The card is in High-Speed mode after the end of the status block,
+	// from now on it is possible to raise the bus clock
+	SD_SetBusClock(SD_CLK_DIV_48M);
+
+	// Read-back check at the new clock
+	cmd_res = SD_ReadCheckBlock(block, &sum);
+	if ((cmd_res == SDR_Success) && (sum != sum_ref)) cmd_res = SDR_DataCRCFail;
+	if (cmd_res == SDR_Success) {
+		SDCard.HighSpeed = 1;
+
+		return SDR_Success;
+	}
+
+	// Fall back to default speed
+	SD_SetBusClock(SD_CLK_DIV_TRAN);
+	SD_SwitchFunc(SD_SWITCH_SET | SD_SWITCH_DEFAULT, status);
+
+	return cmd_res;
+}
+
+#endif // SDIO_USE_HIGHSPEED
+
+// Abort an ongoing data transfer
+// return: SDResult value
+SDResult SD_StopTransfer(void) {
+	// Send STOP_TRANSMISSION command
+	SD_Cmd(SD_CMD_STOP_TRANSMISSION, 0, SD_RESP_SHORT); // CMD12
+
+	return SD_GetR1Resp(SD_CMD_STOP_TRANSMISSION);
+}
+
+// Get current SD card state
+// input:
+//   pState - pointer to the variable for current card state, one of SD_STATE_xx values
+// return: SDResult value
+SDResult SD_GetCardState(uint8_t *pState) {
+	SDResult cmd_res;
+
+	// Send SEND_STATUS command
+	SD_Cmd(SD_CMD_SEND_STATUS, SDCard.RCA << 16, SD_RESP_SHORT); // CMD13
+	cmd_res = SD_GetR1Resp(SD_CMD_SEND_STATUS);
+	if (cmd_res != SDR_Success) {
+		*pState = SD_STATE_ERROR;
+		return cmd_res;
+	}
+
+	// Find out a card status
+	*pState = (SDIO_RD(RESP1) & 0x1e00) >> 9;
+
+	return SDR_Success;
+}
+
+// Wait while the card programs the data of the last write
+// The write functions return right after the data transfer, this is done
+// by the next function which needs the card
+// return: SDResult value
+SDResult SD_WaitReady(void) {
+	SDResult cmd_res = SDR_Success;
+	uint8_t card_state;
+
+	if (!SD_Program) return SDR_Success;
+
+	do {
+		cmd_res = SD_GetCardState(&card_state);
+		if (cmd_res != SDR_Success) break;
+	} while ((card_state == SD_STATE_PRG) || (card_state == SD_STATE_RCV));
+	SD_Program = 0;
+
+	return cmd_res;
+}
+
+// Check if the card still programs the data of the last write, without waiting
+// return: nonzero while the card is busy
+// note: sends one SEND_STATUS command if the card was busy at the last check
+uint8_t SD_CardBusy(void) {
+	uint8_t card_state;
+
+	if (SD_Program) {
+		if ((SD_GetCardState(&card_state) != SDR_Success) ||
+				((card_state != SD_STATE_PRG) && (card_state != SD_STATE_RCV))) {
+			SD_Program = 0;
+		}
+	}
+
+	return SD_Program;
+}
+
+// Erase a range of blocks (CMD32, CMD33, CMD38)
+// Later writes to the erased blocks spare the card its own erase before programming
+// input:
+//   addr - address of the first block to be erased
+//   length - length of the range (must be multiple of 512)
+// return: SDResult value
+// note: like the write functions this returns right after the command, the card
+//       erases in the background and the next function which needs the card waits
+//       for it (see SD_WaitReady), which may take a while for a long range
+SDResult SD_Erase(uint32_t addr, uint32_t length) {
+	SDResult cmd_res;
+	uint32_t end_addr;
+
+	if (length < 512) return SDR_Success;
+
+	// MMC has other erase commands, an SD card must support the erase command class
+	if ((SDCard.Type == SDCT_MMC) ||
+			!((((uint16_t)SDCard.CSD[4] << 4) | (SDCard.CSD[5] >> 4)) & SD_CCC_ERASE)) {
+		return SDR_Unsupported;
+	}
+
+	// Wait for the card to finish programming of the last write
+	cmd_res = SD_WaitReady();
+	if (cmd_res != SDR_Success) return cmd_res;
+
+	end_addr = addr + length - 512;
+
+	// SDSC card uses byte unit address and
+	// SDHC/SDXC cards use block unit address (1 unit = 512 bytes)
+	// For SDHC card addr must be converted to block unit address
+	if (SDCard.Type == SDCT_SDHC) {
+		addr >>= 9;
+		end_addr >>= 9;
+	}
+
+	// Send ERASE_WR_BLK_START and ERASE_WR_BLK_END commands
+	SD_Cmd(SD_CMD_ERASE_WR_BLK_START,addr,SD_RESP_SHORT); // CMD32
+	cmd_res = SD_GetR1Resp(SD_CMD_ERASE_WR_BLK_START);
+	if (cmd_res != SDR_Success) return cmd_res;
+	SD_Cmd(SD_CMD_ERASE_WR_BLK_END,end_addr,SD_RESP_SHORT); // CMD33
+	cmd_res = SD_GetR1Resp(SD_CMD_ERASE_WR_BLK_END);
+	if (cmd_res != SDR_Success) return cmd_res;
+
+	// Send ERASE command, the card stays busy until the blocks are erased
+	SD_Cmd(SD_CMD_ERASE,0,SD_RESP_SHORT); // CMD38
+	cmd_res = SD_GetR1Resp(SD_CMD_ERASE);
+	if (cmd_res == SDR_Success) SD_Program = 1;
+
+	return cmd_res;
+}
+
+// Send the read or write command of a block transfer
+// input:
+//   addr - address of the first block
+//   length - length of the transfer (must be multiple of 512)
+//   write - nonzero for a write
+// return: SDResult value
+static SDResult SD_XferCmd(uint32_t addr, uint32_t length, uint8_t write) {
+	uint8_t cmd;
+
+	// SDSC card uses byte unit address and
+	// SDHC/SDXC cards use block unit address (1 unit = 512 bytes)
+	// For SDHC card addr must be converted to block unit address
+	if (SDCard.Type == SDCT_SDHC) addr >>= 9;
+
+	if (length > 512) {
+		// READ_MULT_BLOCK (CMD18) or WRITE_MULTIPLE_BLOCK (CMD25)
+		cmd = write ? SD_CMD_WRITE_MULTIPLE_BLOCK : SD_CMD_READ_MULT_BLOCK;
+	} else {
+		// READ_SINGLE_BLOCK (CMD17) or WRITE_BLOCK (CMD24)
+		cmd = write ? SD_CMD_WRITE_BLOCK : SD_CMD_READ_SINGLE_BLOCK;
+	}
+	SD_Cmd(cmd, addr, SD_RESP_SHORT);
+
+	return SD_GetR1Resp(cmd);
+}
+
+// Read block of data from the SD card
+// input:
+//   addr - address of the block to be read
+//   pBuf - pointer to the buffer that will contain the received data
+//   length - buffer length (must be multiple of 512)
+// return: SDResult value
+SDResult SD_ReadBlock(uint32_t addr, uint32_t *pBuf, uint32_t length) {
+	SDResult cmd_res = SDR_Success;
+	uint32_t blk_count = length >> 9; // Sectors in block
+	register uint32_t STA; // to speed up SDIO flags checking
+	register uint32_t STA_mask; // mask for SDIO flags checking
+
+	// Wait for the card to finish programming of the last write
+	cmd_res = SD_WaitReady();
+	if (cmd_res != SDR_Success) return cmd_res;
+
+	// Initialize the data control register
+	SDIO_WR(DCTRL,0);
+
+	// Clear the static SDIO flags
+	SDIO_WR(ICR,SD_ICR_STATIC);
+
+	// Prepare bit checking variable for single or multiple block transfer
+	STA_mask = (blk_count > 1) ? SD_RX_MB_FLAGS : SD_RX_SB_FLAGS;
+
+	// Send READ_SINGLE_BLOCK or READ_MULT_BLOCK command
+	cmd_res = SD_XferCmd(addr, length, 0);
+	if (cmd_res != SDR_Success) {
+		return cmd_res;
+	}
+
+	// Data read timeout
+	SDIO_WR(DTIMER,SD_DATA_R_TIMEOUT);
+	// Data length
+	SDIO_WR(DLEN,length);
+	// Data transfer:
+	//   transfer mode: block
+	//   direction: from card
+	//   DMA: disabled
+	//   block size: 2^9 = 512 bytes
+	//   DPSM: enabled
+	SDIO_WR(DCTRL,SD_DCTRL_DTDIR | (9 << 4) | SD_DCTRL_DTEN);
+
+	// Receive a data block from the SDIO
+	// ----> TIME CRITICAL SECTION BEGIN <----
+	do {
+		STA = SDIO_RD(STA);
+		if (STA & SD_STA_RXFIFOHF) {
+			// Receive FIFO half full, there are at least 8 words in it
+			// This code is 80 bytes more than the 'for' loop, but faster
+			*pBuf++ = SDIO_RD(FIFO);
+			*pBuf++ = SDIO_RD(FIFO);
+			*pBuf++ = SDIO_RD(FIFO);
+			*pBuf++ = SDIO_RD(FIFO);
+			*pBuf++ = SDIO_RD(FIFO);
+			*pBuf++ = SDIO_RD(FIFO);
+			*pBuf++ = SDIO_RD(FIFO);
+			*pBuf++ = SDIO_RD(FIFO);
+		}
+	} while (!(STA & STA_mask));
+	// <---- TIME CRITICAL SECTION END ---->
+
+	// Send stop transmission command in case of multiple block transfer
+	if ((SDCard.Type != SDCT_MMC) && (blk_count > 1)) {
+		cmd_res = SD_StopTransfer();
+	}
+
+	// Check for errors
+	cmd_res = SD_GetXferError(STA, cmd_res);
+
+	// Read the data remnant from RX FIFO (if there is still any data)
+	while (SDIO_RD(STA) & SD_STA_RXDAVL) {
+		*pBuf++ = SDIO_RD(FIFO);
+	}
+
+	// Clear the static SDIO flags
+	SDIO_WR(ICR,SD_ICR_STATIC);
+
+	return cmd_res;
+}
+
+// Write block of data to the SD card
+// input:
+//   addr - address of the block to be written
+//   pBuf - pointer to the buffer that will contain the received data
+//   length - buffer length (must be multiple of 512)
+// return: SDResult value
+SDResult SD_WriteBlock(uint32_t addr, uint32_t *pBuf, uint32_t length) {
+	SDResult cmd_res = SDR_Success;
+	uint32_t blk_count = length >> 9; // Sectors in block
+	uint32_t STA; // To speed up SDIO flags checking
+	register uint32_t STA_mask; // Mask for SDIO flags checking
+	uint32_t data_sent = 0; // Counter of transferred bytes
+
+	// Wait for the card to finish programming of the last write
+	cmd_res = SD_WaitReady();
+	if (cmd_res != SDR_Success) return cmd_res;
+
+	// Initialize the data control register
+	SDIO_WR(DCTRL,0);
+
+	// Prepare bit checking variable for single or multiple block transfer
+	STA_mask = (blk_count > 1) ? SD_TX_MB_FLAGS : SD_TX_SB_FLAGS;
+
+	// Send WRITE_BLOCK or WRITE_MULTIPLE_BLOCK command
+	cmd_res = SD_XferCmd(addr, length, 1);
+	if (cmd_res != SDR_Success) {
+		return cmd_res;
+	}
+
+	// Clear the static SDIO flags
+	SDIO_WR(ICR,SD_ICR_STATIC);
+
+	// Data write timeout
+	SDIO_WR(DTIMER,SD_DATA_W_TIMEOUT);
+	// Data length
+	SDIO_WR(DLEN,length);
+	// Data transfer:
+	//   transfer mode: block
+	//   direction: to card
+	//   DMA: disabled
+	//   block size: 2^9 = 512 bytes
+	//   DPSM: enabled
+	SDIO_WR(DCTRL,(9 << 4) | SD_DCTRL_DTEN);
+
+	// Transfer data block to the SDIO
+	// ----> TIME CRITICAL SECTION BEGIN <----
+	if (!(length & 0x1F)) {
+		// The block length is multiple of 32, simplified transfer procedure can be used
+		do {
+			if ((SDIO_RD(STA) & SD_STA_TXFIFOHE) && (data_sent < length)) {
+				// The TX FIFO is half empty, at least 8 words can be written
+				SDIO_WR(FIFO,*pBuf++);
+				SDIO_WR(FIFO,*pBuf++);
+				SDIO_WR(FIFO,*pBuf++);
+				SDIO_WR(FIFO,*pBuf++);
+				SDIO_WR(FIFO,*pBuf++);
+				SDIO_WR(FIFO,*pBuf++);
+				SDIO_WR(FIFO,*pBuf++);
+				SDIO_WR(FIFO,*pBuf++);
+				data_sent += 32;
+			}
+		} while (!(SDIO_RD(STA) & STA_mask));
+	} else {
+		// Since the block length is not a multiple of 32, it is necessary to apply additional calculations
+		do {
+			if ((SDIO_RD(STA) & SD_STA_TXFIFOHE) && (data_sent < length)) {
+				// TX FIFO half empty, at least 8 words can be written
+				uint32_t data_left = length - data_sent;
+				if (data_left < 32) {
+					// Write last portion of data to the TX FIFO
+					data_left = ((data_left & 0x03) == 0) ? (data_left >> 2) : ((data_left >> 2) + 1);
+					data_sent += data_left << 2;
+					while (data_left--) {
+						SDIO_WR(FIFO,*pBuf++);
+					}
+				} else {
+					// Write 8 words to the TX FIFO
+					SDIO_WR(FIFO,*pBuf++);
+					SDIO_WR(FIFO,*pBuf++);
+					SDIO_WR(FIFO,*pBuf++);
+					SDIO_WR(FIFO,*pBuf++);
+					SDIO_WR(FIFO,*pBuf++);
+					SDIO_WR(FIFO,*pBuf++);
+					SDIO_WR(FIFO,*pBuf++);
+					SDIO_WR(FIFO,*pBuf++);
+					data_sent += 32;
+				}
+			}
+		} while (!(SDIO_RD(STA) & STA_mask));
+	}
+	// <---- TIME CRITICAL SECTION END ---->
+
+	// Save STA register value for further analysis
+	STA = SDIO_RD(STA);
+
+	// Send stop transmission command in case of multiple block transfer
+	if ((SDCard.Type != SDCT_MMC) && (blk_count > 1)) {
+		cmd_res = SD_StopTransfer();
+	}
+
+	// Check for errors
+	cmd_res = SD_GetXferError(STA, cmd_res);
+
+	// The card programs the data now, the next command which needs the card waits for it
+	SD_Program = 1;
+
+	// Clear the static SDIO flags
+	SDIO_WR(ICR,SD_ICR_STATIC);
+
+	return cmd_res;
+}
+
+#if (SDIO_USE_DMA)
+
+// Send the read command and start the DMA transfer of the data
+// input:
+//   addr - address of the first block to be read
+//   pBuf - pointer to the buffer for the DMA
+//   dma_length - buffer length, less than length if the DMA gets further buffers later
+//   length - length of the data to read (must be multiple of 512)
+// return: SDResult value
+static SDResult SD_StartRead(uint32_t addr, uint32_t *pBuf, uint32_t dma_length, uint32_t length) {
+	SDResult cmd_res;
+
+	// Wait for the card to finish programming of the last write
+	cmd_res = SD_WaitReady();
+	if (cmd_res != SDR_Success) return cmd_res;
+
+	// Initialize the data control register
+	SDIO_WR(DCTRL,0);
+
+	// Clear the static SDIO flags
+	SDIO_WR(ICR,SD_ICR_STATIC);
+
+	// Send READ_SINGLE_BLOCK or READ_MULT_BLOCK command
+	cmd_res = SD_XferCmd(addr, length, 0);
+	if (cmd_res != SDR_Success) return cmd_res;
+
+	// Configure the DMA channel to receive the data from the SDIO and enable it
+	SD_Configure_DMA(pBuf, dma_length, SDIO_DMA_DIR_RX);
+	SDIO_DMA_ENABLE();
+
+	// Data read timeout
+	SDIO_WR(DTIMER,SD_DATA_R_TIMEOUT);
+	// Data length
+	SDIO_WR(DLEN,length);
+	// Data transfer:
+	//   transfer mode: block
+	//   direction: from card
+	//   DMA: enabled
+	//   block size: 2^9 = 512 bytes
+	//   DPSM: enabled
+	SDIO_WR(DCTRL,SD_DCTRL_DMAEN | SD_DCTRL_DTDIR | (9 << 4) | SD_DCTRL_DTEN);
+
+	return SDR_Success;
+}
+
+// Send the write command and start the DMA transfer of the data
+// input:
+//   addr - address of the first block to be written
+//   pBuf - pointer to the buffer for the DMA
+//   dma_length - buffer length, less than length if the DMA gets further buffers later
+//   length - length of the data to write (must be multiple of 512)
+// return: SDResult value
+static SDResult SD_StartWrite(uint32_t addr, uint32_t *pBuf, uint32_t dma_length, uint32_t length) {
+	SDResult cmd_res;
+
+	// Wait for the card to finish programming of the last write
+	cmd_res = SD_WaitReady();
+	if (cmd_res != SDR_Success) return cmd_res;
+
+	// Initialize the data control register
+	SDIO_WR(DCTRL,0);
+
+	// Clear the static SDIO flags
+	SDIO_WR(ICR,SD_ICR_STATIC);
+
+	// Send WRITE_BLOCK or WRITE_MULTIPLE_BLOCK command
+	cmd_res = SD_XferCmd(addr, length, 1);
+	if (cmd_res != SDR_Success) return cmd_res;
+
+	// Configure the DMA channel to send the data to the SDIO and enable it
+	SD_Configure_DMA(pBuf, dma_length, SDIO_DMA_DIR_TX);
+	SDIO_DMA_ENABLE();
+
+	// Data write timeout
+	SDIO_WR(DTIMER,SD_DATA_W_TIMEOUT);
+	// Data length
+	SDIO_WR(DLEN,length);
+	// Data transfer:
+	//   transfer mode: block
+	//   direction: to card
+	//   DMA: enabled
+	//   block size: 2^9 = 512 bytes
+	//   DPSM: enabled
+	SDIO_DMA_TX_START(SD_DCTRL_DMAEN | (9 << 4) | SD_DCTRL_DTEN);
+
+	return SDR_Success;
+}
+
+// Start reading of data block from the SD card with DMA transfer
+// input:
+//   addr - address of the block to be read
+//   pBuf - pointer to the buffer that will contain the received data
+//   length - buffer length (must be multiple of 512)
+// return: SDResult value
+// note: SD_CheckRead() waits for the end of the transfer
+SDResult SD_ReadBlock_DMA(uint32_t addr, uint32_t *pBuf, uint32_t length) {
+	return SD_StartRead(addr, pBuf, length, length);
+}
+
+// Start writing block of data to the SD card with DMA transfer
+// input:
+//   addr - address of the block to be written
+//   pBuf - pointer to the buffer that will contain the received data
+//   length - buffer length (must be multiple of 512)
+// return: SDResult value
+// note: SD_CheckWrite() waits for the end of the transfer
+SDResult SD_WriteBlock_DMA(uint32_t addr, uint32_t *pBuf, uint32_t length) {
+	return SD_StartWrite(addr, pBuf, length, length);
+}
+
+// This function waits until the SDIO DMA data read transfer is finished
+// It must be called after SD_ReadBlock_DMA() function to ensure that all
+// data sent by the SD card is already transfered by the DMA and send STOP
+// command in case of multiple block transfer
+// input:
+//   length - buffer length (must be a multiple of 512)
+// return: SDResult value
+// note: length passed here to determine if it was multiple block transfer
+SDResult SD_CheckRead(uint32_t length) {
+	SDResult cmd_res = SDR_Success;
+	uint32_t blk_count = length >> 9;
+	volatile uint32_t wait = SD_DATA_R_TIMEOUT;
+	uint32_t STA_mask = (blk_count > 1) ? SD_RX_MB_FLAGS : SD_RX_SB_FLAGS;
+	uint32_t STA;
+
+	// Wait for SDIO receive complete or error occurred
+	while (!(SDIO_RD(STA) & STA_mask) && --wait);
+	STA = SDIO_RD(STA);
+
+	// The SDIO has received the data, the DMA still has to move the rest
+	// of it out of the FIFO, this is not the case after an error
+	if (!(STA & SD_XFER_ERROR_FLAGS)) {
+		while (!SDIO_DMA_TC() && --wait);
+	}
+	SDIO_DMA_DISABLE();
+
+	// Send stop transmission command in case of multiple block transfer
+	if ((SDCard.Type != SDCT_MMC) && (blk_count > 1)) {
+		cmd_res = SD_StopTransfer();
+	}
+
+	// Clear the static SDIO flags
+	SDIO_WR(ICR,SD_ICR_STATIC);
+
+	// Timeout?
+	if (wait == 0) return SDR_Timeout;
+
+	// Error happened?
+	return SD_GetXferError(STA, cmd_res);
+}
+
+// This function waits until the SDIO DMA data write transfer is finished
+// It must be called after SD_WriteBlock_DMA() function to ensure that all
+// data is already transfered by the DMA to SD card and send STOP command
+// in case of multiple block transfer
+// input:
+//   length - buffer length (must be a multiple of 512)
+// return: SDResult value
+// note: length passed here to determine if it was multiple block transfer
+SDResult SD_CheckWrite(uint32_t length) {
+	SDResult cmd_res = SDR_Success;
+	uint32_t blk_count = length >> 9;
+	volatile uint32_t wait = SD_DATA_W_TIMEOUT;
+	uint32_t STA_mask = (blk_count > 1) ? SD_TX_MB_FLAGS : SD_TX_SB_FLAGS;
+	uint32_t STA;
+
+	// Wait for SDIO transmit complete or error occurred
+	while (!(SDIO_RD(STA) & STA_mask) && --wait);
+
+	// Wait while the SDIO transfer active
+	while ((SDIO_RD(STA) & SD_STA_TXACT) && --wait);
+	STA = SDIO_RD(STA);
+
+	// Disable the DMA channel
+	SDIO_DMA_DISABLE();
+
+	// Send stop transmission command in case of multiple block transfer
+	if ((SDCard.Type != SDCT_MMC) && (blk_count > 1)) {
+		cmd_res = SD_StopTransfer();
+	}
+
+	// The card programs the data now, the next command which needs the card waits for it
+	SD_Program = 1;
+
+	// Clear the static SDIO flags
+	SDIO_WR(ICR,SD_ICR_STATIC);
+
+	// Timeout?
+	if (wait == 0) return SDR_Timeout;
+
+	// Error happened?
+	return SD_GetXferError(STA, cmd_res);
+}
+
+#if (SDIO_USE_IRQ)
+
+// Completion flags of an asynchronous transfer
+#define SD_XFER_F_SDIO                0x01 // SDIO data path finished (data end or error)
+#define SD_XFER_F_DMA                 0x02 // DMA transfer complete
+
+static volatile uint8_t SD_XferState = SD_XFER_IDLE; // State of the asynchronous transfer (SD_XFER_xx)
+static volatile uint8_t SD_XferFlags;                // Completion flags of the transfer (SD_XFER_F_xx)
+static volatile SDResult SD_XferResult;              // Result of the transfer
+static uint8_t SD_XferDir;                           // Direction of the transfer (SDIO_DMA_DIR_xx)
+static uint32_t SD_XferBlocks;                       // Number of blocks in the transfer
+static SD_XferCallback_TypeDef SD_XferCallback;      // Completion callback
+static const SD_Segment_TypeDef *SD_XferSeg;         // Segment the DMA is working on
+static uint32_t SD_XferSegs;                         // Segments left after the current one
+static SD_Segment_TypeDef SD_XferOne;                // Segment of a single buffer transfer
+
+// Finish an asynchronous transfer and call the completion callback
+static void SD_XferComplete(void) {
+	// Clear the static SDIO flags
+	SDIO_WR(ICR,SD_ICR_STATIC);
+
+	if (SD_XferDir == SDIO_DMA_DIR_TX) SD_Program = 1;
+	SD_XferState = SD_XFER_IDLE;
+
+	if (SD_XferCallback) SD_XferCallback(SD_XferResult);
+}
+
+// Advance an asynchronous transfer after its data phase
+// A read is done when the SDIO has received all data and the DMA has moved it
+// out of the FIFO, a write is done when the SDIO has sent all data (the DMA
+// finishes first). After that a multiple block transfer needs the STOP_TRANSMISSION
+// command, the response is handled by the SDIO IRQ handler.
+static void SD_XferNext(void) {
+	if (!(SD_XferFlags & SD_XFER_F_SDIO)) return;
+	if ((SD_XferDir == SDIO_DMA_DIR_RX) && !(SD_XferFlags & SD_XFER_F_DMA) && (SD_XferResult == SDR_Success)) return;
+
+	// Disable the DMA channel and its interrupts
+	SDIO_DMA_DISABLE();
+	SDIO_DMA_IRQ_OFF();
+
+	if ((SDCard.Type != SDCT_MMC) && (SD_XferBlocks > 1)) {
+		// Send STOP_TRANSMISSION command and let the IRQ handler get the response
+		SD_XferState = SD_XFER_STOP;
+		SD_Cmd(SD_CMD_STOP_TRANSMISSION, 0, SD_RESP_SHORT); // CMD12
+		SDIO_WR(MASK,SD_MASK_CMD);
+	} else {
+		SD_XferComplete();
+	}
+}
+
+// Start an asynchronous transfer
+// input:
+//   addr - address of the first block
+//   pSeg - pointer to the array of segments (see SD_ReadBlock_SG())
+//   count - number of segments
+//   direction - SDIO_DMA_DIR_RX to read from the card or SDIO_DMA_DIR_TX to write
+//   callback - function to call on completion (NULL if none)
+// return: SDResult value
+static SDResult SD_XferStart(uint32_t addr, const SD_Segment_TypeDef *pSeg, uint32_t count, uint8_t direction, SD_XferCallback_TypeDef callback) {
+	SDResult cmd_res;
+	uint32_t blocks = 0;
+	uint32_t i;
+
+	if (SD_XferState != SD_XFER_IDLE) return SDR_Busy;
+
+	// The DMA moves at most 65535 words per buffer
+	for (i = 0; i < count; i++) {
+		if (!pSeg[i].blocks || (pSeg[i].blocks > 511)) return SDR_BlockLenError;
+		blocks += pSeg[i].blocks;
+	}
+	if (!blocks) return SDR_BlockLenError;
+
+	// The card accepts a new transfer once it has programmed the last write
+	cmd_res = SD_WaitReady();
+	if (cmd_res != SDR_Success) return cmd_res;
+
+	SD_XferCallback = callback;
+	SD_XferDir      = direction;
+	SD_XferBlocks   = blocks;
+	SD_XferSeg      = pSeg;
+	SD_XferSegs     = count - 1;
+	SD_XferFlags    = 0;
+	SD_XferResult   = SDR_Success;
+	SD_XferState    = SD_XFER_DATA;
+
+	// The DMA starts with the first segment, the rest is chained by the DMA IRQ handler
+	if (direction == SDIO_DMA_DIR_RX) {
+		cmd_res = SD_StartRead(addr, pSeg->pBuf, pSeg->blocks << 9, blocks << 9);
+	} else {
+		cmd_res = SD_StartWrite(addr, pSeg->pBuf, pSeg->blocks << 9, blocks << 9);
+	}
+	if (cmd_res != SDR_Success) {
+		SDIO_DMA_DISABLE();
+		SD_XferState = SD_XFER_IDLE;
+
+		return cmd_res;
+	}
+
+	// The rest of the transfer is driven by the SDIO and DMA interrupts
+	SDIO_DMA_IRQ_ON();
+	SDIO_WR(MASK,SD_MASK_DATA);
+
+	return SDR_Success;
+}
+
+// Start an asynchronous transfer of a single buffer
+// input:
+//   addr - address of the first block
+//   pBuf - pointer to the data buffer (must be word aligned)
+//   length - buffer length (must be a multiple of 512)
+//   direction - SDIO_DMA_DIR_RX to read from the card or SDIO_DMA_DIR_TX to write
+//   callback - function to call on completion (NULL if none)
+// return: SDResult value
+static SDResult SD_XferStartBuf(uint32_t addr, uint32_t *pBuf, uint32_t length, uint8_t direction, SD_XferCallback_TypeDef callback) {
+	if (SD_XferState != SD_XFER_IDLE) return SDR_Busy;
+
+	SD_XferOne.pBuf   = pBuf;
+	SD_XferOne.blocks = length >> 9;
+
+	return SD_XferStart(addr, &SD_XferOne, 1, direction, callback);
+}
+
+// Start reading blocks from the SD card, the function returns once the transfer is started
+// input:
+//   addr - address of the first block to be read
+//   pBuf - pointer to the buffer that will contain the received data (must be word aligned)
+//   length - buffer length (must be a multiple of 512, at most 511 blocks)
+//   callback - function to call from the IRQ handler when the transfer is finished (NULL if none)
+// return: SDResult value, SDR_Busy if another asynchronous transfer is in progress
+// note: the buffer must not be touched and no other SD function called until the transfer is
+//       finished (see SD_XferBusy() and SD_XferWait())
+SDResult SD_ReadBlock_IRQ(uint32_t addr, uint32_t *pBuf, uint32_t length, SD_XferCallback_TypeDef callback) {
+	return SD_XferStartBuf(addr, pBuf, length, SDIO_DMA_DIR_RX, callback);
+}
+
+// Start writing blocks to the SD card, the function returns once the transfer is started
+// input:
+//   addr - address of the first block to be written
+//   pBuf - pointer to the buffer with the data to write (must be word aligned)
+//   length - buffer length (must be a multiple of 512, at most 511 blocks)
+//   callback - function to call from the IRQ handler when the transfer is finished (NULL if none)
+// return: SDResult value, SDR_Busy if another asynchronous transfer is in progress
+// note: the transfer is finished when the card has received the data, it may still program it,
+//       the next SD_xxxBlock_IRQ() call or SD_XferWait() waits for this
+SDResult SD_WriteBlock_IRQ(uint32_t addr, uint32_t *pBuf, uint32_t length, SD_XferCallback_TypeDef callback) {
+	return SD_XferStartBuf(addr, pBuf, length, SDIO_DMA_DIR_TX, callback);
+}
+
+// Start reading blocks from the SD card into a list of buffers (scatter-gather)
+// All blocks are read by one command, the DMA moves on to the next buffer in its
+// transfer complete interrupt
+// input:
+//   addr - address of the first block to be read
+//   pSeg - pointer to the array of segments: buffer (must be word aligned) and number of
+//          blocks for it (1..511)
+//   count - number of segments
+//   callback - function to call from the IRQ handler when the transfer is finished (NULL if none)
+// return: SDResult value, SDR_Busy if another asynchronous transfer is in progress
+// note: the segment array and the buffers must not be touched until the transfer is finished
+// note: the SDIO FIFO covers the switch to the next buffer only for a few microseconds,
+//       so the SDIO DMA IRQ must not be held off by other interrupts for longer than that
+SDResult SD_ReadBlock_SG(uint32_t addr, const SD_Segment_TypeDef *pSeg, uint32_t count, SD_XferCallback_TypeDef callback) {
+	return SD_XferStart(addr, pSeg, count, SDIO_DMA_DIR_RX, callback);
+}
+
+// Start writing blocks from a list of buffers to the SD card (scatter-gather)
+// All blocks are written by one command, see SD_ReadBlock_SG()
+// input:
+//   addr - address of the first block to be written
+//   pSeg - pointer to the array of segments: buffer (must be word aligned) and number of
+//          blocks in it (1..511)
+//   count - number of segments
+//   callback - function to call from the IRQ handler when the transfer is finished (NULL if none)
+// return: SDResult value, SDR_Busy if another asynchronous transfer is in progress
+SDResult SD_WriteBlock_SG(uint32_t addr, const SD_Segment_TypeDef *pSeg, uint32_t count, SD_XferCallback_TypeDef callback) {
+	return SD_XferStart(addr, pSeg, count, SDIO_DMA_DIR_TX, callback);
+}
+
+// Check if an asynchronous transfer is in progress
+// return: nonzero while the transfer is not finished
+uint8_t SD_XferBusy(void) {
+	return (SD_XferState != SD_XFER_IDLE);
+}
+
+// Wait for the end of an asynchronous transfer
+// After a write this also waits while the card programs the data, so any
+// other SD function can be called afterwards
+// return: SDResult value of the transfer
+SDResult SD_XferWait(void) {
+	SDResult cmd_res;
+
+	while (SD_XferState != SD_XFER_IDLE) SDIO_IDLE();
+	cmd_res = SD_XferResult;
+
+	if ((SD_WaitReady() != SDR_Success) && (cmd_res == SDR_Success)) cmd_res = SDR_WriteError;
+
+	return cmd_res;
+}
+
+// SDIO IRQ handler
+// note: must have the same priority as the SDIO DMA channel IRQ
+void SDIO_IRQHandler(void) {
+	uint32_t STA = SDIO_RD(STA);
+	SDResult cmd_res;
+
+	switch (SD_XferState) {
+		case SD_XFER_DATA:
+			if (!(STA & (SD_XFER_ERROR_FLAGS | SD_STA_DATAEND))) break;
+			SDIO_WR(MASK,0);
+
+			// Error happened?
+			SD_XferResult = SD_GetXferError(STA, SD_XferResult);
+
+			// Clear the data flags
+			SDIO_WR(ICR,SD_ICR_DATA | SD_STA_DATAEND | SD_STA_TXUNDERR);
+
+			SD_XferFlags |= SD_XFER_F_SDIO;
+			SD_XferNext();
+			break;
+		case SD_XFER_STOP:
+			if (!(STA & (SD_STA_CMDREND | SD_STA_CCRCFAIL | SD_STA_CTIMEOUT))) break;
+			SDIO_WR(MASK,0);
+
+			// Check the STOP_TRANSMISSION response
+			if (STA & SD_STA_CTIMEOUT) {
+				cmd_res = SDR_Timeout;
+			} else if (STA & SD_STA_CCRCFAIL) {
+				cmd_res = SDR_CRCError;
+			} else {
+				cmd_res = SD_GetR1Error(SDIO_RD(RESP1));
+			}
+			if (SD_XferResult == SDR_Success) SD_XferResult = cmd_res;
+
+			SD_XferComplete();
+			break;
+		default:
+			// No asynchronous transfer in progress
+			SDIO_WR(MASK,0);
+			break;
+	}
+}
+
+// SDIO DMA channel IRQ handler
+// note: must have the same priority as the SDIO IRQ
+void SDIO_DMA_IRQHandler(void) {
+	uint32_t error = SDIO_DMA_TE();
+
+	// Clear SDIO DMA channel interrupt flags
+	SDIO_DMA_CLEAR();
+
+	if (SD_XferState != SD_XFER_DATA) return;
+
+	// Chain the next segment of a scatter-gather transfer, the data path keeps running
+	// on the FIFO meanwhile
+	if (!error && SD_XferSegs && !(SD_XferFlags & SD_XFER_F_SDIO)) {
+		SD_XferSeg++;
+		SD_XferSegs--;
+		SDIO_DMA_DISABLE();
+		SDIO_DMA_BUFFER(SD_XferSeg->pBuf, SD_XferSeg->blocks << 9);
+		SDIO_DMA_ENABLE();
+
+		return;
+	}
+
+	if (error) {
+		// The data path doesn't end by itself without the DMA, stop it
+		SDIO_WR(MASK,0);
+		SDIO_WR(DCTRL,0);
+		SD_XferResult = SDR_DMAError;
+		SD_XferFlags |= SD_XFER_F_SDIO;
+	}
+
+	SD_XferFlags |= SD_XFER_F_DMA;
+	SD_XferNext();
+}
+
+#endif // SDIO_USE_IRQ
+
+// Streaming writer state
+#define SD_STREAM_IDLE                0x00 // No open-ended write on the card
+#define SD_STREAM_WRITE               0x01 // WRITE_MULTIPLE_BLOCK is open, the card waits for more blocks
+
+static uint8_t SD_StreamState = SD_STREAM_IDLE; // State of the streaming writer (SD_STREAM_xx)
+static uint8_t SD_StreamPending;                // Nonzero while a chunk of data may be in flight
+static uint32_t SD_StreamNext;                  // Address that continues the open write
+static uint32_t SD_StreamErase;                 // Pre-erase hint in blocks (0 - none)
+
+// Wait for the data of the last chunk to be sent to the card
+// return: SDResult value
+static SDResult SD_StreamWaitData(void) {
+	volatile uint32_t wait = SD_DATA_W_TIMEOUT;
+	uint32_t STA;
+
+	if (!SD_StreamPending) return SDR_Success;
+
+	// Wait for SDIO transmit complete or error occurred
+	while (!(SDIO_RD(STA) & SD_TX_MB_FLAGS) && --wait);
+
+	// Wait while the SDIO transfer active
+	while ((SDIO_RD(STA) & SD_STA_TXACT) && --wait);
+	STA = SDIO_RD(STA);
+
+	// Disable the DMA channel
+	SDIO_DMA_DISABLE();
+	SD_StreamPending = 0;
+
+	// Clear the static SDIO flags
+	SDIO_WR(ICR,SD_ICR_STATIC);
+
+	// Timeout?
+	if (wait == 0) return SDR_Timeout;
+
+	// Error happened?
+	return SD_GetXferError(STA, SDR_Success);
+}
+
+// Terminate the open-ended write
+// return: SDResult value
+static SDResult SD_StreamStop(void) {
+	SDResult cmd_res;
+
+	if (SD_StreamState != SD_STREAM_WRITE) return SDR_Success;
+	SD_StreamState = SD_STREAM_IDLE;
+
+	// An open-ended write always needs the STOP_TRANSMISSION command
+	cmd_res = SD_StopTransfer();
+
+	// The card programs the data now, the next command which needs the card waits for it
+	SD_Program = 1;
+
+	// Clear the static SDIO flags
+	SDIO_WR(ICR,SD_ICR_STATIC);
+
+	return cmd_res;
+}
+
+// Prepare the streaming writer
+// input:
+//   erase_blocks - number of blocks the card should pre-erase each time a new write
+//                  is opened (ACMD23, ignored for MMC), 0 for no pre-erase
+// return: SDResult value
+// note: an open stream is closed first
+SDResult SD_StreamOpen(uint32_t erase_blocks) {
+	SDResult cmd_res;
+
+	cmd_res = SD_StreamClose();
+	SD_StreamErase = erase_blocks & 0x007FFFFF; // ACMD23 argument is 23 bits wide
+
+	return cmd_res;
+}
+
+// Write a chunk of data in the stream, the function returns as soon as the DMA transfer is started
+// Consecutive chunks on contiguous addresses are sent within one WRITE_MULTIPLE_BLOCK
+// command, which is terminated only by SD_StreamClose() or by a chunk on another address
+// input:
+//   addr - address of the first block to be written
+//   pBuf - pointer to the buffer with the data to write (must be word aligned)
+//   length - buffer length (must be multiple of 512)
+// return: SDResult value
+// note: the buffer must not be touched until the next SD_StreamWrite()/SD_StreamClose()
+//       call or until SD_StreamBusy() returns zero, so two buffers can be used in turns:
+//       one is being filled while the other is written
+// note: no other SD function can be called while the stream is open
+SDResult SD_StreamWrite(uint32_t addr, uint32_t *pBuf, uint32_t length) {
+	SDResult cmd_res;
+	uint32_t card_addr = addr;
+
+	// Wait for the previous chunk, a failed write can't be continued
+	cmd_res = SD_StreamWaitData();
+	if (cmd_res != SDR_Success) {
+		SD_StreamStop();
+
+		return cmd_res;
+	}
+
+	// The address doesn't continue the open write
+	if ((SD_StreamState == SD_STREAM_WRITE) && (addr != SD_StreamNext)) {
+		cmd_res = SD_StreamStop();
+		if (cmd_res != SDR_Success) return cmd_res;
+	}
+
+	if (SD_StreamState != SD_STREAM_WRITE) {
+#if (SDIO_USE_IRQ)
+		if (SD_XferState != SD_XFER_IDLE) return SDR_Busy;
+#endif // SDIO_USE_IRQ
+
+		// A new write has to wait until the card has programmed the last one
+		cmd_res = SD_WaitReady();
+		if (cmd_res != SDR_Success) return cmd_res;
+	}
+
+	// Initialize the data control register
+	SDIO_WR(DCTRL,0);
+
+	// Clear the static SDIO flags
+	SDIO_WR(ICR,SD_ICR_STATIC);
+
+	if (SD_StreamState != SD_STREAM_WRITE) {
+		// Pre-erase hint, the card may ignore it and the write goes on anyway
+		if (SD_StreamErase && (SDCard.Type != SDCT_MMC)) {
+			SD_Cmd(SD_CMD_APP_CMD,SDCard.RCA << 16,SD_RESP_SHORT); // CMD55
+			if (SD_GetR1Resp(SD_CMD_APP_CMD) == SDR_Success) {
+				SD_Cmd(SD_CMD_SET_WR_BLK_ERASE_COUNT,SD_StreamErase,SD_RESP_SHORT); // ACMD23
+				SD_GetR1Resp(SD_CMD_SET_WR_BLK_ERASE_COUNT);
+			}
+		}
+
+		// SDSC card uses byte unit address and
+		// SDHC/SDXC cards use block unit address (1 unit = 512 bytes)
+		// For SDHC card addr must be converted to block unit address
+		if (SDCard.Type == SDCT_SDHC) card_addr >>= 9;
+
+		// Send WRITE_MULTIPLE_BLOCK command, it stays open until STOP_TRANSMISSION
+		SD_Cmd(SD_CMD_WRITE_MULTIPLE_BLOCK,card_addr,SD_RESP_SHORT); // CMD25
+		cmd_res = SD_GetR1Resp(SD_CMD_WRITE_MULTIPLE_BLOCK);
+		if (cmd_res != SDR_Success) return cmd_res;
+		SD_StreamState = SD_STREAM_WRITE;
+	}
+
+	// Configure the SDIO DMA channel for the chunk and enable it
+	SD_Configure_DMA(pBuf,length,SDIO_DMA_DIR_TX);
+	SDIO_DMA_ENABLE();
+
+	// Data write timeout
+	SDIO_WR(DTIMER,SD_DATA_W_TIMEOUT);
+	// Data length
+	SDIO_WR(DLEN,length);
+	// Data transfer:
+	//   transfer mode: block
+	//   direction: to card
+	//   DMA: enabled
+	//   block size: 2^9 = 512 bytes
+	//   DPSM: enabled
+	SDIO_DMA_TX_START(SD_DCTRL_DMAEN | (9 << 4) | SD_DCTRL_DTEN);
+
+	SD_StreamPending = 1;
+	SD_StreamNext = addr + length;
+
+	return SDR_Success;
+}
+
+// Check if the last chunk of the stream is still being sent
+// return: nonzero while the buffer of the last SD_StreamWrite() call is in use
+uint8_t SD_StreamBusy(void) {
+	uint32_t STA = SDIO_RD(STA);
+
+	return (SD_StreamPending && (!(STA & SD_TX_MB_FLAGS) || (STA & SD_STA_TXACT)));
+}
+
+// Close the stream: wait for the last chunk and terminate the open write
+// return: SDResult value
+// note: the card programs the data afterwards, see SD_WaitReady()
+SDResult SD_StreamClose(void) {
+	SDResult cmd_res;
+	SDResult stop_res;
+
+	cmd_res  = SD_StreamWaitData();
+	stop_res = SD_StreamStop();
+
+	return (cmd_res != SDR_Success) ? cmd_res : stop_res;
+}
+
+#endif // SDIO_USE_DMA
@@ -1,92 +1,75 @@
 // Define to prevent recursive inclusion
-#ifndef __SDCARD_SDIO_H
-#define __SDCARD_SDIO_H
-
-
-#include <stm32l4xx.h>
-#include "gpio.h"
-
-
-// Enable usage of SDIO 4-bit bus
-//   0 - use 1-bit bus
-//   1 - use 4-bit bus
-#define SDIO_USE_4BIT                 1
-
-// Enable usage of DMA transfers
-//   0 - no DMA-related code
-//   1 - use DMA-related code
-#define SDIO_USE_DMA                  1
-
-
-#if (SDIO_USE_DMA)
-#include "dma.h"
-
-// Handle for SDIO DMA channel
-DMA_HandleTypeDef                     SDIO_DMA_CH;
-
-// SDIO DMA channel parameters
-#define SDIO_DMA_CHANNEL              DMA2_Channel4 // 4 or 5
-#define SDIO_DMA_REQUEST              DMA_REQUEST_7
-
-// SDIO DMA channel direction
-#define SDIO_DMA_DIR_TX               DMA_DIR_M2P // SDIO write
-#define SDIO_DMA_DIR_RX               DMA_DIR_P2M // SDIO read
-#endif // SDIO_USE_DMA
-
-// SDIO HAL
-#define SDIO_GPIO_PERIPH              (RCC_AHB2ENR_GPIOCEN | RCC_AHB2ENR_GPIODEN)
-#define SDIO_GPIO_AF                  GPIO_AF12
-
-// SDIO CMD pin (PD2)
-#define SDIO_GPIO_CMD_PORT            GPIOD
-#define SDIO_GPIO_CMD_PIN             GPIO_PIN_2
-#define SDIO_GPIO_CMD_SRC             GPIO_PinSource2
-
-// SDIO CK pin (PC12)
-#define SDIO_GPIO_CK_PORT             GPIOC
-#define SDIO_GPIO_CK_PIN              GPIO_PIN_12
-#define SDIO_GPIO_CK_SRC              GPIO_PinSource12
-
-// SDIO D0 pin (PC8)
-#define SDIO_GPIO_D0_PORT             GPIOC
-#define SDIO_GPIO_D0_PIN              GPIO_PIN_8
-#define SDIO_GPIO_D0_SRC              GPIO_PinSource8
-
-#if (SDIO_USE_4BIT)
-// SDIO D1 pin (PC9)
-#define SDIO_GPIO_D1_PORT             GPIOC
-#define SDIO_GPIO_D1_PIN              GPIO_PIN_9
-#define SDIO_GPIO_D1_SRC              GPIO_PinSource9
-
-// SDIO D2 pin (PC10)
-#define SDIO_GPIO_D2_PORT             GPIOC
-#define SDIO_GPIO_D2_PIN              GPIO_PIN_10
-#define SDIO_GPIO_D2_SRC              GPIO_PinSource10
-
-// SDIO D3 pin (PC11)
-#define SDIO_GPIO_D3_PORT             GPIOC
-#define SDIO_GPIO_D3_PIN              GPIO_PIN_11
-#define SDIO_GPIO_D3_SRC              GPIO_PinSource11
-
-#endif // SDIO_USE_4BIT
-
-
-#ifdef STM32L1XX_HD
-// Alias word address of bits of the SDIO DCTRL register
-#define SDIO_DCTRL_OFFSET             ((uint32_t)(&(SDMMC1->DCTRL)) - PERIPH_BASE)
-#define SDIO_DCTRL_DTEN_BN            0 // DTEN
-#define SDIO_DCTRL_DTEN_BB            *(__IO uint32_t *)(PERIPH_BB_BASE + (SDMMC_DCTRL_OFFSET << 5) + (SDMMC_DCTRL_DTEN_BN << 2))
+#ifndef __SDCARD_H
+#define __SDCARD_H
+
+
+// SD card driver for the SDIO peripheral (STM32L1) and the SDMMC peripheral (STM32L4)
+// The SD protocol is the same code for all targets, this file and sdcard.c are identical in
+// every project. All that depends on the MCU and the board is in the target layer:
+// sdcard-hw.h/sdcard-hw.c of the project, or the register level simulator of sdcard-host
+// when built with HOSTVER defined.
+//
+// The target layer provides:
+//   SDIO_USE_4BIT, SDIO_USE_DMA, SDIO_USE_IRQ, SDIO_USE_HIGHSPEED - driver options
+//   SD_SDIOCLK - SDIO kernel clock (Hz), SD_CLK_DIV_INIT, SD_CLK_DIV_TRAN - bus clock dividers
+//   SDIO_RD(reg), SDIO_WR(reg,value) - access to a register of the peripheral (POWER, CLKCR, ...)
+//   SDIO_IRQHandler - name of the SDIO interrupt vector
+//   SDIO_IDLE() - called by the loops waiting for an interrupt
+//   SD_GPIO_Init(), SD_GPIO_DeInit(), SD_SDIO_Init(), SD_SDIO_DeInit() - pins and peripheral
+// and with SDIO_USE_DMA:
+//   SDIO_DMA_DIR_RX, SDIO_DMA_DIR_TX - directions of the DMA channel
+//   SD_Configure_DMA(pBuf,length,direction) - set up the channel and clear its flags, the channel stays disabled
+//   SDIO_DMA_ENABLE(), SDIO_DMA_DISABLE() - enable or disable the channel
+//   SDIO_DMA_BUFFER(pBuf,length) - set another buffer to the disabled channel
+//   SDIO_DMA_IRQ_ON(), SDIO_DMA_IRQ_OFF() - transfer complete and transfer error interrupts of the channel
+//   SDIO_DMA_TC(), SDIO_DMA_TE() - transfer complete and transfer error flags, SDIO_DMA_CLEAR() clears them
+//   SDIO_DMA_TX_START(dctrl) - enable the DPSM for a DMA transfer to the card with the given DCTRL value
+//   SDIO_DMA_IRQHandler - name of the DMA channel interrupt vector
+#ifdef HOSTVER
+#include "sdsim.h"
+#else
+#include "sdcard-hw.h"
+#endif
 
-// Alias word address of bits of the SDIO CLKCR register
-#define SDIO_CLKCR_OFFSET             ((uint32_t)(&(SDMMC1->CLKCR)) - PERIPH_BASE)
-#define SDIO_CLKCR_CLKEN_BN           8 // CLKEN
-#define SDIO_CLKCR_CLKEN_BB           *(__IO uint32_t *)(PERIPH_BB_BASE + (SDMMC_CLKCR_OFFSET << 5) + (SDMMC_CLKCR_CLKEN_BN << 2))
-#endif // STM32L1XX_HD
 
+// Bits of the SDIO registers (same layout in the STM32L1 SDIO and the STM32L4 SDMMC)
 
-// SDIO power supply control bits
+// POWER register
 #define SD_PWR_OFF                    ((uint32_t)0x00000000U) // Power off: the clock to card is stopped
-#define SD_PWR_ON                     (SDMMC_POWER_PWRCTRL)   // Power on: the card is clocked
+#define SD_PWR_ON                     ((uint32_t)0x00000003U) // Power on: the card is clocked
+
+// CLKCR register
+#define SD_CLKCR_CLKDIV               ((uint32_t)0x000000FFU) // Clock divide factor
+#define SD_CLKCR_CLKEN                ((uint32_t)0x00000100U) // Clock enable
+#define SD_CLKCR_PWRSAV               ((uint32_t)0x00000200U) // Power saving: clock only while the bus is active
+#define SD_CLKCR_BYPASS               ((uint32_t)0x00000400U) // Clock divider bypass
+#define SD_CLKCR_WIDBUS               ((uint32_t)0x00001800U) // Wide bus mode
+#define SD_CLKCR_HWFC_EN              ((uint32_t)0x00004000U) // Hardware flow control
+
+// CMD register
+#define SD_CMD_CPSMEN                 ((uint32_t)0x00000400U) // Command path state machine enable
+
+// DCTRL register
+#define SD_DCTRL_DTEN                 ((uint32_t)0x00000001U) // Data transfer enable (DPSM)
+#define SD_DCTRL_DTDIR                ((uint32_t)0x00000002U) // Direction: from card to controller
+#define SD_DCTRL_DMAEN                ((uint32_t)0x00000008U) // DMA enable
+
+// STA register, the ICR and MASK registers have the same layout for the static flags
+#define SD_STA_CCRCFAIL               ((uint32_t)0x00000001U) // Command response received (CRC check failed)
+#define SD_STA_DCRCFAIL               ((uint32_t)0x00000002U) // Data block sent/received (CRC check failed)
+#define SD_STA_CTIMEOUT               ((uint32_t)0x00000004U) // Command response timeout
+#define SD_STA_DTIMEOUT               ((uint32_t)0x00000008U) // Data timeout
+#define SD_STA_TXUNDERR               ((uint32_t)0x00000010U) // Transmit FIFO underrun
+#define SD_STA_RXOVERR                ((uint32_t)0x00000020U) // Receive FIFO overrun
+#define SD_STA_CMDREND                ((uint32_t)0x00000040U) // Command response received (CRC check passed)
+#define SD_STA_CMDSENT                ((uint32_t)0x00000080U) // Command sent (no response required)
+#define SD_STA_DATAEND                ((uint32_t)0x00000100U) // Data end (data counter is zero)
+#define SD_STA_STBITERR               ((uint32_t)0x00000200U) // Start bit not detected on all data signals (STM32L1 only)
+#define SD_STA_DBCKEND                ((uint32_t)0x00000400U) // Data block sent/received (CRC check passed)
+#define SD_STA_TXACT                  ((uint32_t)0x00001000U) // Data transmit in progress
+#define SD_STA_TXFIFOHE               ((uint32_t)0x00004000U) // Transmit FIFO half empty
+#define SD_STA_RXFIFOHF               ((uint32_t)0x00008000U) // Receive FIFO half full
+#define SD_STA_RXDAVL                 ((uint32_t)0x00200000U) // Data available in receive FIFO
 
 // SDIO clock divider
 #define SD_CLK_DIV_400K               ((uint32_t)0x00000076U) // SDIO clock 400kHz  (48MHz / (0x76 + 2) = 400kHz)
@@ -99,28 +82,19 @@ DMA_HandleTypeDef                     SDIO_DMA_CH;
 #define SD_CLK_DIV_12M                ((uint32_t)0x00000002U) // SDIO clock 12MHz   (48MHz / (0x02 + 2) = 12MHz)
 #define SD_CLK_DIV_16M                ((uint32_t)0x00000001U) // SDIO clock 16MHz   (48MHz / (0x01 + 2) = 16MHz)
 #define SD_CLK_DIV_24M                ((uint32_t)0x00000000U) // SDIO clock 24MHz   (48MHz / (0x00 + 2) = 24MHz)
-
-// SDIO clocks for initialization and data transfer
-#define SD_CLK_DIV_INIT               (SD_CLK_DIV_400K) // SDIO initialization frequency (400kHz)
-//#define SD_CLK_DIV_TRAN               (SD_CLK_DIV_400K) // SDIO data transfer 400kHz
-//#define SD_CLK_DIV_TRAN               (SD_CLK_DIV_1M)   // SDIO data transfer 1MHz
-//#define SD_CLK_DIV_TRAN               (SD_CLK_DIV_8M)   // SDIO data transfer 8MHz
-//#define SD_CLK_DIV_TRAN               (SD_CLK_DIV_9M6)  // SDIO data transfer 9.6MHz
-//#define SD_CLK_DIV_TRAN               (SD_CLK_DIV_12M)  // SDIO data transfer 12MHz
-//#define SD_CLK_DIV_TRAN               (SD_CLK_DIV_16M)  // SDIO data transfer 16MHz
-#define SD_CLK_DIV_TRAN               (SD_CLK_DIV_24M) // SDIO data transfer frequency
+#define SD_CLK_DIV_48M                (SD_CLKCR_BYPASS)       // SDIO clock 48MHz   (divider bypassed, High-Speed mode only)
 
 // SDIO CMD response type
 #define SD_RESP_NONE                  ((uint32_t)0x00000000U) // No response
-#define SD_RESP_SHORT                 (SDMMC_CMD_WAITRESP_0)  // Short response
-#define SD_RESP_LONG                  (SDMMC_CMD_WAITRESP)    // Long response
+#define SD_RESP_SHORT                 ((uint32_t)0x00000040U) // Short response
+#define SD_RESP_LONG                  ((uint32_t)0x000000C0U) // Long response
 
 // SD commands  index
 #define SD_CMD_GO_IDLE_STATE          ((uint8_t)0)
 #define SD_CMD_SEND_OP_COND           ((uint8_t)1)  // MMC only
 #define SD_CMD_ALL_SEND_CID           ((uint8_t)2)  // Not supported in SPI mode
 #define SD_CMD_SEND_REL_ADDR          ((uint8_t)3)  // Not supported in SPI mode
-#define SD_CMD_SET_BUS_WIDTH          ((uint8_t)6)
+#define SD_CMD_SWITCH_FUNC            ((uint8_t)6)  // SD v1.10+ only
 #define SD_CMD_SEL_DESEL_CARD         ((uint8_t)7)  // Not supported in SPI mode
 #define SD_CMD_HS_SEND_EXT_CSD        ((uint8_t)8)
 #define SD_CMD_SEND_CSD               ((uint8_t)9)
@@ -139,6 +113,8 @@ DMA_HandleTypeDef                     SDIO_DMA_CH;
 #define SD_CMD_SET_WRITE_PROT         ((uint8_t)28) // Not supported in SPI mode
 #define SD_CMD_CLR_WRITE_PROT         ((uint8_t)29) // Not supported in SPI mode
 #define SD_CMD_SEND_WRITE_PROT        ((uint8_t)30) // Not supported in SPI mode
+#define SD_CMD_ERASE_WR_BLK_START     ((uint8_t)32)
+#define SD_CMD_ERASE_WR_BLK_END       ((uint8_t)33)
 #define SD_CMD_ERASE                  ((uint8_t)38)
 #define SD_CMD_LOCK_UNLOCK            ((uint8_t)42)
 #define SD_CMD_APP_CMD                ((uint8_t)55)
@@ -148,6 +124,7 @@ DMA_HandleTypeDef                     SDIO_DMA_CH;
 // Following commands are SD Card Specific commands.
 // SD_CMD_APP_CMD should be sent before sending these commands.
 #define SD_CMD_SET_BUS_WIDTH          ((uint8_t)6)  // ACMD6
+#define SD_CMD_SET_WR_BLK_ERASE_COUNT ((uint8_t)23) // ACMD23
 #define SD_CMD_SD_SEND_OP_COND        ((uint8_t)41) // ACMD41
 #define SD_CMD_SET_CLR_CARD_DETECT    ((uint8_t)42) // ACMD42
 #define SD_CMD_SEND_SCR               ((uint8_t)51) // ACMD51
@@ -205,60 +182,71 @@ DMA_HandleTypeDef                     SDIO_DMA_CH;
 #define SD_CMD_TIMEOUT                ((uint32_t)0x00010000U)
 
 // SDIO timeout for data transfer ((48MHz / CLKDIV / 1000) * timeout_ms)
-#define SD_DATA_R_TIMEOUT             ((uint32_t)((48000000U / (SD_CLK_DIV_TRAN + 2U) / 1000U) * 100U)) // Data read timeout is 100ms
-#define SD_DATA_W_TIMEOUT             ((uint32_t)((48000000U / (SD_CLK_DIV_TRAN + 2U) / 1000U) * 250U)) // Date write timeout is 250ms
+// In High-Speed mode the bus runs at full SDIOCLK, the timeouts must be long enough for that
+#if (SDIO_USE_HIGHSPEED)
+#define SD_DATA_R_TIMEOUT             ((uint32_t)((SD_SDIOCLK / 1000U) * 100U)) // Data read timeout is 100ms
+#define SD_DATA_W_TIMEOUT             ((uint32_t)((SD_SDIOCLK / 1000U) * 250U)) // Date write timeout is 250ms
+#else
+#define SD_DATA_R_TIMEOUT             ((uint32_t)((SD_SDIOCLK / (SD_CLK_DIV_TRAN + 2U) / 1000U) * 100U)) // Data read timeout is 100ms
+#define SD_DATA_W_TIMEOUT             ((uint32_t)((SD_SDIOCLK / (SD_CLK_DIV_TRAN + 2U) / 1000U) * 250U)) // Date write timeout is 250ms
+#endif
+
+// Bits of the SWITCH_FUNC (CMD6) argument
+#define SD_SWITCH_CHECK               ((uint32_t)0x00FFFFF0U) // Check function, function group 1 is in the low nibble
+#define SD_SWITCH_SET                 ((uint32_t)0x80FFFFF0U) // Switch function, function group 1 is in the low nibble
+#define SD_SWITCH_DEFAULT             ((uint32_t)0x00000000U) // Function group 1: default speed
+#define SD_SWITCH_HIGHSPEED           ((uint32_t)0x00000001U) // Function group 1: High-Speed
+
+// Erase command class in the CCC field of the CSD (class 5)
+#define SD_CCC_ERASE                  ((uint16_t)0x0020U)
 
 // Trials count for ACMD41
 #define SD_ACMD41_TRIALS              ((uint32_t)0x0000FFFF)
 
 // Bitmap to clear the SDIO command flags
-#define SDIO_ICR_CMD                  ((uint32_t)(SDMMC_ICR_CCRCFAILC | SDMMC_ICR_CTIMEOUTC | SDMMC_ICR_CMDRENDC | SDMMC_ICR_CMDSENTC))
+#define SD_ICR_CMD                    (SD_STA_CCRCFAIL | SD_STA_CTIMEOUT | SD_STA_CMDREND | SD_STA_CMDSENT)
 
 // Bitmap to clear the SDIO data flags
-#define SDIO_ICR_DATA                 ((uint32_t)(SDMMC_ICR_RXOVERRC | SDMMC_ICR_DCRCFAILC | SDMMC_ICR_DTIMEOUTC | SDMMC_ICR_DBCKENDC | SDMMC_ICR_STBITERRC))
+#define SD_ICR_DATA                   (SD_STA_RXOVERR | SD_STA_DCRCFAIL | SD_STA_DTIMEOUT | SD_STA_DBCKEND | SD_STA_STBITERR)
 
 // Bitmap to clear the SDIO static flags (command and data)
-#define SDIO_ICR_STATIC               ((uint32_t)(SDMMC_ICR_CCRCFAILC | SDMMC_ICR_DCRCFAILC | SDMMC_ICR_CTIMEOUTC | \
-												SDMMC_ICR_DTIMEOUTC | SDMMC_ICR_TXUNDERRC | SDMMC_ICR_RXOVERRC  | \
-												SDMMC_ICR_CMDRENDC  | SDMMC_ICR_CMDSENTC  | SDMMC_ICR_DATAENDC  | \
-												SDMMC_ICR_DBCKENDC))
+#define SD_ICR_STATIC                 (SD_STA_CCRCFAIL | SD_STA_DCRCFAIL | SD_STA_CTIMEOUT | \
+                                       SD_STA_DTIMEOUT | SD_STA_TXUNDERR | SD_STA_RXOVERR  | \
+                                       SD_STA_CMDREND  | SD_STA_CMDSENT  | SD_STA_DATAEND  | \
+                                       SD_STA_DBCKEND)
 
 // SDIO bus width
 #define SD_BUS_1BIT                   ((uint32_t)0x00000000U) // 1-bit wide bus (SDIO_D0 used)
-#define SD_BUS_4BIT                   (SDMMC_CLKCR_WIDBUS_0)  // 4-bit wide bus (SDIO_D[3:0] used)
-#define SD_BUS_8BIT                   (SDMMC_CLKCR_WIDBUS_1)  // 8-bit wide bus (SDIO_D[7:0] used)
+#define SD_BUS_4BIT                   ((uint32_t)0x00000800U) // 4-bit wide bus (SDIO_D[3:0] used)
+#define SD_BUS_8BIT                   ((uint32_t)0x00001000U) // 8-bit wide bus (SDIO_D[7:0] used)
 
 // SDIO transfer flags
-#define SDIO_XFER_COMMON_FLAGS        (SDMMC_STA_DTIMEOUT | SDMMC_STA_DCRCFAIL | SDMMC_STA_STBITERR)
+#define SD_XFER_COMMON_FLAGS          (SD_STA_DTIMEOUT | SD_STA_DCRCFAIL | SD_STA_STBITERR)
 
 // SDIO flags for single block receive
-#define SDIO_RX_SB_FLAGS              (SDIO_XFER_COMMON_FLAGS | SDMMC_STA_DBCKEND | SDMMC_STA_RXOVERR)
+#define SD_RX_SB_FLAGS                (SD_XFER_COMMON_FLAGS | SD_STA_DBCKEND | SD_STA_RXOVERR)
 
 // SDIO flags for multiple block receive
-#define SDIO_RX_MB_FLAGS              (SDIO_XFER_COMMON_FLAGS | SDMMC_STA_DATAEND | SDMMC_STA_RXOVERR)
+#define SD_RX_MB_FLAGS                (SD_XFER_COMMON_FLAGS | SD_STA_DATAEND | SD_STA_RXOVERR)
 
 // SDIO flags for single block transmit
-#define SDIO_TX_SB_FLAGS              (SDIO_XFER_COMMON_FLAGS | SDMMC_STA_DBCKEND | SDMMC_STA_TXUNDERR)
+#define SD_TX_SB_FLAGS                (SD_XFER_COMMON_FLAGS | SD_STA_DBCKEND | SD_STA_TXUNDERR)
 
 // SDIO flags for multiple block transmit
-#define SDIO_TX_MB_FLAGS              (SDIO_XFER_COMMON_FLAGS | SDMMC_STA_DATAEND | SDMMC_STA_TXUNDERR)
+#define SD_TX_MB_FLAGS                (SD_XFER_COMMON_FLAGS | SD_STA_DATAEND | SD_STA_TXUNDERR)
 
 // SDIO transfer error flags
-#define SDIO_XFER_ERROR_FLAGS         (SDIO_XFER_COMMON_FLAGS | SDMMC_STA_TXUNDERR | SDMMC_STA_RXOVERR)
+#define SD_XFER_ERROR_FLAGS           (SD_XFER_COMMON_FLAGS | SD_STA_TXUNDERR | SD_STA_RXOVERR)
 
-// RCA for the MMC card
-#define SDIO_MMC_RCA                  ((uint16_t)0x0001)
+// SDIO interrupts for the data phase of an asynchronous transfer
+#define SD_MASK_DATA                  (SD_STA_DATAEND | SD_STA_DCRCFAIL | SD_STA_DTIMEOUT | SD_STA_TXUNDERR | SD_STA_RXOVERR)
 
+// SDIO interrupts for the response of a command
+#define SD_MASK_CMD                   (SD_STA_CMDREND | SD_STA_CCRCFAIL | SD_STA_CTIMEOUT)
+
+// RCA for the MMC card
+#define SD_MMC_RCA                    ((uint16_t)0x0001)
 
-// SD card response type
-enum {
-	SD_R1  = 0x01, // R1
-	SD_R1b = 0x02, // R1b
-	SD_R2  = 0x03, // R2
-	SD_R3  = 0x04, // R3
-	SD_R6  = 0x05, // R6 (SDIO only)
-	SD_R7  = 0x06  // R7
-};
 
 // Card type
 enum {
@@ -269,6 +257,13 @@ enum {
 	SDCT_SDHC    = 0x04   // High capacity SD card (SDHC or SDXC)
 };
 
+// State of an asynchronous transfer
+enum {
+	SD_XFER_IDLE = 0x00,  // No transfer in progress
+	SD_XFER_DATA = 0x01,  // Data transfer in progress
+	SD_XFER_STOP = 0x02   // Waiting for the STOP_TRANSMISSION response
+};
+
 // SD functions result
 typedef enum {
 	SDR_Success             = 0x00,
@@ -308,6 +303,8 @@ typedef enum {
 	SDR_ECCDisabled         = 0x22,  // The command has been executed without using the internal ECC
 	SDR_EraseReset          = 0x23,  // An erase sequence was cleared before executing
 	SDR_AKESeqError         = 0x24,  // Error in the sequence of the authentication process
+	SDR_Busy                = 0x25,  // An asynchronous transfer is in progress
+	SDR_DMAError            = 0x26,  // DMA transfer error
 	SDR_UnknownError        = 0xFF   // Unknown error
 } SDResult;
 
@@ -318,19 +315,32 @@ typedef struct {
 	uint32_t    BlockCount;      // SD card blocks count
 	uint32_t    BlockSize;       // SD card block size (bytes), determined in SD_ReadCSD()
 	uint32_t    MaxBusClkFreq;   // Maximum card bus frequency (MHz)
+	uint32_t    BusClock;        // Current bus clock (Hz), set by SD_SetBusClock()
+	uint8_t     HighSpeed;       // Nonzero when the card is in High-Speed mode
 	uint8_t     CSDVer;          // SD card CSD register version
 	uint16_t    RCA;             // SD card RCA address (only for SDIO)
 	uint8_t     MID;             // SD card manufacturer ID
+	uint8_t     PRV;             // SD card product revision (two BCD digits: '6.2' will be 01100010b)
 	uint16_t    OID;             // SD card OEM/Application ID
 	uint8_t     PNM[5];          // SD card product name (5-character ASCII string)
-	uint8_t     PRV;             // SD card product revision (two BCD digits: '6.2' will be 01100010b)
-	uint32_t    PSN;             // SD card serial number
 	uint16_t    MDT;             // SD card manufacturing date
+	uint32_t    PSN;             // SD card serial number
+	// The registers are read word by word, keep them word aligned
 	uint8_t     CSD[16];         // SD card CSD register (card structure data)
 	uint8_t     CID[16];         // SD card CID register (card identification number)
 	uint8_t     SCR[8];          // SD card SCR register (SD card configuration)
 } SDCard_TypeDef;
 
+// Completion callback of an asynchronous transfer, called from the IRQ handler
+// with the result of the transfer
+typedef void (*SD_XferCallback_TypeDef)(SDResult result);
+
+// Segment of a scatter-gather transfer
+typedef struct {
+	uint32_t *pBuf;              // Data buffer (must be word aligned)
+	uint32_t  blocks;            // Number of 512-byte blocks in the buffer (1..511)
+} SD_Segment_TypeDef;
+
 
 // Exported variables
 
@@ -357,12 +367,17 @@ SDResult SD_Init(void);
 SDResult SD_SetBusWidth(uint32_t BW);
 void SD_SetBusClock(uint32_t clk_div);
 void SD_GetCardInfo(void);
+#if (SDIO_USE_HIGHSPEED)
 SDResult SD_HighSpeed(void);
+#endif // SDIO_USE_HIGHSPEED
 
 SDResult SD_StopTransfer(void);
-SDResult SD_GetCardStatus(uint8_t *pStatus);
+SDResult SD_GetCardState(uint8_t *pState);
+SDResult SD_WaitReady(void);
+uint8_t SD_CardBusy(void);
+SDResult SD_Erase(uint32_t addr, uint32_t length);
 
-SDResult SD_ReadBlock(uint32_t addr, uint32_t *pBuf, uint32_t len);
+SDResult SD_ReadBlock(uint32_t addr, uint32_t *pBuf, uint32_t length);
 SDResult SD_WriteBlock(uint32_t addr, uint32_t *pBuf, uint32_t length);
 
 #if (SDIO_USE_DMA)
@@ -371,6 +386,20 @@ SDResult SD_ReadBlock_DMA(uint32_t addr, uint32_t *pBuf, uint32_t length);
 SDResult SD_WriteBlock_DMA(uint32_t addr, uint32_t *pBuf, uint32_t length);
 SDResult SD_CheckRead(uint32_t length);
 SDResult SD_CheckWrite(uint32_t length);
+#if (SDIO_USE_IRQ)
+SDResult SD_ReadBlock_IRQ(uint32_t addr, uint32_t *pBuf, uint32_t length, SD_XferCallback_TypeDef callback);
+SDResult SD_WriteBlock_IRQ(uint32_t addr, uint32_t *pBuf, uint32_t length, SD_XferCallback_TypeDef callback);
+SDResult SD_ReadBlock_SG(uint32_t addr, const SD_Segment_TypeDef *pSeg, uint32_t count, SD_XferCallback_TypeDef callback);
+SDResult SD_WriteBlock_SG(uint32_t addr, const SD_Segment_TypeDef *pSeg, uint32_t count, SD_XferCallback_TypeDef callback);
+uint8_t SD_XferBusy(void);
+SDResult SD_XferWait(void);
+void SDIO_IRQHandler(void);
+void SDIO_DMA_IRQHandler(void);
+#endif // SDIO_USE_IRQ
+SDResult SD_StreamOpen(uint32_t erase_blocks);
+SDResult SD_StreamWrite(uint32_t addr, uint32_t *pBuf, uint32_t length);
+uint8_t SD_StreamBusy(void);
+SDResult SD_StreamClose(void);
 #endif // SDIO_USE_DMA
 
-#endif // __SDCARD_SDIO_H
+#endif // __SDCARD_H
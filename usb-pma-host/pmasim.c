@@ -0,0 +1,119 @@
+/*
+	Model of the USB packet memory area (PMA) of the STM32L1, see pmasim.h.
+	- the PMA holds 16 bits in every 32-bit word of its address space, a write stores the
+	  low halfword of the value, the high half of a word read is undefined (random here)
+	- an access outside the PMA or a misaligned access to the user buffer is counted
+	  as an error
+	- the accesses are counted and weighted with the assumed cycle costs
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pmasim.h"
+
+
+// The PMA: one halfword per 32-bit word
+static uint32_t SIM_PMA[SIM_PMA_SIZE / 2];
+
+// Access counters
+SIM_Counters_TypeDef SIM_Counters;
+
+
+// Clear the counters and fill the PMA with a pattern
+void SIM_Init(void) {
+	uint32_t i;
+
+	for (i = 0; i < SIM_PMA_SIZE / 2; i++) SIM_PMA[i] = (i * 0x9E37) & 0xFFFF;
+	memset(&SIM_Counters,0,sizeof(SIM_Counters));
+}
+
+// Address of a PMA offset in the address space, as the drivers compute it
+// input:
+//   offset - byte offset in the PMA (even)
+uint32_t *SIM_PMA_Addr(uint16_t offset) {
+	return &SIM_PMA[offset >> 1];
+}
+
+// Read a byte of the PMA, bypassing the counters
+// input:
+//   offset - byte offset in the PMA
+uint8_t SIM_PMA_Byte(uint16_t offset) {
+	return (SIM_PMA[offset >> 1] >> ((offset & 1) << 3)) & 0xFF;
+}
+
+// Write a byte of the PMA, bypassing the counters
+// input:
+//   offset - byte offset in the PMA
+//   value - byte to write
+void SIM_PMA_SetByte(uint16_t offset, uint8_t value) {
+	uint32_t shift = (offset & 1) << 3;
+
+	SIM_PMA[offset >> 1] = (SIM_PMA[offset >> 1] & ~(0xFFU << shift)) | ((uint32_t)value << shift);
+}
+
+// Estimated cycles of the counted accesses
+uint32_t SIM_Cycles(void) {
+	return SIM_Counters.pma_wr * SIM_CYC_PMA_WR + SIM_Counters.pma_rd * SIM_CYC_PMA_RD +
+			SIM_Counters.buf_rd * SIM_CYC_BUF_RD + SIM_Counters.buf_wr * SIM_CYC_BUF_WR;
+}
+
+// Check a PMA address
+// return: index of the halfword or -1
+static int32_t SIM_PMA_Index(uint32_t *pPMA) {
+	if ((pPMA < SIM_PMA) || (pPMA >= SIM_PMA + SIM_PMA_SIZE / 2)) {
+		SIM_Counters.errors++;
+
+		return -1;
+	}
+
+	return pPMA - SIM_PMA;
+}
+
+// Halfword write to the PMA
+// input:
+//   pPMA - address of the halfword
+//   value - value to write, the 16-bit store takes its low half
+void SIM_PMA_Write(uint32_t *pPMA, uint32_t value) {
+	int32_t idx = SIM_PMA_Index(pPMA);
+
+	SIM_Counters.pma_wr++;
+	if (idx >= 0) SIM_PMA[idx] = value & 0xFFFF;
+}
+
+// Word read from the PMA
+// input:
+//   pPMA - address of the halfword
+// return: the halfword in the low 16 bits, garbage in the high ones
+uint32_t SIM_PMA_Read(uint32_t *pPMA) {
+	int32_t idx = SIM_PMA_Index(pPMA);
+
+	SIM_Counters.pma_rd++;
+
+	return ((uint32_t)rand() << 16) | ((idx >= 0) ? SIM_PMA[idx] : 0);
+}
+
+// Load from the user buffer
+// input:
+//   pBuf - address
+//   size - 1, 2 or 4 bytes
+uint32_t SIM_BUF_Read(const uint8_t *pBuf, uint32_t size) {
+	uint32_t value = 0;
+
+	SIM_Counters.buf_rd++;
+	if ((uintptr_t)pBuf & (size - 1)) SIM_Counters.errors++;
+	memcpy(&value,pBuf,size); // Little endian host
+
+	return value;
+}
+
+// Store to the user buffer
+// input:
+//   pBuf - address
+//   value - value to store (low size bytes)
+//   size - 1, 2 or 4 bytes
+void SIM_BUF_Write(uint8_t *pBuf, uint32_t value, uint32_t size) {
+	SIM_Counters.buf_wr++;
+	if ((uintptr_t)pBuf & (size - 1)) SIM_Counters.errors++;
+	memcpy(pBuf,&value,size);
+}
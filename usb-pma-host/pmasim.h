@@ -0,0 +1,62 @@
+#ifndef __PMASIM_H
+#define __PMASIM_H
+
+
+#include <stdint.h>
+
+
+// Model of the USB packet memory area (PMA) of the STM32L1 for the PMA copy routines (usb_pma.h)
+// built with HOSTVER defined. The PMA is 256 halfwords, each in the low half of a 32-bit word.
+// Every access of the copy routines goes to the model, which checks it and counts it.
+
+
+// Size of the PMA in bytes
+#define SIM_PMA_SIZE                  512
+
+// Access to the PMA
+#define PMA_WR(pPMA,value)            SIM_PMA_Write((pPMA),(value))
+#define PMA_RD(pPMA)                  SIM_PMA_Read(pPMA)
+
+// Access to the user buffer
+#define BUF_RD8(pBuf)                 SIM_BUF_Read((pBuf),1)
+#define BUF_RD16(pBuf)                SIM_BUF_Read((pBuf),2)
+#define BUF_RD32(pBuf)                SIM_BUF_Read((pBuf),4)
+#define BUF_WR8(pBuf,value)           SIM_BUF_Write((pBuf),(value),1)
+#define BUF_WR16(pBuf,value)          SIM_BUF_Write((pBuf),(value),2)
+#define BUF_WR32(pBuf,value)          SIM_BUF_Write((pBuf),(value),4)
+
+// Offset of the user buffer from a word boundary
+#define BUF_ALIGN(pBuf)               ((uint32_t)(uintptr_t)(pBuf) & 0x03)
+
+// Assumed cost of the accesses in CPU cycles (Cortex-M3, HCLK = PCLK1 = 32MHz, no wait states)
+#define SIM_CYC_PMA_WR                3 // STRH to the APB1 bridge
+#define SIM_CYC_PMA_RD                4 // LDR from the APB1 bridge
+#define SIM_CYC_BUF_RD                2 // LDRB/LDRH/LDR from SRAM
+#define SIM_CYC_BUF_WR                1 // STRB/STRH/STR to SRAM (write buffer)
+
+
+// Access counters, cleared by SIM_Init
+typedef struct {
+	uint32_t pma_wr;
+	uint32_t pma_rd;
+	uint32_t buf_rd;
+	uint32_t buf_wr;
+	uint32_t errors; // accesses out of the PMA or misaligned in the user buffer
+} SIM_Counters_TypeDef;
+
+extern SIM_Counters_TypeDef SIM_Counters;
+
+
+// Function prototypes
+void SIM_Init(void);
+uint32_t *SIM_PMA_Addr(uint16_t offset);
+uint8_t SIM_PMA_Byte(uint16_t offset);
+void SIM_PMA_SetByte(uint16_t offset, uint8_t value);
+uint32_t SIM_Cycles(void);
+
+void SIM_PMA_Write(uint32_t *pPMA, uint32_t value);
+uint32_t SIM_PMA_Read(uint32_t *pPMA);
+uint32_t SIM_BUF_Read(const uint8_t *pBuf, uint32_t size);
+void SIM_BUF_Write(uint8_t *pBuf, uint32_t value, uint32_t size);
+
+#endif // __PMASIM_H
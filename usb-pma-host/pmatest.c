@@ -0,0 +1,149 @@
+/*
+	Host test and benchmark of the USB PMA copy routines (usb_pma.c)
+	Build against the copy to check:
+	  cc -O2 -Wall -DHOSTVER -I. -I../cube-usb-msc -o pmatest pmatest.c pmasim.c ../cube-usb-msc/usb_pma.c
+	Run: ./pmatest [-v]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usb_pma.h"
+
+
+static uint32_t Checks;
+static uint32_t Failures;
+static int Verbose;
+
+
+// Count a check, print it when failed or verbose
+static void Check(int ok, const char *what, uint32_t offset, uint32_t length, uint32_t align) {
+	Checks++;
+	if (!ok) Failures++;
+	if (!ok || Verbose) printf("%s: %s offset=%u length=%u align=%u\n",ok ? "ok" : "FAIL",what,offset,length,align);
+}
+
+// The copy routines of the ST library (byte reassembly, one halfword per iteration) for comparison
+static void Legacy_Write(uint32_t *pPMA, const uint8_t *pBuf, uint32_t length) {
+	uint32_t i;
+	uint32_t temp;
+
+	for (i = (length + 1) >> 1; i--; ) {
+		temp = BUF_RD8(pBuf);
+		temp |= BUF_RD8(pBuf + 1) << 8;
+		PMA_WR(pPMA++,temp);
+		pBuf += 2;
+	}
+}
+
+static void Legacy_Read(uint32_t *pPMA, uint8_t *pBuf, uint32_t length) {
+	uint32_t i;
+
+	for (i = (length + 1) >> 1; i--; ) {
+		BUF_WR16(pBuf,PMA_RD(pPMA++));
+		pBuf += 2;
+	}
+}
+
+// Copy one buffer to the PMA and check the PMA
+static void Test_Write(uint16_t offset, uint32_t length, uint32_t align) {
+	static uint32_t buf_words[SIM_PMA_SIZE / 4 + 2];
+	uint8_t *buf = (uint8_t *)buf_words;
+	uint8_t before[SIM_PMA_SIZE];
+	uint32_t i;
+	int ok = 1;
+
+	for (i = 0; i < sizeof(buf_words); i++) buf[i] = rand();
+	SIM_Init();
+	for (i = 0; i < SIM_PMA_SIZE; i++) before[i] = SIM_PMA_Byte(i);
+
+	PMA_Write(SIM_PMA_Addr(offset),buf + align,length);
+
+	for (i = 0; i < SIM_PMA_SIZE; i++) {
+		if ((i >= offset) && (i < offset + length)) {
+			if (SIM_PMA_Byte(i) != buf[align + i - offset]) ok = 0;
+		} else if (!((length & 1) && (i == offset + length))) {
+			// The high byte of the last halfword of an odd length is don't care
+			if (SIM_PMA_Byte(i) != before[i]) ok = 0;
+		}
+	}
+	Check(ok && !SIM_Counters.errors,"write",offset,length,align);
+}
+
+// Copy one packet from the PMA and check the buffer and its surroundings
+static void Test_Read(uint16_t offset, uint32_t length, uint32_t align) {
+	static uint32_t buf_words[SIM_PMA_SIZE / 4 + 4];
+	uint8_t *buf = (uint8_t *)buf_words;
+	uint32_t i;
+	int ok = 1;
+
+	SIM_Init();
+	for (i = 0; i < SIM_PMA_SIZE; i++) SIM_PMA_SetByte(i,rand());
+	memset(buf,0xA5,sizeof(buf_words));
+
+	PMA_Read(SIM_PMA_Addr(offset),buf + 4 + align,length);
+
+	for (i = 0; i < sizeof(buf_words); i++) {
+		if ((i >= 4 + align) && (i < 4 + align + length)) {
+			if (buf[i] != SIM_PMA_Byte(offset + i - 4 - align)) ok = 0;
+		} else {
+			if (buf[i] != 0xA5) ok = 0;
+		}
+	}
+	Check(ok && !SIM_Counters.errors,"read",offset,length,align);
+}
+
+// Estimated cycles of one copy
+static uint32_t Bench(void (*copy_wr)(uint32_t *, const uint8_t *, uint32_t),
+		void (*copy_rd)(uint32_t *, uint8_t *, uint32_t), uint32_t length, uint32_t align) {
+	static uint32_t buf_words[SIM_PMA_SIZE / 4 + 2];
+
+	SIM_Init();
+	if (copy_wr) copy_wr(SIM_PMA_Addr(0),(uint8_t *)buf_words + align,length);
+	if (copy_rd) copy_rd(SIM_PMA_Addr(0),(uint8_t *)buf_words + align,length);
+
+	return SIM_Cycles();
+}
+
+int main(int argc, char *argv[]) {
+	static const uint32_t sizes[] = { 8, 16, 64, 512 };
+	uint32_t offset;
+	uint32_t length;
+	uint32_t align;
+	uint32_t i;
+
+	if ((argc > 1) && !strcmp(argv[1],"-v")) Verbose = 1;
+	srand(1);
+
+	// Every length up to two packets, every buffer alignment, a few PMA offsets
+	for (offset = 0; offset <= 64; offset += 2) {
+		for (length = 0; length <= 130; length++) {
+			for (align = 0; align < 4; align++) {
+				Test_Write(offset,length,align);
+				Test_Read(offset,length,align);
+			}
+		}
+	}
+	// The whole PMA
+	for (align = 0; align < 4; align++) {
+		Test_Write(0,SIM_PMA_SIZE,align);
+		Test_Read(0,SIM_PMA_SIZE,align);
+		Test_Write(SIM_PMA_SIZE - 2,2,align);
+		Test_Read(SIM_PMA_SIZE - 2,1,align);
+	}
+
+	// Estimated cycles of the PMA and buffer accesses (loop overhead not included)
+	printf("bytes align   write: legacy   new    read: legacy   new\n");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		for (align = 0; align < 4; align++) {
+			printf("%5u   %u          %6u %6u           %6u %6u\n",sizes[i],align,
+					Bench(Legacy_Write,NULL,sizes[i],align),Bench(PMA_Write,NULL,sizes[i],align),
+					Bench(NULL,Legacy_Read,sizes[i],align),Bench(NULL,PMA_Read,sizes[i],align));
+		}
+	}
+
+	printf("%u checks, %u failed\n",Checks,Failures);
+
+	return Failures ? 1 : 0;
+}